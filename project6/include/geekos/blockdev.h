@@ -46,6 +46,7 @@ struct Block_Request {
     struct Block_Device *dev;
     enum Request_Type type;
     int blockNum;
+    int numBlocks;		 /* Number of consecutive blocks to transfer */
     void *buf;
     volatile enum Request_State state;
     volatile int errorCode;
@@ -58,6 +59,7 @@ IMPLEMENT_LIST(Block_Request_List, Block_Request);
 
 struct Block_Device;
 struct Block_Device_Ops;
+struct Device_Stats;
 
 /*
  * A block device.
@@ -71,6 +73,10 @@ struct Block_Device {
     struct Thread_Queue *waitQueue;
     struct Block_Request_List *requestQueue;
 
+    /* Request counts, for statistics */
+    ulong_t numReads, numWrites;
+    ulong_t blocksRead, blocksWritten;
+
     DEFINE_LINK(Block_Device_List, Block_Device);
 };
 
@@ -93,11 +99,12 @@ int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
 int Open_Block_Device(const char *name, struct Block_Device **pDev);
 int Close_Block_Device(struct Block_Device *dev);
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
-    int blockNum, void *buf);
+    int blockNum, int numBlocks, void *buf);
 void Post_Request_And_Wait(struct Block_Request *request);
 struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
     struct Thread_Queue *waitQueue);
 void Notify_Request_Completion(struct Block_Request *request, enum Request_State state, int errorCode);
+int Get_Block_Device_Stats(struct Device_Stats *stats, int max);
 
 /*
  * High level block device API.
@@ -105,6 +112,8 @@ void Notify_Request_Completion(struct Block_Request *request, enum Request_State
  */
 int Block_Read(struct Block_Device *dev, int blockNum, void *buf);
 int Block_Write(struct Block_Device *dev, int blockNum, void *buf);
+int Block_Read_Multiple(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
+int Block_Write_Multiple(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
 int Get_Num_Blocks(struct Block_Device *dev);
 
 /*
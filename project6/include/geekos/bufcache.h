@@ -21,6 +21,7 @@ struct Block_Device;
  */
 #define FS_BUFFER_DIRTY	0x01	/*!< Buffer contains uncommitted data. */
 #define FS_BUFFER_INUSE	0x02	/*!< Buffer is in use. */
+#define FS_BUFFER_PINNED	0x04	/*!< Buffer must not be written back yet. */
 
 struct FS_Buffer;
 DEFINE_LIST(FS_Buffer_List, FS_Buffer);
@@ -56,7 +57,11 @@ int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
 int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
 
 int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf);
+int Get_New_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf);
+int Read_FS_Blocks(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t numBlocks, void *buf);
 void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Pin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Unpin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 int Sync_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 
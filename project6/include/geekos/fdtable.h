@@ -0,0 +1,49 @@
+/*
+ * Per-process file descriptor table
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_FDTABLE_H
+#define GEEKOS_FDTABLE_H
+
+#ifdef GEEKOS
+
+#include <geekos/ktypes.h>
+
+struct File;
+
+/*
+ * Tables start with room for 32 descriptors and double in size
+ * when full.  fullMap has one bit per word of usedMap, which
+ * limits a table to 32 * 32 descriptors.
+ */
+#define FILE_TABLE_INITIAL_SIZE	32
+#define FILE_TABLE_MAX_SIZE	(32 * 32)
+
+/*
+ * Table mapping file descriptors to open files.  It starts out
+ * empty and grows as descriptors are allocated.  Each bit of
+ * usedMap is set when the corresponding descriptor is in use,
+ * and each bit of fullMap is set when the corresponding word
+ * of usedMap is all ones, so the lowest free descriptor can
+ * be found with two bit scans.
+ */
+struct File_Table {
+    struct File **fileList;
+    ulong_t *usedMap;
+    ulong_t fullMap;
+    int size;			 /* Number of descriptors, a multiple of 32 */
+};
+
+int Alloc_File_Descriptor(struct File_Table *table, struct File *file);
+int Install_File_Descriptor(struct File_Table *table, int fd, struct File *file);
+struct File *Lookup_File_Descriptor(struct File_Table *table, int fd);
+struct File *Release_File_Descriptor(struct File_Table *table, int fd);
+int Clone_File_Table(struct File_Table *table, struct File_Table *clone);
+void Destroy_File_Table(struct File_Table *table);
+
+#endif /* GEEKOS */
+
+#endif /* GEEKOS_FDTABLE_H */
@@ -57,6 +57,7 @@ struct VFS_File_Stat {
     int size;
     int isDirectory:1;
     int isSetuid:1;
+    int isTerminal:1;		/* Console rather than a file or pipe */
     struct VFS_ACL_Entry acls[VFS_MAX_ACL_ENTRIES];
 };
 
@@ -80,4 +81,42 @@ struct VFS_Mount_Request {
     char fstype[VFS_MAX_FS_NAME_LEN+1];	/* Filesystem type: e.g., "gosfs". */
 };
 
+/*
+ * Batched file operations.
+ * A process queues operations in the submission queue of a
+ * Batch_Ring in its own memory, and passes the ring to the
+ * SubmitBatch system call, which carries them out in order
+ * and posts a completion for each one.  The kernel advances
+ * sqHead and cqTail; the process advances sqTail and cqHead.
+ * Indices run freely and are reduced modulo BATCH_RING_SIZE.
+ */
+#define BATCH_RING_SIZE 32	/* Must be a power of 2 */
+
+#define BATCH_READ	1	/* Read(fd, buf, len) */
+#define BATCH_WRITE	2	/* Write(fd, buf, len) */
+#define BATCH_SEEK	3	/* Seek(fd, len) */
+#define BATCH_STAT	4	/* Stat(path in buf, path length in len, stat) */
+#define BATCH_FSTAT	5	/* FStat(fd, stat) */
+
+struct Batch_Op {
+    int opcode;
+    int fd;
+    ulong_t buf;		/* Data buffer or path */
+    ulong_t len;		/* Length, path length, or file position */
+    struct VFS_File_Stat *stat;	/* Where Stat and FStat store metadata */
+    ulong_t userData;		/* Returned in the completion */
+};
+
+struct Batch_Completion {
+    ulong_t userData;
+    int result;			/* Return value of the operation */
+};
+
+struct Batch_Ring {
+    ulong_t sqHead, sqTail;
+    ulong_t cqHead, cqTail;
+    struct Batch_Op sq[BATCH_RING_SIZE];
+    struct Batch_Completion cq[BATCH_RING_SIZE];
+};
+
 #endif
@@ -0,0 +1,40 @@
+/*
+ * Kernel log
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_KLOG_H
+#define GEEKOS_KLOG_H
+
+#ifdef GEEKOS
+
+#include <geekos/ktypes.h>
+
+/*
+ * Log levels, most severe first.
+ */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+/*
+ * Log messages are kept in a ring of fixed size entries, and the
+ * oldest are overwritten if the log daemon falls behind.
+ * Messages longer than LOG_TEXT_SIZE-1 characters are truncated.
+ */
+#define LOG_RING_SIZE 256	/* Must be a power of 2 */
+#define LOG_TEXT_SIZE 96
+
+/* Messages above this level are discarded. */
+extern int g_logLevel;
+
+void Init_Log(void);
+void Log(int level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void Flush_Log(void);
+
+#endif /* GEEKOS */
+
+#endif /* GEEKOS_KLOG_H */
@@ -16,6 +16,7 @@
 struct Kernel_Thread;
 struct User_Context;
 struct Interrupt_State;
+struct Thread_Stats;
 
 /*
  * Queue of threads.
@@ -42,6 +43,7 @@ struct Kernel_Thread {
     DEFINE_LINK(Thread_Queue, Kernel_Thread);
     void* stackPage;
     struct User_Context* userContext;
+    int userStackSlot;		/* Stack slot in user context, 0 for initial thread */
     struct Kernel_Thread* owner;
     int refCount;
 
@@ -66,6 +68,9 @@ struct Kernel_Thread {
      */
     int currentReadyQueue;
     bool blocked;
+
+    /* Total number of timer ticks the thread has run for. */
+    ulong_t totalTicks;
 };
 
 /*
@@ -112,6 +117,10 @@ struct Kernel_Thread* Start_Kernel_Thread(
     bool detached
 );
 struct Kernel_Thread* Start_User_Thread(struct User_Context* userContext, bool detached);
+struct Kernel_Thread* Start_User_Thread_At(struct User_Context* userContext,
+    ulong_t entryAddr, ulong_t stackPointer, int stackSlot, bool detached);
+struct Kernel_Thread* Start_Cloned_User_Thread(struct User_Context* userContext,
+    struct Interrupt_State* state, bool detached);
 void Make_Runnable(struct Kernel_Thread* kthread);
 void Make_Runnable_Atomic(struct Kernel_Thread* kthread);
 struct Kernel_Thread* Get_Current(void);
@@ -121,6 +130,7 @@ void Yield(void);
 void Exit(int exitCode) __attribute__ ((noreturn));
 int Join(struct Kernel_Thread* kthread);
 struct Kernel_Thread* Lookup_Thread(int pid);
+int Get_Thread_Stats(struct Thread_Stats *stats, int max);
 
 /*
  * Thread context switch function, defined in lowlevel.asm
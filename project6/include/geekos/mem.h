@@ -64,6 +64,8 @@ struct Page {
     int clock;
     ulong_t vaddr;			 /* User virtual address where page is mapped */
     pte_t *entry;			 /* Page table entry referring to the page */
+    int shareCount;			 /* Number of address spaces sharing page copy-on-write */
+    int pinCount;			 /* Number of kernel users accessing the page directly */
 };
 
 IMPLEMENT_LIST(Page_List, Page);
@@ -73,6 +75,9 @@ void Init_BSS(void);
 void* Alloc_Page(void);
 void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr);
 void Free_Page(void* pageAddr);
+void Pin_Page(struct Page *page);
+void Unpin_Page(struct Page *page);
+void Start_Pageout_Daemon(void);
 
 /*
  * Determine if given address is a multiple of the page size.
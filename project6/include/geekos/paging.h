@@ -88,9 +88,15 @@ typedef struct {
  * Bits used in the kernelInfo field of the PTE's:
  */
 #define KINFO_PAGE_ON_DISK	0x4	 /* Page not present; contents in paging file */
+#define KINFO_SHARED_PAGE	0x2	 /* Page present; frame is shared, not owned by this address space */
+#define KINFO_COW_PAGE		0x1	 /* Page present; frame shared copy-on-write with other processes */
+#define KINFO_PAGE_IN_TRANSIT	0x3	 /* Page not present; frame being written to or read from paging file */
+
+extern pde_t *g_kernelPageDir;
 
 void Init_VM(struct Boot_Info *bootInfo);
 void Init_Paging(void);
+int Fault_In_Page(struct User_Context *userContext, ulong_t address);
 
 extern void Flush_TLB(void);
 extern void Set_PDBR(pde_t *pageDir);
@@ -114,6 +120,9 @@ int Find_Space_On_Paging_File(void);
 void Free_Space_On_Paging_File(int pagefileIndex);
 void Write_To_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex);
 void Read_From_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex);
+int Find_Run_On_Paging_File(int numPages);
+void Write_Cluster_To_Paging_File(void *buf, int pagefileIndex, int numPages);
+void Read_Cluster_From_Paging_File(void *buf, int pagefileIndex, int numPages);
 
 
 #endif
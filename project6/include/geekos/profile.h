@@ -0,0 +1,58 @@
+/*
+ * Sampling profiler
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_PROFILE_H
+#define GEEKOS_PROFILE_H
+
+#include <geekos/ktypes.h>
+
+/*
+ * The profiler records one sample every "interval" timer ticks,
+ * until the sample buffer is full.
+ */
+#define PROFILE_MAX_SAMPLES 8192
+
+/*
+ * A sample of the interrupted thread.  User mode eips are
+ * offsets in the user code segment, so they can be looked up
+ * directly in the program's symbol table.
+ */
+struct Profile_Sample {
+    ulong_t eip;
+    ushort_t pid;
+    uchar_t user;			 /* Interrupted in user mode */
+    uchar_t reserved;
+};
+
+/*
+ * Header of a profile dump file, followed by numSamples
+ * struct Profile_Samples.  Written by the prof program and
+ * read by scripts/profile; all fields are little endian.
+ */
+#define PROFILE_MAGIC "GPRF"
+
+struct Profile_Header {
+    char magic[4];
+    ulong_t interval;			 /* Ticks between samples */
+    ulong_t numSamples;
+    ulong_t numDropped;			 /* Samples lost to a full buffer */
+};
+
+#ifdef GEEKOS
+
+struct Interrupt_State;
+
+extern bool g_profiling;
+
+int Start_Profiling(int interval);
+int Stop_Profiling(struct Profile_Header *header);
+void Profile_Tick(struct Interrupt_State *state);
+int Get_Profile_Samples(struct Profile_Sample *buf, int first, int max);
+
+#endif /* GEEKOS */
+
+#endif /* GEEKOS_PROFILE_H */
@@ -0,0 +1,97 @@
+/*
+ * Kernel event counters and tracepoints
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_STATS_H
+#define GEEKOS_STATS_H
+
+#include <geekos/ktypes.h>
+#include <geekos/fileio.h>
+
+/*
+ * Event counters.
+ */
+enum {
+    STAT_CONTEXT_SWITCHES,	 /* Scheduler picked a different thread */
+    STAT_THREADS_CREATED,
+    STAT_SYSCALLS,
+    STAT_PAGE_FAULTS,		 /* Faults on non-present pages */
+    STAT_COW_FAULTS,		 /* Writes to copy-on-write pages */
+    STAT_PAGES_IN,		 /* Pages read from the paging file */
+    STAT_PAGES_OUT,		 /* Pages written to the paging file */
+    STAT_BLOCK_REQUESTS,	 /* Block device requests, all devices */
+    STAT_BUFCACHE_HITS,
+    STAT_BUFCACHE_MISSES,
+    STAT_BUFCACHE_EVICTIONS,
+    STAT_PFAT_READS,		 /* Read() calls on PFAT files */
+    STAT_PFAT_BYTES_READ,
+    STAT_USER_IO_REQUESTS,	 /* Filesystem requests made for user buffers */
+    STAT_USER_IO_PAGES,		 /* User pages pinned for those requests */
+
+    NUM_STAT_COUNTERS
+};
+
+#define STATS_MAX_SYSCALLS 64
+#define STATS_MAX_DEVICES  8
+#define STATS_MAX_THREADS  32
+
+struct Device_Stats {
+    char name[BLOCKDEV_MAX_NAME_LEN+1];
+    ulong_t numReads, numWrites;	 /* Requests */
+    ulong_t blocksRead, blocksWritten;
+};
+
+struct Thread_Stats {
+    int pid;
+    int priority;
+    ulong_t ticks;			 /* Total time run, in timer ticks */
+    bool user;				 /* Has a user context */
+};
+
+/*
+ * Snapshot of the kernel's counters, as returned by
+ * the GetStats system call.
+ */
+struct Kernel_Stats {
+    ulong_t ticks;			 /* Timer ticks since boot */
+    ulong_t counter[NUM_STAT_COUNTERS];
+    ulong_t syscallCount[STATS_MAX_SYSCALLS];
+    int numDevices;
+    struct Device_Stats device[STATS_MAX_DEVICES];
+    int numThreads;
+    struct Thread_Stats thread[STATS_MAX_THREADS];
+};
+
+#ifdef GEEKOS
+
+#include <geekos/klog.h>
+
+extern ulong_t g_statCounter[NUM_STAT_COUNTERS];
+extern ulong_t g_syscallCount[STATS_MAX_SYSCALLS];
+extern bool g_statsEnabled;
+extern bool g_traceEnabled;
+
+/*
+ * Counting is a test of g_statsEnabled and a single increment,
+ * which is atomic with respect to interrupts.  Building with
+ * NSTATS compiles the counters and tracepoints out entirely.
+ */
+#ifndef NSTATS
+#  define STAT_ADD(id, n) do { if (g_statsEnabled) g_statCounter[(id)] += (n); } while (0)
+#  define STAT_SYSCALL(num) do { if (g_statsEnabled && (num) < STATS_MAX_SYSCALLS) ++g_syscallCount[(num)]; } while (0)
+#  define TRACE(args...) do { if (g_traceEnabled) Log(LOG_DEBUG, args); } while (0)
+#else
+#  define STAT_ADD(id, n) ((void) 0)
+#  define STAT_SYSCALL(num) ((void) 0)
+#  define TRACE(args...) ((void) 0)
+#endif
+#define STAT_INC(id) STAT_ADD(id, 1)
+
+void Get_Kernel_Stats(struct Kernel_Stats *stats);
+
+#endif /* GEEKOS */
+
+#endif /* GEEKOS_STATS_H */
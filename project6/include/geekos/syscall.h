@@ -33,6 +33,20 @@ extern const Syscall g_syscallTable[];
 
 #define SYSCALL "int $0x90"	 /* Assembly instruction for the system call trap. */
 
+/*
+ * Instruction sequence for a system call through sysenter.
+ * The kernel returns to the address pushed on the user stack,
+ * which it finds through ebp, and pops it (see Sysenter_Entry
+ * in lowlevel.asm).
+ */
+#define SYSENTER_SYSCALL	\
+    "pushl %%ebp\n\t"		\
+    "pushl $1f\n\t"		\
+    "movl %%esp, %%ebp\n\t"	\
+    "sysenter\n"		\
+    "1:\n\t"			\
+    "popl %%ebp"
+
 /*
  * System call numbers
  */
@@ -68,6 +82,15 @@ enum {
     SYS_SYNC,		 /* Sync filesystems system call  */
     SYS_FORMAT,		 /* Format filesystem system call  */
     SYS_CREATEPIPE,	 /* CreatePipe system call. */
+    SYS_FORK,		 /* Fork (copy-on-write clone of process) system call */
+    SYS_CREATETHREAD,	 /* Create thread in current process */
+    SYS_JOINTHREAD,	 /* Wait for thread to exit */
+    SYS_HAVESYSENTER,	 /* Check whether system calls may use sysenter */
+    SYS_SUBMITBATCH,	 /* Carry out batched file operations */
+    SYS_GETSTATS,	 /* Get kernel statistics */
+    SYS_PROFILESTART,	 /* Start the sampling profiler */
+    SYS_PROFILESTOP,	 /* Stop the sampling profiler */
+    SYS_PROFILEDUMP,	 /* Copy out profile samples */
 };
 
 /*
@@ -93,11 +116,22 @@ enum {
 #define SYSCALL_REGS_4 , "b" (arg0), "c" (arg1), "d" (arg2), "S" (arg3)
 #define SYSCALL_REGS_5 , "b" (arg0), "c" (arg1), "d" (arg2), "S" (arg3), "D" (arg4)
 
+#if !defined(GEEKOS)
+/*
+ * Set by the program entry code if the kernel supports sysenter;
+ * system calls use int $0x90 when it is clear.
+ */
+extern int g_useSysenter;
+#endif
+
 #define DEF_SYSCALL(name,num,retType,params,argDefs,regs)		\
 retType name params {							\
     int sysNum = (num), rc;						\
     argDefs								\
-    __asm__ __volatile__ (SYSCALL : "=a" (rc) :"a" (sysNum) regs);	\
+    if (g_useSysenter)							\
+	__asm__ __volatile__ (SYSENTER_SYSCALL : "=a" (rc) :"a" (sysNum) regs);	\
+    else								\
+	__asm__ __volatile__ (SYSCALL : "=a" (rc) :"a" (sysNum) regs);	\
     return (retType) rc;						\
 }
 
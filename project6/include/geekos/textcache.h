@@ -0,0 +1,34 @@
+/*
+ * Shared text page cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_TEXTCACHE_H
+#define GEEKOS_TEXTCACHE_H
+
+#ifdef GEEKOS
+
+#include <geekos/ktypes.h>
+
+/*
+ * The read-only text pages of an executable, shared by all
+ * processes running it.  Entries are keyed by the executable's
+ * path, size, and a checksum of its headers, and are dropped
+ * when the file is opened for writing or deleted.
+ */
+struct Text_Cache_Entry;
+
+struct Text_Cache_Entry *Get_Text_Cache_Entry(const char *path, ulong_t fileSize, ulong_t crc,
+    ulong_t start, ulong_t end);
+void Add_Text_Cache_Ref(struct Text_Cache_Entry *entry);
+void Release_Text_Cache_Entry(struct Text_Cache_Entry *entry);
+void Invalidate_Text_Cache(const char *path);
+int Reclaim_Text_Cache(void);
+void *Lookup_Text_Page(struct Text_Cache_Entry *entry, ulong_t userAddr);
+void *Install_Text_Page(struct Text_Cache_Entry *entry, ulong_t userAddr, void *frame);
+
+#endif /* GEEKOS */
+
+#endif /* GEEKOS_TEXTCACHE_H */
@@ -10,6 +10,9 @@
 #ifndef GEEKOS_TRAP_H
 #define GEEKOS_TRAP_H
 
+struct Interrupt_State;
+
 void Init_Traps(void);
+void Sysenter_Handler(struct Interrupt_State* state);
 
 #endif  /* GEEKOS_TRAP_H */
@@ -83,7 +83,10 @@ struct TSS {
     ushort_t ioMapBase;
 };
 
+extern bool g_sysenterEnabled;
+
 void Init_TSS(void);
 void Set_Kernel_Stack_Pointer(ulong_t esp0);
+void Init_Sysenter(void);
 
 #endif  /* GEEKOS_TSS_H */
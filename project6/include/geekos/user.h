@@ -15,11 +15,43 @@
 #include <geekos/segment.h>
 #include <geekos/elf.h>
 #include <geekos/paging.h>
+#include <geekos/synch.h>
+#include <geekos/fdtable.h>
 
 struct File;
+struct Text_Cache_Entry;
 
-/* Number of files user process can have open. */
-#define USER_MAX_FILES		10
+/*
+ * User address space: user address 0 corresponds to linear
+ * address USER_VM_START.
+ */
+#define USER_VM_START		0x80000000
+#define USER_VM_SIZE		0x80000000
+
+/*
+ * A region of user memory whose pages are filled in on demand by
+ * the page fault handler: bytes in [fileStart, fileEnd) come from
+ * the executable file, and the rest of the region is zero-filled.
+ */
+struct User_Region {
+    ulong_t start;		 /* First user address of region (page aligned) */
+    ulong_t end;		 /* End of region (page aligned) */
+    ulong_t fileStart;		 /* First user address backed by the file */
+    ulong_t fileEnd;		 /* End of the part backed by the file */
+    ulong_t offsetInFile;	 /* File offset of data at fileStart */
+    int protFlags;		 /* VM_READ, VM_WRITE, VM_EXEC */
+    struct Text_Cache_Entry *textCache; /* Shared pages, for read-only text */
+};
+
+/*
+ * Number of threads that can run in one user context at a time.
+ * The initial thread uses the stack set up by Load_User_Program();
+ * each other thread gets a stack slot of its own below it.
+ */
+#define USER_MAX_THREADS	8
+
+/* Executable segments, plus one stack per thread. */
+#define USER_MAX_REGIONS	(EXE_MAX_SEGMENTS + USER_MAX_THREADS)
 
 /*
  * A user mode context which can be attached to a Kernel_Thread,
@@ -57,6 +89,17 @@ struct User_Context {
     /* Page directory for user address space. */
     pde_t *pageDir;
 
+    /* Demand-loaded regions of the address space */
+    struct User_Region regionList[USER_MAX_REGIONS];
+    int numRegions;
+
+    /* Executable file backing the text and data regions */
+    struct File *exeFile;
+    struct Mutex exeLock;
+
+    /* Open files, indexed by file descriptor */
+    struct File_Table fileTable;
+
     /* Code entry point */
     ulong_t entryAddr;
 
@@ -67,9 +110,13 @@ struct User_Context {
     ulong_t stackPointerAddr;
 
     /*
-     * May use this in future to allow multiple threads
-     * in the same user context
+     * Thread stack slots: slot i (for i > 0) lies i slots below
+     * threadStackBase.  Slot 0 is the initial thread's stack.
      */
+    ulong_t threadStackBase;
+    bool threadStackUsed[USER_MAX_THREADS];
+
+    /* Number of threads attached to this user context */
     int refCount;
 
 #if 0
@@ -89,6 +136,9 @@ void Detach_User_Context(struct Kernel_Thread* kthread);
 int Spawn(const char *program, const char *command,
     struct File *stdInput, struct File *stdOutput,
     struct Kernel_Thread **pThread);
+int Clone_Process(struct Interrupt_State *state, struct Kernel_Thread **pThread);
+int Create_User_Thread(ulong_t startAddr, ulong_t startFunc, ulong_t arg,
+    struct Kernel_Thread **pThread);
 void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_State* state);
 
 /*
@@ -96,11 +146,20 @@ void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_Stat
  */
 
 void Destroy_User_Context(struct User_Context* context);
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext);
+int Page_In_User_Region(struct User_Context *userContext, ulong_t userAddr);
+void Attach_Text_Cache(struct User_Context *userContext, const char *path,
+    ulong_t fileSize, ulong_t crc);
+int Clone_User_Context(struct User_Context *parent, struct User_Context **pChild);
+int Copy_On_Write_Fault(struct User_Context *userContext, ulong_t userAddr);
+int Alloc_User_Thread_Stack(struct User_Context *userContext, int *pSlot, ulong_t *pStackTop);
+void Free_User_Thread_Stack(struct User_Context *userContext, int slot);
 bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t bufSize);
 bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize);
+void *Pin_User_Page(ulong_t userAddr, bool forWrite);
+void Unpin_User_Page(void *kernelAddr);
 void Switch_To_Address_Space(struct User_Context *userContext);
 
 
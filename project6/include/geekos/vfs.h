@@ -75,6 +75,9 @@ struct File {
      */
     int mode;			 /* Mode (read vs. write). */
     struct Mount_Point *mountPoint; /* Mounted filesystem file is part of. */
+
+    /* Number of references; see Clone_File() and Close(). */
+    int refCount;
 };
 
 /* Operations that can be performed on a File. */
@@ -122,11 +125,14 @@ struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *
 int FStat(struct File *file, struct VFS_File_Stat *stat);
 int Read(struct File *file, void *buf, ulong_t len);
 int Write(struct File *file, void *buf, ulong_t len);
+int Seek(struct File *file, ulong_t pos);
 int Read_Fully(const char *path, void **pBuffer, ulong_t *pLen);
 int Clone_File(struct File *file, struct File **pClone);
+int Copy_File(struct File *file, struct File **pCopy);
 
 /* Directory operations. */
 int Create_Directory(const char *path);
+int Delete(const char *path);
 int Open_Directory(const char *path, struct File **pDir);
 int Read_Entry(struct File *file, struct VFS_Dir_Entry *entry);
 
@@ -0,0 +1,266 @@
+/*
+ * Extent-based GeekOS filesystem
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_XGOSFS_H
+#define GEEKOS_XGOSFS_H
+
+#include <geekos/ktypes.h>
+#include <geekos/fileio.h>
+
+/*
+ * XGOSFS is a variant of GOSFS in which a file's data is described
+ * by extents, runs of physically contiguous blocks, rather than a
+ * list of block pointers.  A file written sequentially on a disk
+ * with free space is a single extent, so it is mapped with one
+ * lookup and read with large requests.
+ *
+ * On-disk layout, in 4K blocks:
+ *   block 0                   superblock
+ *   groupStart...             allocation group descriptors
+ *   bitmapStart...            free block bitmap, one bit per block
+ *   inodeBitmapStart...       free inode bitmap, one bit per inode
+ *   inodeTableStart...        inode table
+ *   journalStart...           metadata journal
+ *   the rest                  directories, files and extent tree nodes
+ *
+ * A file's metadata is kept in its inode, in a table of fixed
+ * size set at format time.  Directories map names to inode numbers
+ * with compact variable-length records, hashed into bucket blocks,
+ * so a name is looked up by reading one directory block.
+ *
+ * The disk is divided into allocation groups of blocksPerGroup
+ * blocks, with inodes numbered inodesPerGroup to a group.  Each
+ * group has a descriptor counting its free blocks and inodes, so
+ * the allocator can pass over full groups without reading their
+ * bitmaps.  A file's inode is put in the group of its directory,
+ * and its data in the same group if there is room.  The inode
+ * table of a group need not be zeroed when it is made: free inodes
+ * are never read, and the group's descriptor says whether they
+ * still have to be cleared, which is done after mounting.
+ *
+ * Changes to metadata (everything but file data, and directory
+ * blocks that nothing points to yet) are written to the journal,
+ * a circular log, before they are written in place.  Changes are
+ * batched into transactions, each written to the log with one
+ * request: a descriptor block listing the blocks changed, their
+ * new contents, and a commit block with a checksum.  Mounting
+ * replays the transactions in the log, so a crash leaves the
+ * filesystem as it was after the last complete transaction.
+ * All fields are little endian.
+ */
+
+/* Number of disk sectors per filesystem block. */
+#define XGOSFS_SECTORS_PER_FS_BLOCK	8
+
+/* Size of a filesystem block in bytes. */
+#define XGOSFS_FS_BLOCK_SIZE		(XGOSFS_SECTORS_PER_FS_BLOCK*SECTOR_SIZE)
+
+#define XGOSFS_MAGIC			0x53464758	/* "XGFS" */
+#define XGOSFS_VERSION			6
+
+/* Flags bits for inodes. */
+#define XGOSFS_INODE_USED		0x01	/* Inode is in use. */
+#define XGOSFS_INODE_ISDIRECTORY	0x02	/* Inode is a directory. */
+#define XGOSFS_INODE_SETUID		0x04	/* File executes using uid of file owner. */
+#define XGOSFS_INODE_INLINE		0x08	/* File's data is in the inode. */
+
+#define XGOSFS_FILENAME_MAX		127	/* Maximum filename length. */
+
+/*
+ * A run of length blocks starting at block start, holding
+ * the file's blocks starting with block number logical.
+ */
+struct XGOSFS_Extent {
+    uint_t logical;
+    uint_t start;
+    uint_t length;
+};
+
+/* Number of extents kept in the inode itself. */
+#define XGOSFS_NUM_INLINE_EXTENTS	8
+
+/*
+ * Map of a file's blocks, which are all allocated: blocks
+ * 0..numBlocks-1 are covered by numExtents extents, in order.
+ * The first XGOSFS_NUM_INLINE_EXTENTS are kept here; the rest
+ * overflow into a B+tree rooted at block tree.
+ */
+struct XGOSFS_Extent_Map {
+    uint_t numBlocks;
+    uint_t numExtents;
+    uint_t tree;				/* Root of extent tree, or 0 if none. */
+    uint_t reserved;
+    struct XGOSFS_Extent extent[XGOSFS_NUM_INLINE_EXTENTS];
+};
+
+/*
+ * Files of up to this many bytes are kept in the inode itself,
+ * in place of the extent map, so they take no blocks and are read
+ * along with the inode.  A file gets a block of its own when it
+ * grows past this; directories always have blocks.
+ */
+#define XGOSFS_MAX_INLINE_DATA		208
+
+/*
+ * An inode: everything about a file but its name.
+ */
+struct XGOSFS_Inode {
+    uint_t size;				/* Size of file. */
+    uint_t flags;				/* Flags: used, isdirectory, setuid, inline. */
+    struct VFS_ACL_Entry acl[VFS_MAX_ACL_ENTRIES];/* List of ACL entries; first is for the file's owner. */
+    union {
+	struct XGOSFS_Extent_Map map;		/* Where the file's data is, */
+	uchar_t data[XGOSFS_MAX_INLINE_DATA];	/* or the data itself. */
+    } u;
+};
+
+#define XGOSFS_INODE_SIZE		256
+#define XGOSFS_INODES_PER_BLOCK		(XGOSFS_FS_BLOCK_SIZE / XGOSFS_INODE_SIZE)
+
+/* Inode 0 is never used, so it can mean "none"; 1 is the root directory. */
+#define XGOSFS_ROOT_INODE		1
+
+/*
+ * A directory is an array of numBuckets bucket blocks, numBuckets
+ * being a power of 2 (or 0 for an empty directory).  A name is kept
+ * in the bucket given by the low bits of its hash, and when that is
+ * full the number of buckets is doubled, splitting each bucket in
+ * two.  Records that belong in a new bucket are copied there, and
+ * the stale ones left behind (whose hash no longer leads to the
+ * bucket they are in) are ignored, and removed when the bucket is
+ * next full.  A bucket block starts with the number of bytes in
+ * use, including the header, followed by records packed end to end.
+ */
+struct XGOSFS_Dir_Bucket {
+    uint_t used;
+    uint_t reserved;
+};
+
+/*
+ * A directory record: the inode number and the name, which is
+ * not nul-terminated and follows the record header directly.
+ * Records are padded to a multiple of 4 bytes.
+ */
+struct XGOSFS_Dir_Record {
+    uint_t inode;
+    uchar_t nameLen;
+    uchar_t reserved[3];
+};
+
+#define XGOSFS_RECORD_SIZE(nameLen) \
+    ((sizeof(struct XGOSFS_Dir_Record) + (nameLen) + 3) & ~3)
+
+/* Largest directory, in buckets. */
+#define XGOSFS_MAX_DIR_BUCKETS		1024
+
+/*
+ * Extent tree nodes take a whole block.  Leaves (level 0) hold
+ * extents; interior nodes hold the first logical block mapped
+ * by each child.  Extents are only ever appended to a file, so
+ * nodes are filled left to right and never merged.
+ */
+#define XGOSFS_TREE_MAGIC		0x45455254	/* "TREE" */
+#define XGOSFS_TREE_HEADER_SIZE		(4 * sizeof(uint_t))
+#define XGOSFS_TREE_EXTENTS \
+    ((XGOSFS_FS_BLOCK_SIZE - XGOSFS_TREE_HEADER_SIZE) / sizeof(struct XGOSFS_Extent))
+#define XGOSFS_TREE_INDEXES \
+    ((XGOSFS_FS_BLOCK_SIZE - XGOSFS_TREE_HEADER_SIZE) / sizeof(struct XGOSFS_Tree_Index))
+
+struct XGOSFS_Tree_Index {
+    uint_t logical;
+    uint_t child;
+};
+
+struct XGOSFS_Tree_Node {
+    uint_t magic;
+    uint_t level;				/* 0 for leaves */
+    uint_t count;				/* Entries in use */
+    uint_t reserved;
+    union {
+	struct XGOSFS_Extent extent[XGOSFS_TREE_EXTENTS];
+	struct XGOSFS_Tree_Index index[XGOSFS_TREE_INDEXES];
+    } u;
+};
+
+/*
+ * The superblock, at the start of block 0.
+ */
+struct XGOSFS_Superblock {
+    uint_t magic;
+    uint_t version;
+    uint_t numBlocks;				/* Size of filesystem in blocks. */
+    uint_t numGroups;				/* Number of allocation groups. */
+    uint_t blocksPerGroup;
+    uint_t inodesPerGroup;
+    uint_t groupStart;				/* First block of group descriptors. */
+    uint_t groupBlocks;				/* Number of group descriptor blocks. */
+    uint_t bitmapStart;				/* First block of free block bitmap. */
+    uint_t bitmapBlocks;			/* Number of bitmap blocks. */
+    uint_t numInodes;				/* Size of inode table. */
+    uint_t inodeBitmapStart;			/* First block of free inode bitmap. */
+    uint_t inodeBitmapBlocks;			/* Number of inode bitmap blocks. */
+    uint_t inodeTableStart;			/* First block of inode table. */
+    uint_t inodeTableBlocks;			/* Number of inode table blocks. */
+    uint_t journalStart;			/* First block of journal. */
+    uint_t journalBlocks;			/* Number of journal blocks. */
+};
+
+/* Number of inodes per block of disk space made at format time. */
+#define XGOSFS_BLOCKS_PER_INODE		4
+
+/*
+ * An allocation group descriptor.
+ */
+struct XGOSFS_Group {
+    uint_t freeBlocks;
+    uint_t freeInodes;
+    uint_t flags;
+    uint_t reserved;
+};
+
+/* Flags bits for groups. */
+#define XGOSFS_GROUP_INODES_UNINIT	0x01	/* Free inodes of group not zeroed yet. */
+
+#define XGOSFS_GROUPS_PER_BLOCK		(XGOSFS_FS_BLOCK_SIZE / sizeof(struct XGOSFS_Group))
+
+/*
+ * Blocks per allocation group.  Groups of blocks, and of inodes
+ * (whose number per group is a power of 2 no larger than this),
+ * each fit in a single bitmap block.
+ */
+#define XGOSFS_BLOCKS_PER_GROUP		8192
+
+/*
+ * Journal blocks all start with this header.  The first block of
+ * the journal says which transaction is the first one in the log,
+ * at the second block; each one follows the one before it.
+ */
+struct XGOSFS_Journal_Header {
+    uint_t magic;
+    uint_t type;
+    uint_t sequence;				/* Transaction number */
+    uint_t count;				/* Descriptor: number of blocks */
+    uint_t checksum;				/* Commit: checksum of blocks */
+};
+
+#define XGOSFS_JOURNAL_MAGIC		0x4c4e524a	/* "JRNL" */
+#define XGOSFS_JOURNAL_SUPER		1
+#define XGOSFS_JOURNAL_DESCRIPTOR	2	/* Followed by block numbers */
+#define XGOSFS_JOURNAL_COMMIT		3
+
+/* Size of journal, in blocks. */
+#define XGOSFS_JOURNAL_MIN_BLOCKS	128
+#define XGOSFS_JOURNAL_MAX_BLOCKS	1024
+
+/* Number of blocks or inodes whose state is kept in one bitmap block. */
+#define XGOSFS_BITS_PER_BLOCK		(XGOSFS_FS_BLOCK_SIZE * 8)
+
+#ifdef GEEKOS
+void Init_XGOSFS(void);
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Buffered output
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef BUFIO_H
+#define BUFIO_H
+
+#include <stdarg.h>
+#include <geekos/ktypes.h>
+
+#define BUFIO_SIZE 1024
+
+/*
+ * Buffering modes.
+ */
+#define BUFIO_AUTO 0	/* Line buffered for the console, fully buffered otherwise */
+#define BUFIO_LINE 1	/* Flushed at each newline */
+#define BUFIO_FULL 2	/* Flushed when full */
+#define BUFIO_NONE 3	/* Not buffered */
+
+/*
+ * Output buffered in user space, so that a line of output
+ * (or a block, for files and pipes) costs one Write() system call.
+ * Buffers are not safe for use by several threads at once.
+ */
+struct Output_Buffer {
+    int fd;
+    int mode;
+    int count;			/* Bytes waiting in data */
+    struct Output_Buffer *next;	/* In list of buffers flushed at exit */
+    char data[BUFIO_SIZE];
+};
+
+/* Buffer for standard output (fd 1), used by Print() and friends */
+extern struct Output_Buffer g_stdOutput;
+
+void Init_Output_Buffer(struct Output_Buffer *out, int fd, int mode);
+int Close_Output_Buffer(struct Output_Buffer *out);
+int Buffer_Write(struct Output_Buffer *out, const void *buf, unsigned long len);
+int Buffer_Put_Char(struct Output_Buffer *out, int ch);
+int Buffer_Print(struct Output_Buffer *out, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+int Buffer_VPrint(struct Output_Buffer *out, const char *fmt, va_list args);
+int Flush_Output(struct Output_Buffer *out);
+void Flush_All_Output(void);
+
+#endif  /* BUFIO_H */
@@ -29,5 +29,17 @@ int Seek(int fd, int pos);
 int Delete(const char *path);
 int Create_Pipe(int *readfd, int *writefd);
 
+/*
+ * Batched operations use a single ring per process, which is not
+ * safe for use by several threads at once.
+ */
+int Batch_Read(int fd, void *buf, unsigned long len, unsigned long userData);
+int Batch_Write(int fd, const void *buf, unsigned long len, unsigned long userData);
+int Batch_Seek(int fd, int pos, unsigned long userData);
+int Batch_Stat(const char *path, struct VFS_File_Stat *stat, unsigned long userData);
+int Batch_FStat(int fd, struct VFS_File_Stat *stat, unsigned long userData);
+int Submit_Batch(void);
+bool Get_Completion(struct Batch_Completion *completion);
+
 #endif  /* FILEIO_H */
 
@@ -17,6 +17,10 @@ int Spawn_Program(const char *program, const char* command, int stdinFd, int std
 int Spawn_With_Path(const char *program, const char *command, int stdinFd, int stdoutFd, const char *path);
 int Wait(int pid);
 int Get_PID(void);
+int Fork(void);
+int Create_Thread(int (*startFunc)(void *), void *arg);
+int Join_Thread(int tid);
+int Have_Sysenter(void);
 
 #endif  /* PROCESS_H */
 
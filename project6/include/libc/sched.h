@@ -14,5 +14,14 @@
 int Set_Scheduling_Policy(int policy, int quantum);
 int Get_Time_Of_Day(void);
 
+struct Kernel_Stats;
+int Get_Stats(struct Kernel_Stats *stats);
+
+struct Profile_Header;
+struct Profile_Sample;
+int Start_Profile(int interval);
+int Stop_Profile(struct Profile_Header *header);
+int Dump_Profile(struct Profile_Sample *buf, int first, int max);
+
 #endif  /* SCHED_H */
 
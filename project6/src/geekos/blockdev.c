@@ -14,11 +14,13 @@
 #include <geekos/int.h>
 #include <geekos/kthread.h>
 #include <geekos/synch.h>
+#include <geekos/klog.h>
 #include <geekos/blockdev.h>
+#include <geekos/stats.h>
 
 /*#define BLOCKDEV_DEBUG */
 #ifdef BLOCKDEV_DEBUG
-#  define Debug(args...) Print(args)
+#  define Debug(args...) Log(LOG_DEBUG, args)
 #else
 #  define Debug(args...)
 #endif
@@ -48,12 +50,13 @@ static struct Block_Device_List s_deviceList;
  * Perform a block IO request.
  * Returns 0 if successful, error code on failure.
  */
-static int Do_Request(struct Block_Device *dev, enum Request_Type type, int blockNum, void *buf)
+static int Do_Request(struct Block_Device *dev, enum Request_Type type,
+    int blockNum, int numBlocks, void *buf)
 {
     struct Block_Request *request;
     int rc;
 
-    request = Create_Request(dev, type, blockNum, buf);
+    request = Create_Request(dev, type, blockNum, numBlocks, buf);
     if (request == 0)
 	return ENOMEM;
     Post_Request_And_Wait(request);
@@ -93,6 +96,8 @@ int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
     dev->driverData = driverData;
     dev->waitQueue = waitQueue;
     dev->requestQueue = requestQueue;
+    dev->numReads = dev->numWrites = 0;
+    dev->blocksRead = dev->blocksWritten = 0;
 
     Mutex_Lock(&s_blockdevLock);
     /* FIXME: handle name conflict with existing device */
@@ -159,16 +164,22 @@ int Close_Block_Device(struct Block_Device *dev)
 }
 
 /*
- * Create a block device request to transfer a single block.
+ * Create a block device request to transfer one or more
+ * consecutive blocks.
  */
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
-    int blockNum, void *buf)
+    int blockNum, int numBlocks, void *buf)
 {
-    struct Block_Request *request = Malloc(sizeof(*request));
+    struct Block_Request *request;
+
+    KASSERT(numBlocks > 0);
+
+    request = Malloc(sizeof(*request));
     if (request != 0) {
 	request->dev = dev;
 	request->type = type;
 	request->blockNum = blockNum;
+	request->numBlocks = numBlocks;
 	request->buf = buf;
 	request->state = PENDING;
 	Clear_Thread_Queue(&request->waitQueue);
@@ -192,7 +203,17 @@ void Post_Request_And_Wait(struct Block_Request *request)
 
     /* Send request to the driver */
     Debug("Posting block device request [@%x]...\n", request);
+    STAT_INC(STAT_BLOCK_REQUESTS);
+    TRACE("blockdev: %s %s %d+%d\n", dev->name, request->type == BLOCK_READ ? "read" : "write",
+	request->blockNum, request->numBlocks);
     Disable_Interrupts();
+    if (request->type == BLOCK_READ) {
+	++dev->numReads;
+	dev->blocksRead += request->numBlocks;
+    } else {
+	++dev->numWrites;
+	dev->blocksWritten += request->numBlocks;
+    }
     Add_To_Back_Of_Block_Request_List(dev->requestQueue, request);
     Wake_Up(dev->waitQueue);
     Enable_Interrupts();
@@ -243,7 +264,7 @@ void Notify_Request_Completion(struct Block_Request *request, enum Request_State
  */
 int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
 {
-    return Do_Request(dev, BLOCK_READ, blockNum, buf);
+    return Do_Request(dev, BLOCK_READ, blockNum, 1, buf);
 }
 
 /*
@@ -252,7 +273,25 @@ int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
  */
 int Block_Write(struct Block_Device *dev, int blockNum, void *buf)
 {
-    return Do_Request(dev, BLOCK_WRITE, blockNum, buf);
+    return Do_Request(dev, BLOCK_WRITE, blockNum, 1, buf);
+}
+
+/*
+ * Read consecutive blocks from given device with a single request.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Read_Multiple(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
+{
+    return Do_Request(dev, BLOCK_READ, blockNum, numBlocks, buf);
+}
+
+/*
+ * Write consecutive blocks to given device with a single request.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Write_Multiple(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
+{
+    return Do_Request(dev, BLOCK_WRITE, blockNum, numBlocks, buf);
 }
 
 /*
@@ -263,3 +302,27 @@ int Get_Num_Blocks(struct Block_Device *dev)
     return dev->ops->Get_Num_Blocks(dev);
 }
 
+/*
+ * Fill in statistics for up to max block devices.
+ * Returns the number of devices filled in.
+ */
+int Get_Block_Device_Stats(struct Device_Stats *stats, int max)
+{
+    struct Block_Device *dev;
+    int count = 0;
+
+    Mutex_Lock(&s_blockdevLock);
+    for (dev = Get_Front_Of_Block_Device_List(&s_deviceList);
+	 dev != 0 && count < max;
+	 dev = Get_Next_In_Block_Device_List(dev)) {
+	strcpy(stats[count].name, dev->name);
+	stats[count].numReads = dev->numReads;
+	stats[count].numWrites = dev->numWrites;
+	stats[count].blocksRead = dev->blocksRead;
+	stats[count].blocksWritten = dev->blocksWritten;
+	++count;
+    }
+    Mutex_Unlock(&s_blockdevLock);
+
+    return count;
+}
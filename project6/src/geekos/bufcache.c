@@ -11,8 +11,11 @@
 #include <geekos/kassert.h>
 #include <geekos/mem.h>
 #include <geekos/malloc.h>
+#include <geekos/string.h>
 #include <geekos/blockdev.h>
+#include <geekos/klog.h>
 #include <geekos/bufcache.h>
+#include <geekos/stats.h>
 
 /*
  * Maximum number of buffers that are cached per-filesystem.
@@ -24,7 +27,7 @@
  * ---------------------------------------------------------------------- */
 
 int bufCacheDebug = 0;
-#define Debug(args...) if (bufCacheDebug) Print(args)
+#define Debug(args...) if (bufCacheDebug) Log(LOG_DEBUG, args)
 
 /* XXX */
 int noEvict = 0;
@@ -39,31 +42,38 @@ static uint_t Get_Num_Sectors_Per_FS_Block(struct FS_Buffer_Cache *cache)
 }
 
 /*
- * Read or write a filesystem buffer.
+ * Allocate and free buffer data.  Blocks smaller than a page
+ * (such as PFAT's single sectors) come from the kernel heap,
+ * so they don't each take up a whole page.
+ */
+static void *Alloc_Buffer_Data(struct FS_Buffer_Cache *cache)
+{
+    return cache->fsBlockSize < PAGE_SIZE ? Malloc(cache->fsBlockSize) : Alloc_Page();
+}
+
+static void Free_Buffer_Data(struct FS_Buffer_Cache *cache, void *data)
+{
+    if (cache->fsBlockSize < PAGE_SIZE)
+	Free(data);
+    else
+	Free_Page(data);
+}
+
+/*
+ * Read or write a filesystem buffer, with a single request
+ * for all of its sectors.
  */
 static int Do_Buffer_IO(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf,
-    int (*IO_Func)(struct Block_Device *dev, int blockNum, void *buf))
+    int (*IO_Func)(struct Block_Device *dev, int blockNum, int numBlocks, void *buf))
 {
-    uint_t offset;
-    int sectorCount = 0;
-    int blockNum = buf->fsBlockNum * Get_Num_Sectors_Per_FS_Block(cache);
-    char *ptr = (char*) buf->data;
-
-    for (offset = 0; offset < cache->fsBlockSize; offset += SECTOR_SIZE) {
-	int rc = IO_Func(cache->dev, blockNum, ptr + offset);
-	if (rc != 0)
-	    return rc;
-	++sectorCount;
-	++blockNum;
-    }
-    KASSERT(offset == cache->fsBlockSize);
-    KASSERT(sectorCount == Get_Num_Sectors_Per_FS_Block(cache));
+    uint_t numSectors = Get_Num_Sectors_Per_FS_Block(cache);
 
-    return 0;
+    return IO_Func(cache->dev, buf->fsBlockNum * numSectors, numSectors, buf->data);
 }
 
 /*
  * If necessary, write back uncomitted buffer contents to block device.
+ * Pinned buffers are left alone.
  */
 static int Sync_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 {
@@ -71,8 +81,8 @@ static int Sync_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 
     KASSERT(IS_HELD(&cache->lock));
 
-    if (buf->flags & FS_BUFFER_DIRTY) {
-	if ((rc = Do_Buffer_IO(cache, buf, Block_Write)) == 0)
+    if ((buf->flags & (FS_BUFFER_DIRTY | FS_BUFFER_PINNED)) == FS_BUFFER_DIRTY) {
+	if ((rc = Do_Buffer_IO(cache, buf, Block_Write_Multiple)) == 0)
 	    buf->flags &= ~(FS_BUFFER_DIRTY);
     }
 
@@ -91,9 +101,11 @@ static void Move_To_Front(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 
 /*
  * Get buffer for given block, and mark it in use.
+ * If read is false, the block's contents aren't needed, and
+ * the buffer is zero filled instead of being read from disk.
  * Must be called with cache mutex held.
  */
-static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
+static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, bool read, struct FS_Buffer **pBuf)
 {
     struct FS_Buffer *buf, *lru = 0;
     int rc;
@@ -115,11 +127,14 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
 		Debug("Waiting for block %lu\n", fsBlockNum);
 		Cond_Wait(&cache->cond, &cache->lock);
 	    }
+	    STAT_INC(STAT_BUFCACHE_HITS);
+	    if (!read)
+		memset(buf->data, '\0', cache->fsBlockSize);
 	    goto done;
 	}
 
-	/* If buffer isn't in use, it's a candidate for LRU. */
-	if (!(buf->flags & FS_BUFFER_INUSE))
+	/* If buffer isn't in use or pinned, it's a candidate for LRU. */
+	if (!(buf->flags & (FS_BUFFER_INUSE | FS_BUFFER_PINNED)))
 	    lru = buf;
 
 	buf = Get_Next_In_FS_Buffer_List(buf);
@@ -132,7 +147,7 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
     if (cache->numCached < FS_BUFFER_CACHE_MAX_BLOCKS) {
 	buf = (struct FS_Buffer*) Malloc(sizeof(*buf));
 	if (buf != 0) {
-	    buf->data = Alloc_Page();
+	    buf->data = Alloc_Buffer_Data(cache);
 	    if (buf->data == 0)
 		Free(buf);
 	    else {
@@ -160,7 +175,9 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
 	return rc;
 
     /* LRU buffer is clean, so we can steal it. */
+    STAT_INC(STAT_BUFCACHE_EVICTIONS);
     buf = lru;
+    buf->fsBlockNum = fsBlockNum;
     buf->flags = 0;
     Move_To_Front(cache, buf);
 
@@ -174,8 +191,14 @@ readAndAcquire:
     KASSERT(Get_Front_Of_FS_Buffer_List(&cache->bufferList) == buf);
 
     /* Read block data into buffer. */
-    if ((rc = Do_Buffer_IO(cache, buf, Block_Read)) != 0)
+    STAT_INC(STAT_BUFCACHE_MISSES);
+    if (!read)
+	memset(buf->data, '\0', cache->fsBlockSize);
+    else if ((rc = Do_Buffer_IO(cache, buf, Block_Read_Multiple)) != 0) {
+	/* Don't leave the buffer claiming to hold the block */
+	buf->fsBlockNum = ~0UL;
 	return rc;
+    }
 
 done:
     /* Buffer is now in use. */
@@ -210,10 +233,10 @@ static int Sync_Cache(struct FS_Buffer_Cache *cache)
 /*
  * Free the memory used by a filesystem buffer.
  */
-static void Free_Buffer(struct FS_Buffer *buf)
+static void Free_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 {
     KASSERT(!(buf->flags & (FS_BUFFER_DIRTY | FS_BUFFER_INUSE)));
-    Free_Page(buf->data);
+    Free_Buffer_Data(cache, buf->data);
     Free(buf);
 }
 
@@ -285,7 +308,7 @@ int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
     buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
     while (buf != 0) {
 	struct FS_Buffer *next = Get_Next_In_FS_Buffer_List(buf);
-	Free_Buffer(buf);
+	Free_Buffer(cache, buf);
 	buf = next;
     }
     Clear_FS_Buffer_List(&cache->bufferList);
@@ -306,12 +329,64 @@ int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_B
     int rc;
 
     Mutex_Lock(&cache->lock);
-    rc = Get_Buffer(cache, fsBlockNum, pBuf);
+    rc = Get_Buffer(cache, fsBlockNum, true, pBuf);
+    Mutex_Unlock(&cache->lock);
+
+    return rc;
+}
+
+/*
+ * Get a buffer for a filesystem block whose old contents aren't
+ * needed, such as a newly allocated block: it is zero filled
+ * rather than read from disk.
+ */
+int Get_New_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
+{
+    int rc;
+
+    Mutex_Lock(&cache->lock);
+    rc = Get_Buffer(cache, fsBlockNum, false, pBuf);
     Mutex_Unlock(&cache->lock);
 
     return rc;
 }
 
+/*
+ * Read consecutive filesystem blocks straight into buf with
+ * a single device request, bypassing the cache.  Blocks that
+ * are in the cache are copied from there instead, since the
+ * cached copy may be newer than the one on disk.
+ */
+int Read_FS_Blocks(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t numBlocks, void *buf)
+{
+    uint_t numSectors = Get_Num_Sectors_Per_FS_Block(cache);
+    struct FS_Buffer *fsBuf;
+    int rc;
+
+    rc = Block_Read_Multiple(cache->dev, fsBlockNum * numSectors, numBlocks * numSectors, buf);
+    if (rc != 0)
+	return rc;
+
+    Mutex_Lock(&cache->lock);
+    fsBuf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+    while (fsBuf != 0) {
+	if (fsBuf->fsBlockNum >= fsBlockNum && fsBuf->fsBlockNum < fsBlockNum + numBlocks) {
+	    if (fsBuf->flags & FS_BUFFER_INUSE) {
+		/* Wait for it to be released, then start over */
+		Cond_Wait(&cache->cond, &cache->lock);
+		fsBuf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
+		continue;
+	    }
+	    memcpy((char*) buf + (fsBuf->fsBlockNum - fsBlockNum) * cache->fsBlockSize,
+		fsBuf->data, cache->fsBlockSize);
+	}
+	fsBuf = Get_Next_In_FS_Buffer_List(fsBuf);
+    }
+    Mutex_Unlock(&cache->lock);
+
+    return 0;
+}
+
 /*
  * Mark the given buffer as being modified.
  */
@@ -321,6 +396,32 @@ void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
     buf->flags |= FS_BUFFER_DIRTY;
 }
 
+/*
+ * Pin given buffer, which must be in use, so that it is neither
+ * written back nor evicted until it is unpinned.  This lets a
+ * filesystem make sure a change reaches some other place on disk,
+ * such as a journal, before it reaches the block itself.
+ */
+void Pin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(buf->flags & FS_BUFFER_INUSE);
+
+    Mutex_Lock(&cache->lock);
+    buf->flags |= FS_BUFFER_PINNED;
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Unpin a buffer pinned by Pin_FS_Buffer().
+ * It need not be in use.
+ */
+void Unpin_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    Mutex_Lock(&cache->lock);
+    buf->flags &= ~(FS_BUFFER_PINNED);
+    Mutex_Unlock(&cache->lock);
+}
+
 /*
  * Explicitly synchronize given buffer with its on-disk storage,
  * without releasing the buffer.
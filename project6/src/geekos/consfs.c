@@ -11,6 +11,7 @@
 #include <geekos/kassert.h>
 #include <geekos/vfs.h>
 #include <geekos/malloc.h>
+#include <geekos/string.h>
 #include <geekos/screen.h>
 #include <geekos/keyboard.h>
 #include <geekos/consfs.h>
@@ -19,6 +20,18 @@
  * Private data and functions
  * ---------------------------------------------------------------------- */
 
+/*
+ * Get metadata for console input or output.
+ * The console is marked as a terminal, so user programs
+ * can choose to line buffer their output to it.
+ */
+static int Console_FStat(struct File *file, struct VFS_File_Stat *stat)
+{
+    memset(stat, '\0', sizeof(*stat));
+    stat->isTerminal = 1;
+    return 0;
+}
+
 /*
  * Read from console (keyboard).
  * Returns number of bytes read, or error code.
@@ -34,7 +47,8 @@ static int Console_Read(struct File *file, void *buf, ulong_t numBytes)
  */
 static int Console_Write(struct File *file, void *buf, ulong_t numBytes)
 {
-    TODO("Write to console");
+    Put_Buf((const char*) buf, numBytes);
+    return (int) numBytes;
 }
 
 /*
@@ -43,7 +57,8 @@ static int Console_Write(struct File *file, void *buf, ulong_t numBytes)
  */
 static int Console_Close(struct File *file)
 {
-    TODO("Close console input or output");
+    /* Nothing to release; the VFS frees the File */
+    return 0;
 }
 
 /*
@@ -70,7 +85,7 @@ static int Console_Clone(struct File *file, struct File **pClone)
  * File_Ops for console input.
  */
 static struct File_Ops s_consInputFileOps = {
-    0,			/* FStat() */
+    &Console_FStat,
     &Console_Read,
     0,			/* Write() */
     0,			/* Seek() */
@@ -83,7 +98,7 @@ static struct File_Ops s_consInputFileOps = {
  * File_Ops for console output.
  */
 static struct File_Ops s_consOutputFileOps = {
-    0,			/* FStat() */
+    &Console_FStat,
     0,			/* Read() */
     &Console_Write,
     0,			/* Seek() */
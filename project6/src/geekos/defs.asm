@@ -80,4 +80,12 @@ KERNEL_DS equ 2<<3	; kernel data segment is GDT entry 2
 KERN_THREAD_OBJ equ (1024*1024)
 KERN_STACK equ KERN_THREAD_OBJ + 4096
 
+; User code and data segments are entries 0 and 1 of every
+; process's LDT, with RPL 3 (see Create_User_Context() in uservm.c)
+USER_CS equ (0<<3)|4|3
+USER_DS equ (1<<3)|4|3
+
+SYSCALL_INT equ 0x90	; must match defs.h
+EFLAGS_IF equ (1<<9)	; interrupt enable flag
+
 %endif
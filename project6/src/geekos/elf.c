@@ -17,8 +17,14 @@
 #include <geekos/string.h>
 #include <geekos/user.h>
 #include <geekos/fileio.h>
+#include <geekos/paging.h>
 #include <geekos/elf.h>
 
+/*
+ * Program header type for loadable segments.
+ */
+#define PT_LOAD 1
+
 
 /**
  * From the data of an ELF executable, determine how its segments
@@ -32,6 +38,47 @@
 int Parse_ELF_Executable(char *exeFileData, ulong_t exeFileLength,
     struct Exe_Format *exeFormat)
 {
-    TODO("Parse an ELF executable image");
+    elfHeader *hdr = (elfHeader*) exeFileData;
+    programHeader *phdr;
+    int i;
+
+    if (exeFileLength < sizeof(elfHeader) ||
+	hdr->ident[0] != 0x7f || hdr->ident[1] != 'E' ||
+	hdr->ident[2] != 'L' || hdr->ident[3] != 'F')
+	return ENOEXEC;
+
+    /*
+     * The program headers must be within the part of the file
+     * we were given (normally just the first page).
+     */
+    if (hdr->phoff + hdr->phnum * sizeof(programHeader) > exeFileLength)
+	return ENOEXEC;
+
+    phdr = (programHeader*) (exeFileData + hdr->phoff);
+    exeFormat->numSegments = 0;
+    for (i = 0; i < hdr->phnum; ++i) {
+	struct Exe_Segment *segment;
+
+	if (phdr[i].type != PT_LOAD)
+	    continue;
+	if (exeFormat->numSegments == EXE_MAX_SEGMENTS ||
+	    phdr[i].fileSize > phdr[i].memSize)
+	    return ENOEXEC;
+
+	segment = &exeFormat->segmentList[exeFormat->numSegments++];
+	segment->offsetInFile = phdr[i].offset;
+	segment->lengthInFile = phdr[i].fileSize;
+	segment->startAddress = phdr[i].vaddr;
+	segment->sizeInMemory = phdr[i].memSize;
+	segment->protFlags = VM_READ |
+	    ((phdr[i].flags & PF_W) ? VM_WRITE : 0) |
+	    ((phdr[i].flags & PF_X) ? VM_EXEC : 0);
+    }
+
+    if (exeFormat->numSegments == 0)
+	return ENOEXEC;
+
+    exeFormat->entryAddr = hdr->entry;
+    return 0;
 }
 
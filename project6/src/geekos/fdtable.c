@@ -0,0 +1,253 @@
+/*
+ * Per-process file descriptor table
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/int.h>
+#include <geekos/malloc.h>
+#include <geekos/string.h>
+#include <geekos/vfs.h>
+#include <geekos/fdtable.h>
+
+/*
+ * Tables may be shared by the threads of a process, so they are
+ * only modified with interrupts disabled.  Files are closed
+ * with interrupts enabled, since that may block.
+ */
+
+/* ----------------------------------------------------------------------
+ * Private functions
+ * ---------------------------------------------------------------------- */
+
+#define WORD_BITS 32
+
+/*
+ * Index of the lowest clear bit in given word, which must not be all ones.
+ */
+static __inline__ int Lowest_Clear_Bit(ulong_t word)
+{
+    ulong_t bit;
+
+    KASSERT(word != 0xffffffff);
+    __asm__ ("bsfl %1, %0" : "=r" (bit) : "r" (~word));
+    return (int) bit;
+}
+
+/*
+ * Make the table big enough to hold given descriptor.
+ * Interrupts must be disabled.
+ */
+static int Grow_File_Table(struct File_Table *table, int fd)
+{
+    int newSize = table->size > 0 ? table->size : FILE_TABLE_INITIAL_SIZE;
+    struct File **fileList;
+    ulong_t *usedMap;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (fd < 0 || fd >= FILE_TABLE_MAX_SIZE)
+	return EMFILE;
+    if (fd < table->size)
+	return 0;
+
+    while (newSize <= fd)
+	newSize *= 2;
+
+    fileList = (struct File **) Malloc(newSize * sizeof(struct File *));
+    usedMap = (ulong_t *) Malloc((newSize / WORD_BITS) * sizeof(ulong_t));
+    if (fileList == 0 || usedMap == 0) {
+	if (fileList != 0)
+	    Free(fileList);
+	if (usedMap != 0)
+	    Free(usedMap);
+	return ENOMEM;
+    }
+
+    memset(fileList, '\0', newSize * sizeof(struct File *));
+    memset(usedMap, '\0', (newSize / WORD_BITS) * sizeof(ulong_t));
+    if (table->size > 0) {
+	memcpy(fileList, table->fileList, table->size * sizeof(struct File *));
+	memcpy(usedMap, table->usedMap, (table->size / WORD_BITS) * sizeof(ulong_t));
+	Free(table->fileList);
+	Free(table->usedMap);
+    }
+
+    table->fileList = fileList;
+    table->usedMap = usedMap;
+    table->size = newSize;
+    return 0;
+}
+
+/*
+ * Mark descriptor as used or free.
+ */
+static void Set_Descriptor_Used(struct File_Table *table, int fd, bool used)
+{
+    int word = fd / WORD_BITS;
+    ulong_t mask = 1UL << (fd % WORD_BITS);
+
+    if (used)
+	table->usedMap[word] |= mask;
+    else
+	table->usedMap[word] &= ~mask;
+
+    if (table->usedMap[word] == 0xffffffff)
+	table->fullMap |= 1UL << word;
+    else
+	table->fullMap &= ~(1UL << word);
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Install file at the lowest free descriptor.
+ * Returns the descriptor, or an error code if the table is full.
+ */
+int Alloc_File_Descriptor(struct File_Table *table, struct File *file)
+{
+    int fd, rc;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+
+    if (table->fullMap == 0xffffffff) {
+	rc = EMFILE;
+	goto done;
+    }
+
+    /* Words past the end of the table count as free */
+    fd = Lowest_Clear_Bit(table->fullMap) * WORD_BITS;
+    if (fd < table->size)
+	fd += Lowest_Clear_Bit(table->usedMap[fd / WORD_BITS]);
+
+    if ((rc = Grow_File_Table(table, fd)) != 0)
+	goto done;
+
+    KASSERT(table->fileList[fd] == 0);
+    table->fileList[fd] = file;
+    Set_Descriptor_Used(table, fd, true);
+    rc = fd;
+
+done:
+    End_Int_Atomic(iflag);
+    return rc;
+}
+
+/*
+ * Install file at given descriptor, which must be free.
+ * Returns 0 if successful, or an error code.
+ */
+int Install_File_Descriptor(struct File_Table *table, int fd, struct File *file)
+{
+    int rc;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+
+    if ((rc = Grow_File_Table(table, fd)) == 0) {
+	if (table->fileList[fd] != 0)
+	    rc = EBUSY;
+	else {
+	    table->fileList[fd] = file;
+	    Set_Descriptor_Used(table, fd, true);
+	}
+    }
+
+    End_Int_Atomic(iflag);
+    return rc;
+}
+
+/*
+ * Get the file for given descriptor, or null if it isn't open.
+ */
+struct File *Lookup_File_Descriptor(struct File_Table *table, int fd)
+{
+    struct File *file = 0;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    if (fd >= 0 && fd < table->size)
+	file = table->fileList[fd];
+    End_Int_Atomic(iflag);
+
+    return file;
+}
+
+/*
+ * Free given descriptor.  Returns the file it referred to,
+ * which the caller should close, or null if it wasn't open.
+ */
+struct File *Release_File_Descriptor(struct File_Table *table, int fd)
+{
+    struct File *file = 0;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    if (fd >= 0 && fd < table->size && (file = table->fileList[fd]) != 0) {
+	table->fileList[fd] = 0;
+	Set_Descriptor_Used(table, fd, false);
+    }
+    End_Int_Atomic(iflag);
+
+    return file;
+}
+
+/*
+ * Fill in the (empty) clone table with the same descriptors
+ * as the original.  The open files are shared between the two.
+ * Returns 0 if successful, or an error code.
+ */
+int Clone_File_Table(struct File_Table *table, struct File_Table *clone)
+{
+    int fd, rc = 0;
+    bool iflag;
+
+    KASSERT(clone->size == 0);
+
+    iflag = Begin_Int_Atomic();
+
+    if (table->size > 0)
+	rc = Grow_File_Table(clone, table->size - 1);
+
+    for (fd = 0; fd < table->size && rc == 0; ++fd) {
+	if (table->fileList[fd] != 0)
+	    rc = Clone_File(table->fileList[fd], &clone->fileList[fd]);
+    }
+    if (rc == 0) {
+	memcpy(clone->usedMap, table->usedMap, (table->size / WORD_BITS) * sizeof(ulong_t));
+	clone->fullMap = table->fullMap;
+    }
+
+    End_Int_Atomic(iflag);
+
+    /* On failure, clone holds whatever references were taken */
+    return rc;
+}
+
+/*
+ * Close all files in the table and free its memory.
+ * Called with interrupts enabled.
+ */
+void Destroy_File_Table(struct File_Table *table)
+{
+    int fd;
+
+    KASSERT(Interrupts_Enabled());
+
+    for (fd = 0; fd < table->size; ++fd) {
+	if (table->fileList[fd] != 0)
+	    Close(table->fileList[fd]);
+    }
+
+    if (table->size > 0) {
+	Free(table->fileList);
+	Free(table->usedMap);
+    }
+    memset(table, '\0', sizeof(*table));
+}
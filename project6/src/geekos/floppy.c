@@ -46,6 +46,8 @@
  * History:
  * 23-Oct-2003: Works under Bochs 2.0 for read transfers.
  * 12-Nov-2003: Modified to use block device API.
+ * Reads a whole cylinder at a time into a track cache, and leaves
+ * the motor running until the drive has been idle for a while.
  */
 
 /* ----------------------------------------------------------------------
@@ -167,6 +169,7 @@ static struct Floppy_Parameters s_floppyParamsTable[] = {
  */
 struct Floppy_Drive {
     struct Floppy_Parameters *params;
+    int cylinder;		 /* Where the head is, or -1 if not known */
 };
 
 /*
@@ -181,10 +184,31 @@ struct Floppy_Drive s_driveTable[2];
 static struct Thread_Queue s_floppyInterruptWaitQueue;
 
 /*
- * Page of memory used for floppy DMA.
+ * Page of memory used for single sector floppy DMA.
  */
 static uchar_t *s_transferBuf;
 
+/*
+ * Track cache: both heads of one cylinder, read with a single
+ * multi-track command.  Sectors on the cached cylinder are
+ * served from memory; writes go through to the disk and
+ * update the cache.  The cache is dropped whenever the motor
+ * stops, since the diskette may be changed after that.
+ */
+static uchar_t *s_trackBuf;
+static int s_trackDrive = -1, s_trackCylinder = -1;
+
+/*
+ * The motor is left on between requests and turned off
+ * by a timer once the drive has been idle for a while
+ * (the timer runs at about 18 ticks per second).  The timer
+ * is only armed while no request is in progress, and is
+ * only touched with interrupts disabled.
+ */
+#define MOTOR_IDLE_TICKS	36
+static bool s_motorOn;
+static int s_motorTimerId = -1;
+
 /*
  * Queue of floppy block I/O requests.
  */
@@ -274,6 +298,7 @@ static void Setup_Drive_Parameters(int drive, int type)
 	Print("    %s: cyl=%d, heads=%d, sectors=%d\n", devname,
 		 params->cylinders, params->heads, params->sectors);
 	s_driveTable[drive].params = params;
+	s_driveTable[drive].cylinder = -1;
 
 	/* Register the block device. */
 	rc = Register_Block_Device(devname, &s_floppyDeviceOps, drive, 0,
@@ -396,6 +421,67 @@ static void Stop_Motor(int drive)
 	FDC_DOR_DMA_ENABLE | FDC_DOR_RESET_DISABLE | FDC_DOR_DRIVE_SELECT(0));
 }
 
+/*
+ * Timer callback: the drive has been idle long enough,
+ * so turn the motor off.
+ */
+static void Motor_Off_Callback(int id)
+{
+    KASSERT(id == s_motorTimerId);
+
+    Cancel_Timer(id);
+    s_motorTimerId = -1;
+    Stop_Motor(0);
+    s_motorOn = false;
+    s_trackDrive = s_trackCylinder = -1;
+    Debug("Floppy motor off\n");
+}
+
+/*
+ * Make sure the motor is running before a command.
+ * Must be called with interrupts disabled.
+ */
+static void Motor_On(int drive)
+{
+    KASSERT(!Interrupts_Enabled());
+
+    if (s_motorTimerId >= 0) {
+	Cancel_Timer(s_motorTimerId);
+	s_motorTimerId = -1;
+    }
+
+    if (!s_motorOn) {
+	Start_Motor(drive);
+	s_motorOn = true;
+
+	/*
+	 * According to The Undocumented PC, we should wait 8 millis
+	 * before attempting a read or write.
+	 */
+	Micro_Delay(8000);
+    }
+}
+
+/*
+ * Called when the drive goes idle: arm the timer that
+ * turns the motor off.  Must be called with interrupts disabled.
+ */
+static void Motor_Idle(int drive)
+{
+    KASSERT(!Interrupts_Enabled());
+
+    if (!s_motorOn || s_motorTimerId >= 0)
+	return;
+
+    s_motorTimerId = Start_Timer(MOTOR_IDLE_TICKS, Motor_Off_Callback);
+    if (s_motorTimerId < 0) {
+	/* No timers left: don't leave the motor running forever */
+	Stop_Motor(drive);
+	s_motorOn = false;
+	s_trackDrive = s_trackCylinder = -1;
+    }
+}
+
 /*
  * Reset and calibrate the controller.
  * Return true is successful, false otherwise.
@@ -411,8 +497,12 @@ static bool Reset_Controller(void)
      * TODO: we might want to support drives other than 0 eventually
      */
     Start_Motor(0);
+    s_motorOn = true;
 
-    return Calibrate(0);
+    if (!Calibrate(0))
+	return false;
+    s_driveTable[0].cylinder = 0;
+    return true;
 }
 
 static bool Floppy_Seek(int drive, int cylinder, int head)
@@ -423,12 +513,16 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
 
     Debug("Floppy_Seek(%d,%d,%d)\n", drive, cylinder, head);
 
-    while (numAttempts-- > 0) {
-	Start_Motor(drive);
-	/*Micro_Delay(1000); */
+    /* Heads are selected by the transfer command, not by seeking */
+    if (s_driveTable[drive].cylinder == cylinder)
+	return true;
+    s_driveTable[drive].cylinder = -1;
 
+    while (numAttempts-- > 0) {
 	Disable_Interrupts();
 
+	Motor_On(drive);
+
 	Floppy_Out(FDC_COMMAND_SEEK);
 	Floppy_Out((head << 2) | (drive & 3));
 	Floppy_Out(cylinder & 0xFF);
@@ -439,8 +533,6 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
 
 	Enable_Interrupts();
 
-	Stop_Motor(drive);
-
 	Sense_Interrupt_Status(&st0, &pcn);
 	if (st0 & FDC_ST0_SEEK_END) {
 	    /* Make sure we arrived at the desired cylinder */
@@ -448,6 +540,7 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
 		Debug("Seek arrived at wrong cylinder\n");
 	    } else {
 		Debug("Seek complete!\n");
+		s_driveTable[drive].cylinder = cylinder;
 		success = true;
 		break;
 	    }
@@ -457,11 +550,16 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
     return success;
 }
 
-static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
+/*
+ * Transfer numSectors sectors, starting at given sector, between
+ * the disk and dmaBuf.  A transfer starting on head 0 may run on
+ * into head 1 of the same cylinder.
+ */
+static int Floppy_Transfer(int direction, int driveNum, int cylinder, int head,
+    int sector, int numSectors, uchar_t *dmaBuf)
 {
     struct Floppy_Drive *drive = &s_driveTable[driveNum];
     struct Floppy_Parameters *params = drive->params;
-    int cylinder, head, sector;
     enum DMA_Direction dmaDirection =
 	direction == FLOPPY_READ ? DMA_READ : DMA_WRITE;
     uchar_t command;
@@ -471,8 +569,8 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     KASSERT(driveNum == 0);  /* FIXME */
     KASSERT(direction == FLOPPY_READ || direction == FLOPPY_WRITE);
     KASSERT(params != 0);
-
-    LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+    KASSERT(numSectors > 0 &&
+	(head * params->sectors) + sector - 1 + numSectors <= params->heads * params->sectors);
 
     if (!Floppy_Seek(driveNum, cylinder, head))
 	return -1;
@@ -480,21 +578,17 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Disable_Interrupts();
 
     /* Set up DMA for transfer */
-    Setup_DMA(dmaDirection, FDC_DMA, s_transferBuf, SECTOR_SIZE);
+    Setup_DMA(dmaDirection, FDC_DMA, dmaBuf, numSectors * SECTOR_SIZE);
 
-    /* Turn the floppy motor on */
-    Start_Motor(driveNum);
-
-    /*
-     * According to The Undocumented PC, we should wait 8 millis
-     * before attempting a read or write.
-     */
-    Micro_Delay(8000);
+    /* Make sure the floppy motor is on */
+    Motor_On(driveNum);
 
     if (direction == FLOPPY_READ)
 	command = FDC_COMMAND_READ_SECTOR | FDC_MFM | FDC_SKIP_DELETED;
     else
 	command = FDC_COMMAND_WRITE_SECTOR | FDC_MFM;
+    if (sector - 1 + numSectors > params->sectors)
+	command |= FDC_MULTI_TRACK;
  
     /* Issue the command */
     Floppy_Out(command);
@@ -520,8 +614,6 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Floppy_In();  /* sector number */
     Floppy_In();  /* sector size */
 
-    Stop_Motor(driveNum);
-
     if (FDC_ST0_IS_SUCCESS(st0)) {
 	Debug("Floppy_Transfer: successful transfer!\n");
 	result = 0;
@@ -533,25 +625,70 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     return result;
 }
 
-static int Floppy_Read(int driveNum, int blockNum, char *buffer)
+/*
+ * Read both heads of given cylinder into the track cache.
+ */
+static int Read_Track(int driveNum, int cylinder)
 {
+    struct Floppy_Parameters *params = s_driveTable[driveNum].params;
     int rc;
 
+    Debug("Read_Track(%d,%d)\n", driveNum, cylinder);
+
+    s_trackDrive = s_trackCylinder = -1;
+    rc = Floppy_Transfer(FLOPPY_READ, driveNum, cylinder, 0, 1,
+	params->heads * params->sectors, s_trackBuf);
+    if (rc == 0) {
+	s_trackDrive = driveNum;
+	s_trackCylinder = cylinder;
+    }
+
+    return rc;
+}
+
+/*
+ * Get the address of given sector in the track cache,
+ * or null if its cylinder isn't cached.
+ */
+static uchar_t *Cached_Sector(int driveNum, int cylinder, int head, int sector)
+{
+    struct Floppy_Parameters *params = s_driveTable[driveNum].params;
+
+    if (driveNum != s_trackDrive || cylinder != s_trackCylinder)
+	return 0;
+    return s_trackBuf + ((head * params->sectors) + sector - 1) * SECTOR_SIZE;
+}
+
+static int Floppy_Read(int driveNum, int blockNum, char *buffer)
+{
+    int cylinder, head, sector;
+    uchar_t *cached;
+    int rc = 0;
+
     Debug("Floppy_Read(%d,%d,%x)\n", driveNum, blockNum, buffer);
 
 #ifndef NDEBUG
     memset(buffer, (char) 0xcd, SECTOR_SIZE);
-    memset(s_transferBuf, (char) 0xcd, SECTOR_SIZE);
 #endif
 
-    rc = Floppy_Transfer(FLOPPY_READ, driveNum, blockNum, buffer);
+    LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+
+    if ((cached = Cached_Sector(driveNum, cylinder, head, sector)) == 0 &&
+	Read_Track(driveNum, cylinder) == 0)
+	cached = Cached_Sector(driveNum, cylinder, head, sector);
+
+    if (cached == 0) {
+	/* Couldn't read the whole track: try just this sector */
+	rc = Floppy_Transfer(FLOPPY_READ, driveNum, cylinder, head, sector, 1, s_transferBuf);
+	cached = s_transferBuf;
+    }
 
     if (rc == 0) {
 	/*
 	 * Successful transfer!
-	 * Copy data from transfer buffer into caller's buffer.
+	 * Copy data from cache or transfer buffer into caller's buffer.
 	 */
-	memcpy(buffer, s_transferBuf, SECTOR_SIZE);
+	memcpy(buffer, cached, SECTOR_SIZE);
     }
 
     return rc;
@@ -559,10 +696,26 @@ static int Floppy_Read(int driveNum, int blockNum, char *buffer)
 
 static int Floppy_Write(int driveNum, int blockNum, char *buffer)
 {
+    int cylinder, head, sector;
+    uchar_t *cached;
+    int rc;
+
     Debug("Floppy_Write(%d,%d,%x)\n", driveNum, blockNum, buffer);
 
+    LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+
     memcpy(s_transferBuf, buffer, SECTOR_SIZE);
-    return Floppy_Transfer(FLOPPY_WRITE, driveNum, blockNum, buffer);
+    rc = Floppy_Transfer(FLOPPY_WRITE, driveNum, cylinder, head, sector, 1, s_transferBuf);
+
+    /* Write through to the track cache */
+    if ((cached = Cached_Sector(driveNum, cylinder, head, sector)) != 0) {
+	if (rc == 0)
+	    memcpy(cached, buffer, SECTOR_SIZE);
+	else
+	    s_trackDrive = s_trackCylinder = -1;
+    }
+
+    return rc;
 }
 
 /*
@@ -570,7 +723,7 @@ static int Floppy_Write(int driveNum, int blockNum, char *buffer)
  */
 static void Floppy_Request_Thread(ulong_t arg)
 {
-    int rc;
+    int rc, i;
 
     Debug("FRQ: Floppy request thread starting...\n");
 
@@ -583,11 +736,19 @@ static void Floppy_Request_Thread(ulong_t arg)
 	Debug("FRQ: Got a floppy request [@%x]\n", request);
 	KASSERT(request->type == BLOCK_READ || request->type == BLOCK_WRITE);
 
-	/* Perform the I/O. */
-	if (request->type == BLOCK_READ)
-	    rc = Floppy_Read(request->dev->unit, request->blockNum, request->buf);
-	else
-	    rc = Floppy_Write(request->dev->unit, request->blockNum, request->buf);
+	/* Perform the I/O, one sector at a time. */
+	for (i = 0, rc = 0; i < request->numBlocks && rc == 0; ++i) {
+	    char *buf = (char*) request->buf + i*SECTOR_SIZE;
+	    if (request->type == BLOCK_READ)
+		rc = Floppy_Read(request->dev->unit, request->blockNum + i, buf);
+	    else
+		rc = Floppy_Write(request->dev->unit, request->blockNum + i, buf);
+	}
+
+	/* Leave the motor on in case another request follows soon */
+	Disable_Interrupts();
+	Motor_Idle(request->dev->unit);
+	Enable_Interrupts();
 
 	/* Notify the requesting thread of the outcome of the I/O. */
 	Debug("FRQ: Notifying requesting thread...\n");
@@ -596,6 +757,24 @@ static void Floppy_Request_Thread(ulong_t arg)
     }
 }
 
+/*
+ * Allocate a buffer for floppy DMA.  ISA DMA can't cross
+ * a 64K boundary, so allocate twice the size and use
+ * whichever half-aligned part of it doesn't.
+ */
+static uchar_t *Alloc_DMA_Buffer(ulong_t size)
+{
+    ulong_t addr = (ulong_t) Malloc(size * 2);
+
+    KASSERT(size <= 0xffff);
+    if (addr == 0)
+	return 0;
+
+    if ((addr & 0xffff) + size > 0xffff)
+	addr = (addr + 0xffff) & ~0xffffUL;
+    return (uchar_t*) addr;
+}
+
 /* ----------------------------------------------------------------------
  * Public functions
  * ---------------------------------------------------------------------- */
@@ -620,6 +799,16 @@ void Init_Floppy(void)
     Setup_Drive_Parameters(0, (floppyByte >> 4) & 0xF);
     Setup_Drive_Parameters(1, floppyByte & 0xF);
 
+    /* Track cache, big enough for a cylinder of drive 0 */
+    if (s_driveTable[0].params != 0) {
+	struct Floppy_Parameters *params = s_driveTable[0].params;
+	s_trackBuf = Alloc_DMA_Buffer(params->heads * params->sectors * SECTOR_SIZE);
+    }
+    if (s_trackBuf == 0) {
+	Print("  Failed to allocate track buffer\n");
+	goto done;
+    }
+
     /* Install floppy interrupt handler */
     Install_IRQ(FDC_IRQ, &Floppy_Interrupt_Handler);
     Enable_IRQ(FDC_IRQ);
@@ -646,6 +835,10 @@ void Init_Floppy(void)
     ready = true;
     Start_Kernel_Thread(Floppy_Request_Thread, 0, PRIORITY_NORMAL, true);
 
+    Disable_Interrupts();
+    Motor_Idle(0);
+    Enable_Interrupts();
+
 done:
     if (!ready)
 	Print("  Floppy controller initialization FAILED\n");
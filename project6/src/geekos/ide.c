@@ -25,6 +25,7 @@
 #include <geekos/timer.h>
 #include <geekos/kthread.h>
 #include <geekos/blockdev.h>
+#include <geekos/klog.h>
 #include <geekos/ide.h>
 
 /* Registers */
@@ -40,6 +41,9 @@
 #define IDE_COMMAND_REGISTER		0x1f7
 #define IDE_DEVICE_CONTROL_REGISTER	0x3F6
 
+/* Most sectors that can be transferred by one read/write command */
+#define IDE_MAX_SECTORS_PER_REQUEST	256
+
 /* Drives */
 #define IDE_DRIVE_0			0xa0
 #define IDE_DRIVE_1			0xb0
@@ -121,11 +125,12 @@ static int IDE_getNumBlocks(int driveNum)
 }
 
 /*
- * Read a block at the logical block number indicated.
+ * Read numBlocks consecutive blocks starting at the logical
+ * block number indicated.
  */
-static int IDE_Read(int driveNum, int blockNum, char *buffer)
+static int IDE_Read(int driveNum, int blockNum, int numBlocks, char *buffer)
 {
-    int i;
+    int i, n;
     int head;
     int sector;
     int cylinder;
@@ -133,12 +138,13 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
     int reEnable = 0;
 
     if (driveNum < 0 || driveNum > (numDrives-1)) {
-	if (ideDebug) Print("ide: invalid drive %d\n", driveNum);
+	if (ideDebug) Log(LOG_DEBUG, "ide: invalid drive %d\n", driveNum);
         return IDE_ERROR_BAD_DRIVE;
     }
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
-	if (ideDebug) Print("ide: invalid block %d\n", blockNum);
+    if (blockNum < 0 || numBlocks < 1 || numBlocks > IDE_MAX_SECTORS_PER_REQUEST ||
+	blockNum + numBlocks > IDE_getNumBlocks(driveNum)) {
+	if (ideDebug) Log(LOG_DEBUG, "ide: invalid block %d\n", blockNum);
         return IDE_ERROR_INVALID_BLOCK;
     }
 
@@ -155,13 +161,14 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
         drives[driveNum].num_Heads;
 
     if (ideDebug >= 2) {
-	Print ("request to read block %d\n", blockNum);
+	Print ("request to read %d blocks at %d\n", numBlocks, blockNum);
 	Print ("    head %d\n", head);
 	Print ("    cylinder %d\n", cylinder);
 	Print ("    sector %d\n", sector);
     }
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
+    /* A sector count of 0 means 256 sectors */
+    Out_Byte(IDE_SECTOR_COUNT_REGISTER, numBlocks & 0xff);
     Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
     Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
     Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
@@ -173,21 +180,25 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
 
     Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_READ_SECTORS);
 
-    if (ideDebug > 2) Print("About to wait for Read \n");
+    /* The drive raises DRQ once for each sector it has ready */
+    bufferW = (short *) buffer;
+    for (n = 0; n < numBlocks; n++) {
+	if (ideDebug > 2) Log(LOG_DEBUG, "About to wait for Read \n");
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+	/* wait for the drive */
+	while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
-    }
+	if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
+	    Log(LOG_ERROR, "ide: error status %d\n", In_Byte(IDE_STATUS_REGISTER));
+	    if (reEnable) Enable_Interrupts();
+	    return IDE_ERROR_DRIVE_ERROR;
+	}
 
-    if (ideDebug > 2) Print("got buffer \n");
+	if (ideDebug > 2) Log(LOG_DEBUG, "got buffer \n");
 
-    bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        bufferW[i] = In_Word(IDE_DATA_REGISTER);
+	for (i=0; i < 256; i++) {
+	    *bufferW++ = In_Word(IDE_DATA_REGISTER);
+	}
     }
 
     if (reEnable) Enable_Interrupts();
@@ -196,11 +207,12 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
 }
 
 /*
- * Write a block at the logical block number indicated.
+ * Write numBlocks consecutive blocks starting at the logical
+ * block number indicated.
  */
-static int IDE_Write(int driveNum, int blockNum, char *buffer)
+static int IDE_Write(int driveNum, int blockNum, int numBlocks, char *buffer)
 {
-    int i;
+    int i, n;
     int head;
     int sector;
     int cylinder;
@@ -211,7 +223,8 @@ static int IDE_Write(int driveNum, int blockNum, char *buffer)
         return IDE_ERROR_BAD_DRIVE;
     }
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
+    if (blockNum < 0 || numBlocks < 1 || numBlocks > IDE_MAX_SECTORS_PER_REQUEST ||
+	blockNum + numBlocks > IDE_getNumBlocks(driveNum)) {
         return IDE_ERROR_INVALID_BLOCK;
     }
 
@@ -228,13 +241,14 @@ static int IDE_Write(int driveNum, int blockNum, char *buffer)
         drives[driveNum].num_Heads;
 
     if (ideDebug) {
-	Print ("request to write block %d\n", blockNum);
+	Print ("request to write %d blocks at %d\n", numBlocks, blockNum);
 	Print ("    head %d\n", head);
 	Print ("    cylinder %d\n", cylinder);
 	Print ("    sector %d\n", sector);
     }
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
+    /* A sector count of 0 means 256 sectors */
+    Out_Byte(IDE_SECTOR_COUNT_REGISTER, numBlocks & 0xff);
     Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
     Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
     Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
@@ -246,23 +260,25 @@ static int IDE_Write(int driveNum, int blockNum, char *buffer)
 
     Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_WRITE_SECTORS);
 
-
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
-
     bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        Out_Word(IDE_DATA_REGISTER, bufferW[i]);
-    }
+    for (n = 0; n < numBlocks; n++) {
+	/* wait for the drive */
+	while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
 
-    if (ideDebug) Print("About to wait for Write \n");
+	for (i=0; i < 256; i++) {
+	    Out_Word(IDE_DATA_REGISTER, *bufferW++);
+	}
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+	if (ideDebug) Log(LOG_DEBUG, "About to wait for Write \n");
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
+	/* wait for the drive */
+	while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+
+	if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
+	    Log(LOG_ERROR, "ide: error status %d\n", In_Byte(IDE_STATUS_REGISTER));
+	    if (reEnable) Enable_Interrupts();
+	    return IDE_ERROR_DRIVE_ERROR;
+	}
     }
 
     if (reEnable) Enable_Interrupts();
@@ -297,16 +313,24 @@ static void IDE_Request_Thread(ulong_t arg)
 {
     for (;;) {
 	struct Block_Request *request;
-	int rc;
+	int rc, done, count;
 
 	/* Wait for a request to arrive */
 	request = Dequeue_Request(&s_ideRequestQueue, &s_ideWaitQueue);
 
-	/* Do the I/O */
-	if (request->type == BLOCK_READ)
-	    rc = IDE_Read(request->dev->unit, request->blockNum, request->buf);
-	else
-	    rc = IDE_Write(request->dev->unit, request->blockNum, request->buf);
+	/* Do the I/O, in chunks the controller can handle in one command */
+	for (done = 0, rc = 0; done < request->numBlocks && rc == 0; done += count) {
+	    char *buf = (char*) request->buf + done*SECTOR_SIZE;
+
+	    count = request->numBlocks - done;
+	    if (count > IDE_MAX_SECTORS_PER_REQUEST)
+		count = IDE_MAX_SECTORS_PER_REQUEST;
+
+	    if (request->type == BLOCK_READ)
+		rc = IDE_Read(request->dev->unit, request->blockNum + done, count, buf);
+	    else
+		rc = IDE_Write(request->dev->unit, request->blockNum + done, count, buf);
+	}
 
 	/* Notify requesting thread of final status */
 	Notify_Request_Completion(request, rc == 0 ? COMPLETED : ERROR, rc);
@@ -321,7 +345,7 @@ static int readDriveConfig(int drive)
     char devname[BLOCKDEV_MAX_NAME_LEN];
     int rc;
 
-    if (ideDebug > 1) Print("ide: about to read drive config for drive #%d\n", drive);
+    if (ideDebug > 1) Log(LOG_DEBUG, "ide: about to read drive config for drive #%d\n", drive);
 
     Out_Byte(IDE_DRIVE_HEAD_REGISTER, (drive == 0) ? IDE_DRIVE_0 : IDE_DRIVE_1);
     Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_IDENTIFY_DRIVE);
@@ -389,19 +413,19 @@ void Init_IDE(void)
     while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY)
 	;
 
-    if (ideDebug) Print("About to run drive Diagnosis\n");
+    if (ideDebug) Log(LOG_DEBUG, "About to run drive Diagnosis\n");
 
     Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_DIAGNOSTIC);
     while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
     errorCode = In_Byte(IDE_ERROR_REGISTER);
-    if (ideDebug > 1) Print("ide: ide error register = %x\n", errorCode);
+    if (ideDebug > 1) Log(LOG_DEBUG, "ide: ide error register = %x\n", errorCode);
 
     /* Probe and register drives */
     if (readDriveConfig(0) == 0)
 	++numDrives;
     if (readDriveConfig(1) == 0)
 	++numDrives;
-    if (ideDebug) Print("Found %d IDE drives\n", numDrives);
+    if (ideDebug) Log(LOG_DEBUG, "Found %d IDE drives\n", numDrives);
 
     /* Start request thread */
     if (numDrives > 0)
@@ -0,0 +1,204 @@
+/*
+ * Kernel log
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <stdarg.h>
+#include <geekos/kassert.h>
+#include <geekos/int.h>
+#include <geekos/kthread.h>
+#include <geekos/screen.h>
+#include <geekos/timer.h>
+#include <geekos/fmtout.h>
+#include <geekos/string.h>
+#include <geekos/klog.h>
+
+/*
+ * Log() formats its message straight into an entry of the ring,
+ * never touching the screen, so logging is cheap enough for hot
+ * paths and doesn't change their timing much.  The log daemon
+ * prints the messages at low priority.  Errors are the exception:
+ * they are printed at once as well, since one is often the last
+ * thing logged before a KASSERT() or Panic(), and would never
+ * get printed otherwise.
+ *
+ * Writers claim an entry by bumping s_logHead with interrupts
+ * disabled for just that instruction, then fill it in and publish
+ * it by setting its sequence number.  Entries are printed in order
+ * of s_logHead, so the daemon stops at one that is still being
+ * written.
+ */
+
+/* ----------------------------------------------------------------------
+ * Private data and functions
+ * ---------------------------------------------------------------------- */
+
+struct Log_Entry {
+    volatile ulong_t seq;	 /* Sequence number + 1, once complete */
+    ulong_t ticks;		 /* Value of g_numTicks when logged */
+    int level;
+    bool printed;		 /* Already printed by Log() */
+    char text[LOG_TEXT_SIZE];
+};
+
+/*
+ * Output sink for formatting into a log entry.
+ */
+struct Log_Sink {
+    struct Output_Sink sink;
+    char *text;
+    int len;
+};
+
+int g_logLevel = LOG_DEBUG;
+
+static struct Log_Entry s_logRing[LOG_RING_SIZE];
+
+static volatile ulong_t s_logHead;	 /* Sequence number of next entry to write */
+static ulong_t s_logTail;		 /* Sequence number of next entry to print */
+
+static struct Thread_Queue s_logWaitQueue;
+static volatile bool s_logDaemonWaiting;
+
+static const char *s_levelNames[] = { "error: ", "warning: ", "", "" };
+
+static void Log_Emit(struct Output_Sink *o, int ch)
+{
+    struct Log_Sink *sink = (struct Log_Sink*) o;
+    if (sink->len < LOG_TEXT_SIZE - 1)
+	sink->text[sink->len++] = (char) ch;
+}
+
+static void Log_Finish(struct Output_Sink *o)
+{
+    struct Log_Sink *sink = (struct Log_Sink*) o;
+    sink->text[sink->len] = '\0';
+}
+
+/*
+ * Check whether the entry at the tail of the log can be
+ * printed (or skipped, if it has been overwritten).
+ */
+static bool Log_Tail_Ready(void)
+{
+    ulong_t seq = s_logRing[s_logTail % LOG_RING_SIZE].seq;
+    return s_logTail != s_logHead && seq != 0 && seq != s_logTail - LOG_RING_SIZE + 1;
+}
+
+/*
+ * Log daemon: prints log messages as they arrive.
+ */
+static void Log_Daemon(ulong_t arg)
+{
+    while (true) {
+	Flush_Log();
+
+	Disable_Interrupts();
+	s_logDaemonWaiting = true;
+	if (!Log_Tail_Ready())
+	    Wait(&s_logWaitQueue);
+	s_logDaemonWaiting = false;
+	Enable_Interrupts();
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Start the log daemon.
+ * Messages logged before then are kept until it starts.
+ */
+void Init_Log(void)
+{
+    Start_Kernel_Thread(Log_Daemon, 0, PRIORITY_LOW, true);
+}
+
+/*
+ * Add a message to the log, using printf()-style formatting.
+ * May be called from interrupt handlers.
+ */
+void Log(int level, const char *fmt, ...)
+{
+    struct Log_Entry *entry;
+    struct Log_Sink sink;
+    ulong_t seq;
+    va_list args;
+    bool iflag;
+
+    if (level > g_logLevel)
+	return;
+
+    iflag = Begin_Int_Atomic();
+    seq = s_logHead++;
+    End_Int_Atomic(iflag);
+
+    entry = &s_logRing[seq % LOG_RING_SIZE];
+    entry->seq = 0;
+    entry->ticks = g_numTicks;
+    entry->level = level;
+    entry->printed = (level == LOG_ERROR);
+
+    sink.sink.Emit = &Log_Emit;
+    sink.sink.Finish = &Log_Finish;
+    sink.text = entry->text;
+    sink.len = 0;
+    va_start(args, fmt);
+    Format_Output(&sink.sink, fmt, args);
+    va_end(args);
+
+    if (entry->printed)
+	Print("[%lu] %s%s", entry->ticks, s_levelNames[level], entry->text);
+
+    entry->seq = seq + 1;
+
+    if (s_logDaemonWaiting) {
+	iflag = Begin_Int_Atomic();
+	s_logDaemonWaiting = false;
+	Wake_Up(&s_logWaitQueue);
+	End_Int_Atomic(iflag);
+    }
+}
+
+/*
+ * Print the messages logged so far, stopping at one that
+ * is still being written.  Only the log daemon should call
+ * this once it is running.
+ */
+void Flush_Log(void)
+{
+    struct Log_Entry copy;
+
+    while (s_logTail != s_logHead) {
+	struct Log_Entry *entry;
+	ulong_t lost = 0;
+
+	/* Skip anything overwritten before we got to it */
+	if (s_logHead - s_logTail > LOG_RING_SIZE) {
+	    lost = s_logHead - s_logTail - LOG_RING_SIZE;
+	    s_logTail += lost;
+	}
+
+	entry = &s_logRing[s_logTail % LOG_RING_SIZE];
+	if (entry->seq != s_logTail + 1) {
+	    if (entry->seq == 0 || entry->seq == s_logTail - LOG_RING_SIZE + 1)
+		break;		/* Still being written */
+	    ++lost;		/* Overwritten by a later message */
+	} else {
+	    memcpy(&copy, entry, sizeof(copy));
+	    if (entry->seq != s_logTail + 1)
+		++lost;		/* Overwritten while we copied it */
+	    else if (!copy.printed) {
+		KASSERT(copy.level >= LOG_ERROR && copy.level <= LOG_DEBUG);
+		Print("[%lu] %s%s", copy.ticks, s_levelNames[copy.level], copy.text);
+	    }
+	}
+	++s_logTail;
+
+	if (lost > 0)
+	    Print("[log: %lu messages lost]\n", lost);
+    }
+}
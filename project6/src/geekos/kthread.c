@@ -16,6 +16,8 @@
 #include <geekos/string.h>
 #include <geekos/kthread.h>
 #include <geekos/malloc.h>
+#include <geekos/user.h>
+#include <geekos/stats.h>
 
 
 /* ----------------------------------------------------------------------
@@ -88,6 +90,7 @@ static void Init_Thread(struct Kernel_Thread* kthread, void* stackPage,
     kthread->priority = priority;
     kthread->userContext = 0;
     kthread->owner = owner;
+    STAT_INC(STAT_THREADS_CREATED);
 
     /*
      * The thread has an implicit self-reference.
@@ -162,6 +165,8 @@ static __inline__ void Push(struct Kernel_Thread* kthread, ulong_t value)
  */
 static void Destroy_Thread(struct Kernel_Thread* kthread)
 {
+    /* Release the thread's user context and stack, if any. */
+    Detach_User_Context(kthread);
 
     /* Dispose of the thread's memory. */
     Disable_Interrupts();
@@ -200,6 +205,28 @@ static void Detach_Thread(struct Kernel_Thread* kthread)
     }
 }
 
+/*
+ * Drop the references given thread holds, as their owner,
+ * to the threads it started and has not joined.  Those threads
+ * are then reaped as soon as they exit.
+ * Must be called with interrupts disabled!
+ */
+static void Detach_Owned_Threads(struct Kernel_Thread* owner)
+{
+    struct Kernel_Thread* kthread;
+
+    KASSERT(!Interrupts_Enabled());
+
+    kthread = Get_Front_Of_All_Thread_List(&s_allThreadList);
+    while (kthread != 0) {
+	if (kthread->owner == owner) {
+	    kthread->owner = 0;
+	    Detach_Thread(kthread);
+	}
+	kthread = Get_Next_In_All_Thread_List(kthread);
+    }
+}
+
 /*
  * This function performs any needed initialization before
  * a thread start function is executed.  Currently we just use
@@ -299,6 +326,40 @@ static void Setup_Kernel_Thread(
     Push(kthread, 0);  /* gs */
 }
 
+/*
+ * Push an interrupt frame which makes the thread appear to have
+ * been interrupted in user mode just before executing the
+ * instruction at entryAddr, with given user stack pointer
+ * and esi register value.
+ */
+static void Push_User_Frame(struct Kernel_Thread* kthread, struct User_Context* userContext,
+    ulong_t entryAddr, ulong_t stackPointer, ulong_t esi)
+{
+    /* Interrupt frame for returning to user mode */
+    Push(kthread, userContext->dsSelector);	/* user ss */
+    Push(kthread, stackPointer);	/* user esp */
+    Push(kthread, EFLAGS_IF);	/* eflags */
+    Push(kthread, userContext->csSelector);	/* cs */
+    Push(kthread, entryAddr);	/* eip */
+    Push(kthread, 0);	/* error code */
+    Push(kthread, 0);	/* interrupt number */
+
+    /* General purpose registers */
+    Push(kthread, 0);	/* eax */
+    Push(kthread, 0);	/* ebx */
+    Push(kthread, 0);	/* ecx */
+    Push(kthread, 0);	/* edx */
+    Push(kthread, esi);	/* esi */
+    Push(kthread, 0);	/* edi */
+    Push(kthread, 0);	/* ebp */
+
+    /* Segment registers */
+    Push(kthread, userContext->dsSelector);	/* ds */
+    Push(kthread, userContext->dsSelector);	/* es */
+    Push(kthread, userContext->dsSelector);	/* fs */
+    Push(kthread, userContext->dsSelector);	/* gs */
+}
+
 /*
  * Set up the a user mode thread.
  */
@@ -315,10 +376,35 @@ static void Setup_Kernel_Thread(
      * - The esi register should contain the address of
      *   the argument block
      */
-    TODO("Create a new thread to execute in user mode");
+    Attach_User_Context(kthread, userContext);
+
+    Push_User_Frame(kthread, userContext, userContext->entryAddr,
+	userContext->stackPointerAddr, userContext->argBlockAddr);
 }
 
 
+/*
+ * Set up a new thread in an existing user context, which resumes
+ * in user mode with the same registers as in the given saved state,
+ * except that eax (the system call return value) is 0.
+ */
+static void Setup_Cloned_User_Thread(
+    struct Kernel_Thread* kthread, struct User_Context* userContext,
+    struct Interrupt_State* state)
+{
+    struct Interrupt_State *childState;
+
+    KASSERT(Is_User_Interrupt(state));
+
+    Attach_User_Context(kthread, userContext);
+    kthread->userStackSlot = g_currentThread->userStackSlot;
+
+    kthread->esp -= sizeof(struct User_Interrupt_State);
+    memcpy((void*) kthread->esp, state, sizeof(struct User_Interrupt_State));
+    childState = (struct Interrupt_State*) kthread->esp;
+    childState->eax = 0;
+}
+
 /*
  * This is the body of the idle thread.  Its job is to preserve
  * the invariant that a runnable thread always exists,
@@ -326,6 +412,9 @@ static void Setup_Kernel_Thread(
  */
 static void Idle(ulong_t arg)
 {
+    /* Stay in the lowest run queue, so any other thread runs first */
+    g_currentThread->currentReadyQueue = MAX_QUEUE_LEVEL - 1;
+
     while (true)
 	Yield();
 }
@@ -517,7 +606,50 @@ Start_User_Thread(struct User_Context* userContext, bool detached)
      * - Call Make_Runnable_Atomic() to schedule the process
      *   for execution
      */
-    TODO("Start user thread");
+    struct Kernel_Thread* kthread = Create_Thread(PRIORITY_USER, detached);
+    if (kthread != 0) {
+	Setup_User_Thread(kthread, userContext);
+	Make_Runnable_Atomic(kthread);
+    }
+
+    return kthread;
+}
+
+/*
+ * Start an additional thread in an existing user context,
+ * running on the stack in given stack slot.
+ * Returns pointer to the new thread if successful, null otherwise.
+ */
+struct Kernel_Thread*
+Start_User_Thread_At(struct User_Context* userContext, ulong_t entryAddr,
+    ulong_t stackPointer, int stackSlot, bool detached)
+{
+    struct Kernel_Thread* kthread = Create_Thread(PRIORITY_USER, detached);
+    if (kthread != 0) {
+	Attach_User_Context(kthread, userContext);
+	kthread->userStackSlot = stackSlot;
+	Push_User_Frame(kthread, userContext, entryAddr, stackPointer, 0);
+	Make_Runnable_Atomic(kthread);
+    }
+
+    return kthread;
+}
+
+/*
+ * Start a user mode thread in given user context, as a copy of
+ * the thread whose user mode registers are saved in given
+ * interrupt state.  Used to fork a process.
+ */
+struct Kernel_Thread*
+Start_Cloned_User_Thread(struct User_Context* userContext, struct Interrupt_State* state, bool detached)
+{
+    struct Kernel_Thread* kthread = Create_Thread(PRIORITY_USER, detached);
+    if (kthread != 0) {
+	Setup_Cloned_User_Thread(kthread, userContext, state);
+	Make_Runnable_Atomic(kthread);
+    }
+
+    return kthread;
 }
 
 /*
@@ -561,13 +693,27 @@ struct Kernel_Thread* Get_Current(void)
 struct Kernel_Thread* Get_Next_Runnable(void)
 {
     struct Kernel_Thread* best = 0;
+    int i;
 
     /* Find the best thread from the highest-priority run queue */
-    TODO("Find a runnable thread from run queues");
+    for (i = 0; i < MAX_QUEUE_LEVEL; ++i) {
+	best = Find_Best(&s_runQueue[i]);
+	if (best != 0) {
+	    Remove_Thread(&s_runQueue[i], best);
+	    break;
+	}
+    }
+
+    /* The idle thread is always runnable */
+    KASSERT(best != 0);
 
 /*
  *    Print("Scheduling %x\n", best);
  */
+    if (best != g_currentThread) {
+	STAT_INC(STAT_CONTEXT_SWITCHES);
+	TRACE("sched: switch %d -> %d\n", g_currentThread->pid, best->pid);
+    }
     return best;
 }
 
@@ -634,6 +780,9 @@ void Exit(int exitCode)
     /* Notify the thread's owner, if any */
     Wake_Up(&current->joinQueue);
 
+    /* Nobody is left to join the threads this one started */
+    Detach_Owned_Threads(current);
+
     /* Remove the thread's implicit reference to itself. */
     Detach_Thread(g_currentThread);
 
@@ -712,6 +861,30 @@ struct Kernel_Thread* Lookup_Thread(int pid)
 }
 
 
+/*
+ * Fill in statistics for up to max threads.
+ * Returns the number of threads filled in.
+ */
+int Get_Thread_Stats(struct Thread_Stats *stats, int max)
+{
+    struct Kernel_Thread *kthread;
+    int count = 0;
+    bool iflag = Begin_Int_Atomic();
+
+    kthread = Get_Front_Of_All_Thread_List(&s_allThreadList);
+    while (kthread != 0 && count < max) {
+	stats[count].pid = kthread->pid;
+	stats[count].priority = kthread->priority;
+	stats[count].ticks = kthread->totalTicks;
+	stats[count].user = (kthread->userContext != 0);
+	++count;
+	kthread = Get_Next_In_All_Thread_List(kthread);
+    }
+
+    End_Int_Atomic(iflag);
+    return count;
+}
+
 /*
  * Wait on given wait queue.
  * Must be called with interrupts disabled!
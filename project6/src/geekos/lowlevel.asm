@@ -123,6 +123,9 @@ IMPORT Make_Runnable
 ; Function to activate a new user context (if needed).
 IMPORT Switch_To_User_Context
 
+; C handler for system calls made with sysenter.
+IMPORT Sysenter_Handler
+
 ; Sizes of interrupt handler entry points for interrupts with
 ; and without error codes.  The code in idt.c uses this
 ; information to infer the layout of the table of interrupt
@@ -140,6 +143,9 @@ EXPORT Load_LDTR
 EXPORT g_entryPointTableStart
 EXPORT g_entryPointTableEnd
 
+; Entry point for system calls made with sysenter.
+EXPORT Sysenter_Entry
+
 ; Thread context switch function.
 EXPORT Switch_To_Thread
 
@@ -302,6 +308,62 @@ Handle_Interrupt:
 	; Return from the interrupt.
 	iret
 
+; ----------------------------------------------------------------------
+; Sysenter_Entry
+;   Fast system call entry point.  The sysenter instruction gets here
+;   with interrupts disabled, the kernel code and stack segments
+;   loaded, and esp pointing at the esp0 field of the TSS.
+;
+;   The user side saves ebp and pushes its return address on the
+;   user stack, then copies esp into ebp before executing sysenter.
+;   The other registers hold the system call number and arguments,
+;   just as for int SYSCALL_INT.
+;
+;   We build the same Interrupt_State an int SYSCALL_INT would have,
+;   so the thread can be switched away from, forked, or killed as
+;   usual.  Sysenter_Handler() fills in the user eip and esp from
+;   the user stack.  Returning is done with iret rather than sysexit,
+;   because sysexit only returns to flat segments, and the user
+;   segments have base USER_VM_START.  Since we return to the thread
+;   that entered, there is no need to check for rescheduling or to
+;   activate its user context, and fs and gs are left alone
+;   (the kernel never changes them).
+; ----------------------------------------------------------------------
+align 16
+Sysenter_Entry:
+	mov	esp, [esp]		; kernel stack of current thread
+
+	push	dword USER_DS		; user ss
+	push	dword 0			; user esp (filled in by handler)
+	pushfd
+	or	dword [esp], EFLAGS_IF	; eflags, with interrupts enabled
+	push	dword USER_CS		; cs
+	push	dword 0			; eip (filled in by handler)
+	push	dword 0			; error code
+	push	dword SYSCALL_INT	; interrupt number
+	Save_Registers
+
+	mov	ax, KERNEL_DS
+	mov	ds, ax
+	mov	es, ax
+
+	push	esp			; Interrupt_State pointer
+	call	Sysenter_Handler
+	add	esp, 4			; clear 1 argument
+
+	add	esp, 8			; skip gs and fs
+	pop	es
+	pop	ds
+	pop	ebp
+	pop	edi
+	pop	esi
+	pop	edx
+	pop	ecx
+	pop	ebx
+	pop	eax
+	add	esp, 8			; skip int num and error code
+	iret
+
 ; ----------------------------------------------------------------------
 ; Switch_To_Thread()
 ;   Save context of currently executing thread, and activate
@@ -28,7 +28,9 @@
 #include <geekos/user.h>
 #include <geekos/paging.h>
 #include <geekos/gosfs.h>
+#include <geekos/xgosfs.h>
 #include <geekos/consfs.h>
+#include <geekos/klog.h>
 
 
 /*
@@ -69,13 +71,16 @@ void Main(struct Boot_Info* bootInfo)
     Init_VM(bootInfo);
     Init_Scheduler();
     Init_Traps();
+    Init_Sysenter();
     Init_Timer();
+    Init_Log();
     Init_Keyboard();
     Init_DMA();
     Init_Floppy();
     Init_IDE();
     Init_PFAT();
     Init_GOSFS();
+    Init_XGOSFS();
 
     Mount_Root_Filesystem();
 
@@ -111,5 +116,15 @@ static void Mount_Root_Filesystem(void)
 
 static void Spawn_Init_Process(void)
 {
-    TODO("Spawn the init process");
+    struct Kernel_Thread *initProcess;
+    int rc;
+
+    rc = Spawn(INIT_PROGRAM, INIT_PROGRAM, Open_Console_Input(), Open_Console_Output(), &initProcess);
+    if (rc < 0)
+	Print("Failed to spawn init process: error code = %d\n", rc);
+    else {
+	/* Wait for it to exit */
+	int exitCode = Join(initProcess);
+	Print("Init process exited with code %d\n", exitCode);
+    }
 }
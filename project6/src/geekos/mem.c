@@ -17,8 +17,11 @@
 #include <geekos/int.h>
 #include <geekos/malloc.h>
 #include <geekos/string.h>
+#include <geekos/kthread.h>
 #include <geekos/paging.h>
 #include <geekos/mem.h>
+#include <geekos/textcache.h>
+#include <geekos/stats.h>
 
 /* ----------------------------------------------------------------------
  * Global data
@@ -54,6 +57,52 @@ static struct Page_List s_freeList;
  */
 int unsigned s_numPages;
 
+/*
+ * Free page watermarks for the pageout daemon.
+ * The daemon is woken when the number of free pages drops
+ * below the low watermark, and evicts pages until it is back
+ * above the high watermark.
+ */
+#define PAGEOUT_LOW_WATERMARK	16
+#define PAGEOUT_HIGH_WATERMARK	32
+
+/*
+ * Maximum number of pages written out by the daemon per batch,
+ * and per cluster of virtually contiguous pages.
+ */
+#define PAGEOUT_BATCH_SIZE	8
+#define PAGEOUT_CLUSTER_SIZE	8
+
+/*
+ * A run of virtually contiguous pages, written to consecutive
+ * chunks of the paging file with a single request.
+ */
+struct Pageout_Cluster {
+    int pagefileIndex;
+    int numPages;
+    struct Page *page[PAGEOUT_CLUSTER_SIZE];
+};
+
+/*
+ * Buffer the pageout daemon gathers clusters into for writing.
+ */
+static char *s_pageoutBuf;
+
+/*
+ * The pageout daemon, or null if it hasn't been started yet.
+ */
+static struct Kernel_Thread *s_pageoutDaemon;
+
+/*
+ * Wait queue for the pageout daemon.
+ */
+static struct Thread_Queue s_pageoutWaitQueue;
+
+/*
+ * Threads waiting for the pageout daemon to free some pages.
+ */
+static struct Thread_Queue s_freePageWaitQueue;
+
 /*
  * Add a range of pages to the inventory of physical memory.
  */
@@ -84,6 +133,8 @@ static void Add_Page_Range(ulong_t start, ulong_t end, int flags)
 	page->clock = 0;
 	page->vaddr = 0;
 	page->entry = 0;
+	page->shareCount = 0;
+	page->pinCount = 0;
     }
 }
 
@@ -197,6 +248,10 @@ void* Alloc_Page(void)
 	result = (void*) Get_Page_Address(page);
     }
 
+    /* Running low on memory: get the pageout daemon going */
+    if (g_freePageCount < PAGEOUT_LOW_WATERMARK && s_pageoutDaemon != 0)
+	Wake_Up(&s_pageoutWaitQueue);
+
     End_Int_Atomic(iflag);
 
     return result;
@@ -215,7 +270,8 @@ static struct Page *Find_Page_To_Page_Out()
 
     for (i=0; i < s_numPages; i++) {
 	if ((g_pageList[i].flags & PAGE_PAGEABLE) &&
-	    (g_pageList[i].flags & PAGE_ALLOCATED)) {
+	    (g_pageList[i].flags & PAGE_ALLOCATED) &&
+	    g_pageList[i].pinCount == 0) {
 	    if (!best) best = &g_pageList[i];
 	    curr = &g_pageList[i];
 	    if ((curr->clock < best->clock) && (curr->flags & PAGE_PAGEABLE)) {
@@ -248,6 +304,22 @@ void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
     KASSERT(Is_Page_Multiple(vaddr));
 
     paddr = Alloc_Page();
+
+    /* Cached text no process is running is the cheapest thing to give up */
+    if (paddr == 0 && Reclaim_Text_Cache() > 0)
+	paddr = Alloc_Page();
+
+    /*
+     * If the pageout daemon is running, give it a chance to
+     * free some pages before stealing one ourselves.
+     */
+    if (paddr == 0 && s_pageoutDaemon != 0 && g_currentThread != s_pageoutDaemon) {
+	Debug("Waiting for pageout daemon\n");
+	Wake_Up(&s_pageoutWaitQueue);
+	Wait(&s_freePageWaitQueue);
+	paddr = Alloc_Page();
+    }
+
     if (paddr != 0) {
 	page = Get_Page((ulong_t) paddr);
 	KASSERT((page->flags & PAGE_PAGEABLE) == 0);
@@ -257,6 +329,9 @@ void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
         /* Select a page to steal from another process */
 	Debug("About to hunt for a page to page out\n");
 	page = Find_Page_To_Page_Out();
+	if (page == 0)
+	    /* Nothing left to steal. */
+	    goto done;
 	KASSERT(page->flags & PAGE_PAGEABLE);
 	paddr = (void*) Get_Page_Address(page);
 	Debug("Selected page at addr %p (age = %d)\n", paddr, page->clock);
@@ -274,8 +349,15 @@ void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
 	/* Lock the page so it cannot be freed while we're writing */
         page->flags |= PAGE_LOCKED;
 
+	/* Unmap it, so nothing changes it while it is being written */
+	page->entry->present = 0;
+	page->entry->kernelInfo = KINFO_PAGE_IN_TRANSIT;
+	/* XXX - flush TLB should only flush the one page */
+	Flush_TLB();
+
 	/* Write the page to disk. Interrupts are enabled, since the I/O may block. */
 	Debug("Writing physical frame %p to paging file at %d\n", paddr, pagefileIndex);
+	STAT_INC(STAT_PAGES_OUT);
 	Enable_Interrupts();
 	Write_To_Paging_File(paddr, page->vaddr, pagefileIndex);
 	Disable_Interrupts();
@@ -285,7 +367,6 @@ void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
         {
            /* The page is still in use update its bookeping info */
            /* Update page table to reflect the page being on disk */
-           page->entry->present = 0;
            page->entry->kernelInfo = KINFO_PAGE_ON_DISK;
            page->entry->pageBaseAddr = pagefileIndex; /* Remember where it is located! */
         }
@@ -300,15 +381,11 @@ void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
 
         /* Unlock the page */
         page->flags &= ~(PAGE_LOCKED);
-
-	/* XXX - flush TLB should only flush the one page */
-	Flush_TLB();
     }
 
     /* Fill in accounting information for page */
     page->flags |= PAGE_PAGEABLE;
     page->entry = entry;
-    page->entry->kernelInfo = 0;
     page->vaddr = vaddr;
     KASSERT(page->flags & PAGE_ALLOCATED);
 
@@ -338,8 +415,16 @@ void Free_Page(void* pageAddr)
     page->flags &= ~(PAGE_ALLOCATED);
 
     /* When a page is locked, don't free it just let other thread know its not needed */
-    if (page->flags & PAGE_LOCKED)
-      return;
+    if (page->flags & PAGE_LOCKED) {
+	End_Int_Atomic(iflag);
+	return;
+    }
+
+    /* Likewise for a pinned page; Unpin_Page() frees it */
+    if (page->pinCount > 0) {
+	End_Int_Atomic(iflag);
+	return;
+    }
 
     /* Clear the pageable bit */
     page->flags &= ~(PAGE_PAGEABLE);
@@ -350,3 +435,237 @@ void Free_Page(void* pageAddr)
 
     End_Int_Atomic(iflag);
 }
+
+/*
+ * Pin a page of user memory, so that it is neither paged out
+ * nor reused while the kernel accesses it directly.
+ * Interrupts must be disabled.
+ */
+void Pin_Page(struct Page *page)
+{
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(page->flags & PAGE_ALLOCATED);
+    KASSERT(!(page->flags & PAGE_LOCKED));
+
+    ++page->pinCount;
+}
+
+/*
+ * Release a pin taken by Pin_Page(), freeing the page if
+ * it was freed while pinned.
+ */
+void Unpin_Page(struct Page *page)
+{
+    bool iflag = Begin_Int_Atomic();
+
+    KASSERT(page->pinCount > 0);
+
+    if (--page->pinCount == 0 && !(page->flags & PAGE_ALLOCATED)) {
+	page->flags &= ~(PAGE_PAGEABLE);
+	Add_To_Back_Of_Page_List(&s_freeList, page);
+	g_freePageCount++;
+    }
+
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Get the page mapped by given page table entry, if it
+ * is one the pageout daemon could evict.
+ */
+static struct Page *Get_Evictable_Page(pte_t *entry)
+{
+    struct Page *page;
+
+    if (!entry->present || entry->pageBaseAddr >= s_numPages)
+	return 0;
+    page = &g_pageList[entry->pageBaseAddr];
+    if ((page->flags & (PAGE_PAGEABLE|PAGE_ALLOCATED)) != (PAGE_PAGEABLE|PAGE_ALLOCATED) ||
+	page->pinCount > 0 || page->entry != entry)
+	return 0;
+    return page;
+}
+
+/*
+ * Collect the evictable pages mapped next to the given one in
+ * the same page table, so that they can be written to adjacent
+ * chunks of the paging file (and read back together later).
+ * Returns the number of pages in the cluster.
+ */
+static int Gather_Cluster(struct Page *seed, struct Page **cluster, int max)
+{
+    pte_t *entry = seed->entry;
+    int tableIndex = ((ulong_t) entry % PAGE_SIZE) / sizeof(pte_t);
+    int before = 0, count, i;
+
+    while (before < max/2 && tableIndex - before > 0 && Get_Evictable_Page(entry - before - 1) != 0)
+	++before;
+    count = before + 1;
+    while (count < max && tableIndex - before + count < NUM_PAGE_TABLE_ENTRIES &&
+	   Get_Evictable_Page(entry - before + count) != 0)
+	++count;
+
+    for (i = 0; i < count; ++i)
+	cluster[i] = Get_Evictable_Page(entry - before + i);
+
+    return count;
+}
+
+/*
+ * Write out a batch of pages to the paging file,
+ * returning them to the freelist.
+ * Interrupts must be disabled; they are enabled while
+ * the pages are being written.
+ * Returns the number of pages freed.
+ */
+static int Page_Out_Batch(void)
+{
+    struct Pageout_Cluster cluster[PAGEOUT_BATCH_SIZE];
+    int numClusters = 0, numPages = 0;
+    int i, j, n, index;
+    char *buf;
+
+    KASSERT(!Interrupts_Enabled());
+
+    /* Choose the oldest pageable pages (and their neighbors), and reserve space for them */
+    while (numPages < PAGEOUT_BATCH_SIZE) {
+	struct Page *seed = Find_Page_To_Page_Out();
+	struct Pageout_Cluster next;
+
+	if (seed == 0)
+	    break;
+
+	n = Gather_Cluster(seed, next.page, MIN(PAGEOUT_CLUSTER_SIZE, PAGEOUT_BATCH_SIZE - numPages));
+	index = Find_Run_On_Paging_File(n);
+	if (index < 0) {
+	    /* No room for the whole cluster; just write the victim */
+	    next.page[0] = seed;
+	    n = 1;
+	    index = Find_Space_On_Paging_File();
+	    if (index < 0)
+		break;
+	}
+	next.pagefileIndex = index;
+	next.numPages = n;
+
+	/*
+	 * Lock the pages so they can neither be stolen nor freed while
+	 * we're writing, and unmap them so they can't be changed either.
+	 */
+	for (i = 0; i < n; ++i) {
+	    next.page[i]->flags &= ~(PAGE_PAGEABLE);
+	    next.page[i]->flags |= PAGE_LOCKED;
+	    next.page[i]->entry->present = 0;
+	    next.page[i]->entry->kernelInfo = KINFO_PAGE_IN_TRANSIT;
+	}
+
+	/* Keep the batch sorted by paging file index */
+	for (j = numClusters; j > 0 && cluster[j-1].pagefileIndex > index; --j)
+	    cluster[j] = cluster[j-1];
+	cluster[j] = next;
+	++numClusters;
+	numPages += n;
+    }
+
+    if (numPages == 0)
+	return 0;
+
+    /* XXX - flush TLB should only flush the pages being written */
+    Flush_TLB();
+
+    /* Gather each cluster into the bounce buffer */
+    buf = s_pageoutBuf;
+    for (i = 0; i < numClusters; ++i) {
+	for (j = 0; j < cluster[i].numPages; ++j) {
+	    memcpy(buf, (void*) Get_Page_Address(cluster[i].page[j]), PAGE_SIZE);
+	    buf += PAGE_SIZE;
+	}
+    }
+
+    /* Write the clusters out in ascending paging file order, one request each. */
+    Debug("Pageout daemon writing %d pages in %d clusters\n", numPages, numClusters);
+    STAT_ADD(STAT_PAGES_OUT, numPages);
+    TRACE("pageout: %d pages in %d clusters\n", numPages, numClusters);
+    Enable_Interrupts();
+    buf = s_pageoutBuf;
+    for (i = 0; i < numClusters; ++i) {
+	Write_Cluster_To_Paging_File(buf, cluster[i].pagefileIndex, cluster[i].numPages);
+	buf += cluster[i].numPages * PAGE_SIZE;
+    }
+    Disable_Interrupts();
+
+    for (i = 0; i < numClusters; ++i) {
+	for (j = 0; j < cluster[i].numPages; ++j) {
+	    struct Page *page = cluster[i].page[j];
+	    int pagefileIndex = cluster[i].pagefileIndex + j;
+
+	    if (page->flags & PAGE_ALLOCATED) {
+		/* Update page table to reflect the page being on disk */
+		page->entry->kernelInfo = KINFO_PAGE_ON_DISK;
+		page->entry->pageBaseAddr = pagefileIndex;
+	    } else {
+		/* The page was freed while we were writing it */
+		Free_Space_On_Paging_File(pagefileIndex);
+	    }
+
+	    page->flags &= ~(PAGE_ALLOCATED | PAGE_LOCKED);
+	    page->entry = 0;
+	    page->vaddr = 0;
+	    Add_To_Back_Of_Page_List(&s_freeList, page);
+	    g_freePageCount++;
+	}
+    }
+
+    return numPages;
+}
+
+/*
+ * Pageout daemon: keeps the number of free pages
+ * above the low watermark, so that page faults can
+ * usually be satisfied from the freelist.
+ */
+static void Pageout_Daemon(ulong_t arg)
+{
+    Disable_Interrupts();
+
+    while (true) {
+	bool stuck = false;
+
+	/* Dropping cached text costs no I/O, so do that first */
+	if (g_freePageCount < PAGEOUT_HIGH_WATERMARK)
+	    Reclaim_Text_Cache();
+
+	/* Evict pages until we're back above the high watermark */
+	while (!stuck && g_freePageCount < PAGEOUT_HIGH_WATERMARK) {
+	    if (Page_Out_Batch() == 0)
+		stuck = true;
+	    else
+		Wake_Up(&s_freePageWaitQueue);
+	}
+
+	/*
+	 * Let any waiters retry (they fall back to stealing a page
+	 * themselves if we couldn't free anything), then sleep until
+	 * memory runs low again.
+	 */
+	Wake_Up(&s_freePageWaitQueue);
+	Wait(&s_pageoutWaitQueue);
+    }
+}
+
+/*
+ * Start the pageout daemon.
+ * Should be called once the paging file is available.
+ */
+void Start_Pageout_Daemon(void)
+{
+    KASSERT(s_pageoutDaemon == 0);
+
+    s_pageoutBuf = Malloc(PAGEOUT_BATCH_SIZE * PAGE_SIZE);
+    if (s_pageoutBuf == 0) {
+	Print("Could not allocate pageout buffer\n");
+	return;
+    }
+
+    s_pageoutDaemon = Start_Kernel_Thread(Pageout_Daemon, 0, PRIORITY_HIGH, true);
+}
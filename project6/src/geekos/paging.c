@@ -9,6 +9,7 @@
  */
 
 #include <geekos/string.h>
+#include <geekos/errno.h>
 #include <geekos/int.h>
 #include <geekos/idt.h>
 #include <geekos/kthread.h>
@@ -21,24 +22,53 @@
 #include <geekos/user.h>
 #include <geekos/vfs.h>
 #include <geekos/crc32.h>
+#include <geekos/bitset.h>
+#include <geekos/blockdev.h>
 #include <geekos/paging.h>
+#include <geekos/stats.h>
 
 /* ----------------------------------------------------------------------
  * Public data
  * ---------------------------------------------------------------------- */
 
+/*
+ * Kernel page directory.  Its lower half (the kernel mappings)
+ * is shared by every user address space.
+ */
+pde_t *g_kernelPageDir;
+
 /* ----------------------------------------------------------------------
  * Private functions/data
  * ---------------------------------------------------------------------- */
 
 #define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
 
+/*
+ * Maximum number of pages read in from the paging file on one fault.
+ */
+#define PAGEIN_CLUSTER_SIZE 8
+
 /*
  * flag to indicate if debugging paging code
  */
 int debugFaults = 0;
 #define Debug(args...) if (debugFaults) Print(args)
 
+/*
+ * The paging device, and a bitmap of which page-sized
+ * chunks of it are in use.
+ */
+static struct Paging_Device *s_pagingDevice;
+static void *s_pagingFileBitmap;
+static int s_numPagingFileSlots;
+
+/*
+ * Buffer clusters of pages are read into, and whether a
+ * Page_In() is using it.
+ */
+static char *s_pageinBuf;
+static bool s_pageinBufBusy;
+
 
 void checkPaging()
 {
@@ -71,6 +101,163 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
         Print ("in Supervisor Mode\n");
 }
 
+/*
+ * Find the page table entry mapping given address in given page directory.
+ * Returns null if there is no page table for the address.
+ */
+static pte_t *Find_PTE(pde_t *pageDir, ulong_t address)
+{
+    pde_t *pde = &pageDir[PAGE_DIRECTORY_INDEX(address)];
+    pte_t *pageTable;
+
+    if (!pde->present)
+	return 0;
+    pageTable = (pte_t*) (pde->pageTableBaseAddr << PAGE_POWER);
+    return &pageTable[PAGE_TABLE_INDEX(address)];
+}
+
+/*
+ * Is given page table entry for a page whose contents are
+ * in the given chunk of the paging file?
+ */
+static __inline__ bool Is_On_Disk_At(pte_t *entry, int pagefileIndex)
+{
+    return !entry->present && entry->kernelInfo == KINFO_PAGE_ON_DISK &&
+	entry->pageBaseAddr == pagefileIndex;
+}
+
+/*
+ * Bring a page back in from the paging file, along with neighboring
+ * virtual pages which were evicted to adjacent chunks of the paging
+ * file, using a single read request.
+ * Interrupts must be disabled.
+ * Returns 0 if successful (or if someone else brought the page
+ * in first), or an error code.
+ */
+static int Page_In(pte_t *entry, ulong_t address)
+{
+    ulong_t vaddr = Round_Down_To_Page(address);
+    int pagefileIndex = entry->pageBaseAddr;
+    int tableIndex = PAGE_TABLE_INDEX(vaddr);
+    int first, count, lo, hi, i, n;
+    struct Page *page[PAGEIN_CLUSTER_SIZE], **cluster;
+    bool useBuf = false;
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(Is_On_Disk_At(entry, pagefileIndex));
+
+    /*
+     * Extend the cluster over neighboring pages in the same page table
+     * that live in adjacent paging file chunks, in the same order.
+     */
+    first = 0;
+    while (first > -(PAGEIN_CLUSTER_SIZE/2) && tableIndex + first > 0 &&
+	   Is_On_Disk_At(entry + first - 1, pagefileIndex + first - 1))
+	--first;
+    count = -first + 1;
+    while (count < PAGEIN_CLUSTER_SIZE && tableIndex + first + count < NUM_PAGE_TABLE_ENTRIES &&
+	   Is_On_Disk_At(entry + first + count, pagefileIndex + first + count))
+	++count;
+
+    /* The cluster buffer is shared; if it's in use, read just the faulting page */
+    if (count > 1 && s_pageinBuf != 0 && !s_pageinBufBusy) {
+	s_pageinBufBusy = true;
+	useBuf = true;
+    } else {
+	first = 0;
+	count = 1;
+    }
+
+    /*
+     * Allocate and lock frames for the cluster, the faulting page's
+     * first.  Allocation may block, so the page table is checked
+     * again once all of them are allocated.
+     */
+    memset(page, '\0', sizeof(page));
+    for (n = 0; n < count; ++n) {
+	void *paddr;
+
+	i = (n - first) % count;
+	paddr = Alloc_Pageable_Page(entry + first + i, vaddr + (first + i) * PAGE_SIZE);
+	if (paddr == 0)
+	    break;
+	page[i] = Get_Page((ulong_t) paddr);
+	page[i]->flags &= ~(PAGE_PAGEABLE);
+	page[i]->flags |= PAGE_LOCKED;
+    }
+
+    /*
+     * Keep the run of neighbors around the faulting page that are
+     * still where they were, and got frames.  If the faulting page
+     * itself has moved, someone else brought it in already.
+     */
+    lo = hi = -first;
+    if (page[-first] != 0 && Is_On_Disk_At(entry, pagefileIndex)) {
+	++hi;
+	while (lo > 0 && page[lo-1] != 0 &&
+	       Is_On_Disk_At(entry + first + lo - 1, pagefileIndex + first + lo - 1))
+	    --lo;
+	while (hi < count && page[hi] != 0 &&
+	       Is_On_Disk_At(entry + first + hi, pagefileIndex + first + hi))
+	    ++hi;
+    }
+    for (i = 0; i < count; ++i) {
+	if (page[i] != 0 && (i < lo || i >= hi)) {
+	    page[i]->flags &= ~(PAGE_LOCKED);
+	    Free_Page((void*) Get_Page_Address(page[i]));
+	}
+    }
+    if (lo == hi) {
+	if (useBuf)
+	    s_pageinBufBusy = false;
+	return page[-first] == 0 ? ENOMEM : 0;
+    }
+    cluster = page + lo;
+    first += lo;
+    count = hi - lo;
+
+    /* Until the read is done, faults on these pages wait for it */
+    for (i = 0; i < count; ++i) {
+	pte_t *pte = entry + first + i;
+
+	pte->pageBaseAddr = PAGE_ALLIGNED_ADDR(Get_Page_Address(cluster[i]));
+	pte->kernelInfo = KINFO_PAGE_IN_TRANSIT;
+    }
+
+    Debug("Paging in %d pages at index %d\n", count, pagefileIndex + first);
+    STAT_ADD(STAT_PAGES_IN, count);
+    Enable_Interrupts();
+    if (count > 1) {
+	Read_Cluster_From_Paging_File(s_pageinBuf, pagefileIndex + first, count);
+	for (i = 0; i < count; ++i)
+	    memcpy((void*) Get_Page_Address(cluster[i]), s_pageinBuf + i * PAGE_SIZE, PAGE_SIZE);
+    } else
+	Read_From_Paging_File((void*) Get_Page_Address(cluster[0]), vaddr, pagefileIndex);
+    Disable_Interrupts();
+    if (useBuf)
+	s_pageinBufBusy = false;
+
+    for (i = 0; i < count; ++i) {
+	pte_t *pte = entry + first + i;
+
+	Free_Space_On_Paging_File(pagefileIndex + first + i);
+	cluster[i]->flags &= ~(PAGE_LOCKED);
+
+	if (!(cluster[i]->flags & PAGE_ALLOCATED)) {
+	    /* The page was freed (and its entry cleared) while we were reading it */
+	    cluster[i]->flags |= PAGE_ALLOCATED;
+	    Free_Page((void*) Get_Page_Address(cluster[i]));
+	    continue;
+	}
+
+	pte->kernelInfo = 0;
+	pte->present = 1;
+	cluster[i]->flags |= PAGE_PAGEABLE;
+    }
+
+    return 0;
+}
+
 /*
  * Handler for page faults.
  * You should call the Install_Interrupt_Handler() function to
@@ -90,6 +277,23 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
     /* Get the fault code */
     faultCode = *((faultcode_t *) &(state->errorCode));
 
+    TRACE("fault: %s at %lx by %d\n", faultCode.writeFault ? "write" : "read", address, g_currentThread->pid);
+
+    /* Is it a page we haven't brought in yet? */
+    if (!faultCode.protectionViolation && g_currentThread->userContext != 0) {
+	STAT_INC(STAT_PAGE_FAULTS);
+	if (Fault_In_Page(g_currentThread->userContext, address) == 0)
+	    return;
+    }
+
+    /* Is it a write to a page shared copy-on-write? */
+    if (faultCode.protectionViolation && faultCode.writeFault &&
+	g_currentThread->userContext != 0 && address >= USER_VM_START) {
+	STAT_INC(STAT_COW_FAULTS);
+	if (Copy_On_Write_Fault(g_currentThread->userContext, address - USER_VM_START) == 0)
+	    return;
+    }
+
     /* rest of your handling code here */
     Print ("Unexpected Page Fault received\n");
     Print_Fault_Info(address, faultCode);
@@ -105,6 +309,47 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
  * Public functions
  * ---------------------------------------------------------------------- */
 
+/*
+ * Bring in the non-present user page at given (linear) address,
+ * either from the paging file or from the process's executable.
+ * If the page is on its way to or from the paging file, just
+ * wait a while; the caller must check the page again.
+ * Interrupts must be disabled.
+ * Returns 0 if successful, or an error code if the address
+ * isn't valid or the page couldn't be brought in.
+ */
+int Fault_In_Page(struct User_Context *userContext, ulong_t address)
+{
+    pte_t *entry;
+    int rc;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (address < USER_VM_START)
+	return EINVALID;
+
+    entry = Find_PTE(userContext->pageDir, address);
+    if (entry != 0 && entry->present)
+	return 0;
+
+    if (entry != 0 && entry->kernelInfo == KINFO_PAGE_IN_TRANSIT) {
+	/* Someone else is moving the page; let them finish, then retry */
+	Enable_Interrupts();
+	Yield();
+	Disable_Interrupts();
+	return 0;
+    }
+
+    if (entry != 0 && entry->kernelInfo == KINFO_PAGE_ON_DISK)
+	rc = Page_In(entry, address);
+    else
+	rc = Page_In_User_Region(userContext, address - USER_VM_START);
+
+    if (rc != 0)
+	Debug("Could not bring in page at %lx: error %d\n", address, rc);
+    return rc;
+}
+
 
 /*
  * Initialize virtual memory by building page tables
@@ -121,7 +366,40 @@ void Init_VM(struct Boot_Info *bootInfo)
      * - Do not map a page at address 0; this will help trap
      *   null pointer references
      */
-    TODO("Build initial kernel page directory and page tables");
+    ulong_t numPages = bootInfo->memSizeKB >> 2;
+    ulong_t addr;
+
+    g_kernelPageDir = (pde_t*) Alloc_Page();
+    KASSERT(g_kernelPageDir != 0);
+    memset(g_kernelPageDir, '\0', PAGE_SIZE);
+
+    /* Identity map all of physical memory, except for page 0 */
+    for (addr = 0; addr < numPages * PAGE_SIZE; addr += PAGE_SIZE) {
+	pde_t *pde = &g_kernelPageDir[PAGE_DIRECTORY_INDEX(addr)];
+	pte_t *pageTable;
+
+	if (!pde->present) {
+	    pageTable = (pte_t*) Alloc_Page();
+	    KASSERT(pageTable != 0);
+	    memset(pageTable, '\0', PAGE_SIZE);
+	    pde->pageTableBaseAddr = PAGE_ALLIGNED_ADDR(pageTable);
+	    pde->flags = VM_WRITE;
+	    pde->present = 1;
+	}
+
+	if (addr == 0)
+	    continue;
+
+	pageTable = (pte_t*) (pde->pageTableBaseAddr << PAGE_POWER);
+	pageTable[PAGE_TABLE_INDEX(addr)].pageBaseAddr = PAGE_ALLIGNED_ADDR(addr);
+	pageTable[PAGE_TABLE_INDEX(addr)].flags = VM_WRITE;
+	pageTable[PAGE_TABLE_INDEX(addr)].globalPage = 1;
+	pageTable[PAGE_TABLE_INDEX(addr)].present = 1;
+    }
+
+    Enable_Paging(g_kernelPageDir);
+
+    Install_Interrupt_Handler(14, Page_Fault_Handler);
 }
 
 /**
@@ -131,7 +409,28 @@ void Init_VM(struct Boot_Info *bootInfo)
  */
 void Init_Paging(void)
 {
-    TODO("Initialize paging file data structures");
+    s_pagingDevice = Get_Paging_Device();
+    if (s_pagingDevice == 0) {
+	Print("No paging device registered\n");
+	return;
+    }
+
+    s_numPagingFileSlots = s_pagingDevice->numSectors / SECTORS_PER_PAGE;
+    s_pagingFileBitmap = Create_Bit_Set(s_numPagingFileSlots);
+    if (s_pagingFileBitmap == 0) {
+	Print("Could not allocate paging file bitmap\n");
+	s_pagingDevice = 0;
+	return;
+    }
+
+    Print("Paging file %s: %d pages\n", s_pagingDevice->fileName, s_numPagingFileSlots);
+
+    /* Without it, pages are read in one at a time */
+    s_pageinBuf = Malloc(PAGEIN_CLUSTER_SIZE * PAGE_SIZE);
+    if (s_pageinBuf == 0)
+	Print("Could not allocate pagein buffer\n");
+
+    Start_Pageout_Daemon();
 }
 
 /**
@@ -142,8 +441,20 @@ void Init_Paging(void)
  */
 int Find_Space_On_Paging_File(void)
 {
+    int pagefileIndex;
+
     KASSERT(!Interrupts_Enabled());
-    TODO("Find free page in paging file");
+
+    if (s_pagingDevice == 0)
+	return -1;
+
+    pagefileIndex = Find_First_Free_Bit(s_pagingFileBitmap, s_numPagingFileSlots);
+    if (pagefileIndex >= s_numPagingFileSlots)
+	return -1;
+    if (pagefileIndex >= 0)
+	Set_Bit(s_pagingFileBitmap, pagefileIndex);
+
+    return pagefileIndex;
 }
 
 /**
@@ -154,7 +465,60 @@ int Find_Space_On_Paging_File(void)
 void Free_Space_On_Paging_File(int pagefileIndex)
 {
     KASSERT(!Interrupts_Enabled());
-    TODO("Free page in paging file");
+    KASSERT(pagefileIndex >= 0 && pagefileIndex < s_numPagingFileSlots);
+    KASSERT(Is_Bit_Set(s_pagingFileBitmap, pagefileIndex));
+
+    Clear_Bit(s_pagingFileBitmap, pagefileIndex);
+}
+
+/**
+ * Find a run of consecutive free page-sized chunks in the paging file.
+ * Interrupts must be disabled.
+ * @param numPages number of chunks needed
+ * @return index of the first chunk of the run, or -1 if there
+ *   is no run that long
+ */
+int Find_Run_On_Paging_File(int numPages)
+{
+    int pagefileIndex, i;
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(numPages > 0);
+
+    if (numPages == 1)
+	return Find_Space_On_Paging_File();
+    if (s_pagingDevice == 0 || numPages >= s_numPagingFileSlots)
+	return -1;
+
+    pagefileIndex = Find_First_N_Free(s_pagingFileBitmap, numPages, s_numPagingFileSlots);
+    if (pagefileIndex >= 0) {
+	for (i = 0; i < numPages; ++i)
+	    Set_Bit(s_pagingFileBitmap, pagefileIndex + i);
+    }
+
+    return pagefileIndex;
+}
+
+/*
+ * Transfer a run of pages between memory and the paging file
+ * with a single block device request.
+ */
+static void Do_Paging_File_IO(bool write, void *buf, int pagefileIndex, int numPages)
+{
+    int blockNum, rc;
+
+    KASSERT(s_pagingDevice != 0);
+    KASSERT(numPages > 0);
+    KASSERT(pagefileIndex >= 0 && pagefileIndex + numPages <= s_numPagingFileSlots);
+
+    blockNum = s_pagingDevice->startSector + pagefileIndex * SECTORS_PER_PAGE;
+    if (write)
+	rc = Block_Write_Multiple(s_pagingDevice->dev, blockNum, numPages * SECTORS_PER_PAGE, buf);
+    else
+	rc = Block_Read_Multiple(s_pagingDevice->dev, blockNum, numPages * SECTORS_PER_PAGE, buf);
+    if (rc != 0)
+	Panic("Error %d %s pages %d-%d of paging file\n", rc, write ? "writing" : "reading",
+	    pagefileIndex, pagefileIndex + numPages - 1);
 }
 
 /**
@@ -169,7 +533,7 @@ void Write_To_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex)
 {
     struct Page *page = Get_Page((ulong_t) paddr);
     KASSERT(!(page->flags & PAGE_PAGEABLE)); /* Page must be locked! */
-    TODO("Write page data to paging file");
+    Do_Paging_File_IO(true, paddr, pagefileIndex, 1);
 }
 
 /**
@@ -185,6 +549,27 @@ void Read_From_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex)
 {
     struct Page *page = Get_Page((ulong_t) paddr);
     KASSERT(!(page->flags & PAGE_PAGEABLE)); /* Page must be locked! */
-    TODO("Read page data from paging file");
+    Do_Paging_File_IO(false, paddr, pagefileIndex, 1);
 }
 
+/**
+ * Write a cluster of pages to consecutive chunks of the paging file.
+ * @param buf buffer holding numPages pages of data
+ * @param pagefileIndex index of the first chunk
+ * @param numPages number of pages to write
+ */
+void Write_Cluster_To_Paging_File(void *buf, int pagefileIndex, int numPages)
+{
+    Do_Paging_File_IO(true, buf, pagefileIndex, numPages);
+}
+
+/**
+ * Read a cluster of pages from consecutive chunks of the paging file.
+ * @param buf buffer to hold numPages pages of data
+ * @param pagefileIndex index of the first chunk
+ * @param numPages number of pages to read
+ */
+void Read_Cluster_From_Paging_File(void *buf, int pagefileIndex, int numPages)
+{
+    Do_Paging_File_IO(false, buf, pagefileIndex, numPages);
+}
@@ -15,11 +15,13 @@
 #include <geekos/malloc.h>
 #include <geekos/ide.h>
 #include <geekos/blockdev.h>
-#include <geekos/bitset.h>
+#include <geekos/bufcache.h>
 #include <geekos/vfs.h>
 #include <geekos/list.h>
 #include <geekos/synch.h>
+#include <geekos/klog.h>
 #include <geekos/pfat.h>
+#include <geekos/stats.h>
 
 /*
  * History:
@@ -27,6 +29,9 @@
  * 17-Dec-2003: Rewrite to conform to new VFS layer
  * 19-Feb-2004: Cache and share PFAT_File objects, instead of
  *   allocating them repeatedly
+ * 19-Oct-2026: Read file data through a bounded buffer cache shared
+ *   by the whole filesystem, instead of caching each file in full,
+ *   and free PFAT_File objects when the last File is closed
  */
 
 /*
@@ -41,7 +46,7 @@
 #define PAGEFILE_FILENAME "/pagefile.bin"
 
 int debugPFAT = 0;
-#define Debug(args...) if (debugPFAT) Print("PFAT: " args)
+#define Debug(args...) if (debugPFAT) Log(LOG_DEBUG, "PFAT: " args)
 
 struct PFAT_File;
 DEFINE_LIST(PFAT_File_List, PFAT_File);
@@ -55,26 +60,42 @@ struct PFAT_Instance {
     int *fat;
     directoryEntry *rootDir;
     directoryEntry rootDirEntry;
+    struct FS_Buffer_Cache *cache;	 /* Cache of data blocks */
+    int numBuckets;			 /* Size of hashHead, a power of 2 */
+    int *hashHead;			 /* First root dir entry in each bucket */
+    int *hashNext;			 /* Next entry in same bucket, or -1 */
     struct Mutex lock;
-    struct PFAT_File_List fileList;
+    struct PFAT_File_List fileList;	 /* Files currently open */
 };
 
 /*
  * In-memory information for a particular open file.
- * In particular, this object contains a cache of the contents
- * of the file.
+ * It is shared by all of the File objects open on the file,
+ * and freed when the last of them is closed.
  * Kept in fsInfo field of File.
  */
 struct PFAT_File {
     directoryEntry *entry;		 /* Directory entry of the file */
-    ulong_t numBlocks;			 /* Number of blocks used by file */
-    char *fileDataCache;		 /* File data cache */
-    struct Bit_Set *validBlockSet;	 /* Which data blocks of cache are valid */
-    struct Mutex lock;			 /* Synchronize concurrent accesses */
+    int refCount;			 /* Number of File objects using it */
     DEFINE_LINK(PFAT_File_List, PFAT_File);
 };
 IMPLEMENT_LIST(PFAT_File_List, PFAT_File);
 
+/*
+ * Drop a reference to a PFAT_File object taken by Get_PFAT_File()
+ * or PFAT_Clone(), freeing it if it was the last.
+ */
+static void Put_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile)
+{
+    Mutex_Lock(&instance->lock);
+    KASSERT(pfatFile->refCount > 0);
+    if (--pfatFile->refCount == 0) {
+	Remove_From_PFAT_File_List(&instance->fileList, pfatFile);
+	Free(pfatFile);
+    }
+    Mutex_Unlock(&instance->lock);
+}
+
 /*
  * Copy file metadata from directory entry into
  * struct VFS_File_Stat object.
@@ -85,6 +106,7 @@ static void Copy_Stat(struct VFS_File_Stat *stat, directoryEntry *entry)
     stat->isDirectory = entry->directory;
 
     stat->isSetuid = 0;
+    stat->isTerminal = 0;
     memset(&stat->acls, '\0', sizeof(stat->acls));
     stat->acls[0].uid = 0;
     stat->acls[0].permission = O_READ;
@@ -102,87 +124,154 @@ static int PFAT_FStat(struct File *file, struct VFS_File_Stat *stat)
     return 0;
 }
 
+/*
+ * Runs of at least this many whole sectors are read straight
+ * into the caller's buffer, rather than through the buffer cache,
+ * with requests of at most PFAT_MAX_READ_BLOCKS sectors.
+ */
+#define PFAT_DIRECT_MIN_BLOCKS	8
+#define PFAT_MAX_READ_BLOCKS	128
+
+/*
+ * Copy bytes [from, to) of given device block into dest,
+ * through the buffer cache.
+ */
+static int Read_Cached_Block(struct PFAT_Instance *instance, ulong_t devBlock,
+    ulong_t from, ulong_t to, char *dest)
+{
+    struct FS_Buffer *fsBuf;
+    int rc;
+
+    KASSERT(from < to && to <= SECTOR_SIZE);
+
+    Debug("Reading device block %lu\n", devBlock);
+    if ((rc = Get_FS_Buffer(instance->cache, devBlock, &fsBuf)) != 0)
+	return rc;
+    memcpy(dest, (char*) fsBuf->data + from, to - from);
+    Release_FS_Buffer(instance->cache, fsBuf);
+
+    return 0;
+}
+
+/*
+ * Read the part of bytes [start, end) of the file that lies in a
+ * physically contiguous run of numBlocks blocks, starting at
+ * file block fileBlock and device block devBlock, into buf
+ * (which holds the data starting at start).
+ */
+static int Read_Run(struct File *file, ulong_t fileBlock, ulong_t devBlock, ulong_t numBlocks,
+    ulong_t start, ulong_t end, char *buf)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+    ulong_t runStart = fileBlock * SECTOR_SIZE;
+    ulong_t runEnd = runStart + numBlocks * SECTOR_SIZE;
+    ulong_t from = start > runStart ? start : runStart;
+    ulong_t to = end < runEnd ? end : runEnd;
+    ulong_t pos = from;
+    int rc;
+
+    KASSERT(from < to);
+
+    while (pos < to) {
+	ulong_t blockOffset = pos % SECTOR_SIZE;
+	ulong_t block = devBlock + (pos - runStart) / SECTOR_SIZE;
+	ulong_t wholeBlocks = (to - pos) / SECTOR_SIZE;
+
+	if (blockOffset == 0 && wholeBlocks >= PFAT_DIRECT_MIN_BLOCKS) {
+	    /* Big aligned piece: one request straight into the caller's buffer */
+	    if (wholeBlocks > PFAT_MAX_READ_BLOCKS)
+		wholeBlocks = PFAT_MAX_READ_BLOCKS;
+	    Debug("Reading %lu device blocks at %lu\n", wholeBlocks, block);
+	    rc = Block_Read_Multiple(file->mountPoint->dev, block, wholeBlocks, buf + (pos - start));
+	    if (rc != 0)
+		return rc;
+	    pos += wholeBlocks * SECTOR_SIZE;
+	} else {
+	    /* Partial or isolated block: go through the cache */
+	    ulong_t blockEnd = pos - blockOffset + SECTOR_SIZE;
+	    ulong_t count = (to < blockEnd ? to : blockEnd) - pos;
+
+	    rc = Read_Cached_Block(instance, block, blockOffset, blockOffset + count, buf + (pos - start));
+	    if (rc != 0)
+		return rc;
+	    pos += count;
+	}
+    }
+
+    return 0;
+}
+
 /*
  * Read function for PFAT files.
+ * Reads stop at the end of the file.
  */
 static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
 {
     struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
     struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
     ulong_t start = file->filePos;
-    ulong_t end = file->filePos + numBytes;
-    ulong_t startBlock, endBlock, curBlock;
+    ulong_t end;
+    ulong_t startBlock, endBlock, curBlock, runLength;
     ulong_t i;
+    int rc;
+
+    STAT_INC(STAT_PFAT_READS);
 
     /* Special case: can't handle reads longer than INT_MAX */
     if (numBytes > INT_MAX)
 	return EINVALID;
 
-    /* Make sure request represents a valid range within the file */
-    if (start >= file->endPos || end > file->endPos || end < start) {
-	Debug("Invalid read position: filePos=%lu, numBytes=%lu, endPos=%lu\n",
-	    file->filePos, numBytes, file->endPos);
-	return EINVALID;
-    }
+    /* Read no further than the end of the file */
+    if (start >= file->endPos)
+	return 0;
+    end = numBytes < file->endPos - start ? start + numBytes : file->endPos;
+    numBytes = end - start;
 
-    /*
-     * Now the complicated part; ensure that all blocks containing the
-     * data we need are in the file data cache.
-     */
-    startBlock = (start % SECTOR_SIZE) / SECTOR_SIZE;
+    startBlock = start / SECTOR_SIZE;
     endBlock = Round_Up_To_Block(end) / SECTOR_SIZE;
 
     /*
-     * Traverse the FAT finding the blocks of the file.
-     * As we encounter requested blocks that aren't in the
-     * file data cache, we issue requests to read them.
+     * Traverse the FAT to find the first block we need.
      */
     curBlock = pfatFile->entry->firstBlock;
-    for (i = 0; i < endBlock; ++i) {
-	/* Are we at a valid block? */
-	if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF) {
-	    Print("Unexpected end of file in FAT at file block %lu\n", i);
-	    return EIO;  /* probable filesystem corruption */
-	}
-
-	/* Do we need to read this block? */
-	if (i >= startBlock) {
-	    int rc = 0;
-
-	    /* Only allow one thread at a time to read this block. */
-	    Mutex_Lock(&pfatFile->lock);
-
-	    if (!Is_Bit_Set(pfatFile->validBlockSet, i)) {
-		/* Read block into the file data cache */
-		Debug("Reading file block %lu (device block %lu)\n", i, curBlock);
-		rc = Block_Read(file->mountPoint->dev, curBlock, pfatFile->fileDataCache + i*SECTOR_SIZE);
-
-		if (rc == 0)
-		    /* Mark as having read this block */
-		    Set_Bit(pfatFile->validBlockSet, i);
-	    }
-
-	    /* Done attempting to fetch the block */
-	    Mutex_Unlock(&pfatFile->lock);
-
-	    if (rc != 0)
-		return rc;
-	}
-
-	/* Continue to next block */
-	ulong_t nextBlock = instance->fat[curBlock];
-	curBlock = nextBlock;
+    for (i = 0; i < startBlock; ++i) {
+	if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF)
+	    goto corrupt;
+	curBlock = instance->fat[curBlock];
     }
 
     /*
-     * All cached data we need is up to date,
-     * so just copy it into the caller's buffer.
+     * Read the rest of the blocks a physically contiguous
+     * run at a time.
      */
-    memcpy(buf, pfatFile->fileDataCache + start, numBytes);
+    while (i < endBlock) {
+	if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF)
+	    goto corrupt;
+
+	runLength = 1;
+	while (i + runLength < endBlock &&
+	       instance->fat[curBlock + runLength - 1] == curBlock + runLength)
+	    ++runLength;
+
+	rc = Read_Run(file, i, curBlock, runLength, start, end, (char*) buf);
+	if (rc != 0)
+	    return rc;
+
+	/* Continue with the block after the run */
+	i += runLength;
+	curBlock = instance->fat[curBlock + runLength - 1];
+    }
+
+    file->filePos = end;
+    STAT_ADD(STAT_PFAT_BYTES_READ, numBytes);
 
     Debug("Read satisfied!\n");
 
     return numBytes;
+
+corrupt:
+    Log(LOG_WARN, "Unexpected end of file in FAT at file block %lu\n", i);
+    return EIO;  /* probable filesystem corruption */
 }
 
 /*
@@ -210,11 +299,14 @@ static int PFAT_Seek(struct File *file, ulong_t pos)
  */
 static int PFAT_Close(struct File *file)
 {
+    struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+
     /*
-     * The PFAT_File object caching the contents of the file
-     * will remain in the PFAT_Instance object, to speed up
-     * future accesses to this file.
+     * The file's data stays in the buffer cache, to speed up
+     * future accesses to it, until it is evicted.
      */
+    Put_PFAT_File(instance, pfatFile);
     return 0;
 }
 
@@ -228,6 +320,8 @@ static int PFAT_Clone(struct File *file, struct File **pClone)
 {
     int rc = 0;
     struct File *clone;
+    struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
 
     /* Create a duplicate File object. */
     clone = Allocate_File(file->ops, file->filePos, file->endPos, file->fsData, file->mode, file->mountPoint);
@@ -236,6 +330,11 @@ static int PFAT_Clone(struct File *file, struct File **pClone)
 	goto done;
     }
 
+    /* The clone shares the PFAT_File. */
+    Mutex_Lock(&instance->lock);
+    ++pfatFile->refCount;
+    Mutex_Unlock(&instance->lock);
+
     *pClone = clone;
 
 done:
@@ -310,13 +409,66 @@ static struct File_Ops s_pfatDirOps = {
     &PFAT_Read_Entry,
 };
 
+/*
+ * Minimum size of the root directory hash index.
+ */
+#define PFAT_MIN_HASH_BUCKETS 16
+
+/*
+ * Hash a file name of at most len characters (FNV-1a).
+ */
+static uint_t Hash_Name(const char *name, size_t len)
+{
+    uint_t hash = 2166136261U;
+
+    while (len-- > 0 && *name != '\0') {
+	hash ^= (uchar_t) *name++;
+	hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Build the hash index of the root directory, so lookups don't have
+ * to scan it.  Entries are chained in directory order, so the first
+ * of several entries with the same name is found, as with a scan.
+ * Returns 0 if successful, or an error code.
+ */
+static int Build_Hash_Index(struct PFAT_Instance *instance)
+{
+    int count = instance->fsinfo.rootDirectoryCount;
+    int numBuckets = PFAT_MIN_HASH_BUCKETS;
+    int i;
+
+    while (numBuckets < count)
+	numBuckets *= 2;
+
+    instance->hashHead = (int*) Malloc(numBuckets * sizeof(int));
+    instance->hashNext = (int*) Malloc((count > 0 ? count : 1) * sizeof(int));
+    if (instance->hashHead == 0 || instance->hashNext == 0)
+	return ENOMEM;
+    instance->numBuckets = numBuckets;
+
+    for (i = 0; i < numBuckets; ++i)
+	instance->hashHead[i] = -1;
+    for (i = count - 1; i >= 0; --i) {
+	directoryEntry *entry = &instance->rootDir[i];
+	uint_t bucket = Hash_Name(entry->fileName, sizeof(entry->fileName)) & (numBuckets - 1);
+
+	instance->hashNext[i] = instance->hashHead[bucket];
+	instance->hashHead[bucket] = i;
+    }
+
+    return 0;
+}
+
 /*
  * Look up a directory entry in a PFAT filesystem.
  */
 static directoryEntry *PFAT_Lookup(struct PFAT_Instance *instance, const char *path)
 {
     directoryEntry *rootDir = instance->rootDir;
-    bootSector *fsinfo = &instance->fsinfo;
+    uint_t bucket;
     int i;
 
     KASSERT(*path == '/');
@@ -333,9 +485,13 @@ static directoryEntry *PFAT_Lookup(struct PFAT_Instance *instance, const char *p
      * directory structure.  For now, only the root directory
      * is supported.
      */
-    for (i = 0; i < fsinfo->rootDirectoryCount; ++i) {
+    if (strlen(path) > sizeof(rootDir->fileName))
+	return 0;
+
+    bucket = Hash_Name(path, sizeof(rootDir->fileName)) & (instance->numBuckets - 1);
+    for (i = instance->hashHead[bucket]; i >= 0; i = instance->hashNext[i]) {
     	directoryEntry *entry = &rootDir[i];
-	if (strcmp(entry->fileName, path) == 0) {
+	if (strncmp(entry->fileName, path, sizeof(entry->fileName)) == 0) {
 	    /* Found it! */
 	    Debug("Found matching dir entry for %s\n", path);
 	    return entry;
@@ -348,14 +504,11 @@ static directoryEntry *PFAT_Lookup(struct PFAT_Instance *instance, const char *p
 
 /*
  * Get a PFAT_File object representing the file whose directory entry
- * is given.
+ * is given, with a reference taken for the caller.
  */
 static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directoryEntry *entry)
 {
-    ulong_t numBlocks;
     struct PFAT_File *pfatFile = 0;
-    char *fileDataCache = 0;
-    struct Bit_Set *validBlockSet = 0;
 
     KASSERT(entry != 0);
     KASSERT(instance != 0);
@@ -363,7 +516,7 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
     Mutex_Lock(&instance->lock);
 
     /*
-     * See if this file has already been opened.
+     * See if this file is already open.
      * If so, use the existing PFAT_File object.
      */
     for (pfatFile = Get_Front_Of_PFAT_File_List(&instance->fileList);
@@ -374,41 +527,19 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
     }
 
     if (pfatFile == 0) {
-	/* Determine size of data block cache for file. */
-	numBlocks = Round_Up_To_Block(entry->fileSize) / SECTOR_SIZE;
-
-	/*
-	 * Allocate File object, PFAT_File object, file block data cache,
-	 * and valid cache block bitset
-	 */
-	if ((pfatFile = (struct PFAT_File *) Malloc(sizeof(*pfatFile))) == 0 ||
-	    (fileDataCache = Malloc(numBlocks * SECTOR_SIZE)) == 0 ||
-	    (validBlockSet = Create_Bit_Set(numBlocks)) == 0) {
-	    goto memfail;
-	}
+	if ((pfatFile = (struct PFAT_File *) Malloc(sizeof(*pfatFile))) == 0)
+	    goto done;
 
 	/* Populate PFAT_File */
 	pfatFile->entry = entry;
-	pfatFile->numBlocks = numBlocks;
-	pfatFile->fileDataCache = fileDataCache;
-	pfatFile->validBlockSet = validBlockSet;
-	Mutex_Init(&pfatFile->lock);
+	pfatFile->refCount = 0;
 
 	/* Add to instance's list of PFAT_File objects. */
 	Add_To_Back_Of_PFAT_File_List(&instance->fileList, pfatFile);
 	KASSERT(pfatFile->nextPFAT_File_List == 0);
     }
 
-    /* Success! */
-    goto done;
-
-memfail:
-    if (pfatFile != 0)
-	Free(pfatFile);
-    if (fileDataCache != 0)
-	Free(fileDataCache);
-    if (validBlockSet != 0)
-	Free(validBlockSet);
+    ++pfatFile->refCount;
 
 done:
     Mutex_Unlock(&instance->lock);
@@ -441,12 +572,15 @@ static int PFAT_Open(struct Mount_Point *mountPoint, const char *path, int mode,
 
     /* Get PFAT_File object */
     pfatFile = Get_PFAT_File(instance, entry);
-    if (pfatFile == 0)
+    if (pfatFile == 0) {
+	rc = ENOMEM;
 	goto done;
+    }
 
     /* Create the file object. */
     file = Allocate_File(&s_pfatFileOps, 0, entry->fileSize, pfatFile, 0, 0);
     if (file == 0) {
+	Put_PFAT_File(instance, pfatFile);
 	rc = ENOMEM;
 	goto done;
     }
@@ -621,7 +755,7 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
 
     /* Does magic number match? */
     if (fsinfo->magic != PFAT_MAGIC) {
-	Print("Bad magic number (%x) for PFAT filesystem\n", fsinfo->magic);
+	Log(LOG_ERROR, "Bad magic number (%x) for PFAT filesystem\n", fsinfo->magic);
 	goto invalidfs;
     }
     Debug("Magic number is good!\n");
@@ -631,7 +765,7 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
 	fsinfo->fileAllocationLength <= 0 ||
 	fsinfo->rootDirectoryCount < 0 ||
 	fsinfo->rootDirectoryOffset <= 0) {
-	Print("Invalid parameters for PFAT filesystem\n");
+	Log(LOG_ERROR, "Invalid parameters for PFAT filesystem\n");
 	goto invalidfs;
     }
     Debug("PFAT filesystem parameters appear to be good!\n");
@@ -653,16 +787,22 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
     /* Allocate root directory */
     rootDirSize = Round_Up_To_Block(sizeof(directoryEntry) * fsinfo->rootDirectoryCount);
     instance->rootDir = (directoryEntry*) Malloc(rootDirSize);
+    if (instance->rootDir == 0)
+	goto memfail;
 
     /* Read the root directory */
     Debug("Root directory size = %d\n", rootDirSize);
     for (i = 0; i < rootDirSize; i += SECTOR_SIZE) {
-	int blockNum = fsinfo->rootDirectoryOffset + i;
-	if ((rc = Block_Read(mountPoint->dev, blockNum, instance->rootDir + (i*SECTOR_SIZE))) < 0)
+	int blockNum = fsinfo->rootDirectoryOffset + i / SECTOR_SIZE;
+	if ((rc = Block_Read(mountPoint->dev, blockNum, ((char*)instance->rootDir) + i)) < 0)
 	    goto fail;
     }
     Debug("Read root directory successfully!\n");
 
+    /* Index it by name */
+    if ((rc = Build_Hash_Index(instance)) != 0)
+	goto fail;
+
     /* Create the fake root directory entry. */
     memset(&instance->rootDirEntry, '\0', sizeof(directoryEntry));
     instance->rootDirEntry.readOnly = 1;
@@ -670,6 +810,11 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
     instance->rootDirEntry.fileSize =
 	instance->fsinfo.rootDirectoryCount * sizeof(directoryEntry);
 
+    /* Create the cache for file data blocks. */
+    instance->cache = Create_FS_Buffer_Cache(mountPoint->dev, SECTOR_SIZE);
+    if (instance->cache == 0)
+	goto memfail;
+
     /* Initialize instance lock and PFAT_File list. */
     Mutex_Init(&instance->lock);
     Clear_PFAT_File_List(&instance->fileList);
@@ -696,6 +841,10 @@ fail:
 	    Free(instance->fat);
 	if (instance->rootDir != 0)
 	    Free(instance->rootDir);
+	if (instance->hashHead != 0)
+	    Free(instance->hashHead);
+	if (instance->hashNext != 0)
+	    Free(instance->hashNext);
 	Free(instance);
     }
     if (bootSect != 0)
@@ -0,0 +1,143 @@
+/*
+ * Sampling profiler
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/ktypes.h>
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/int.h>
+#include <geekos/malloc.h>
+#include <geekos/string.h>
+#include <geekos/kthread.h>
+#include <geekos/klog.h>
+#include <geekos/profile.h>
+
+/*
+ * Samples are taken by the timer interrupt handler, so all of
+ * the profiler's state is only touched with interrupts disabled.
+ * The buffer is allocated the first time profiling is started
+ * and kept from then on, so that it never goes away under
+ * a thread copying it out.
+ */
+
+bool g_profiling;
+
+static struct Profile_Sample *s_samples;
+static int s_numSamples;
+static ulong_t s_numDropped;
+static int s_interval;
+static int s_countdown;
+
+/*
+ * Discard any earlier samples and start profiling,
+ * taking a sample every interval ticks.
+ * Returns 0 if successful, or an error code.
+ */
+int Start_Profiling(int interval)
+{
+    struct Profile_Sample *samples = 0;
+    bool iflag;
+
+    if (interval < 1)
+	return EINVALID;
+
+    if (s_samples == 0) {
+	samples = (struct Profile_Sample*) Malloc(PROFILE_MAX_SAMPLES * sizeof(struct Profile_Sample));
+	if (samples == 0)
+	    return ENOMEM;
+    }
+
+    iflag = Begin_Int_Atomic();
+    if (s_samples == 0) {
+	s_samples = samples;
+	samples = 0;
+    }
+    s_numSamples = 0;
+    s_numDropped = 0;
+    s_interval = s_countdown = interval;
+    g_profiling = true;
+    End_Int_Atomic(iflag);
+
+    /* Lost a race with another thread starting the profiler */
+    if (samples != 0)
+	Free(samples);
+
+    return 0;
+}
+
+/*
+ * Stop profiling and describe the samples taken.
+ * Returns 0 if successful, or an error code.
+ */
+int Stop_Profiling(struct Profile_Header *header)
+{
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    g_profiling = false;
+    memcpy(header->magic, PROFILE_MAGIC, sizeof(header->magic));
+    header->interval = s_interval;
+    header->numSamples = s_numSamples;
+    header->numDropped = s_numDropped;
+    End_Int_Atomic(iflag);
+
+    if (header->numDropped > 0)
+	Log(LOG_WARN, "profile buffer full, %lu samples dropped\n", header->numDropped);
+
+    return 0;
+}
+
+/*
+ * Called from the timer interrupt handler on every tick
+ * while profiling.
+ */
+void Profile_Tick(struct Interrupt_State *state)
+{
+    struct Profile_Sample *sample;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (--s_countdown > 0)
+	return;
+    s_countdown = s_interval;
+
+    if (s_numSamples == PROFILE_MAX_SAMPLES) {
+	++s_numDropped;
+	return;
+    }
+
+    sample = &s_samples[s_numSamples++];
+    sample->eip = state->eip;
+    sample->pid = (ushort_t) g_currentThread->pid;
+    sample->user = Is_User_Interrupt(state);
+    sample->reserved = 0;
+}
+
+/*
+ * Copy up to max samples, starting with sample number first.
+ * Profiling must be stopped.
+ * Returns the number of samples copied, or an error code.
+ */
+int Get_Profile_Samples(struct Profile_Sample *buf, int first, int max)
+{
+    int count = 0;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    if (g_profiling)
+	count = EBUSY;
+    else if (first < 0 || max < 0)
+	count = EINVALID;
+    else if (first < s_numSamples) {
+	count = s_numSamples - first;
+	if (count > max)
+	    count = max;
+	memcpy(buf, &s_samples[first], count * sizeof(struct Profile_Sample));
+    }
+    End_Int_Atomic(iflag);
+
+    return count;
+}
@@ -13,6 +13,7 @@
 #include <geekos/io.h>
 #include <geekos/int.h>
 #include <geekos/fmtout.h>
+#include <geekos/string.h>
 #include <geekos/screen.h>
 
 /*
@@ -44,6 +45,14 @@ struct Console_State {
     int saveRow, saveCol;
     uchar_t currentAttr;
 
+    /*
+     * Row of video memory holding screen row 0.  Scrolling
+     * advances it instead of moving the screen contents, and
+     * Sync_Screen() puts the rows back in order (making it 0)
+     * once a piece of output is complete.
+     */
+    int topRow;
+
     /* Working variables for processing escape sequences. */
     enum State state;
     int argList[MAXARGS];
@@ -57,25 +66,61 @@ static struct Console_State s_cons;
 #define NUM_DWORDS_PER_LINE ((NUMCOLS*2)/4)
 #define FILL_DWORD (0x00200020 | (s_cons.currentAttr<<24) | (s_cons.currentAttr<<8))
 
+/* Holds the rows moved out of the way by Sync_Screen(). */
+static uint_t s_syncBuf[NUM_SCROLL_DWORDS];
+
+/*
+ * Get the video memory address of given screen position.
+ */
+static __inline__ uchar_t *Screen_Addr(int row, int col)
+{
+    row += s_cons.topRow;
+    if (row >= NUMROWS)
+	row -= NUMROWS;
+    return VIDMEM + row*(NUMCOLS*2) + col*2;
+}
+
 /*
  * Scroll the display one line.
- * We speed things up by copying 4 bytes at a time.
+ * The top line is cleared and becomes the bottom line,
+ * so a scroll costs one line's worth of stores.
  */
 static void Scroll(void)
 {
-    uint_t* v;
-    int i, n = NUM_SCROLL_DWORDS;
+    uint_t* v = (uint_t*) Screen_Addr(0, 0);
+    int i;
     uint_t fill = FILL_DWORD;
 
-    /* Move lines 1..NUMROWS-1 up one position. */
-    for (v = (uint_t*)VIDMEM, i = 0; i < n; ++i) {
-	*v = *(v + NUM_DWORDS_PER_LINE);
-	++v;
-    }
-
-    /* Clear out last line. */
-    for (v = (uint_t*)VIDMEM + n, i = 0; i < NUM_DWORDS_PER_LINE; ++i)
+    for (i = 0; i < NUM_DWORDS_PER_LINE; ++i)
 	*v++ = fill;
+
+    if (++s_cons.topRow == NUMROWS)
+	s_cons.topRow = 0;
+}
+
+/*
+ * Put the rows of video memory back in screen order after
+ * scrolling, with one bulk move however many lines were scrolled.
+ * We speed things up by copying 4 bytes at a time.
+ */
+static void Sync_Screen(void)
+{
+    uint_t *v = (uint_t*) VIDMEM;
+    int n = s_cons.topRow * NUM_DWORDS_PER_LINE;
+    int i;
+
+    if (s_cons.topRow == 0)
+	return;
+
+    /* Rows above topRow are the bottom of the screen */
+    for (i = 0; i < n; ++i)
+	s_syncBuf[i] = v[i];
+    for (i = 0; i < NUM_SCREEN_DWORDS - n; ++i)
+	v[i] = v[i + n];
+    for (i = 0; i < n; ++i)
+	v[NUM_SCREEN_DWORDS - n + i] = s_syncBuf[i];
+
+    s_cons.topRow = 0;
 }
 
 /*
@@ -85,7 +130,7 @@ static void Scroll(void)
 static void Clear_To_EOL(void)
 {
     int n = (NUMCOLS - s_cons.col);
-    uchar_t* v = VIDMEM + s_cons.row*(NUMCOLS*2) + s_cons.col*2;
+    uchar_t* v = Screen_Addr(s_cons.row, s_cons.col);
     while (n-- > 0) {
 	*v++ = ' ';
 	*v++ = s_cons.currentAttr;
@@ -113,7 +158,7 @@ static void Newline(void)
  */
 static void Put_Graphic_Char(int c)
 {
-    uchar_t* v = VIDMEM + s_cons.row*(NUMCOLS*2) + s_cons.col*2;
+    uchar_t* v = Screen_Addr(s_cons.row, s_cons.col);
 
     /* Put character at current position */
     *v++ = (uchar_t) c;
@@ -334,7 +379,7 @@ again:
 	case 'J':
 	    if (s_cons.numArgs == 1 && Get_Arg(0) == 2) {
 		Clear_Screen();
-		Put_Cursor(0, 0);
+		Move_Cursor(0, 0);
 	    }
 	    break;
 	default: break;
@@ -347,6 +392,59 @@ again:
     }
 }
 
+/*
+ * Characters that Output_Literal_Character() simply draws.
+ */
+#define IS_PLAIN(c) ((c) != ESC && (c) != '\n' && (c) != '\t')
+
+/*
+ * Fast path for output: write a run of plain characters straight
+ * into video memory, as far as the end of the current line.
+ * Returns the number of characters written.
+ */
+static ulong_t Put_Plain_Run(const char *buf, ulong_t length)
+{
+    uchar_t *v = Screen_Addr(s_cons.row, s_cons.col);
+    uchar_t attr = s_cons.currentAttr;
+    ulong_t n = 0, room = NUMCOLS - s_cons.col;
+
+    if (length > room)
+	length = room;
+
+    while (n < length && IS_PLAIN(buf[n])) {
+	*v++ = (uchar_t) buf[n];
+	*v++ = attr;
+#ifndef NDEBUG
+	Out_Byte(0xE9, buf[n]);
+#endif
+	++n;
+    }
+
+    s_cons.col += n;
+    if (s_cons.col == NUMCOLS)
+	Newline();
+
+    return n;
+}
+
+/*
+ * Output a buffer of characters, taking the fast path
+ * for runs of plain characters outside escape sequences.
+ */
+static void Put_Buf_Imp(const char *buf, ulong_t length)
+{
+    while (length > 0) {
+	if (s_cons.state == S_NORMAL && IS_PLAIN(*buf)) {
+	    ulong_t n = Put_Plain_Run(buf, length);
+	    buf += n;
+	    length -= n;
+	} else {
+	    Put_Char_Imp(*buf++);
+	    --length;
+	}
+    }
+}
+
 /*
  * Update the location of the hardware cursor.
  */
@@ -414,6 +512,7 @@ void Clear_Screen(void)
 
     for (i = 0; i < NUM_SCREEN_DWORDS; ++i)
 	*v++ = fill;
+    s_cons.topRow = 0;
 
     End_Int_Atomic(iflag);
 }
@@ -476,6 +575,7 @@ void Put_Char(int c)
 {
     bool iflag = Begin_Int_Atomic();
     Put_Char_Imp(c);
+    Sync_Screen();
     Update_Cursor();
     End_Int_Atomic(iflag);
 }
@@ -487,30 +587,30 @@ void Put_Char(int c)
 void Put_String(const char* s)
 {
     bool iflag = Begin_Int_Atomic();
-    while (*s != '\0')
-	Put_Char_Imp(*s++);
+    Put_Buf_Imp(s, strlen(s));
+    Sync_Screen();
     Update_Cursor();
     End_Int_Atomic(iflag);
 }
 
 /*
  * Write a buffer of characters at current cursor position
- * using current attribute.
+ * using current attribute.  However much is written, the screen
+ * is scrolled with one bulk move, and the hardware cursor
+ * updated once.
  */
 void Put_Buf(const char* buf, ulong_t length)
 {
     bool iflag = Begin_Int_Atomic();
-    while (length > 0) {
-	Put_Char_Imp(*buf++);
-	--length;
-    }
+    Put_Buf_Imp(buf, length);
+    Sync_Screen();
     Update_Cursor();
     End_Int_Atomic(iflag);
 }
 
 /* Support for Print(). */
 static void Print_Emit(struct Output_Sink *o, int ch) { Put_Char_Imp(ch); }
-static void Print_Finish(struct Output_Sink *o) { Update_Cursor(); }
+static void Print_Finish(struct Output_Sink *o) { Sync_Screen(); Update_Cursor(); }
 static struct Output_Sink s_outputSink = { &Print_Emit, &Print_Finish };
 
 /*
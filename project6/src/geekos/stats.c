@@ -0,0 +1,36 @@
+/*
+ * Kernel event counters and tracepoints
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/ktypes.h>
+#include <geekos/string.h>
+#include <geekos/timer.h>
+#include <geekos/kthread.h>
+#include <geekos/blockdev.h>
+#include <geekos/stats.h>
+
+ulong_t g_statCounter[NUM_STAT_COUNTERS];
+ulong_t g_syscallCount[STATS_MAX_SYSCALLS];
+
+/* Counters are cheap enough to keep on all the time. */
+bool g_statsEnabled = true;
+
+/* Tracepoints send a message to the kernel log for every event. */
+bool g_traceEnabled = false;
+
+/*
+ * Take a snapshot of all the counters.
+ */
+void Get_Kernel_Stats(struct Kernel_Stats *stats)
+{
+    memset(stats, '\0', sizeof(*stats));
+
+    stats->ticks = g_numTicks;
+    memcpy(stats->counter, g_statCounter, sizeof(stats->counter));
+    memcpy(stats->syscallCount, g_syscallCount, sizeof(stats->syscallCount));
+    stats->numDevices = Get_Block_Device_Stats(stats->device, STATS_MAX_DEVICES);
+    stats->numThreads = Get_Thread_Stats(stats->thread, STATS_MAX_THREADS);
+}
@@ -20,6 +20,232 @@
 #include <geekos/user.h>
 #include <geekos/timer.h>
 #include <geekos/vfs.h>
+#include <geekos/tss.h>
+#include <geekos/stats.h>
+#include <geekos/profile.h>
+
+/*
+ * Copy a string of given length from user memory into a
+ * newly allocated, nul-terminated kernel buffer.
+ * Returns 0 if successful, or an error code.
+ */
+static int Copy_User_String(ulong_t uaddr, ulong_t len, ulong_t maxLen, char **pStr)
+{
+    char *str;
+
+    if (len > maxLen)
+	return ENAMETOOLONG;
+
+    str = (char*) Malloc(len + 1);
+    if (str == 0)
+	return ENOMEM;
+    if (!Copy_From_User(str, uaddr, len)) {
+	Free(str);
+	return EINVALID;
+    }
+    str[len] = '\0';
+
+    *pStr = str;
+    return 0;
+}
+
+/*
+ * Open a file or directory, with the function given, and give it
+ * the lowest free descriptor in the current process.
+ * Returns the descriptor, or an error code.
+ */
+static int Open_User_File(struct Interrupt_State *state, int mode, bool directory)
+{
+    struct File_Table *table = &g_currentThread->userContext->fileTable;
+    struct File *file;
+    char *path;
+    int rc;
+
+    rc = Copy_User_String(state->ebx, state->ecx, VFS_MAX_PATH_LEN, &path);
+    if (rc != 0)
+	return rc;
+
+    Enable_Interrupts();
+    rc = directory ? Open_Directory(path, &file) : Open(path, mode, &file);
+    if (rc == 0 && (rc = Alloc_File_Descriptor(table, file)) < 0)
+	Close(file);
+    Disable_Interrupts();
+
+    Free(path);
+    return rc;
+}
+
+/*
+ * Get the file for given descriptor of the current process,
+ * with a reference of its own (release it with Close()), so it
+ * stays open even if another thread closes the descriptor.
+ */
+static int Get_User_File(int fd, struct File **pFile)
+{
+    struct File *file;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    file = Lookup_File_Descriptor(&g_currentThread->userContext->fileTable, fd);
+    if (file != 0)
+	Clone_File(file, &file);
+    End_Int_Atomic(iflag);
+
+    if (file == 0)
+	return EINVALID;
+    *pFile = file;
+    return 0;
+}
+
+/*
+ * Maximum number of user pages pinned for one filesystem request.
+ */
+#define TRANSFER_MAX_PAGES 16
+
+/*
+ * Read or write a user buffer directly, rather than copying it
+ * through a kernel buffer.  The pages are pinned a run at a time;
+ * a run continues for as long as the user pages are also adjacent
+ * in physical memory, so the filesystem gets one request for it.
+ * Returns the number of bytes transferred; an error code is
+ * returned only if nothing was transferred, or the buffer is invalid.
+ */
+static int Transfer_User_Buffer(struct File *file, ulong_t userBuf, ulong_t len, bool toUser)
+{
+    char *pinned[TRANSFER_MAX_PAGES];
+    ulong_t done = 0;
+    int numPinned, i, rc = 0;
+
+    while (done < len) {
+	ulong_t count = 0;
+
+	for (numPinned = 0; numPinned < TRANSFER_MAX_PAGES && done + count < len; ++numPinned) {
+	    ulong_t chunk = PAGE_SIZE - (userBuf + done + count) % PAGE_SIZE;
+	    char *buf = Pin_User_Page(userBuf + done + count, toUser);
+
+	    if (buf == 0)
+		break;
+	    if (numPinned > 0 && buf != pinned[0] + count) {
+		/* Not contiguous: leave it for the next run */
+		Unpin_User_Page(buf);
+		break;
+	    }
+	    pinned[numPinned] = buf;
+	    count += MIN(chunk, len - done - count);
+	}
+	if (numPinned == 0)
+	    return EINVALID;
+
+	STAT_INC(STAT_USER_IO_REQUESTS);
+	STAT_ADD(STAT_USER_IO_PAGES, numPinned);
+	rc = toUser ? Read(file, pinned[0], count) : Write(file, pinned[0], count);
+	for (i = 0; i < numPinned; ++i)
+	    Unpin_User_Page(pinned[i]);
+
+	if (rc < 0)
+	    break;
+	done += rc;
+	if (rc < count)
+	    break;
+    }
+
+    return (rc < 0 && done == 0) ? rc : (int) done;
+}
+
+/*
+ * The file operations behind the Read, Write, Seek, Stat and FStat
+ * system calls, which are also used for batched operations.
+ * They are called with interrupts enabled.
+ */
+
+static int Do_Read(int fd, ulong_t userBuf, ulong_t len)
+{
+    struct File *file;
+    int rc;
+
+    if ((rc = Get_User_File(fd, &file)) != 0)
+	return rc;
+    rc = Transfer_User_Buffer(file, userBuf, len, true);
+    Close(file);
+    return rc;
+}
+
+static int Do_Write(int fd, ulong_t userBuf, ulong_t len)
+{
+    struct File *file;
+    int rc;
+
+    if ((rc = Get_User_File(fd, &file)) != 0)
+	return rc;
+    rc = Transfer_User_Buffer(file, userBuf, len, false);
+    Close(file);
+    return rc;
+}
+
+static int Do_Seek(int fd, ulong_t pos)
+{
+    struct File *file;
+    int rc;
+
+    if ((rc = Get_User_File(fd, &file)) != 0)
+	return rc;
+    rc = Seek(file, pos);
+    Close(file);
+    return rc;
+}
+
+static int Do_Stat(ulong_t userPath, ulong_t pathLen, ulong_t userStat)
+{
+    struct VFS_File_Stat stat;
+    char *path;
+    int rc;
+
+    if ((rc = Copy_User_String(userPath, pathLen, VFS_MAX_PATH_LEN, &path)) != 0)
+	return rc;
+    memset(&stat, '\0', sizeof(stat));
+    rc = Stat(path, &stat);
+    if (rc == 0 && !Copy_To_User(userStat, &stat, sizeof(stat)))
+	rc = EINVALID;
+    Free(path);
+    return rc;
+}
+
+static int Do_FStat(int fd, ulong_t userStat)
+{
+    struct VFS_File_Stat stat;
+    struct File *file;
+    int rc;
+
+    if ((rc = Get_User_File(fd, &file)) != 0)
+	return rc;
+    memset(&stat, '\0', sizeof(stat));
+    rc = FStat(file, &stat);
+    if (rc == 0 && !Copy_To_User(userStat, &stat, sizeof(stat)))
+	rc = EINVALID;
+    Close(file);
+    return rc;
+}
+
+/*
+ * Carry out one batched operation.
+ */
+static int Do_Batch_Op(struct Batch_Op *op)
+{
+    switch (op->opcode) {
+    case BATCH_READ:
+	return Do_Read(op->fd, op->buf, op->len);
+    case BATCH_WRITE:
+	return Do_Write(op->fd, op->buf, op->len);
+    case BATCH_SEEK:
+	return Do_Seek(op->fd, op->len);
+    case BATCH_STAT:
+	return Do_Stat(op->buf, op->len, (ulong_t) op->stat);
+    case BATCH_FSTAT:
+	return Do_FStat(op->fd, (ulong_t) op->stat);
+    default:
+	return EINVALID;
+    }
+}
 
 /*
  * Null system call.
@@ -46,7 +272,14 @@ static int Sys_Null(struct Interrupt_State* state)
  */
 static int Sys_Exit(struct Interrupt_State* state)
 {
-    TODO("Exit system call");
+    /*
+     * Only the calling thread exits; the process's memory and files
+     * go away when the last thread detaches from its user context.
+     */
+    Exit(state->ebx);
+
+    /* Not reached */
+    return 0;
 }
 
 /*
@@ -58,7 +291,31 @@ static int Sys_Exit(struct Interrupt_State* state)
  */
 static int Sys_PrintString(struct Interrupt_State* state)
 {
-    TODO("PrintString system call");
+    ulong_t userBuf = state->ebx, len = state->ecx;
+    int rc = 0;
+
+    Enable_Interrupts();
+
+    /* Print straight from the user's pages */
+    while (len > 0) {
+	ulong_t count = PAGE_SIZE - userBuf % PAGE_SIZE;
+	char *buf;
+
+	if (count > len)
+	    count = len;
+	if ((buf = Pin_User_Page(userBuf, false)) == 0) {
+	    rc = EINVALID;
+	    break;
+	}
+	Put_Buf(buf, count);
+	Unpin_User_Page(buf);
+
+	userBuf += count;
+	len -= count;
+    }
+
+    Disable_Interrupts();
+    return rc;
 }
 
 /*
@@ -70,7 +327,7 @@ static int Sys_PrintString(struct Interrupt_State* state)
  */
 static int Sys_GetKey(struct Interrupt_State* state)
 {
-    TODO("GetKey system call");
+    return Wait_For_Key();
 }
 
 /*
@@ -81,7 +338,8 @@ static int Sys_GetKey(struct Interrupt_State* state)
  */
 static int Sys_SetAttr(struct Interrupt_State* state)
 {
-    TODO("SetAttr system call");
+    Set_Current_Attr((uchar_t) state->ebx);
+    return 0;
 }
 
 /*
@@ -93,7 +351,13 @@ static int Sys_SetAttr(struct Interrupt_State* state)
  */
 static int Sys_GetCursor(struct Interrupt_State* state)
 {
-    TODO("GetCursor system call");
+    int row, col;
+
+    Get_Cursor(&row, &col);
+    if (!Copy_To_User(state->ebx, &row, sizeof(int)) ||
+	!Copy_To_User(state->ecx, &col, sizeof(int)))
+	return -1;
+    return 0;
 }
 
 /*
@@ -105,9 +369,14 @@ static int Sys_GetCursor(struct Interrupt_State* state)
  */
 static int Sys_PutCursor(struct Interrupt_State* state)
 {
-    TODO("PutCursor system call");
+    return Put_Cursor((int) state->ebx, (int) state->ecx) ? 0 : -1;
 }
 
+/*
+ * Longest command line accepted by Spawn.
+ */
+#define SPAWN_MAX_COMMAND_LEN 1024
+
 /*
  * Create a new user process.
  * Params:
@@ -120,13 +389,38 @@ static int Sys_PutCursor(struct Interrupt_State* state)
  */
 static int Sys_Spawn(struct Interrupt_State* state)
 {
-    /*
-     * NOTE: here is how to get the file descriptors for
-     * the child's stdin and stdout.
-     * int stdinFd = (int) (state->edi & 0xffff);
-     * int stdoutFd = (int) (state->edi >> 16);
-     */
-    TODO("Spawn system call");
+    int stdinFd = (int) (state->edi & 0xffff);
+    int stdoutFd = (int) (state->edi >> 16);
+    struct File *stdInput = 0, *stdOutput = 0;
+    struct Kernel_Thread *child;
+    char *program = 0, *command = 0;
+    int rc;
+
+    if ((rc = Copy_User_String(state->ebx, state->ecx, VFS_MAX_PATH_LEN, &program)) != 0 ||
+	(rc = Copy_User_String(state->edx, state->esi, SPAWN_MAX_COMMAND_LEN, &command)) != 0 ||
+	(rc = Get_User_File(stdinFd, &stdInput)) != 0 ||
+	(rc = Get_User_File(stdoutFd, &stdOutput)) != 0)
+	goto done;
+
+    /* The child gets references of its own to the files */
+    Enable_Interrupts();
+    rc = Spawn(program, command, stdInput, stdOutput, &child);
+    Disable_Interrupts();
+
+done:
+    if (stdInput != 0 || stdOutput != 0) {
+	Enable_Interrupts();
+	if (stdInput != 0)
+	    Close(stdInput);
+	if (stdOutput != 0)
+	    Close(stdOutput);
+	Disable_Interrupts();
+    }
+    if (program != 0)
+	Free(program);
+    if (command != 0)
+	Free(command);
+    return rc;
 }
 
 /*
@@ -138,7 +432,19 @@ static int Sys_Spawn(struct Interrupt_State* state)
  */
 static int Sys_Wait(struct Interrupt_State* state)
 {
-    TODO("Wait system call");
+    struct Kernel_Thread *kthread;
+    int exitCode;
+
+    /* Only processes started by the caller, with Spawn or Fork */
+    kthread = Lookup_Thread((int) state->ebx);
+    if (kthread == 0 || kthread->userContext == g_currentThread->userContext)
+	return EINVALID;
+
+    Enable_Interrupts();
+    exitCode = Join(kthread);
+    Disable_Interrupts();
+
+    return exitCode;
 }
 
 /*
@@ -149,7 +455,7 @@ static int Sys_Wait(struct Interrupt_State* state)
  */
 static int Sys_GetPID(struct Interrupt_State* state)
 {
-    TODO("GetPID system call");
+    return g_currentThread->pid;
 }
 
 /*
@@ -173,7 +479,7 @@ static int Sys_SetSchedulingPolicy(struct Interrupt_State* state)
  */
 static int Sys_GetTimeOfDay(struct Interrupt_State* state)
 {
-    TODO("GetTimeOfDay system call");
+    return g_numTicks;
 }
 
 /*
@@ -254,12 +560,17 @@ static int Sys_Mount(struct Interrupt_State *state)
 	goto done;
     }
 
-    /*
-     * Hint: use devname, prefix, and fstype from the args structure
-     * and invoke the Mount() VFS function.  You will need to check
-     * to make sure they are correctly nul-terminated.
-     */
-    TODO("Mount system call");
+    /* Make sure the strings are nul-terminated. */
+    if (strnlen(args->devname, sizeof(args->devname)) == sizeof(args->devname) ||
+	strnlen(args->prefix, sizeof(args->prefix)) == sizeof(args->prefix) ||
+	strnlen(args->fstype, sizeof(args->fstype)) == sizeof(args->fstype)) {
+	rc = EINVALID;
+	goto done;
+    }
+
+    Enable_Interrupts();
+    rc = Mount(args->devname, args->prefix, args->fstype);
+    Disable_Interrupts();
 
 done:
     if (args != 0) Free(args);
@@ -278,7 +589,7 @@ done:
  */
 static int Sys_Open(struct Interrupt_State *state)
 {
-    TODO("Open system call");
+    return Open_User_File(state, state->edx, false);
 }
 
 /*
@@ -292,7 +603,7 @@ static int Sys_Open(struct Interrupt_State *state)
  */
 static int Sys_OpenDirectory(struct Interrupt_State *state)
 {
-    TODO("Open directory system call");
+    return Open_User_File(state, 0, true);
 }
 
 /*
@@ -303,7 +614,18 @@ static int Sys_OpenDirectory(struct Interrupt_State *state)
  */
 static int Sys_Close(struct Interrupt_State *state)
 {
-    TODO("Close system call");
+    struct File *file;
+    int rc;
+
+    file = Release_File_Descriptor(&g_currentThread->userContext->fileTable, (int) state->ebx);
+    if (file == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Close(file);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -316,7 +638,18 @@ static int Sys_Close(struct Interrupt_State *state)
  */
 static int Sys_Delete(struct Interrupt_State *state)
 {
-    TODO("Delete system call");
+    char *path;
+    int rc;
+
+    if ((rc = Copy_User_String(state->ebx, state->ecx, VFS_MAX_PATH_LEN, &path)) != 0)
+	return rc;
+
+    Enable_Interrupts();
+    rc = Delete(path);
+    Disable_Interrupts();
+
+    Free(path);
+    return rc;
 }
 
 /*
@@ -331,7 +664,13 @@ static int Sys_Delete(struct Interrupt_State *state)
  */
 static int Sys_Read(struct Interrupt_State *state)
 {
-    TODO("Read system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Do_Read((int) state->ebx, state->ecx, state->edx);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -343,7 +682,26 @@ static int Sys_Read(struct Interrupt_State *state)
  */
 static int Sys_ReadEntry(struct Interrupt_State *state)
 {
-    TODO("ReadEntry system call");
+    struct VFS_Dir_Entry *entry;
+    struct File *file;
+    int rc;
+
+    /* Too big for the kernel stack */
+    if ((entry = (struct VFS_Dir_Entry*) Malloc(sizeof(*entry))) == 0)
+	return ENOMEM;
+
+    Enable_Interrupts();
+    if ((rc = Get_User_File((int) state->ebx, &file)) == 0) {
+	memset(entry, '\0', sizeof(*entry));
+	rc = Read_Entry(file, entry);
+	if (rc == 0 && !Copy_To_User(state->ecx, entry, sizeof(*entry)))
+	    rc = EINVALID;
+	Close(file);
+    }
+    Disable_Interrupts();
+
+    Free(entry);
+    return rc;
 }
 
 /*
@@ -358,7 +716,13 @@ static int Sys_ReadEntry(struct Interrupt_State *state)
  */
 static int Sys_Write(struct Interrupt_State *state)
 {
-    TODO("Write system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Do_Write((int) state->ebx, state->ecx, state->edx);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -372,7 +736,13 @@ static int Sys_Write(struct Interrupt_State *state)
  */
 static int Sys_Stat(struct Interrupt_State *state)
 {
-    TODO("Stat system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Do_Stat(state->ebx, state->ecx, state->edx);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -385,7 +755,13 @@ static int Sys_Stat(struct Interrupt_State *state)
  */
 static int Sys_FStat(struct Interrupt_State *state)
 {
-    TODO("FStat system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Do_FStat((int) state->ebx, state->ecx);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -398,7 +774,13 @@ static int Sys_FStat(struct Interrupt_State *state)
  */
 static int Sys_Seek(struct Interrupt_State *state)
 {
-    TODO("Seek system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Do_Seek((int) state->ebx, state->ecx);
+    Disable_Interrupts();
+
+    return rc;
 }
 
 /*
@@ -411,7 +793,18 @@ static int Sys_Seek(struct Interrupt_State *state)
  */
 static int Sys_CreateDir(struct Interrupt_State *state)
 {
-    TODO("CreateDir system call");
+    char *path;
+    int rc;
+
+    if ((rc = Copy_User_String(state->ebx, state->ecx, VFS_MAX_PATH_LEN, &path)) != 0)
+	return rc;
+
+    Enable_Interrupts();
+    rc = Create_Directory(path);
+    Disable_Interrupts();
+
+    Free(path);
+    return rc;
 }
 
 /*
@@ -421,7 +814,13 @@ static int Sys_CreateDir(struct Interrupt_State *state)
  */
 static int Sys_Sync(struct Interrupt_State *state)
 {
-    TODO("Sync system call");
+    int rc;
+
+    Enable_Interrupts();
+    rc = Sync();
+    Disable_Interrupts();
+
+    return rc;
 }
 /*
  * Format a device
@@ -435,7 +834,21 @@ static int Sys_Sync(struct Interrupt_State *state)
  */
 static int Sys_Format(struct Interrupt_State *state)
 {
-    TODO("Format system call");
+    char *devname = 0, *fstype = 0;
+    int rc;
+
+    if ((rc = Copy_User_String(state->ebx, state->ecx, BLOCKDEV_MAX_NAME_LEN, &devname)) != 0 ||
+	(rc = Copy_User_String(state->edx, state->esi, VFS_MAX_FS_NAME_LEN, &fstype)) != 0)
+	goto done;
+
+    Enable_Interrupts();
+    rc = Format(devname, fstype);
+    Disable_Interrupts();
+
+done:
+    if (devname != 0) Free(devname);
+    if (fstype != 0) Free(fstype);
+    return rc;
 }
 
 static int Sys_CreatePipe(struct Interrupt_State *state)
@@ -443,6 +856,281 @@ static int Sys_CreatePipe(struct Interrupt_State *state)
     TODO("CreatePipe system call");
 }
 
+/*
+ * Create a new thread in the current process.
+ * Params:
+ *   state->ebx - user address where the thread starts; it is entered
+ *     as if called with startFunc and arg as its arguments
+ *   state->ecx - start function argument (startFunc)
+ *   state->edx - start function argument (arg)
+ * Returns: id of the new thread, or error code (< 0) on error
+ */
+static int Sys_CreateThread(struct Interrupt_State *state)
+{
+    struct Kernel_Thread *thread;
+    int rc;
+
+    Enable_Interrupts();
+    rc = Create_User_Thread(state->ebx, state->ecx, state->edx, &thread);
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Wait for a thread created by the current thread to exit.
+ * Params:
+ *   state->ebx - id of thread to wait for
+ * Returns: the exit code of the thread,
+ *   or error code (< 0) on error
+ */
+static int Sys_JoinThread(struct Interrupt_State *state)
+{
+    struct Kernel_Thread *thread;
+    int exitCode;
+
+    /* Only threads created by the caller, in the same process */
+    thread = Lookup_Thread((int) state->ebx);
+    if (thread == 0 || thread->userContext != g_currentThread->userContext)
+	return EINVALID;
+
+    Enable_Interrupts();
+    exitCode = Join(thread);
+    Disable_Interrupts();
+
+    return exitCode;
+}
+
+/*
+ * Check whether system calls may be made with sysenter.
+ * Params:
+ *   none
+ * Returns: 1 if sysenter may be used, 0 if only int 0x90 works
+ */
+static int Sys_HaveSysenter(struct Interrupt_State *state)
+{
+    return g_sysenterEnabled ? 1 : 0;
+}
+
+/*
+ * Carry out the file operations queued in a Batch_Ring
+ * (see <geekos/fileio.h>), in order, posting a completion for
+ * each one.  Stops when the submission queue is empty or the
+ * completion queue is full.  The whole batch is read, and the
+ * completion slots checked, before any operation is run, so
+ * either all of it runs or none of it does.
+ * Params:
+ *   state->ebx - user address of the Batch_Ring
+ * Returns: number of operations completed,
+ *   or error code (< 0) if the ring is invalid
+ */
+static int Sys_SubmitBatch(struct Interrupt_State *state)
+{
+    ulong_t ring = state->ebx;
+    ulong_t sqHead, sqTail, cqHead, cqTail;
+    struct Batch_Op *ops = 0;
+    struct Batch_Completion completion;
+    ulong_t cqSlot;
+    int count, i, rc = 0;
+
+    Enable_Interrupts();
+
+    /* The kernel's indices are written back as they are, to check they can be */
+    if (!Copy_From_User(&sqHead, ring + offsetof(struct Batch_Ring, sqHead), sizeof(ulong_t)) ||
+	!Copy_From_User(&sqTail, ring + offsetof(struct Batch_Ring, sqTail), sizeof(ulong_t)) ||
+	!Copy_From_User(&cqHead, ring + offsetof(struct Batch_Ring, cqHead), sizeof(ulong_t)) ||
+	!Copy_From_User(&cqTail, ring + offsetof(struct Batch_Ring, cqTail), sizeof(ulong_t)) ||
+	!Copy_To_User(ring + offsetof(struct Batch_Ring, sqHead), &sqHead, sizeof(ulong_t)) ||
+	!Copy_To_User(ring + offsetof(struct Batch_Ring, cqTail), &cqTail, sizeof(ulong_t)) ||
+	sqTail - sqHead > BATCH_RING_SIZE || cqTail - cqHead > BATCH_RING_SIZE) {
+	rc = EINVALID;
+	goto done;
+    }
+
+    count = MIN(sqTail - sqHead, BATCH_RING_SIZE - (cqTail - cqHead));
+    if (count == 0)
+	goto done;
+    if ((ops = (struct Batch_Op*) Malloc(count * sizeof(*ops))) == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
+
+    /* Read the batch, and make sure every completion can be posted */
+    for (i = 0; i < count; ++i) {
+	cqSlot = ring + offsetof(struct Batch_Ring, cq) +
+	    ((cqTail + i) % BATCH_RING_SIZE) * sizeof(completion);
+	if (!Copy_From_User(&ops[i], ring + offsetof(struct Batch_Ring, sq) +
+		((sqHead + i) % BATCH_RING_SIZE) * sizeof(ops[i]), sizeof(ops[i])) ||
+	    !Copy_From_User(&completion, cqSlot, sizeof(completion)) ||
+	    !Copy_To_User(cqSlot, &completion, sizeof(completion))) {
+	    rc = EINVALID;
+	    goto done;
+	}
+    }
+
+    for (i = 0; i < count; ++i) {
+	completion.userData = ops[i].userData;
+	completion.result = Do_Batch_Op(&ops[i]);
+
+	cqSlot = ring + offsetof(struct Batch_Ring, cq) +
+	    ((cqTail + i) % BATCH_RING_SIZE) * sizeof(completion);
+	if (!Copy_To_User(cqSlot, &completion, sizeof(completion)))
+	    break;
+    }
+
+    /* Everything that ran is accounted for, even if the ring went away meanwhile */
+    sqHead += i;
+    cqTail += i;
+    rc = i;
+    Copy_To_User(ring + offsetof(struct Batch_Ring, sqHead), &sqHead, sizeof(ulong_t));
+    Copy_To_User(ring + offsetof(struct Batch_Ring, cqTail), &cqTail, sizeof(ulong_t));
+
+done:
+    if (ops != 0)
+	Free(ops);
+    Disable_Interrupts();
+    return rc;
+}
+
+/*
+ * Get a snapshot of the kernel's event counters.
+ * Params:
+ *   state->ebx - user address of a struct Kernel_Stats
+ *   state->ecx - size of the struct, to catch mismatched programs
+ * Returns: 0 if successful, error code (< 0) if unsuccessful
+ */
+static int Sys_GetStats(struct Interrupt_State *state)
+{
+    struct Kernel_Stats *stats;
+    int rc = 0;
+
+    if (state->ecx != sizeof(struct Kernel_Stats))
+	return EINVALID;
+
+    Enable_Interrupts();
+    if ((stats = (struct Kernel_Stats*) Malloc(sizeof(*stats))) == 0)
+	rc = ENOMEM;
+    else {
+	Get_Kernel_Stats(stats);
+	if (!Copy_To_User(state->ebx, stats, sizeof(*stats)))
+	    rc = EINVALID;
+	Free(stats);
+    }
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Start the sampling profiler, discarding any earlier samples.
+ * Params:
+ *   state->ebx - number of timer ticks between samples
+ * Returns: 0 if successful, error code (< 0) if unsuccessful
+ */
+static int Sys_ProfileStart(struct Interrupt_State *state)
+{
+    int rc;
+
+    Enable_Interrupts();
+    rc = Start_Profiling((int) state->ebx);
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Stop the sampling profiler.
+ * Params:
+ *   state->ebx - user address of a struct Profile_Header,
+ *     which is filled in to describe the samples taken
+ * Returns: 0 if successful, error code (< 0) if unsuccessful
+ */
+static int Sys_ProfileStop(struct Interrupt_State *state)
+{
+    struct Profile_Header header;
+    int rc;
+
+    if ((rc = Stop_Profiling(&header)) != 0)
+	return rc;
+
+    Enable_Interrupts();
+    if (!Copy_To_User(state->ebx, &header, sizeof(header)))
+	rc = EINVALID;
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/* Samples copied per trip through the kernel buffer */
+#define PROFILE_CHUNK (PAGE_SIZE / sizeof(struct Profile_Sample))
+
+/*
+ * Copy out the samples taken by the profiler, which must be stopped.
+ * Params:
+ *   state->ebx - user address of an array of struct Profile_Sample
+ *   state->ecx - index of first sample to copy
+ *   state->edx - maximum number of samples to copy
+ * Returns: number of samples copied, error code (< 0) if unsuccessful
+ */
+static int Sys_ProfileDump(struct Interrupt_State *state)
+{
+    struct Profile_Sample *chunk;
+    ulong_t userBuf = state->ebx;
+    int first = (int) state->ecx, max = (int) state->edx;
+    int count, total = 0;
+
+    if (first < 0 || max < 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+
+    if ((chunk = (struct Profile_Sample*) Malloc(PROFILE_CHUNK * sizeof(*chunk))) == 0) {
+	total = ENOMEM;
+	goto done;
+    }
+
+    while (total < max) {
+	count = Get_Profile_Samples(chunk, first + total,
+	    max - total < (int) PROFILE_CHUNK ? max - total : (int) PROFILE_CHUNK);
+	if (count <= 0) {
+	    if (count < 0)
+		total = count;
+	    break;
+	}
+	if (!Copy_To_User(userBuf + total * sizeof(*chunk), chunk, count * sizeof(*chunk))) {
+	    total = EINVALID;
+	    break;
+	}
+	total += count;
+    }
+
+    Free(chunk);
+
+done:
+    Disable_Interrupts();
+    return total;
+}
+
+/*
+ * Create a copy of the current process.  The child's address
+ * space shares the parent's pages copy-on-write.
+ * Params:
+ *   none
+ * Returns: pid of child process in the parent, 0 in the child,
+ *   or error code (< 0) on error
+ */
+static int Sys_Fork(struct Interrupt_State *state)
+{
+    struct Kernel_Thread *child;
+    int rc;
+
+    Enable_Interrupts();
+    rc = Clone_Process(state, &child);
+    Disable_Interrupts();
+
+    return rc;
+}
+
 
 /*
  * Global table of system call handler functions.
@@ -482,6 +1170,21 @@ const Syscall g_syscallTable[] = {
     Sys_Format,
     /* Pipe system calls. */
     Sys_CreatePipe,
+    /* Process cloning. */
+    Sys_Fork,
+    /* Threads. */
+    Sys_CreateThread,
+    Sys_JoinThread,
+    /* Fast system call support. */
+    Sys_HaveSysenter,
+    /* Batched file operations. */
+    Sys_SubmitBatch,
+    /* Statistics. */
+    Sys_GetStats,
+    /* Sampling profiler. */
+    Sys_ProfileStart,
+    Sys_ProfileStop,
+    Sys_ProfileDump,
 };
 
 /*
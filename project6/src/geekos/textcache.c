@@ -0,0 +1,298 @@
+/*
+ * Shared text page cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/int.h>
+#include <geekos/mem.h>
+#include <geekos/malloc.h>
+#include <geekos/string.h>
+#include <geekos/list.h>
+#include <geekos/textcache.h>
+
+/*
+ * Number of entries no process is using that we keep around,
+ * so that the next run of the same program finds its text
+ * already in memory.
+ */
+#define TEXT_CACHE_MAX_IDLE 4
+
+/* ----------------------------------------------------------------------
+ * Private data and functions
+ * ---------------------------------------------------------------------- */
+
+int textCacheDebug = 0;
+#define Debug(args...) if (textCacheDebug) Print(args)
+
+struct Text_Cache_Entry;
+DEFINE_LIST(Text_Cache_List, Text_Cache_Entry);
+
+struct Text_Cache_Entry {
+    char *path;
+    ulong_t fileSize;
+    ulong_t crc;
+    ulong_t start;		 /* User address of first page */
+    ulong_t numPages;
+    void **frameList;		 /* Frame for each page, or null if not loaded yet */
+    int refCount;
+    bool invalid;		 /* Executable changed; no longer on the list */
+
+    DEFINE_LINK(Text_Cache_List, Text_Cache_Entry);
+};
+
+IMPLEMENT_LIST(Text_Cache_List, Text_Cache_Entry);
+
+/*
+ * All cached executables, least recently used first.
+ * Accessed only with interrupts disabled.
+ */
+static struct Text_Cache_List s_textCacheList;
+
+/*
+ * Free an entry and its pages.
+ * Returns the number of pages freed.
+ */
+static int Destroy_Text_Cache_Entry(struct Text_Cache_Entry *entry)
+{
+    ulong_t i;
+    int numFreed = 0;
+
+    KASSERT(entry->refCount == 0);
+
+    Debug("Dropping text of %s from cache\n", entry->path);
+    for (i = 0; i < entry->numPages; ++i) {
+	if (entry->frameList[i] != 0) {
+	    Free_Page(entry->frameList[i]);
+	    ++numFreed;
+	}
+    }
+    Free(entry->frameList);
+    Free(entry->path);
+    Free(entry);
+    return numFreed;
+}
+
+/*
+ * Drop the least recently used unreferenced entries
+ * if there are more than maxIdle of them.
+ * Interrupts must be disabled.
+ * Returns the number of pages freed.
+ */
+static int Trim_Text_Cache(int maxIdle)
+{
+    struct Text_Cache_Entry *entry, *next;
+    int numIdle = 0, numFreed = 0;
+
+    for (entry = Get_Front_Of_Text_Cache_List(&s_textCacheList); entry != 0;
+	 entry = Get_Next_In_Text_Cache_List(entry)) {
+	if (entry->refCount == 0)
+	    ++numIdle;
+    }
+
+    entry = Get_Front_Of_Text_Cache_List(&s_textCacheList);
+    while (numIdle > maxIdle && entry != 0) {
+	next = Get_Next_In_Text_Cache_List(entry);
+	if (entry->refCount == 0) {
+	    Remove_From_Text_Cache_List(&s_textCacheList, entry);
+	    numFreed += Destroy_Text_Cache_Entry(entry);
+	    --numIdle;
+	}
+	entry = next;
+    }
+
+    return numFreed;
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Get a reference to the cached text for given executable,
+ * creating an empty entry if it isn't cached yet.
+ * Params:
+ *   path - full path of the executable
+ *   fileSize, crc - size and checksum of the file's headers,
+ *     as a check on top of Invalidate_Text_Cache()
+ *   start, end - page aligned user address range of the text
+ * Returns: the entry, or null if out of memory
+ */
+struct Text_Cache_Entry *Get_Text_Cache_Entry(const char *path, ulong_t fileSize, ulong_t crc,
+    ulong_t start, ulong_t end)
+{
+    struct Text_Cache_Entry *entry, *stale = 0;
+    bool iflag;
+
+    KASSERT(Is_Page_Multiple(start) && Is_Page_Multiple(end) && start < end);
+
+    iflag = Begin_Int_Atomic();
+    for (entry = Get_Front_Of_Text_Cache_List(&s_textCacheList); entry != 0;
+	 entry = Get_Next_In_Text_Cache_List(entry)) {
+	if (strcmp(entry->path, path) != 0)
+	    continue;
+	if (entry->fileSize == fileSize && entry->crc == crc && entry->start == start &&
+	    entry->numPages == (end - start) / PAGE_SIZE)
+	    break;
+	if (entry->refCount == 0)
+	    stale = entry;
+    }
+
+    if (entry != 0) {
+	/* Hit: move to the back of the LRU list */
+	++entry->refCount;
+	Remove_From_Text_Cache_List(&s_textCacheList, entry);
+	Add_To_Back_Of_Text_Cache_List(&s_textCacheList, entry);
+	End_Int_Atomic(iflag);
+	Debug("Text cache hit for %s\n", path);
+	return entry;
+    }
+
+    /* The executable at this path has changed; forget the old one */
+    if (stale != 0) {
+	Remove_From_Text_Cache_List(&s_textCacheList, stale);
+	Destroy_Text_Cache_Entry(stale);
+    }
+    End_Int_Atomic(iflag);
+
+    entry = (struct Text_Cache_Entry*) Malloc(sizeof(*entry));
+    if (entry == 0)
+	return 0;
+    entry->numPages = (end - start) / PAGE_SIZE;
+    entry->path = Malloc(strlen(path) + 1);
+    entry->frameList = Malloc(entry->numPages * sizeof(void*));
+    if (entry->path == 0 || entry->frameList == 0) {
+	if (entry->path != 0)
+	    Free(entry->path);
+	if (entry->frameList != 0)
+	    Free(entry->frameList);
+	Free(entry);
+	return 0;
+    }
+    strcpy(entry->path, path);
+    memset(entry->frameList, '\0', entry->numPages * sizeof(void*));
+    entry->fileSize = fileSize;
+    entry->crc = crc;
+    entry->start = start;
+    entry->refCount = 1;
+    entry->invalid = false;
+
+    Debug("Caching text of %s (%lu pages)\n", path, entry->numPages);
+    iflag = Begin_Int_Atomic();
+    Add_To_Back_Of_Text_Cache_List(&s_textCacheList, entry);
+    Trim_Text_Cache(TEXT_CACHE_MAX_IDLE);
+    End_Int_Atomic(iflag);
+
+    return entry;
+}
+
+/*
+ * Add a reference to a text cache entry
+ * (for a process inheriting another's text).
+ */
+void Add_Text_Cache_Ref(struct Text_Cache_Entry *entry)
+{
+    bool iflag = Begin_Int_Atomic();
+
+    KASSERT(entry->refCount > 0);
+    ++entry->refCount;
+
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Drop a reference to a text cache entry.
+ * The pages stay cached until the entry is trimmed,
+ * unless the executable has changed.
+ */
+void Release_Text_Cache_Entry(struct Text_Cache_Entry *entry)
+{
+    bool iflag = Begin_Int_Atomic();
+
+    KASSERT(entry->refCount > 0);
+    --entry->refCount;
+    if (entry->refCount == 0) {
+	if (entry->invalid)
+	    Destroy_Text_Cache_Entry(entry);
+	else
+	    Trim_Text_Cache(TEXT_CACHE_MAX_IDLE);
+    }
+
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Forget the cached text of the executable at given path, because
+ * it is about to be written or deleted.  Processes still running it
+ * keep their entry, which is freed when the last one exits.
+ */
+void Invalidate_Text_Cache(const char *path)
+{
+    struct Text_Cache_Entry *entry, *next;
+    bool iflag = Begin_Int_Atomic();
+
+    for (entry = Get_Front_Of_Text_Cache_List(&s_textCacheList); entry != 0; entry = next) {
+	next = Get_Next_In_Text_Cache_List(entry);
+	if (strcmp(entry->path, path) != 0)
+	    continue;
+	Remove_From_Text_Cache_List(&s_textCacheList, entry);
+	if (entry->refCount == 0)
+	    Destroy_Text_Cache_Entry(entry);
+	else
+	    entry->invalid = true;
+    }
+
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Free the text of executables no process is running,
+ * when memory runs low.
+ * Interrupts must be disabled.
+ * Returns the number of pages freed.
+ */
+int Reclaim_Text_Cache(void)
+{
+    KASSERT(!Interrupts_Enabled());
+
+    return Trim_Text_Cache(0);
+}
+
+/*
+ * Get the frame holding the text page at given user address,
+ * or null if it hasn't been loaded yet.
+ * Interrupts must be disabled.
+ */
+void *Lookup_Text_Page(struct Text_Cache_Entry *entry, ulong_t userAddr)
+{
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(userAddr >= entry->start && userAddr < entry->start + entry->numPages * PAGE_SIZE);
+
+    return entry->frameList[(userAddr - entry->start) / PAGE_SIZE];
+}
+
+/*
+ * Add a loaded text page to the cache.  The frame must come from
+ * Alloc_Page(), and belongs to the cache afterwards.  If another
+ * process loaded the same page first, the given frame is freed and
+ * the cached one returned instead.
+ * Interrupts must be disabled.
+ */
+void *Install_Text_Page(struct Text_Cache_Entry *entry, ulong_t userAddr, void *frame)
+{
+    ulong_t index = (userAddr - entry->start) / PAGE_SIZE;
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(index < entry->numPages);
+
+    if (entry->frameList[index] != 0) {
+	Free_Page(frame);
+	return entry->frameList[index];
+    }
+
+    entry->frameList[index] = frame;
+    return frame;
+}
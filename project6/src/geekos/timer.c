@@ -14,6 +14,7 @@
 #include <geekos/irq.h>
 #include <geekos/kthread.h>
 #include <geekos/timer.h>
+#include <geekos/profile.h>
 
 #define MAX_TIMER_EVENTS	100
 
@@ -75,16 +76,29 @@ static void Timer_Interrupt_Handler(struct Interrupt_State* state)
     /* Update global and per-thread number of ticks */
     ++g_numTicks;
     ++current->numTicks;
+    ++current->totalTicks;
 
-    /* update timer events */
-    for (i=0; i < timeEventCount; i++) {
+    if (g_profiling)
+	Profile_Tick(state);
+
+    /*
+     * update timer events.  A callback may cancel its own event,
+     * which moves the last event into slot i, so slot i is looked
+     * at again if its event changed.
+     */
+    for (i=0; i < timeEventCount; ) {
 	if (pendingTimerEvents[i].ticks == 0) {
+	    int id = pendingTimerEvents[i].id;
+
 	    if (timerDebug) Print("timer: event %d expired (%d ticks)\n", 
-	        pendingTimerEvents[i].id, pendingTimerEvents[i].origTicks);
-	    (pendingTimerEvents[i].callBack)(pendingTimerEvents[i].id);
+	        id, pendingTimerEvents[i].origTicks);
+	    (pendingTimerEvents[i].callBack)(id);
+	    if (i >= timeEventCount || pendingTimerEvents[i].id != id)
+		continue;
 	} else {
 	    pendingTimerEvents[i].ticks--;
 	}
+	i++;
     }
 
     /*
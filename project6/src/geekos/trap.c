@@ -11,7 +11,9 @@
 #include <geekos/kthread.h>
 #include <geekos/defs.h>
 #include <geekos/syscall.h>
+#include <geekos/user.h>
 #include <geekos/trap.h>
+#include <geekos/stats.h>
 
 /*
  * TODO: need to add handlers for other exceptions (such as bounds
@@ -53,6 +55,9 @@ static void Syscall_Handler(struct Interrupt_State* state)
 	KASSERT(false);
     }
 
+    STAT_INC(STAT_SYSCALLS);
+    STAT_SYSCALL(syscallNum);
+
     /*
      * Call the appropriate syscall function.
      * Return code of system call is returned in EAX.
@@ -60,6 +65,33 @@ static void Syscall_Handler(struct Interrupt_State* state)
     state->eax = g_syscallTable[syscallNum](state);
 }
 
+/*
+ * Handler for system calls made with sysenter (see Sysenter_Entry
+ * in lowlevel.asm).  The user return address is on top of the user
+ * stack, which the user left in ebp; once it is read, the state
+ * looks just like one saved by int SYSCALL_INT.
+ */
+void Sysenter_Handler(struct Interrupt_State* state)
+{
+    struct User_Interrupt_State *userState = (struct User_Interrupt_State*) state;
+    ulong_t returnAddr;
+
+    if (g_currentThread->userContext == 0 ||
+	!Copy_From_User(&returnAddr, state->ebp, sizeof(returnAddr))) {
+	Print("Bad sysenter stack pointer %x in process %d\n",
+		state->ebp, g_currentThread->pid);
+	Exit(-1);
+
+	/* We will never get here */
+	KASSERT(false);
+    }
+
+    state->eip = returnAddr;
+    userState->espUser = state->ebp + sizeof(returnAddr);
+
+    Syscall_Handler(state);
+}
+
 /*
  * Initialize handlers for processor traps.
  */
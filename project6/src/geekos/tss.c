@@ -13,6 +13,7 @@
  */
 
 #include <geekos/kassert.h>
+#include <geekos/screen.h>
 #include <geekos/defs.h>
 #include <geekos/gdt.h>
 #include <geekos/segment.h>
@@ -26,6 +27,24 @@ static struct TSS s_theTSS;
 static struct Segment_Descriptor *s_tssDesc;
 static ushort_t s_tssSelector;
 
+/*
+ * Set if system calls may be made with sysenter.
+ */
+bool g_sysenterEnabled;
+
+/* Model specific registers used by sysenter. */
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+/* Entry point for sysenter, in lowlevel.asm. */
+extern void Sysenter_Entry(void);
+
+static void __inline__ Write_MSR(ulong_t msr, ulong_t value)
+{
+    __asm__ __volatile__ ("wrmsr" : : "c" (msr), "a" (value), "d" (0));
+}
+
 static void __inline__ Load_Task_Register(void)
 {
     /* Critical: TSS must be marked as not busy */
@@ -75,3 +94,38 @@ void Set_Kernel_Stack_Pointer(ulong_t esp0)
      */
     Load_Task_Register();
 }
+
+/*
+ * Set up the processor for system calls made with sysenter,
+ * if it supports them.  Must be called after Init_TSS().
+ *
+ * sysenter doesn't switch stacks through the TSS, so we point its
+ * stack pointer at the TSS's esp0 field instead, and the entry code
+ * loads the real kernel stack pointer from there.  That way
+ * Set_Kernel_Stack_Pointer() works for both kinds of system call.
+ */
+void Init_Sysenter(void)
+{
+    ulong_t signature, features, family, model, stepping;
+
+    __asm__ __volatile__ ("cpuid"
+	: "=a" (signature), "=d" (features)
+	: "a" (1)
+	: "ebx", "ecx");
+
+    family = (signature >> 8) & 0xf;
+    model = (signature >> 4) & 0xf;
+    stepping = signature & 0xf;
+
+    /* Early Pentium Pros report SEP, but don't implement it */
+    if (!(features & (1 << 11)) || (family == 6 && model < 3 && stepping < 3)) {
+	Print("sysenter not supported, using int 0x%x for system calls\n", SYSCALL_INT);
+	return;
+    }
+
+    Write_MSR(MSR_SYSENTER_CS, KERNEL_CS);
+    Write_MSR(MSR_SYSENTER_ESP, (ulong_t) &s_theTSS.esp0);
+    Write_MSR(MSR_SYSENTER_EIP, (ulong_t) &Sysenter_Entry);
+
+    g_sysenterEnabled = true;
+}
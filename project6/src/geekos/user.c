@@ -15,6 +15,7 @@
 #include <geekos/malloc.h>
 #include <geekos/kthread.h>
 #include <geekos/vfs.h>
+#include <geekos/crc32.h>
 #include <geekos/tss.h>
 #include <geekos/user.h>
 
@@ -32,28 +33,24 @@ void Attach_User_Context(struct Kernel_Thread* kthread, struct User_Context* con
     KASSERT(context != 0);
     kthread->userContext = context;
 
+    /* Several threads may share one user context */
     Disable_Interrupts();
-
-    /*
-     * We don't actually allow multiple threads
-     * to share a user context (yet)
-     */
-    KASSERT(context->refCount == 0);
-
     ++context->refCount;
     Enable_Interrupts();
 }
 
 /*
- * If the given thread has a user context, detach it
- * and destroy it.  This is called when a thread is
- * being destroyed.
+ * If the given thread has a user context, detach it,
+ * and destroy it if no other threads are using it.
+ * This is called when a thread is being destroyed.
  */
 void Detach_User_Context(struct Kernel_Thread* kthread)
 {
     struct User_Context* old = kthread->userContext;
+    int stackSlot = kthread->userStackSlot;
 
     kthread->userContext = 0;
+    kthread->userStackSlot = 0;
 
     if (old != 0) {
 	int refCount;
@@ -66,9 +63,27 @@ void Detach_User_Context(struct Kernel_Thread* kthread)
 	/*Print("User context refcount == %d\n", refCount);*/
         if (refCount == 0)
             Destroy_User_Context(old);
+	else if (stackSlot != 0)
+	    Free_User_Thread_Stack(old, stackSlot);
     }
 }
 
+/*
+ * Give a new process a reference to one of its parent's files,
+ * at given file descriptor.
+ */
+static int Install_Inherited_File(struct User_Context *userContext, int fd, struct File *file)
+{
+    struct File *clone;
+    int rc;
+
+    if ((rc = Clone_File(file, &clone)) != 0)
+	return rc;
+    if ((rc = Install_File_Descriptor(&userContext->fileTable, fd, clone)) != 0)
+	Close(clone);
+    return rc;
+}
+
 /*
  * Spawn a user process.
  * Params:
@@ -89,20 +104,156 @@ int Spawn(const char *program, const char *command,
     struct File *stdInput, struct File *stdOutput,
     struct Kernel_Thread **pThread)
 {
+    struct File *exeFile = 0;
+    char *header = 0;
+    struct Exe_Format exeFormat;
+    struct User_Context *userContext = 0;
+    struct Kernel_Thread *thread;
+    struct VFS_File_Stat stat;
+    ulong_t headerCrc;
+    int rc;
+
     /*
-     * Hints:
-     * - Call Read_Fully() to load the entire executable into a memory buffer
-     * - Call Parse_ELF_Executable() to verify that the executable is
-     *   valid, and to populate an Exe_Format data structure describing
-     *   how the executable should be loaded
-     * - Call Load_User_Program() to create a User_Context with the loaded
-     *   program
-     * - Call Start_User_Thread() with the new User_Context
-     *
-     * If all goes well, store the pointer to the new thread in
-     * pThread and return 0.  Otherwise, return an error code.
+     * Only the ELF headers are read here; text and data pages
+     * are read from the executable when they are first touched.
      */
-    TODO("Spawn a process by reading an executable from a filesystem");
+    rc = Open(program, O_READ, &exeFile);
+    if (rc != 0)
+	return rc;
+    if ((rc = FStat(exeFile, &stat)) != 0)
+	goto fail;
+
+    header = (char*) Malloc(PAGE_SIZE);
+    if (header == 0) {
+	rc = ENOMEM;
+	goto fail;
+    }
+    rc = Read(exeFile, header, PAGE_SIZE);
+    if (rc < 0)
+	goto fail;
+
+    headerCrc = crc32(0, header, rc);
+    rc = Parse_ELF_Executable(header, rc, &exeFormat);
+    if (rc != 0)
+	goto fail;
+    Free(header);
+    header = 0;
+
+    /* The user context takes ownership of the executable file */
+    rc = Load_User_Program(exeFile, &exeFormat, command, &userContext);
+    if (rc != 0)
+	goto fail;
+    exeFile = 0;
+
+    /* Share text pages with other processes running this program */
+    Attach_Text_Cache(userContext, program, stat.size, headerCrc);
+
+    if (stdInput != 0 && (rc = Install_Inherited_File(userContext, 0, stdInput)) != 0)
+	goto fail;
+    if (stdOutput != 0 && (rc = Install_Inherited_File(userContext, 1, stdOutput)) != 0)
+	goto fail;
+
+    thread = Start_User_Thread(userContext, false);
+    if (thread == 0) {
+	rc = ENOMEM;
+	goto fail;
+    }
+
+    *pThread = thread;
+    return thread->pid;
+
+fail:
+    if (header != 0)
+	Free(header);
+    if (exeFile != 0)
+	Close(exeFile);
+    if (userContext != 0)
+	Destroy_User_Context(userContext);
+    return rc;
+}
+
+/*
+ * Create a copy of the current process, fork-style.
+ * The child's address space shares the parent's pages copy-on-write,
+ * it inherits the parent's open files, and it resumes in user mode
+ * where the parent made the system call, with a return value of 0.
+ * Params:
+ *   state - saved user mode state of the parent
+ *   pThread - reference to Kernel_Thread pointer where a pointer to
+ *     the new process should be stored
+ * Returns:
+ *   The process id (pid) of the new process, or an error code.
+ */
+int Clone_Process(struct Interrupt_State *state, struct Kernel_Thread **pThread)
+{
+    struct User_Context *userContext;
+    struct Kernel_Thread *thread;
+    int rc;
+
+    rc = Clone_User_Context(g_currentThread->userContext, &userContext);
+    if (rc != 0)
+	return rc;
+
+    thread = Start_Cloned_User_Thread(userContext, state, false);
+    if (thread == 0) {
+	Destroy_User_Context(userContext);
+	return ENOMEM;
+    }
+
+    *pThread = thread;
+    return thread->pid;
+}
+
+/*
+ * Create a new thread in the current process.  It shares the
+ * process's address space and open files, and gets a user stack
+ * of its own.  The thread starts in user mode at startAddr, with
+ * its stack set up as for a call startAddr(startFunc, arg),
+ * so startAddr should be a function that calls startFunc(arg)
+ * and exits with its result; it must never return.
+ * Params:
+ *   startAddr - user address where the thread starts
+ *   startFunc - first argument for the start function
+ *   arg - second argument for the start function
+ *   pThread - reference to Kernel_Thread pointer where a pointer to
+ *     the new thread should be stored
+ * Returns:
+ *   The thread id (pid) of the new thread, or an error code.
+ */
+int Create_User_Thread(ulong_t startAddr, ulong_t startFunc, ulong_t arg,
+    struct Kernel_Thread **pThread)
+{
+    struct User_Context *userContext = g_currentThread->userContext;
+    struct Kernel_Thread *thread;
+    ulong_t stackTop, frame[3];
+    int stackSlot, rc;
+
+    rc = Alloc_User_Thread_Stack(userContext, &stackSlot, &stackTop);
+    if (rc != 0)
+	return rc;
+
+    /* Return address (none), then the two arguments */
+    frame[0] = 0;
+    frame[1] = startFunc;
+    frame[2] = arg;
+    if (!Copy_To_User(stackTop - sizeof(frame), frame, sizeof(frame))) {
+	rc = ENOMEM;
+	goto fail;
+    }
+
+    thread = Start_User_Thread_At(userContext, startAddr, stackTop - sizeof(frame),
+	stackSlot, false);
+    if (thread == 0) {
+	rc = ENOMEM;
+	goto fail;
+    }
+
+    *pThread = thread;
+    return thread->pid;
+
+fail:
+    Free_User_Thread_Stack(userContext, stackSlot);
+    return rc;
 }
 
 /*
@@ -116,11 +267,18 @@ int Spawn(const char *program, const char *command,
  */
 void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_State* state)
 {
-    /*
-     * Hint: Before executing in user mode, you will need to call
-     * the Set_Kernel_Stack_Pointer() and Switch_To_Address_Space()
-     * functions.
-     */
-    TODO("Switch to a new user address space, if necessary");
+    struct User_Context* userContext = kthread->userContext;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (userContext == 0)
+	return;
+
+    /* Only reload the page directory if it actually changed */
+    if (Get_PDBR() != userContext->pageDir)
+	Switch_To_Address_Space(userContext);
+
+    /* Kernel stack used on the next entry from user mode */
+    Set_Kernel_Stack_Pointer(((ulong_t) kthread->stackPage) + PAGE_SIZE);
 }
 
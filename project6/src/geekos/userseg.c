@@ -80,8 +80,7 @@ void Destroy_User_Context(struct User_Context* userContext)
  * Load a user executable into memory by creating a User_Context
  * data structure.
  * Params:
- * exeFileData - a buffer containing the executable to load
- * exeFileLength - number of bytes in exeFileData
+ * exeFile - the executable file to load
  * exeFormat - parsed ELF segment information describing how to
  *   load the executable's text and data segments, and the
  *   code entry point address
@@ -94,7 +93,7 @@ void Destroy_User_Context(struct User_Context* userContext)
  * Returns:
  *   0 if successful, or an error code (< 0) if unsuccessful
  */
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext)
 {
@@ -8,6 +8,10 @@
  */
 
 #include <geekos/int.h>
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/gdt.h>
+#include <geekos/segment.h>
 #include <geekos/mem.h>
 #include <geekos/paging.h>
 #include <geekos/malloc.h>
@@ -16,16 +20,286 @@
 #include <geekos/kthread.h>
 #include <geekos/range.h>
 #include <geekos/vfs.h>
+#include <geekos/textcache.h>
 #include <geekos/user.h>
 
 /* ----------------------------------------------------------------------
  * Private functions
  * ---------------------------------------------------------------------- */
 
-// TODO: Add private functions
-/* ----------------------------------------------------------------------
- * Public functions
- * ---------------------------------------------------------------------- */
+#define DEFAULT_USER_STACK_SIZE 8192
+
+/*
+ * Stacks of threads other than the initial one.  An unmapped
+ * guard page separates each stack from the one above it.
+ */
+#define USER_THREAD_STACK_SIZE 16384
+#define USER_THREAD_STACK_STRIDE (USER_THREAD_STACK_SIZE + PAGE_SIZE)
+
+/*
+ * Create a User_Context with an empty address space:
+ * the page directory maps only the kernel.
+ */
+static struct User_Context* Create_User_Context(void)
+{
+    struct User_Context *userContext;
+
+    userContext = (struct User_Context*) Malloc(sizeof(*userContext));
+    if (userContext == 0)
+	return 0;
+    memset(userContext, '\0', sizeof(*userContext));
+
+    /* Share the kernel's page tables */
+    userContext->pageDir = (pde_t*) Alloc_Page();
+    if (userContext->pageDir == 0)
+	goto fail;
+    memset(userContext->pageDir, '\0', PAGE_SIZE);
+    memcpy(userContext->pageDir, g_kernelPageDir,
+	PAGE_DIRECTORY_INDEX(USER_VM_START) * sizeof(pde_t));
+
+    /* Code and data segments cover the user half of the address space */
+    userContext->ldtDescriptor = Allocate_Segment_Descriptor();
+    if (userContext->ldtDescriptor == 0)
+	goto fail;
+    Init_LDT_Descriptor(userContext->ldtDescriptor, userContext->ldt, NUM_USER_LDT_ENTRIES);
+    Init_Code_Segment_Descriptor(&userContext->ldt[0], USER_VM_START, USER_VM_SIZE / PAGE_SIZE, USER_PRIVILEGE);
+    Init_Data_Segment_Descriptor(&userContext->ldt[1], USER_VM_START, USER_VM_SIZE / PAGE_SIZE, USER_PRIVILEGE);
+    userContext->ldtSelector = Selector(KERNEL_PRIVILEGE, true, Get_Descriptor_Index(userContext->ldtDescriptor));
+    userContext->csSelector = Selector(USER_PRIVILEGE, false, 0);
+    userContext->dsSelector = Selector(USER_PRIVILEGE, false, 1);
+
+    Mutex_Init(&userContext->exeLock);
+
+    return userContext;
+
+fail:
+    if (userContext->pageDir != 0)
+	Free_Page(userContext->pageDir);
+    Free(userContext);
+    return 0;
+}
+
+/*
+ * Get the page table entry for given user address,
+ * optionally creating the page table if there isn't one.
+ * Interrupts must be disabled.
+ */
+static pte_t *Get_User_PTE(struct User_Context *userContext, ulong_t userAddr, bool create)
+{
+    ulong_t linearAddr = USER_VM_START + userAddr;
+    pde_t *pde = &userContext->pageDir[PAGE_DIRECTORY_INDEX(linearAddr)];
+    pte_t *pageTable;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (!pde->present) {
+	if (!create)
+	    return 0;
+	pageTable = (pte_t*) Alloc_Page();
+	if (pageTable == 0)
+	    return 0;
+	memset(pageTable, '\0', PAGE_SIZE);
+	pde->pageTableBaseAddr = PAGE_ALLIGNED_ADDR(pageTable);
+	pde->flags = VM_USER | VM_WRITE;
+	pde->present = 1;
+    }
+
+    pageTable = (pte_t*) (pde->pageTableBaseAddr << PAGE_POWER);
+    return &pageTable[PAGE_TABLE_INDEX(linearAddr)];
+}
+
+/*
+ * Add a demand-loaded region to the user address space.
+ */
+static int Add_User_Region(struct User_Context *userContext, ulong_t start, ulong_t size,
+    ulong_t offsetInFile, ulong_t lengthInFile, int protFlags)
+{
+    struct User_Region *region;
+
+    if (userContext->numRegions == USER_MAX_REGIONS ||
+	start >= USER_VM_SIZE || size > USER_VM_SIZE - start)
+	return EINVALID;
+
+    region = &userContext->regionList[userContext->numRegions++];
+    region->start = Round_Down_To_Page(start);
+    region->end = Round_Up_To_Page(start + size);
+    region->fileStart = start;
+    region->fileEnd = start + lengthInFile;
+    region->offsetInFile = offsetInFile;
+    region->protFlags = protFlags;
+
+    return 0;
+}
+
+/*
+ * Copy the argument block into freshly mapped pages
+ * at the top of the user address space.
+ */
+static int Map_Argument_Block(struct User_Context *userContext, ulong_t argBlockAddr,
+    unsigned numArgs, ulong_t argBlockSize, const char *command)
+{
+    char *argBlock;
+    ulong_t offset;
+    int rc = 0;
+    bool iflag;
+
+    argBlock = Malloc(Round_Up_To_Page(argBlockSize));
+    if (argBlock == 0)
+	return ENOMEM;
+    Format_Argument_Block(argBlock, numArgs, argBlockAddr, command);
+
+    iflag = Begin_Int_Atomic();
+    for (offset = 0; offset < argBlockSize; offset += PAGE_SIZE) {
+	pte_t *entry = Get_User_PTE(userContext, argBlockAddr + offset, true);
+	void *paddr;
+
+	if (entry == 0 ||
+	    (paddr = Alloc_Pageable_Page(entry, USER_VM_START + argBlockAddr + offset)) == 0) {
+	    rc = ENOMEM;
+	    break;
+	}
+
+	/* Interrupts are still disabled, so the page can't be stolen yet */
+	memcpy(paddr, argBlock + offset, PAGE_SIZE);
+	entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(paddr);
+	entry->flags = VM_USER | VM_WRITE;
+	entry->present = 1;
+    }
+    End_Int_Atomic(iflag);
+
+    Free(argBlock);
+    return rc;
+}
+
+/*
+ * Drop one address space's reference to a copy-on-write frame,
+ * freeing it when no one is left using it.
+ * Interrupts must be disabled.
+ */
+static void Release_COW_Page(void *frame)
+{
+    struct Page *page = Get_Page((ulong_t) frame);
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(page->shareCount > 0);
+
+    if (--page->shareCount == 0)
+	Free_Page(frame);
+}
+
+/*
+ * Get the kernel address of given user address, faulting its page
+ * in and breaking copy-on-write sharing as needed.
+ * Interrupts must be disabled.
+ * Returns null if the address is invalid, or read-only and
+ * forWrite is set.
+ */
+static char *Map_User_Address(struct User_Context *userContext, ulong_t userAddr, bool forWrite)
+{
+    pte_t *entry;
+
+    KASSERT(!Interrupts_Enabled());
+
+    for (;;) {
+	entry = Get_User_PTE(userContext, userAddr, false);
+	if (entry == 0 || !entry->present) {
+	    if (Fault_In_Page(userContext, USER_VM_START + userAddr) != 0)
+		return 0;
+	} else if (forWrite && (entry->kernelInfo & KINFO_COW_PAGE)) {
+	    /* This may block, so look at the entry again afterwards */
+	    if (Copy_On_Write_Fault(userContext, userAddr) != 0)
+		return 0;
+	} else
+	    break;
+    }
+    if (forWrite && !(entry->flags & VM_WRITE))
+	return 0;
+
+    return (char*) (entry->pageBaseAddr << PAGE_POWER) + userAddr % PAGE_SIZE;
+}
+
+/*
+ * Copy between a kernel buffer and user memory, one page at a time.
+ * Each user page is faulted in if necessary, and copied with
+ * interrupts disabled so it can't be stolen in the middle.
+ */
+static bool Copy_User_Pages(ulong_t userAddr, char *kernelBuf, ulong_t numBytes, bool toUser)
+{
+    struct User_Context *userContext = g_currentThread->userContext;
+
+    if (userContext == 0 || userAddr >= USER_VM_SIZE || numBytes > USER_VM_SIZE - userAddr)
+	return false;
+
+    while (numBytes > 0) {
+	ulong_t offset = userAddr % PAGE_SIZE;
+	ulong_t count = PAGE_SIZE - offset;
+	char *addr;
+	bool iflag;
+
+	if (count > numBytes)
+	    count = numBytes;
+
+	iflag = Begin_Int_Atomic();
+	addr = Map_User_Address(userContext, userAddr, toUser);
+	if (addr == 0) {
+	    End_Int_Atomic(iflag);
+	    return false;
+	}
+	if (toUser)
+	    memcpy(addr, kernelBuf, count);
+	else
+	    memcpy(kernelBuf, addr, count);
+	End_Int_Atomic(iflag);
+
+	userAddr += count;
+	kernelBuf += count;
+	numBytes -= count;
+    }
+
+    return true;
+}
+
+/*
+ * Find the region containing given user address.
+ */
+static struct User_Region *Find_User_Region(struct User_Context *userContext, ulong_t userAddr)
+{
+    int i;
+
+    for (i = 0; i < userContext->numRegions; ++i) {
+	struct User_Region *region = &userContext->regionList[i];
+	if (userAddr >= region->start && userAddr < region->end)
+	    return region;
+    }
+    return 0;
+}
+
+/*
+ * Read the part of given region that lies in the user page at pageAddr
+ * from the executable into the (locked) page frame.
+ * Called with interrupts enabled.
+ */
+static int Read_Region_Data(struct User_Context *userContext, struct User_Region *region,
+    ulong_t pageAddr, char *frame)
+{
+    ulong_t from = (pageAddr > region->fileStart) ? pageAddr : region->fileStart;
+    ulong_t to = (pageAddr + PAGE_SIZE < region->fileEnd) ? pageAddr + PAGE_SIZE : region->fileEnd;
+    int rc = 0;
+
+    if (from >= to)
+	return 0;
+
+    Mutex_Lock(&userContext->exeLock);
+    rc = Seek(userContext->exeFile, region->offsetInFile + (from - region->fileStart));
+    if (rc == 0) {
+	rc = Read(userContext->exeFile, frame + (from - pageAddr), to - from);
+	if (rc >= 0)
+	    rc = (rc == to - from) ? 0 : ENOEXEC;
+    }
+    Mutex_Unlock(&userContext->exeLock);
+
+    return rc;
+}
 
 /*
  * Destroy a User_Context object, including all memory
@@ -33,23 +307,69 @@
  */
 void Destroy_User_Context(struct User_Context* context)
 {
-    /*
-     * Hints:
-     * - Free all pages, page tables, and page directory for
-     *   the process (interrupts must be disabled while you do this,
-     *   otherwise those pages could be stolen by other processes)
-     * - Free semaphores, files, and other resources used
-     *   by the process
-     */
-    TODO("Destroy User_Context data structure after process exits");
+    int i, j;
+    bool iflag;
+
+    KASSERT(context->refCount == 0);
+
+    iflag = Begin_Int_Atomic();
+
+    /* Don't keep running on a page directory we're about to free */
+    if (Get_PDBR() == context->pageDir)
+	Set_PDBR(g_kernelPageDir);
+
+    for (i = PAGE_DIRECTORY_INDEX(USER_VM_START); i < NUM_PAGE_DIR_ENTRIES; ++i) {
+	pde_t *pde = &context->pageDir[i];
+	pte_t *pageTable;
+
+	if (!pde->present)
+	    continue;
+
+	pageTable = (pte_t*) (pde->pageTableBaseAddr << PAGE_POWER);
+	for (j = 0; j < NUM_PAGE_TABLE_ENTRIES; ++j) {
+	    pte_t *entry = &pageTable[j];
+
+	    if (entry->present) {
+		/* Shared text frames belong to the text cache */
+		if (entry->kernelInfo & KINFO_COW_PAGE)
+		    Release_COW_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+		else if (!(entry->kernelInfo & KINFO_SHARED_PAGE))
+		    Free_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+	    }
+	    else if (entry->kernelInfo == KINFO_PAGE_ON_DISK)
+		Free_Space_On_Paging_File(entry->pageBaseAddr);
+	    else if (entry->kernelInfo == KINFO_PAGE_IN_TRANSIT)
+		/* Locked; whoever is doing the I/O finishes freeing it */
+		Free_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+	}
+	Free_Page(pageTable);
+    }
+    Free_Page(context->pageDir);
+
+    Free_Segment_Descriptor(context->ldtDescriptor);
+
+    End_Int_Atomic(iflag);
+
+    for (i = 0; i < context->numRegions; ++i) {
+	if (context->regionList[i].textCache != 0)
+	    Release_Text_Cache_Entry(context->regionList[i].textCache);
+    }
+
+    Destroy_File_Table(&context->fileTable);
+    if (context->exeFile != 0)
+	Close(context->exeFile);
+
+    Free(context);
 }
 
 /*
  * Load a user executable into memory by creating a User_Context
- * data structure.
+ * data structure.  The text and data segments are not read in
+ * here: they are set up as regions which the page fault handler
+ * fills in from the executable file on first touch.
  * Params:
- * exeFileData - a buffer containing the executable to load
- * exeFileLength - number of bytes in exeFileData
+ * exeFile - the executable file; on success, the User_Context
+ *   takes ownership of it
  * exeFormat - parsed ELF segment information describing how to
  *   load the executable's text and data segments, and the
  *   code entry point address
@@ -62,21 +382,499 @@ void Destroy_User_Context(struct User_Context* context)
  * Returns:
  *   0 if successful, or an error code (< 0) if unsuccessful
  */
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext)
 {
+    struct User_Context *userContext;
+    unsigned numArgs;
+    ulong_t argBlockSize, argBlockAddr, stackAddr, stackLimit;
+    int i, rc;
+
+    Get_Argument_Block_Size(command, &numArgs, &argBlockSize);
+    argBlockAddr = USER_VM_SIZE - Round_Up_To_Page(argBlockSize);
+    stackAddr = argBlockAddr - DEFAULT_USER_STACK_SIZE;
+
+    /* Leave room below the initial stack for thread stacks */
+    stackLimit = stackAddr - (USER_MAX_THREADS - 1) * USER_THREAD_STACK_STRIDE;
+
+    userContext = Create_User_Context();
+    if (userContext == 0)
+	return ENOMEM;
+
+    for (i = 0; i < exeFormat->numSegments; ++i) {
+	struct Exe_Segment *segment = &exeFormat->segmentList[i];
+
+	if (segment->startAddress + segment->sizeInMemory > stackLimit) {
+	    rc = ENOEXEC;
+	    goto fail;
+	}
+	rc = Add_User_Region(userContext, segment->startAddress, segment->sizeInMemory,
+	    segment->offsetInFile, segment->lengthInFile, segment->protFlags);
+	if (rc != 0)
+	    goto fail;
+    }
+
     /*
-     * Hints:
-     * - This will be similar to the same function in userseg.c
-     * - Determine space requirements for code, data, argument block,
-     *   and stack
-     * - Allocate pages for above, map them into user address
-     *   space (allocating page directory and page tables as needed)
-     * - Fill in initial stack pointer, argument block address,
-     *   and code entry point fields in User_Context
+     * The stack is zero-filled on demand.  The region extends over
+     * the argument block, which is mapped below.
      */
-    TODO("Load user program into address space");
+    rc = Add_User_Region(userContext, stackAddr, USER_VM_SIZE - stackAddr, 0, 0, VM_READ | VM_WRITE);
+    if (rc != 0)
+	goto fail;
+
+    rc = Map_Argument_Block(userContext, argBlockAddr, numArgs, argBlockSize, command);
+    if (rc != 0)
+	goto fail;
+
+    userContext->exeFile = exeFile;
+    userContext->entryAddr = exeFormat->entryAddr;
+    userContext->argBlockAddr = argBlockAddr;
+    userContext->stackPointerAddr = argBlockAddr;
+    userContext->threadStackBase = stackAddr;
+    userContext->threadStackUsed[0] = true;
+
+    *pUserContext = userContext;
+    return 0;
+
+fail:
+    Destroy_User_Context(userContext);
+    return rc;
+}
+
+/*
+ * Attach the process's read-only text to the shared text cache,
+ * so its pages are shared with other processes running the
+ * same executable.  If this fails, the process just gets private
+ * copies of its text pages.
+ */
+void Attach_Text_Cache(struct User_Context *userContext, const char *path,
+    ulong_t fileSize, ulong_t crc)
+{
+    int i;
+
+    for (i = 0; i < userContext->numRegions; ++i) {
+	struct User_Region *region = &userContext->regionList[i];
+
+	if ((region->protFlags & VM_WRITE) || region->fileStart == region->fileEnd)
+	    continue;
+	region->textCache = Get_Text_Cache_Entry(path, fileSize, crc, region->start, region->end);
+	break;
+    }
+}
+
+/*
+ * Fill in a (locked) frame for the user page at pageAddr with
+ * the data of every region overlapping it; adjacent segments
+ * may share a page.
+ * Called with interrupts enabled.
+ */
+static int Fill_User_Page(struct User_Context *userContext, ulong_t pageAddr, char *frame)
+{
+    int i, rc = 0;
+
+    memset(frame, '\0', PAGE_SIZE);
+    for (i = 0; i < userContext->numRegions && rc == 0; ++i) {
+	struct User_Region *region = &userContext->regionList[i];
+
+	if (pageAddr >= region->start && pageAddr < region->end)
+	    rc = Read_Region_Data(userContext, region, pageAddr, frame);
+    }
+    return rc;
+}
+
+/*
+ * Get the shared text cache entry for the page at pageAddr, if
+ * the page can be shared: it must only be part of read-only regions.
+ */
+static struct Text_Cache_Entry *Get_Shared_Text(struct User_Context *userContext, ulong_t pageAddr)
+{
+    struct Text_Cache_Entry *textCache = 0;
+    int i;
+
+    for (i = 0; i < userContext->numRegions; ++i) {
+	struct User_Region *region = &userContext->regionList[i];
+
+	if (pageAddr < region->start || pageAddr >= region->end)
+	    continue;
+	if (region->protFlags & VM_WRITE)
+	    return 0;
+	if (region->textCache != 0)
+	    textCache = region->textCache;
+    }
+    return textCache;
+}
+
+/*
+ * Map a page of shared text, loading it into the text cache
+ * if no other process has yet.
+ * Interrupts must be disabled.
+ */
+static int Map_Shared_Text_Page(struct User_Context *userContext, struct Text_Cache_Entry *textCache,
+    ulong_t pageAddr, pte_t *entry)
+{
+    void *frame;
+
+    frame = Lookup_Text_Page(textCache, pageAddr);
+    if (frame == 0) {
+	int rc;
+
+	/* Cached text isn't pageable, so this is an ordinary page */
+	frame = Alloc_Page();
+	if (frame == 0)
+	    return ENOMEM;
+
+	Enable_Interrupts();
+	rc = Fill_User_Page(userContext, pageAddr, frame);
+	Disable_Interrupts();
+
+	if (rc != 0) {
+	    Free_Page(frame);
+	    return rc;
+	}
+	frame = Install_Text_Page(textCache, pageAddr, frame);
+    }
+
+    if (!entry->present) {
+	entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(frame);
+	entry->flags = VM_USER;
+	entry->kernelInfo = KINFO_SHARED_PAGE;
+	entry->present = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fill in the page containing given user address, if it belongs
+ * to one of the process's demand-loaded regions.
+ * Called from the page fault handler with interrupts disabled.
+ * Returns 0 if the page was mapped, or an error code if the
+ * address is invalid or the page could not be loaded.
+ */
+int Page_In_User_Region(struct User_Context *userContext, ulong_t userAddr)
+{
+    ulong_t pageAddr = Round_Down_To_Page(userAddr);
+    struct Text_Cache_Entry *textCache;
+    struct Page *page;
+    pte_t *entry;
+    void *paddr;
+    int i, flags = VM_USER, rc;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (Find_User_Region(userContext, userAddr) == 0)
+	return EINVALID;
+
+    entry = Get_User_PTE(userContext, pageAddr, true);
+    if (entry == 0)
+	return ENOMEM;
+
+    textCache = Get_Shared_Text(userContext, pageAddr);
+    if (textCache != 0)
+	return Map_Shared_Text_Page(userContext, textCache, pageAddr, entry);
+
+    paddr = Alloc_Pageable_Page(entry, USER_VM_START + pageAddr);
+    if (paddr == 0)
+	return ENOMEM;
+
+    /* Keep the frame from being stolen while we fill it */
+    page = Get_Page((ulong_t) paddr);
+    page->flags &= ~(PAGE_PAGEABLE);
+    page->flags |= PAGE_LOCKED;
+
+    Enable_Interrupts();
+    rc = Fill_User_Page(userContext, pageAddr, paddr);
+    Disable_Interrupts();
+
+    page->flags &= ~(PAGE_LOCKED);
+    if (rc != 0 || entry->present) {
+	/* Failed, or someone else mapped the page while we were reading */
+	Free_Page(paddr);
+	return rc;
+    }
+
+    for (i = 0; i < userContext->numRegions; ++i) {
+	struct User_Region *region = &userContext->regionList[i];
+	if (pageAddr >= region->start && pageAddr < region->end && (region->protFlags & VM_WRITE))
+	    flags |= VM_WRITE;
+    }
+
+    page->flags |= PAGE_PAGEABLE;
+    entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(paddr);
+    entry->flags = flags;
+    entry->present = 1;
+
+    return 0;
+}
+
+/*
+ * Handle a write to a copy-on-write page: give the process
+ * its own copy, or if it is the last one sharing the frame,
+ * just make the page writable again.
+ * Interrupts must be disabled.
+ * Returns 0 if successful (or if another thread got there
+ * first), or an error code if the page may not be written.
+ */
+int Copy_On_Write_Fault(struct User_Context *userContext, ulong_t userAddr)
+{
+    ulong_t pageAddr = Round_Down_To_Page(userAddr);
+    struct User_Region *region;
+    struct Page *page;
+    pte_t *entry;
+    void *frame, *copy;
+
+    KASSERT(!Interrupts_Enabled());
+
+    region = Find_User_Region(userContext, userAddr);
+    if (region == 0 || !(region->protFlags & VM_WRITE))
+	return EACCESS;
+
+    entry = Get_User_PTE(userContext, pageAddr, false);
+    if (entry == 0 || !entry->present || !(entry->kernelInfo & KINFO_COW_PAGE))
+	return EACCESS;
+    frame = (void*) (entry->pageBaseAddr << PAGE_POWER);
+    page = Get_Page((ulong_t) frame);
+
+    if (page->shareCount > 1) {
+	/* The shared frame isn't pageable, so it stays put if we block here */
+	copy = Alloc_Pageable_Page(entry, USER_VM_START + pageAddr);
+	if (copy == 0)
+	    return ENOMEM;
+
+	/* Another thread of the process may have handled the fault meanwhile */
+	if (!entry->present || !(entry->kernelInfo & KINFO_COW_PAGE) ||
+	    entry->pageBaseAddr != PAGE_ALLIGNED_ADDR(frame)) {
+	    Free_Page(copy);
+	    return 0;
+	}
+
+	memcpy(copy, frame, PAGE_SIZE);
+	Release_COW_Page(frame);
+	entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(copy);
+    } else {
+	/* We're the only one left: take the frame back */
+	page->shareCount = 0;
+	page->entry = entry;
+	page->vaddr = USER_VM_START + pageAddr;
+	page->flags |= PAGE_PAGEABLE;
+    }
+
+    entry->kernelInfo = 0;
+    entry->flags |= VM_WRITE;
+
+    /* XXX - flush TLB should only flush the one page */
+    Flush_TLB();
+
+    return 0;
+}
+
+/*
+ * Share a present private page of the parent with the child,
+ * copy-on-write.  Interrupts must be disabled.
+ */
+static void Share_COW_Page(pte_t *parentEntry, pte_t *childEntry)
+{
+    struct Page *page = Get_Page(parentEntry->pageBaseAddr << PAGE_POWER);
+
+    if (!(parentEntry->kernelInfo & KINFO_COW_PAGE)) {
+	/*
+	 * The frame has more than one page table entry now, which the
+	 * pageout code can't deal with, so it isn't pageable until
+	 * it's private again.
+	 */
+	page->flags &= ~(PAGE_PAGEABLE);
+	page->shareCount = 1;
+	parentEntry->kernelInfo = KINFO_COW_PAGE;
+	parentEntry->flags &= ~(VM_WRITE);
+    }
+
+    ++page->shareCount;
+    *childEntry = *parentEntry;
+}
+
+/*
+ * Create a copy of the parent's address space for a child process.
+ * Pages the parent has touched are shared copy-on-write; everything
+ * else is left for the child to demand-load itself.
+ * Must be called with interrupts enabled, from the parent process.
+ * Returns 0 if successful, or an error code.
+ */
+int Clone_User_Context(struct User_Context *parent, struct User_Context **pChild)
+{
+    struct User_Context *child;
+    int i, j, rc = 0;
+
+    KASSERT(g_currentThread->userContext == parent);
+
+    child = Create_User_Context();
+    if (child == 0)
+	return ENOMEM;
+
+    memcpy(child->regionList, parent->regionList, sizeof(parent->regionList));
+    child->numRegions = parent->numRegions;
+    for (i = 0; i < child->numRegions; ++i) {
+	if (child->regionList[i].textCache != 0)
+	    Add_Text_Cache_Ref(child->regionList[i].textCache);
+    }
+
+    /* The executable's file position is guarded by each process's exeLock */
+    if ((rc = Copy_File(parent->exeFile, &child->exeFile)) != 0)
+	goto fail;
+    if ((rc = Clone_File_Table(&parent->fileTable, &child->fileTable)) != 0)
+	goto fail;
+
+    Disable_Interrupts();
+    for (i = PAGE_DIRECTORY_INDEX(USER_VM_START); i < NUM_PAGE_DIR_ENTRIES && rc == 0; ++i) {
+	pte_t *parentTable, *childTable = 0;
+
+	if (!parent->pageDir[i].present)
+	    continue;
+	parentTable = (pte_t*) (parent->pageDir[i].pageTableBaseAddr << PAGE_POWER);
+
+	for (j = 0; j < NUM_PAGE_TABLE_ENTRIES; ++j) {
+	    pte_t *entry = &parentTable[j];
+	    ulong_t linearAddr = (i << 22) | (j << PAGE_POWER);
+
+	    /*
+	     * Pages in the paging file, or on their way to or from it,
+	     * are brought back in so they can be shared.
+	     */
+	    while (rc == 0) {
+		if (!entry->present && (entry->kernelInfo == KINFO_PAGE_ON_DISK ||
+					entry->kernelInfo == KINFO_PAGE_IN_TRANSIT))
+		    rc = Fault_In_Page(parent, linearAddr);
+		else if (entry->present &&
+			 ((Get_Page(entry->pageBaseAddr << PAGE_POWER)->flags & PAGE_LOCKED) ||
+			  Get_Page(entry->pageBaseAddr << PAGE_POWER)->pinCount > 0)) {
+		    Enable_Interrupts();
+		    Yield();
+		    Disable_Interrupts();
+		} else
+		    break;
+	    }
+	    if (rc != 0)
+		break;
+	    if (!entry->present)
+		continue;
+
+	    if (childTable == 0) {
+		childTable = (pte_t*) Alloc_Page();
+		if (childTable == 0) {
+		    rc = ENOMEM;
+		    break;
+		}
+		memset(childTable, '\0', PAGE_SIZE);
+		child->pageDir[i] = parent->pageDir[i];
+		child->pageDir[i].pageTableBaseAddr = PAGE_ALLIGNED_ADDR(childTable);
+	    }
+
+	    if (entry->kernelInfo & KINFO_SHARED_PAGE)
+		childTable[j] = *entry;
+	    else
+		Share_COW_Page(entry, &childTable[j]);
+	}
+    }
+
+    /* The parent lost write access to its shared pages */
+    Flush_TLB();
+    Enable_Interrupts();
+
+    if (rc != 0)
+	goto fail;
+
+    child->entryAddr = parent->entryAddr;
+    child->argBlockAddr = parent->argBlockAddr;
+    child->stackPointerAddr = parent->stackPointerAddr;
+
+    /* Only the calling thread is copied, so only its stack is in use */
+    child->threadStackBase = parent->threadStackBase;
+    child->threadStackUsed[g_currentThread->userStackSlot] = true;
+
+    *pChild = child;
+    return 0;
+
+fail:
+    Destroy_User_Context(child);
+    return rc;
+}
+
+/*
+ * Reserve a stack for a new thread in given user context.
+ * The stack region is demand-zeroed like the initial stack.
+ * Returns 0 if successful, with the slot number and the (user)
+ * address of the top of the stack stored in *pSlot and *pStackTop,
+ * or an error code if all slots are taken.
+ */
+int Alloc_User_Thread_Stack(struct User_Context *userContext, int *pSlot, ulong_t *pStackTop)
+{
+    ulong_t start;
+    int slot, rc = 0;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+
+    for (slot = 1; slot < USER_MAX_THREADS; ++slot) {
+	if (!userContext->threadStackUsed[slot])
+	    break;
+    }
+    if (slot == USER_MAX_THREADS) {
+	rc = ENOMEM;
+	goto done;
+    }
+
+    /* The region stays in place after the slot's first thread exits */
+    start = userContext->threadStackBase - slot * USER_THREAD_STACK_STRIDE;
+    if (Find_User_Region(userContext, start) == 0 &&
+	(rc = Add_User_Region(userContext, start, USER_THREAD_STACK_SIZE, 0, 0, VM_READ | VM_WRITE)) != 0)
+	goto done;
+
+    userContext->threadStackUsed[slot] = true;
+    *pSlot = slot;
+    *pStackTop = start + USER_THREAD_STACK_SIZE;
+
+done:
+    End_Int_Atomic(iflag);
+    return rc;
+}
+
+/*
+ * Release a thread stack slot, freeing the memory
+ * that was used for the stack.
+ */
+void Free_User_Thread_Stack(struct User_Context *userContext, int slot)
+{
+    ulong_t start, addr;
+    bool iflag;
+
+    KASSERT(slot > 0 && slot < USER_MAX_THREADS);
+
+    start = userContext->threadStackBase - slot * USER_THREAD_STACK_STRIDE;
+
+    iflag = Begin_Int_Atomic();
+
+    for (addr = start; addr < start + USER_THREAD_STACK_SIZE; addr += PAGE_SIZE) {
+	pte_t *entry = Get_User_PTE(userContext, addr, false);
+
+	if (entry == 0)
+	    continue;
+	if (entry->present) {
+	    if (entry->kernelInfo & KINFO_COW_PAGE)
+		Release_COW_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+	    else
+		Free_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+	}
+	else if (entry->kernelInfo == KINFO_PAGE_ON_DISK)
+	    Free_Space_On_Paging_File(entry->pageBaseAddr);
+	else if (entry->kernelInfo == KINFO_PAGE_IN_TRANSIT)
+	    Free_Page((void*) (entry->pageBaseAddr << PAGE_POWER));
+	memset(entry, '\0', sizeof(*entry));
+    }
+    Flush_TLB();
+
+    userContext->threadStackUsed[slot] = false;
+
+    End_Int_Atomic(iflag);
 }
 
 /*
@@ -85,25 +883,7 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
  */
 bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t numBytes)
 {
-    /*
-     * Hints:
-     * - Make sure that user page is part of a valid region
-     *   of memory
-     * - Remember that you need to add 0x80000000 to user addresses
-     *   to convert them to kernel addresses, because of how the
-     *   user code and data segments are defined
-     * - User pages may need to be paged in from disk before being accessed.
-     * - Before you touch (read or write) any data in a user
-     *   page, **disable the PAGE_PAGEABLE bit**.
-     *
-     * Be very careful with race conditions in reading a page from disk.
-     * Kernel code must always assume that if the struct Page for
-     * a page of memory has the PAGE_PAGEABLE bit set,
-     * IT CAN BE STOLEN AT ANY TIME.  The only exception is if
-     * interrupts are disabled; because no other process can run,
-     * the page is guaranteed not to be stolen.
-     */
-    TODO("Copy user data to kernel buffer");
+    return Copy_User_Pages(srcInUser, destInKernel, numBytes, false);
 }
 
 /*
@@ -112,13 +892,50 @@ bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t numBytes)
  */
 bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t numBytes)
 {
-    /*
-     * Hints:
-     * - Same as for Copy_From_User()
-     * - Also, make sure the memory is mapped into the user
-     *   address space with write permission enabled
-     */
-    TODO("Copy kernel data to user buffer");
+    return Copy_User_Pages(destInUser, srcInKernel, numBytes, true);
+}
+
+/*
+ * Pin the page holding given user address, so the kernel can
+ * read or write it directly, even while blocked, instead of
+ * copying through a buffer of its own.  Release it with
+ * Unpin_User_Page().  Called with interrupts enabled.
+ * Returns the kernel address corresponding to userAddr, or null
+ * if the address is invalid (or read-only, when forWrite is set).
+ * Only the bytes up to the end of the page may be accessed.
+ */
+void *Pin_User_Page(ulong_t userAddr, bool forWrite)
+{
+    struct User_Context *userContext = g_currentThread->userContext;
+    char *addr;
+
+    KASSERT(Interrupts_Enabled());
+
+    if (userContext == 0 || userAddr >= USER_VM_SIZE)
+	return 0;
+
+    Disable_Interrupts();
+
+    /* A page being written to the paging file is about to lose its frame */
+    while ((addr = Map_User_Address(userContext, userAddr, forWrite)) != 0 &&
+	   (Get_Page((ulong_t) addr)->flags & PAGE_LOCKED)) {
+	Enable_Interrupts();
+	Yield();
+	Disable_Interrupts();
+    }
+    if (addr != 0)
+	Pin_Page(Get_Page((ulong_t) addr));
+
+    Enable_Interrupts();
+    return addr;
+}
+
+/*
+ * Release a page pinned by Pin_User_Page().
+ */
+void Unpin_User_Page(void *kernelAddr)
+{
+    Unpin_Page(Get_Page((ulong_t) kernelAddr));
 }
 
 /*
@@ -126,12 +943,15 @@ bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t numBytes)
  */
 void Switch_To_Address_Space(struct User_Context *userContext)
 {
-    /*
-     * - If you are still using an LDT to define your user code and data
-     *   segments, switch to the process's LDT
-     * - 
-     */
-    TODO("Switch_To_Address_Space() using paging");
+    ushort_t ldtSelector = userContext->ldtSelector;
+
+    __asm__ __volatile__ (
+	"lldt %0"
+	:
+	: "a" (ldtSelector)
+    );
+
+    Set_PDBR(userContext->pageDir);
 }
 
 
@@ -9,11 +9,14 @@
  */
 
 #include <geekos/errno.h>
+#include <geekos/int.h>
 #include <geekos/list.h>
 #include <geekos/string.h>
 #include <geekos/screen.h>
 #include <geekos/malloc.h>
 #include <geekos/synch.h>
+#include <geekos/klog.h>
+#include <geekos/textcache.h>
 #include <geekos/vfs.h>
 
 /*
@@ -34,7 +37,7 @@
 static struct Mutex s_vfsLock;
 
 int debugVFS = 0;
-#define Debug(args...) if (debugVFS) Print("VFS: " args)
+#define Debug(args...) if (debugVFS) Log(LOG_DEBUG, "VFS: " args)
 
 struct Filesystem;
 
@@ -383,13 +386,20 @@ fail:
  */
 int Open(const char *path, int mode, struct File **pFile)
 {
-    int rc = Do_Open(path, mode, pFile, &Do_Open_File);
+    int rc;
+
+    /* Processes started from now on must not see stale text */
+    if (mode & O_WRITE)
+	Invalidate_Text_Cache(path);
+
+    rc = Do_Open(path, mode, pFile, &Do_Open_File);
     /*if (rc != 0) { Print("File open failed with code %d\n", rc); }*/
     return rc;
 }
 
 /*
- * Close a file or directory.  This will destroy the file object,
+ * Close a file or directory.  This drops one reference to the
+ * file object, and destroys it when the last reference is gone,
  * so it is important not to use the file again after this function
  * is called.
  * Params:
@@ -399,9 +409,17 @@ int Open(const char *path, int mode, struct File **pFile)
 int Close(struct File *file)
 {
     int rc;
+    bool iflag;
 
     KASSERT(file->ops->Close != 0); /* All filesystems must implement Close(). */
 
+    iflag = Begin_Int_Atomic();
+    KASSERT(file->refCount > 0);
+    rc = --file->refCount;
+    End_Int_Atomic(iflag);
+    if (rc > 0)
+	return 0;
+
     rc = file->ops->Close(file);
     if (rc == 0)
 	Free(file);
@@ -485,6 +503,7 @@ struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *
 	file->fsData = fsData;
 	file->mode = mode;
 	file->mountPoint = mountPoint;
+	file->refCount = 1;
     }
     return file;
 }
@@ -609,9 +628,10 @@ fail:
 
 /*
  * Clone given file.
- * This makes a new File object which accesses the same
- * underlying data source as the original File.
- * This operation is used when spawning a new process -
+ * This adds a reference to the File object, which is then shared
+ * (including the file position) by the holders of the original
+ * and the clone; it stays open until each of them calls Close().
+ * This operation is used when spawning or forking a new process -
  * the parent may specify open files for the child to
  * inherit as its standard input and output descriptors.
  * Params:
@@ -621,11 +641,33 @@ fail:
  * Returns: 0 if successful, error code (< 0) if not
  */
 int Clone_File(struct File *file, struct File **pClone)
+{
+    bool iflag = Begin_Int_Atomic();
+    KASSERT(file->refCount > 0);
+    ++file->refCount;
+    End_Int_Atomic(iflag);
+
+    *pClone = file;
+    return 0;
+}
+
+/*
+ * Copy given file.
+ * This makes a new File object which accesses the same
+ * underlying data source as the original File, but has
+ * its own file position.
+ * Params:
+ *   file - the File object
+ *   pCopy - reference to variable where pointer where the
+ *     new File should be stored
+ * Returns: 0 if successful, error code (< 0) if not
+ */
+int Copy_File(struct File *file, struct File **pCopy)
 {
     if (file->ops->Clone == 0)
 	return EUNSUPPORTED;
     else
-	return file->ops->Clone(file, pClone);
+	return file->ops->Clone(file, pCopy);
 }
 
 /*
@@ -678,8 +720,9 @@ int Delete(const char *path)
 
     if (mountPoint->ops->Delete == 0)
 	return EUNSUPPORTED;
-    else
-	return mountPoint->ops->Delete(mountPoint, suffix);
+
+    Invalidate_Text_Cache(path);
+    return mountPoint->ops->Delete(mountPoint, suffix);
 }
 
 /*
@@ -0,0 +1,2925 @@
+/*
+ * Extent-based GeekOS filesystem
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <limits.h>
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/malloc.h>
+#include <geekos/mem.h>
+#include <geekos/string.h>
+#include <geekos/list.h>
+#include <geekos/synch.h>
+#include <geekos/kthread.h>
+#include <geekos/blockdev.h>
+#include <geekos/bufcache.h>
+#include <geekos/vfs.h>
+#include <geekos/klog.h>
+#include <geekos/xgosfs.h>
+
+/* ----------------------------------------------------------------------
+ * Private data and functions
+ * ---------------------------------------------------------------------- */
+
+int debugXGOSFS = 0;
+#define Debug(args...) if (debugXGOSFS) Log(LOG_DEBUG, "XGOSFS: " args)
+
+/*
+ * If set, XGOSFS_Format() writes only the part of the inode table
+ * holding the root, and the rest is zeroed in the background once
+ * the filesystem is mounted.
+ */
+int lazyInitXGOSFS = 1;
+
+/*
+ * Runs of whole blocks are read straight into the caller's
+ * buffer, rather than through the buffer cache, with requests
+ * of at most this many blocks.
+ */
+#define XGOSFS_MAX_READ_BLOCKS	16
+
+/* Deepest extent tree we will follow; enough for any disk. */
+#define XGOSFS_MAX_TREE_DEPTH	4
+
+/*
+ * Data written past the last block of a file is held in memory,
+ * up to this many blocks, and only given disk blocks when it is
+ * written back, so they can all be allocated in one run.
+ */
+#define XGOSFS_MAX_DELAYED_BLOCKS	32
+
+/*
+ * Most metadata blocks in a transaction.  A transaction is
+ * committed at the end of an operation once it has changed
+ * XGOSFS_COMMIT_BLOCKS blocks.  An operation that changes more
+ * is split: before each step that changes metadata, which never
+ * changes more than XGOSFS_MAX_STEP_BLOCKS blocks, the transaction
+ * is committed if the step might not fit.  The journal is written
+ * from a buffer big enough for the largest transaction, which
+ * comes from the kernel heap.
+ */
+#define XGOSFS_MAX_TRANSACTION_BLOCKS	30
+#define XGOSFS_COMMIT_BLOCKS		15
+#define XGOSFS_MAX_STEP_BLOCKS		12
+
+/* Most runs of blocks freed by a transaction before it is committed. */
+#define XGOSFS_MAX_PENDING_FREES	32
+
+struct XGOSFS_Node;
+DEFINE_LIST(XGOSFS_Node_List, XGOSFS_Node);
+
+struct XGOSFS_Free_Run {
+    ulong_t start, count;
+};
+
+/*
+ * In-memory information describing a mounted filesystem.
+ * This is kept in the fsData field of the Mount_Point.
+ * The lock serializes all operations on the filesystem.
+ */
+struct XGOSFS_Instance {
+    struct XGOSFS_Superblock super;
+    ulong_t freeBlocks;			 /* Number of free blocks */
+    ulong_t freeInodes;			 /* Number of free inodes */
+    ulong_t delayedBlocks;		 /* Free blocks promised to delayed writes */
+    struct FS_Buffer_Cache *cache;
+    struct Mutex lock;
+    struct XGOSFS_Node_List nodeList;	 /* Files and directories in use */
+
+    /* The running transaction */
+    struct FS_Buffer *txBuffers[XGOSFS_MAX_TRANSACTION_BLOCKS];
+    uint_t txCount;
+    struct XGOSFS_Free_Run pendingFrees[XGOSFS_MAX_PENDING_FREES];
+    uint_t numPendingFrees;
+
+    bool freedJournaled;		 /* Pending frees include metadata blocks */
+    bool inStep;			 /* In a step that must not be split */
+
+    ulong_t journalHead;		 /* Where the next transaction goes in the log */
+    ulong_t journalSequence;		 /* Number of the next transaction */
+    void *journalBuf;
+};
+
+/*
+ * In-memory copy of the inode of a file or directory in use,
+ * shared by all File objects open on it.  A node deleted while
+ * in use keeps its inode and blocks until it is released for
+ * the last time.  Kept in fsData field of File.
+ *
+ * Blocks numBlocks..numBlocks+numDelayed-1 of the file, where
+ * numBlocks is the number in its extent map, have no disk blocks
+ * yet; their data is in the pages in delayed.
+ */
+struct XGOSFS_Node {
+    struct XGOSFS_Inode inode;
+    ulong_t inodeNum;
+    void *delayed[XGOSFS_MAX_DELAYED_BLOCKS];
+    uint_t numDelayed;
+    int refCount;
+    bool deleted;
+    DEFINE_LINK(XGOSFS_Node_List, XGOSFS_Node);
+};
+IMPLEMENT_LIST(XGOSFS_Node_List, XGOSFS_Node);
+
+#define IS_DIRECTORY(inode) (((inode)->flags & XGOSFS_INODE_ISDIRECTORY) != 0)
+#define IS_INLINE(inode) (((inode)->flags & XGOSFS_INODE_INLINE) != 0)
+
+/*
+ * Block number of the first block after the metadata at the
+ * start of the filesystem.
+ */
+static __inline__ ulong_t First_Data_Block(struct XGOSFS_Instance *instance)
+{
+    return instance->super.journalStart + instance->super.journalBlocks;
+}
+
+static int Commit_Transaction(struct XGOSFS_Instance *instance);
+
+/*
+ * Mark a buffer holding metadata as modified.  The block becomes
+ * part of the running transaction, and its buffer is pinned in
+ * the cache until the transaction has been written to the journal.
+ */
+static void Modify_Metadata(struct XGOSFS_Instance *instance, struct FS_Buffer *buf)
+{
+    Modify_FS_Buffer(instance->cache, buf);
+    if (buf->flags & FS_BUFFER_PINNED)
+	return;
+
+    KASSERT(instance->txCount < XGOSFS_MAX_TRANSACTION_BLOCKS);
+    Pin_FS_Buffer(instance->cache, buf);
+    instance->txBuffers[instance->txCount++] = buf;
+}
+
+/*
+ * Called before each step of an operation that changes metadata,
+ * at which the allocation structures are consistent: make sure
+ * the running transaction has room for the step.  A crash between
+ * steps of an operation split this way may leak blocks or inodes,
+ * but never lets them be allocated twice.
+ */
+static void Begin_Step(struct XGOSFS_Instance *instance)
+{
+    if (!instance->inStep && instance->txCount > XGOSFS_MAX_TRANSACTION_BLOCKS - XGOSFS_MAX_STEP_BLOCKS) {
+	Debug("Committing in mid-operation\n");
+	Commit_Transaction(instance);
+    }
+}
+
+/*
+ * Get the buffer holding the descriptor of given allocation group.
+ */
+static int Get_Group(struct XGOSFS_Instance *instance, ulong_t group,
+    struct FS_Buffer **pBuf, struct XGOSFS_Group **pGroup)
+{
+    int rc;
+
+    KASSERT(group < instance->super.numGroups);
+    rc = Get_FS_Buffer(instance->cache, instance->super.groupStart + group / XGOSFS_GROUPS_PER_BLOCK, pBuf);
+    if (rc != 0)
+	return rc;
+    *pGroup = (struct XGOSFS_Group*) (*pBuf)->data + group % XGOSFS_GROUPS_PER_BLOCK;
+    return 0;
+}
+
+/*
+ * Find the first clear bit in [from, last) of the bitmap starting
+ * at block bitmapStart, and set it and up to count-1 clear bits
+ * following it.  The range must be in a single bitmap block.
+ * *pLen is set to the number of bits set, 0 if none were clear.
+ */
+static int Scan_Bitmap(struct XGOSFS_Instance *instance, ulong_t bitmapStart,
+    ulong_t from, ulong_t last, ulong_t count, ulong_t *pBit, ulong_t *pLen)
+{
+    ulong_t base = from - from % XGOSFS_BITS_PER_BLOCK;
+    ulong_t bit = from - base, end = last - base, len = 0;
+    struct FS_Buffer *buf;
+    uchar_t *bits;
+    int rc;
+
+    KASSERT(end <= XGOSFS_BITS_PER_BLOCK);
+
+    if ((rc = Get_FS_Buffer(instance->cache, bitmapStart + base / XGOSFS_BITS_PER_BLOCK, &buf)) != 0)
+	return rc;
+    bits = (uchar_t*) buf->data;
+
+    while (bit < end) {
+	if (bit % 8 == 0 && bits[bit / 8] == 0xff) {
+	    /* Skip a whole byte of set bits */
+	    bit += 8;
+	    continue;
+	}
+	if ((bits[bit / 8] & (1 << (bit % 8))) == 0)
+	    break;
+	++bit;
+    }
+
+    *pBit = base + bit;
+    while (bit < end && len < count && (bits[bit / 8] & (1 << (bit % 8))) == 0) {
+	bits[bit / 8] |= 1 << (bit % 8);
+	++bit;
+	++len;
+    }
+    if (len > 0)
+	Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    *pLen = len;
+    return 0;
+}
+
+/*
+ * Clear bits [start, start+count) of the bitmap starting at block
+ * bitmapStart, all in a single bitmap block, and return the number
+ * that were set.
+ */
+static int Clear_Bits(struct XGOSFS_Instance *instance, ulong_t bitmapStart,
+    ulong_t start, ulong_t count, ulong_t *pCleared)
+{
+    struct FS_Buffer *buf;
+    uchar_t *bits;
+    ulong_t n;
+    int rc;
+
+    rc = Get_FS_Buffer(instance->cache, bitmapStart + start / XGOSFS_BITS_PER_BLOCK, &buf);
+    if (rc != 0)
+	return rc;
+    bits = (uchar_t*) buf->data;
+
+    *pCleared = 0;
+    for (n = start % XGOSFS_BITS_PER_BLOCK; n < start % XGOSFS_BITS_PER_BLOCK + count; ++n) {
+	if ((bits[n / 8] & (1 << (n % 8))) == 0) {
+	    Log(LOG_WARN, "XGOSFS: bit %lu of bitmap at block %lu freed twice\n",
+		start - start % XGOSFS_BITS_PER_BLOCK + n, bitmapStart);
+	    continue;
+	}
+	bits[n / 8] &= ~(1 << (n % 8));
+	++*pCleared;
+    }
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Allocate a run of up to count free blocks, starting with the first
+ * free one at or after goal.  Groups with no free blocks are skipped
+ * without looking at their bitmaps.  No run is longer than what is
+ * left of the group it starts in.
+ */
+static int Alloc_Blocks(struct XGOSFS_Instance *instance, ulong_t goal, ulong_t count,
+    ulong_t *pStart, ulong_t *pLen)
+{
+    struct XGOSFS_Superblock *super = &instance->super;
+    ulong_t first = goal / super->blocksPerGroup;
+    ulong_t i;
+    int rc;
+
+    KASSERT(count > 0);
+
+    if (goal >= super->numBlocks)
+	goal = first = 0;
+
+    /* The goal's group comes last too, for the part before the goal */
+    for (i = 0; i <= super->numGroups; ++i) {
+	ulong_t group = (first + i) % super->numGroups;
+	ulong_t start = group * super->blocksPerGroup;
+	ulong_t end = start + super->blocksPerGroup;
+	ulong_t from = i == 0 ? goal : start;
+	ulong_t want = count;
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+
+	Begin_Step(instance);
+	if (end > super->numBlocks)
+	    end = super->numBlocks;
+
+	if ((rc = Get_Group(instance, group, &buf, &desc)) != 0)
+	    return rc;
+	if (desc->freeBlocks == 0) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    continue;
+	}
+
+	if (want > desc->freeBlocks)
+	    want = desc->freeBlocks;
+	if ((rc = Scan_Bitmap(instance, super->bitmapStart, from, end, want, pStart, pLen)) != 0) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    return rc;
+	}
+	if (*pLen > 0) {
+	    desc->freeBlocks -= *pLen;
+	    instance->freeBlocks -= *pLen;
+	    Modify_Metadata(instance, buf);
+	    Release_FS_Buffer(instance->cache, buf);
+	    Debug("Allocated blocks %lu..%lu (goal %lu)\n", *pStart, *pStart + *pLen - 1, goal);
+	    return 0;
+	}
+	if (from == start) {
+	    Log(LOG_WARN, "XGOSFS: free block count of group %lu is wrong\n", group);
+	    instance->freeBlocks -= desc->freeBlocks;
+	    desc->freeBlocks = 0;
+	    Modify_Metadata(instance, buf);
+	}
+	Release_FS_Buffer(instance->cache, buf);
+    }
+
+    return ENOSPACE;
+}
+
+/*
+ * Allocate a free block, preferably the first one at or after goal,
+ * so that blocks allocated one after another are contiguous.
+ * Blocks promised to delayed writes are not available.
+ */
+static int Alloc_Block(struct XGOSFS_Instance *instance, ulong_t goal, ulong_t *pBlock)
+{
+    ulong_t len;
+
+    if (instance->freeBlocks <= instance->delayedBlocks)
+	return ENOSPACE;
+
+    if (goal < First_Data_Block(instance) || goal >= instance->super.numBlocks)
+	goal = First_Data_Block(instance);
+    return Alloc_Blocks(instance, goal, 1, pBlock, &len);
+}
+
+/*
+ * Free count blocks starting at block start.
+ */
+static int Free_Blocks(struct XGOSFS_Instance *instance, ulong_t start, ulong_t count)
+{
+    ulong_t perGroup = instance->super.blocksPerGroup;
+    int rc;
+
+    if (start < First_Data_Block(instance) || start + count > instance->super.numBlocks ||
+	start + count < start) {
+	Log(LOG_WARN, "XGOSFS: freeing bad blocks %lu..%lu\n", start, start + count - 1);
+	return EIO;
+    }
+
+    /* A run of blocks can span groups */
+    while (count > 0) {
+	ulong_t group = start / perGroup;
+	ulong_t len = (group + 1) * perGroup - start, cleared;
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+
+	Begin_Step(instance);
+	if (len > count)
+	    len = count;
+	if ((rc = Clear_Bits(instance, instance->super.bitmapStart, start, len, &cleared)) != 0)
+	    return rc;
+	if ((rc = Get_Group(instance, group, &buf, &desc)) != 0)
+	    return rc;
+	desc->freeBlocks += cleared;
+	Modify_Metadata(instance, buf);
+	Release_FS_Buffer(instance->cache, buf);
+	instance->freeBlocks += cleared;
+
+	start += len;
+	count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Free blocks that metadata on disk may still refer to.  They are
+ * freed once the running transaction has been committed, so they
+ * can't be reused, and overwritten, while a crash would still
+ * bring back the metadata that refers to them.  If they held
+ * metadata, journaled says so: they must not be reused either
+ * while the journal has old contents for them.
+ */
+static int Release_Blocks(struct XGOSFS_Instance *instance, ulong_t start, ulong_t count,
+    bool journaled)
+{
+    struct XGOSFS_Free_Run *run;
+    int rc;
+
+    if (instance->numPendingFrees == XGOSFS_MAX_PENDING_FREES &&
+	(rc = Commit_Transaction(instance)) != 0)
+	return rc;
+
+    run = &instance->pendingFrees[instance->numPendingFrees++];
+    run->start = start;
+    run->count = count;
+    if (journaled)
+	instance->freedJournaled = true;
+    return 0;
+}
+
+/*
+ * Allocate a free inode, in given group if possible.
+ */
+static int Alloc_Inode(struct XGOSFS_Instance *instance, ulong_t goalGroup, ulong_t *pInodeNum)
+{
+    struct XGOSFS_Superblock *super = &instance->super;
+    ulong_t i;
+    int rc;
+
+    if (instance->freeInodes == 0)
+	return ENOSPACE;
+
+    for (i = 0; i < super->numGroups; ++i) {
+	ulong_t group = (goalGroup + i) % super->numGroups;
+	ulong_t start = group * super->inodesPerGroup;
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+	ulong_t len;
+
+	Begin_Step(instance);
+	if ((rc = Get_Group(instance, group, &buf, &desc)) != 0)
+	    return rc;
+	if (desc->freeInodes == 0) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    continue;
+	}
+
+	rc = Scan_Bitmap(instance, super->inodeBitmapStart, start, start + super->inodesPerGroup,
+	    1, pInodeNum, &len);
+	if (rc != 0) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    return rc;
+	}
+	if (len == 0) {
+	    Log(LOG_WARN, "XGOSFS: free inode count of group %lu is wrong\n", group);
+	    instance->freeInodes -= desc->freeInodes;
+	    desc->freeInodes = 0;
+	} else {
+	    --desc->freeInodes;
+	    --instance->freeInodes;
+	}
+	Modify_Metadata(instance, buf);
+	Release_FS_Buffer(instance->cache, buf);
+	if (len > 0) {
+	    Debug("Allocated inode %lu (group %lu)\n", *pInodeNum, goalGroup);
+	    return 0;
+	}
+    }
+
+    Log(LOG_WARN, "XGOSFS: free inode count is wrong\n");
+    instance->freeInodes = 0;
+    return ENOSPACE;
+}
+
+/*
+ * Free given inode.
+ */
+static int Free_Inode(struct XGOSFS_Instance *instance, ulong_t inodeNum)
+{
+    struct FS_Buffer *buf;
+    struct XGOSFS_Group *desc;
+    ulong_t cleared;
+    int rc;
+
+    if (inodeNum <= XGOSFS_ROOT_INODE || inodeNum >= instance->super.numInodes) {
+	Log(LOG_WARN, "XGOSFS: freeing bad inode %lu\n", inodeNum);
+	return EIO;
+    }
+
+    Begin_Step(instance);
+    if ((rc = Clear_Bits(instance, instance->super.inodeBitmapStart, inodeNum, 1, &cleared)) != 0)
+	return rc;
+    if ((rc = Get_Group(instance, inodeNum / instance->super.inodesPerGroup, &buf, &desc)) != 0)
+	return rc;
+    desc->freeInodes += cleared;
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+    instance->freeInodes += cleared;
+
+    return 0;
+}
+
+/*
+ * Checksum of a transaction: covers its descriptor block,
+ * with the block numbers, and the copies of the blocks.
+ */
+static uint_t Journal_Checksum(const void *data, ulong_t numBlocks)
+{
+    const uint_t *word = data;
+    ulong_t i;
+    uint_t sum = 0;
+
+    for (i = 0; i < numBlocks * (XGOSFS_FS_BLOCK_SIZE / sizeof(uint_t)); ++i)
+	sum = ((sum << 1) | (sum >> 31)) + word[i];
+    return sum;
+}
+
+/*
+ * Start the journal over: all transactions in it have been
+ * written in place.  The journal superblock records the number
+ * of the next transaction, which will be the first in the log.
+ */
+static int Reset_Journal(struct XGOSFS_Instance *instance)
+{
+    struct XGOSFS_Journal_Header *hdr = instance->journalBuf;
+    int rc;
+
+    memset(hdr, '\0', XGOSFS_FS_BLOCK_SIZE);
+    hdr->magic = XGOSFS_JOURNAL_MAGIC;
+    hdr->type = XGOSFS_JOURNAL_SUPER;
+    hdr->sequence = instance->journalSequence;
+    rc = Block_Write_Multiple(instance->cache->dev, instance->super.journalStart * XGOSFS_SECTORS_PER_FS_BLOCK,
+	XGOSFS_SECTORS_PER_FS_BLOCK, hdr);
+    if (rc == 0)
+	instance->journalHead = 1;
+    return rc;
+}
+
+/*
+ * Commit the running transaction: write the metadata blocks it
+ * changed to the journal, in a single request, after which they
+ * can be written in place.  Everything else dirty in the cache,
+ * file data and metadata committed earlier, is written first, so
+ * committed metadata never refers to blocks with stale data.
+ * Blocks the transaction freed are then really freed, in a new
+ * transaction.
+ */
+static int Commit_Transaction(struct XGOSFS_Instance *instance)
+{
+    struct XGOSFS_Superblock *super = &instance->super;
+    uint_t count = instance->txCount, i;
+    char *block = instance->journalBuf;
+    struct XGOSFS_Journal_Header *hdr;
+    uint_t *blockNums;
+    int rc = 0, rc2;
+
+    if (count == 0 && instance->numPendingFrees == 0)
+	return 0;
+
+    if ((rc = Sync_FS_Buffer_Cache(instance->cache)) != 0)
+	goto done;
+    if (count == 0)
+	goto done;
+
+    /*
+     * No room if the log couldn't be started over after the last
+     * commit.  The blocks are just written in place, as if the
+     * commit had failed, and the log is started over below.
+     */
+    if (instance->journalHead + count + 2 > super->journalBlocks) {
+	Log(LOG_WARN, "XGOSFS: no room in log for transaction %lu\n", instance->journalSequence);
+	goto done;
+    }
+
+    /* Descriptor, copies of the blocks, then the commit block */
+    memset(block, '\0', XGOSFS_FS_BLOCK_SIZE);
+    hdr = (struct XGOSFS_Journal_Header *) block;
+    hdr->magic = XGOSFS_JOURNAL_MAGIC;
+    hdr->type = XGOSFS_JOURNAL_DESCRIPTOR;
+    hdr->sequence = instance->journalSequence;
+    hdr->count = count;
+    blockNums = (uint_t *) (hdr + 1);
+    for (i = 0; i < count; ++i) {
+	blockNums[i] = instance->txBuffers[i]->fsBlockNum;
+	memcpy(block + (i + 1) * XGOSFS_FS_BLOCK_SIZE, instance->txBuffers[i]->data, XGOSFS_FS_BLOCK_SIZE);
+    }
+
+    hdr = (struct XGOSFS_Journal_Header *) (block + (count + 1) * XGOSFS_FS_BLOCK_SIZE);
+    memset(hdr, '\0', XGOSFS_FS_BLOCK_SIZE);
+    hdr->magic = XGOSFS_JOURNAL_MAGIC;
+    hdr->type = XGOSFS_JOURNAL_COMMIT;
+    hdr->sequence = instance->journalSequence;
+    hdr->count = count;
+    hdr->checksum = Journal_Checksum(block, count + 1);
+
+    rc = Block_Write_Multiple(instance->cache->dev,
+	(super->journalStart + instance->journalHead) * XGOSFS_SECTORS_PER_FS_BLOCK,
+	(count + 2) * XGOSFS_SECTORS_PER_FS_BLOCK, block);
+    if (rc == 0) {
+	Debug("Committed transaction %lu: %u blocks at %lu\n",
+	    instance->journalSequence, count, instance->journalHead);
+	instance->journalHead += count + 2;
+	++instance->journalSequence;
+    }
+
+done:
+    /*
+     * If the transaction could not be committed, its blocks are
+     * written in place like any others; better than losing them.
+     */
+    if (rc != 0)
+	Log(LOG_WARN, "XGOSFS: could not commit transaction %lu: %d\n", instance->journalSequence, rc);
+    for (i = 0; i < count; ++i)
+	Unpin_FS_Buffer(instance->cache, instance->txBuffers[i]);
+    instance->txCount = 0;
+
+    /*
+     * With nothing pinned, everything can be written in place and
+     * the log started over: when there may not be room in it for
+     * the next transaction, or when freed metadata blocks could be
+     * reused for file data, which replaying the log would overwrite.
+     * Also after a failed commit, so that replaying older
+     * transactions can't undo the blocks just written in place.
+     * If this fails, the next commit may find no room in the log,
+     * and it is tried again then.
+     */
+    if (rc != 0 || instance->freedJournaled ||
+	instance->journalHead + XGOSFS_MAX_TRANSACTION_BLOCKS + 2 > super->journalBlocks) {
+	if ((rc2 = Sync_FS_Buffer_Cache(instance->cache)) == 0)
+	    rc2 = Reset_Journal(instance);
+	if (rc2 == 0)
+	    instance->freedJournaled = false;
+	else if (rc == 0)
+	    rc = rc2;
+    }
+
+    while (instance->numPendingFrees > 0) {
+	struct XGOSFS_Free_Run run = instance->pendingFrees[--instance->numPendingFrees];
+
+	rc2 = Free_Blocks(instance, run.start, run.count);
+	if (rc == 0)
+	    rc = rc2;
+    }
+
+    return rc;
+}
+
+/*
+ * Called at the end of each operation that changes the filesystem.
+ * Operations are grouped into one transaction until it gets big,
+ * or the blocks it frees are needed.
+ */
+static void End_Operation(struct XGOSFS_Instance *instance)
+{
+    if (instance->txCount >= XGOSFS_COMMIT_BLOCKS ||
+	instance->numPendingFrees >= XGOSFS_MAX_PENDING_FREES / 2 ||
+	(instance->numPendingFrees > 0 &&
+	 instance->freeBlocks <= instance->delayedBlocks + XGOSFS_MAX_DELAYED_BLOCKS))
+	Commit_Transaction(instance);
+}
+
+/*
+ * Choose the group for a new directory's inode: the one with the
+ * most free blocks, so directories, and the files in them, are
+ * spread over the disk and each has room to grow.
+ */
+static int Choose_Directory_Group(struct XGOSFS_Instance *instance, ulong_t *pGroup)
+{
+    ulong_t group, best = 0, bestFree = 0;
+    int rc;
+
+    for (group = 0; group < instance->super.numGroups; ++group) {
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+
+	if ((rc = Get_Group(instance, group, &buf, &desc)) != 0)
+	    return rc;
+	if (desc->freeInodes > 0 && desc->freeBlocks > bestFree) {
+	    best = group;
+	    bestFree = desc->freeBlocks;
+	}
+	Release_FS_Buffer(instance->cache, buf);
+    }
+
+    *pGroup = best;
+    return 0;
+}
+
+/*
+ * Get a buffer for a new extent tree node at given level.
+ * Tree nodes are kept near the start of the disk, out of
+ * the way of the file data they describe.
+ */
+static int New_Tree_Node(struct XGOSFS_Instance *instance, uint_t level, struct FS_Buffer **pBuf)
+{
+    struct XGOSFS_Tree_Node *node;
+    ulong_t block;
+    int rc;
+
+    if ((rc = Alloc_Block(instance, First_Data_Block(instance), &block)) != 0)
+	return rc;
+    if ((rc = Get_New_FS_Buffer(instance->cache, block, pBuf)) != 0) {
+	Free_Blocks(instance, block, 1);
+	return rc;
+    }
+
+    node = (struct XGOSFS_Tree_Node*) (*pBuf)->data;
+    node->magic = XGOSFS_TREE_MAGIC;
+    node->level = level;
+    node->count = 0;
+    Modify_Metadata(instance, *pBuf);
+
+    return 0;
+}
+
+/*
+ * Get the buffer of an extent tree node, checking that it is one.
+ */
+static int Get_Tree_Node(struct XGOSFS_Instance *instance, ulong_t block,
+    struct FS_Buffer **pBuf, struct XGOSFS_Tree_Node **pNode)
+{
+    struct XGOSFS_Tree_Node *node;
+    int rc;
+
+    if (block < First_Data_Block(instance) || block >= instance->super.numBlocks)
+	goto corrupt;
+    if ((rc = Get_FS_Buffer(instance->cache, block, pBuf)) != 0)
+	return rc;
+
+    node = (struct XGOSFS_Tree_Node*) (*pBuf)->data;
+    if (node->magic != XGOSFS_TREE_MAGIC || node->level >= XGOSFS_MAX_TREE_DEPTH || node->count == 0 ||
+	node->count > (node->level == 0 ? XGOSFS_TREE_EXTENTS : XGOSFS_TREE_INDEXES)) {
+	Release_FS_Buffer(instance->cache, *pBuf);
+	goto corrupt;
+    }
+
+    *pNode = node;
+    return 0;
+
+corrupt:
+    Log(LOG_WARN, "XGOSFS: bad extent tree node %lu\n", block);
+    return EIO;
+}
+
+/*
+ * Find the physical block holding given block of the file whose
+ * extents are in an extent tree, and how many blocks follow it
+ * contiguously.
+ */
+static int Tree_Lookup(struct XGOSFS_Instance *instance, ulong_t root, ulong_t logical,
+    ulong_t *pBlock, ulong_t *pRun)
+{
+    struct FS_Buffer *buf;
+    struct XGOSFS_Tree_Node *node;
+    ulong_t block = root;
+    int level = XGOSFS_MAX_TREE_DEPTH;
+    int rc;
+
+    for (;;) {
+	int lo = 0, hi, mid;
+
+	if ((rc = Get_Tree_Node(instance, block, &buf, &node)) != 0)
+	    return rc;
+	if ((int) node->level >= level) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    return EIO;
+	}
+	level = node->level;
+
+	/* Find the last entry starting at or before logical */
+	hi = node->count - 1;
+	while (lo < hi) {
+	    mid = (lo + hi + 1) / 2;
+	    if ((level == 0 ? node->u.extent[mid].logical : node->u.index[mid].logical) <= logical)
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+
+	if (level == 0) {
+	    struct XGOSFS_Extent *extent = &node->u.extent[lo];
+	    if (logical < extent->logical || logical - extent->logical >= extent->length) {
+		Release_FS_Buffer(instance->cache, buf);
+		return EIO;
+	    }
+	    *pBlock = extent->start + (logical - extent->logical);
+	    *pRun = extent->length - (logical - extent->logical);
+	    Release_FS_Buffer(instance->cache, buf);
+	    return 0;
+	}
+
+	block = node->u.index[lo].child;
+	Release_FS_Buffer(instance->cache, buf);
+    }
+}
+
+/*
+ * Find the physical block holding given block of a file, and how
+ * many blocks follow it contiguously.  The block must be mapped.
+ */
+static int Map_Block(struct XGOSFS_Instance *instance, struct XGOSFS_Extent_Map *map,
+    ulong_t logical, ulong_t *pBlock, ulong_t *pRun)
+{
+    uint_t numInline = map->numExtents < XGOSFS_NUM_INLINE_EXTENTS ?
+	map->numExtents : XGOSFS_NUM_INLINE_EXTENTS;
+    uint_t i;
+
+    KASSERT(logical < map->numBlocks);
+
+    for (i = 0; i < numInline; ++i) {
+	struct XGOSFS_Extent *extent = &map->extent[i];
+	if (logical - extent->logical < extent->length) {
+	    *pBlock = extent->start + (logical - extent->logical);
+	    *pRun = extent->length - (logical - extent->logical);
+	    return 0;
+	}
+    }
+
+    if (map->tree == 0)
+	return EIO;
+    return Tree_Lookup(instance, map->tree, logical, pBlock, pRun);
+}
+
+/*
+ * Add an extent of one block to the end of an extent tree,
+ * or extend the last extent if the block follows it.
+ * The tree is only ever appended to, so this works along
+ * the rightmost path: a full node gets a new, empty right
+ * sibling, and a full root a new root above it.
+ */
+static int Tree_Append(struct XGOSFS_Instance *instance, struct XGOSFS_Extent_Map *map,
+    ulong_t logical, ulong_t block)
+{
+    ulong_t path[XGOSFS_MAX_TREE_DEPTH];
+    struct FS_Buffer *buf;
+    struct XGOSFS_Tree_Node *node;
+    struct XGOSFS_Extent *last;
+    ulong_t newBlock;
+    int depth, level;
+    int rc;
+
+    if (map->tree == 0) {
+	/* First extent to overflow: start the tree with it */
+	if ((rc = New_Tree_Node(instance, 0, &buf)) != 0)
+	    return rc;
+	node = (struct XGOSFS_Tree_Node*) buf->data;
+	node->u.extent[0].logical = logical;
+	node->u.extent[0].start = block;
+	node->u.extent[0].length = 1;
+	node->count = 1;
+	map->tree = buf->fsBlockNum;
+	++map->numExtents;
+	goto modified;
+    }
+
+    /* Walk down the rightmost path to the last leaf */
+    if ((rc = Get_Tree_Node(instance, map->tree, &buf, &node)) != 0)
+	return rc;
+    depth = node->level;
+    for (level = depth; ; --level) {
+	ulong_t child;
+
+	path[level] = buf->fsBlockNum;
+	if (node->level == 0)
+	    break;
+	child = node->u.index[node->count - 1].child;
+	Release_FS_Buffer(instance->cache, buf);
+	if ((rc = Get_Tree_Node(instance, child, &buf, &node)) != 0)
+	    return rc;
+	if ((int) node->level != level - 1) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    return EIO;
+	}
+    }
+
+    /* Extend the last extent, or add a new one if there's room */
+    last = &node->u.extent[node->count - 1];
+    if (last->start + last->length == block && last->logical + last->length == logical) {
+	++last->length;
+	goto modified;
+    }
+    if (node->count < XGOSFS_TREE_EXTENTS) {
+	struct XGOSFS_Extent *extent = &node->u.extent[node->count++];
+	extent->logical = logical;
+	extent->start = block;
+	extent->length = 1;
+	++map->numExtents;
+	goto modified;
+    }
+    Release_FS_Buffer(instance->cache, buf);
+
+    /* The last leaf is full: start a new one */
+    if ((rc = New_Tree_Node(instance, 0, &buf)) != 0)
+	return rc;
+    node = (struct XGOSFS_Tree_Node*) buf->data;
+    node->u.extent[0].logical = logical;
+    node->u.extent[0].start = block;
+    node->u.extent[0].length = 1;
+    node->count = 1;
+    newBlock = buf->fsBlockNum;
+    Release_FS_Buffer(instance->cache, buf);
+    ++map->numExtents;
+
+    /* Link it into the first ancestor with room, splitting full ones */
+    for (level = 1; level <= depth; ++level) {
+	if ((rc = Get_Tree_Node(instance, path[level], &buf, &node)) != 0)
+	    return rc;
+	if (node->count < XGOSFS_TREE_INDEXES) {
+	    node->u.index[node->count].logical = logical;
+	    node->u.index[node->count].child = newBlock;
+	    ++node->count;
+	    goto modified;
+	}
+	Release_FS_Buffer(instance->cache, buf);
+
+	if ((rc = New_Tree_Node(instance, level, &buf)) != 0)
+	    return rc;
+	node = (struct XGOSFS_Tree_Node*) buf->data;
+	node->u.index[0].logical = logical;
+	node->u.index[0].child = newBlock;
+	node->count = 1;
+	newBlock = buf->fsBlockNum;
+	Release_FS_Buffer(instance->cache, buf);
+    }
+
+    /* The root is full too: grow the tree by a level */
+    if (depth + 1 >= XGOSFS_MAX_TREE_DEPTH)
+	return ENOSPACE;
+    if ((rc = New_Tree_Node(instance, depth + 1, &buf)) != 0)
+	return rc;
+    node = (struct XGOSFS_Tree_Node*) buf->data;
+    node->u.index[0].logical = 0;
+    node->u.index[0].child = map->tree;
+    node->u.index[1].logical = logical;
+    node->u.index[1].child = newBlock;
+    node->count = 2;
+    map->tree = buf->fsBlockNum;
+
+modified:
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+    return 0;
+}
+
+/*
+ * Add given block to the end of a file's extent map.
+ */
+static int Map_Append(struct XGOSFS_Instance *instance, struct XGOSFS_Extent_Map *map, ulong_t block)
+{
+    int rc;
+
+    if (map->numExtents <= XGOSFS_NUM_INLINE_EXTENTS) {
+	struct XGOSFS_Extent *extent;
+
+	/* Extend the last extent if the block follows it */
+	if (map->numExtents > 0) {
+	    extent = &map->extent[map->numExtents - 1];
+	    if (extent->start + extent->length == block) {
+		++extent->length;
+		goto done;
+	    }
+	}
+	if (map->numExtents < XGOSFS_NUM_INLINE_EXTENTS) {
+	    extent = &map->extent[map->numExtents++];
+	    extent->logical = map->numBlocks;
+	    extent->start = block;
+	    extent->length = 1;
+	    goto done;
+	}
+    }
+
+    /* The rest go in the extent tree, in one step */
+    Begin_Step(instance);
+    instance->inStep = true;
+    rc = Tree_Append(instance, map, map->numBlocks, block);
+    instance->inStep = false;
+    if (rc != 0)
+	return rc;
+
+done:
+    ++map->numBlocks;
+    return 0;
+}
+
+/*
+ * Free an extent tree and the blocks its extents describe,
+ * which are metadata if journaled is set.
+ */
+static int Free_Tree(struct XGOSFS_Instance *instance, ulong_t root, bool journaled)
+{
+    struct FS_Buffer *buf;
+    struct XGOSFS_Tree_Node *node;
+    uint_t i;
+    int rc;
+
+    if ((rc = Get_Tree_Node(instance, root, &buf, &node)) != 0)
+	return rc;
+    for (i = 0; i < node->count && rc == 0; ++i) {
+	if (node->level == 0)
+	    rc = Release_Blocks(instance, node->u.extent[i].start, node->u.extent[i].length, journaled);
+	else
+	    rc = Free_Tree(instance, node->u.index[i].child, journaled);
+    }
+    Release_FS_Buffer(instance->cache, buf);
+
+    if (rc == 0)
+	rc = Release_Blocks(instance, root, 1, true);
+    return rc;
+}
+
+/*
+ * Free all of the blocks of a file, or, if journaled is set,
+ * of a directory.
+ */
+static int Free_Map(struct XGOSFS_Instance *instance, struct XGOSFS_Extent_Map *map, bool journaled)
+{
+    uint_t i;
+    int rc = 0;
+
+    for (i = 0; i < map->numExtents && i < XGOSFS_NUM_INLINE_EXTENTS && rc == 0; ++i)
+	rc = Release_Blocks(instance, map->extent[i].start, map->extent[i].length, journaled);
+    if (rc == 0 && map->tree != 0)
+	rc = Free_Tree(instance, map->tree, journaled);
+
+    memset(map, '\0', sizeof(*map));
+    return rc;
+}
+
+/*
+ * Find where given inode is in the inode table.
+ */
+static int Inode_Pos(struct XGOSFS_Instance *instance, ulong_t inodeNum, ulong_t *pBlock, uint_t *pOffset)
+{
+    if (inodeNum == 0 || inodeNum >= instance->super.numInodes) {
+	Log(LOG_WARN, "XGOSFS: bad inode number %lu\n", inodeNum);
+	return EIO;
+    }
+    *pBlock = instance->super.inodeTableStart + inodeNum / XGOSFS_INODES_PER_BLOCK;
+    *pOffset = (inodeNum % XGOSFS_INODES_PER_BLOCK) * XGOSFS_INODE_SIZE;
+    return 0;
+}
+
+/*
+ * Read given inode from the inode table.
+ */
+static int Read_Inode(struct XGOSFS_Instance *instance, ulong_t inodeNum, struct XGOSFS_Inode *inode)
+{
+    struct FS_Buffer *buf;
+    ulong_t block;
+    uint_t offset;
+    int rc;
+
+    if ((rc = Inode_Pos(instance, inodeNum, &block, &offset)) != 0)
+	return rc;
+    if ((rc = Get_FS_Buffer(instance->cache, block, &buf)) != 0)
+	return rc;
+    memcpy(inode, (char*) buf->data + offset, sizeof(*inode));
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Write given inode to the inode table, or clear
+ * its slot if inode is null.
+ */
+static int Write_Inode(struct XGOSFS_Instance *instance, ulong_t inodeNum, const struct XGOSFS_Inode *inode)
+{
+    struct FS_Buffer *buf;
+    ulong_t block;
+    uint_t offset;
+    int rc;
+
+    if ((rc = Inode_Pos(instance, inodeNum, &block, &offset)) != 0)
+	return rc;
+    Begin_Step(instance);
+    if ((rc = Get_FS_Buffer(instance->cache, block, &buf)) != 0)
+	return rc;
+    if (inode != 0)
+	memcpy((char*) buf->data + offset, inode, sizeof(*inode));
+    else
+	memset((char*) buf->data + offset, '\0', XGOSFS_INODE_SIZE);
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Find the node of given inode if it is in use.
+ */
+static struct XGOSFS_Node *Find_Node(struct XGOSFS_Instance *instance, ulong_t inodeNum)
+{
+    struct XGOSFS_Node *node;
+
+    for (node = Get_Front_Of_XGOSFS_Node_List(&instance->nodeList);
+	 node != 0;
+	 node = Get_Next_In_XGOSFS_Node_List(node)) {
+	if (node->inodeNum == inodeNum)
+	    return node;
+    }
+    return 0;
+}
+
+/*
+ * Get the node for given inode, with a reference taken for the caller.
+ */
+static int Get_Node(struct XGOSFS_Instance *instance, ulong_t inodeNum, struct XGOSFS_Node **pNode)
+{
+    struct XGOSFS_Node *node;
+    int rc;
+
+    /* See if it's already in use */
+    if ((node = Find_Node(instance, inodeNum)) != 0) {
+	++node->refCount;
+	*pNode = node;
+	return 0;
+    }
+
+    if ((node = (struct XGOSFS_Node*) Malloc(sizeof(*node))) == 0)
+	return ENOMEM;
+    if ((rc = Read_Inode(instance, inodeNum, &node->inode)) != 0) {
+	Free(node);
+	return rc;
+    }
+    if ((node->inode.flags & XGOSFS_INODE_USED) == 0) {
+	Log(LOG_WARN, "XGOSFS: inode %lu is not in use\n", inodeNum);
+	Free(node);
+	return EIO;
+    }
+
+    node->inodeNum = inodeNum;
+    node->numDelayed = 0;
+    node->refCount = 1;
+    node->deleted = false;
+    Add_To_Back_Of_XGOSFS_Node_List(&instance->nodeList, node);
+
+    *pNode = node;
+    return 0;
+}
+
+/*
+ * Write a node's inode back to disk.  Its size on disk
+ * doesn't count delayed blocks, which have no disk blocks yet.
+ */
+static int Write_Node(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node)
+{
+    ulong_t size = node->inode.size;
+    int rc;
+
+    if (node->deleted)
+	return 0;
+
+    if (!IS_INLINE(&node->inode) && size > node->inode.u.map.numBlocks * XGOSFS_FS_BLOCK_SIZE)
+	node->inode.size = node->inode.u.map.numBlocks * XGOSFS_FS_BLOCK_SIZE;
+    rc = Write_Inode(instance, node->inodeNum, &node->inode);
+    node->inode.size = size;
+
+    return rc;
+}
+
+/*
+ * Block to place the next block of a file at: the one after
+ * its last block, or for its first block, the start of the
+ * group its inode is in.
+ */
+static int Next_Block_Goal(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node, ulong_t *pGoal)
+{
+    struct XGOSFS_Extent_Map *map = &node->inode.u.map;
+    ulong_t run;
+    int rc;
+
+    if (map->numBlocks == 0) {
+	*pGoal = node->inodeNum / instance->super.inodesPerGroup * instance->super.blocksPerGroup;
+	return 0;
+    }
+    if ((rc = Map_Block(instance, map, map->numBlocks - 1, pGoal, &run)) != 0)
+	return rc;
+    ++*pGoal;
+    return 0;
+}
+
+/*
+ * Give the delayed blocks of a file disk blocks, allocated in as
+ * few runs as possible, and write them to the buffer cache.
+ */
+static int Flush_Delayed(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node)
+{
+    int rc = 0, rc2;
+
+    if (node->numDelayed == 0)
+	return 0;
+
+    while (node->numDelayed > 0) {
+	ulong_t goal, start, len, i;
+
+	if ((rc = Next_Block_Goal(instance, node, &goal)) != 0)
+	    break;
+	if ((rc = Alloc_Blocks(instance, goal, node->numDelayed, &start, &len)) != 0)
+	    break;
+	instance->delayedBlocks -= len;
+
+	for (i = 0; i < len; ++i) {
+	    struct FS_Buffer *buf;
+
+	    /* The data goes first, so it is on disk before the map refers to it */
+	    if ((rc = Get_New_FS_Buffer(instance->cache, start + i, &buf)) == 0) {
+		memcpy(buf->data, node->delayed[i], XGOSFS_FS_BLOCK_SIZE);
+		Modify_FS_Buffer(instance->cache, buf);
+		Release_FS_Buffer(instance->cache, buf);
+		rc = Map_Append(instance, &node->inode.u.map, start + i);
+	    }
+	    if (rc != 0) {
+		/* The rest of the run goes back, and stays promised */
+		Free_Blocks(instance, start + i, len - i);
+		instance->delayedBlocks += len - i;
+		break;
+	    }
+	    Free_Page(node->delayed[i]);
+	}
+
+	/* Blocks up to i now have disk blocks */
+	node->numDelayed -= i;
+	memmove(&node->delayed[0], &node->delayed[i], node->numDelayed * sizeof(void*));
+	if (rc != 0)
+	    break;
+    }
+
+    rc2 = Write_Node(instance, node);
+    return rc != 0 ? rc : rc2;
+}
+
+/*
+ * Throw away the delayed blocks of a file.
+ */
+static void Discard_Delayed(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node)
+{
+    uint_t i;
+
+    for (i = 0; i < node->numDelayed; ++i)
+	Free_Page(node->delayed[i]);
+    instance->delayedBlocks -= node->numDelayed;
+    node->numDelayed = 0;
+}
+
+/*
+ * Get the page holding given block of a file past its last disk
+ * block, adding delayed blocks as needed.  Blocks added before it
+ * (skipped by a seek) are zero filled, as are new blocks.  If
+ * the block is too far past the end, the delayed blocks before
+ * it are written back first.
+ */
+static int Get_Delayed_Block(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node,
+    ulong_t logical, void **pData)
+{
+    struct XGOSFS_Extent_Map *map = &node->inode.u.map;
+    int rc;
+
+    KASSERT(logical >= map->numBlocks);
+
+    while (logical >= map->numBlocks + node->numDelayed) {
+	void *data;
+
+	if (node->numDelayed == XGOSFS_MAX_DELAYED_BLOCKS) {
+	    if ((rc = Flush_Delayed(instance, node)) != 0)
+		return rc;
+	    continue;
+	}
+
+	/* Keep a few blocks in hand for extent tree nodes */
+	if (instance->freeBlocks <= instance->delayedBlocks + XGOSFS_MAX_TREE_DEPTH)
+	    return ENOSPACE;
+	if ((data = Alloc_Page()) == 0)
+	    return ENOMEM;
+	memset(data, '\0', XGOSFS_FS_BLOCK_SIZE);
+	node->delayed[node->numDelayed++] = data;
+	++instance->delayedBlocks;
+    }
+
+    *pData = node->delayed[logical - map->numBlocks];
+    return 0;
+}
+
+/*
+ * Drop a reference to a node taken by Get_Node() or XGOSFS_Clone(),
+ * freeing it if it was the last.  Its delayed blocks are written
+ * back, or if it has been deleted, its inode and blocks are freed.
+ */
+static void Put_Node(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node)
+{
+    KASSERT(node->refCount > 0);
+    if (--node->refCount > 0)
+	return;
+
+    if (!node->deleted && Flush_Delayed(instance, node) != 0)
+	Log(LOG_WARN, "XGOSFS: could not write back data of inode %lu\n", node->inodeNum);
+    Discard_Delayed(instance, node);
+
+    Remove_From_XGOSFS_Node_List(&instance->nodeList, node);
+    if (node->deleted) {
+	/* The inode goes first: its blocks may be freed in a later transaction */
+	if (Write_Inode(instance, node->inodeNum, 0) != 0 ||
+	    Free_Inode(instance, node->inodeNum) != 0 ||
+	    (!IS_INLINE(&node->inode) &&
+	     Free_Map(instance, &node->inode.u.map, IS_DIRECTORY(&node->inode)) != 0))
+	    Log(LOG_WARN, "XGOSFS: could not free deleted inode %lu\n", node->inodeNum);
+    }
+    Free(node);
+}
+
+/*
+ * Make sure a directory has given block, adding blocks as needed,
+ * and find where it is.  *pNew is set if the block was added,
+ * in which case the caller is responsible for its contents;
+ * blocks added before it are zero filled.  Directory blocks are
+ * allocated right away, not delayed like file data.
+ */
+static int Get_Data_Block(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node,
+    ulong_t logical, ulong_t *pBlock, bool *pNew)
+{
+    struct XGOSFS_Extent_Map *map = &node->inode.u.map;
+    ulong_t run;
+    int rc;
+
+    KASSERT(node->numDelayed == 0);
+
+    if (logical < map->numBlocks) {
+	*pNew = false;
+	return Map_Block(instance, map, logical, pBlock, &run);
+    }
+
+    while (map->numBlocks <= logical) {
+	ulong_t goal, block;
+
+	if ((rc = Next_Block_Goal(instance, node, &goal)) != 0)
+	    return rc;
+	if ((rc = Alloc_Block(instance, goal, &block)) != 0)
+	    return rc;
+	if ((rc = Map_Append(instance, map, block)) != 0) {
+	    Free_Blocks(instance, block, 1);
+	    return rc;
+	}
+
+	if (map->numBlocks <= logical) {
+	    struct FS_Buffer *buf;
+
+	    if ((rc = Get_New_FS_Buffer(instance->cache, block, &buf)) != 0)
+		return rc;
+	    Modify_FS_Buffer(instance->cache, buf);
+	    Release_FS_Buffer(instance->cache, buf);
+	}
+	*pBlock = block;
+    }
+
+    *pNew = true;
+    return 0;
+}
+
+/*
+ * Move the data of a file kept in its inode to a block of its
+ * own, so it can grow.  The block is allocated right away, and
+ * written before the extent map refers to it.
+ */
+static int Promote_Inline(struct XGOSFS_Instance *instance, struct XGOSFS_Node *node)
+{
+    struct XGOSFS_Inode *inode = &node->inode;
+    uchar_t data[XGOSFS_MAX_INLINE_DATA];
+    struct FS_Buffer *buf;
+    ulong_t goal, block;
+    int rc;
+
+    KASSERT(IS_INLINE(inode) && node->numDelayed == 0);
+
+    memcpy(data, inode->u.data, sizeof(data));
+    memset(&inode->u, '\0', sizeof(inode->u));
+    inode->flags &= ~XGOSFS_INODE_INLINE;
+
+    if ((rc = Next_Block_Goal(instance, node, &goal)) != 0 ||
+	(rc = Alloc_Block(instance, goal, &block)) != 0)
+	goto fail;
+    if ((rc = Get_New_FS_Buffer(instance->cache, block, &buf)) != 0) {
+	Free_Blocks(instance, block, 1);
+	goto fail;
+    }
+    memcpy(buf->data, data, sizeof(data));
+    Modify_FS_Buffer(instance->cache, buf);
+    Release_FS_Buffer(instance->cache, buf);
+    if ((rc = Map_Append(instance, &inode->u.map, block)) != 0) {
+	Free_Blocks(instance, block, 1);
+	goto fail;
+    }
+
+    Debug("Moved data of inode %lu to block %lu\n", node->inodeNum, block);
+    return 0;
+
+fail:
+    memcpy(inode->u.data, data, sizeof(data));
+    inode->flags |= XGOSFS_INODE_INLINE;
+    return rc;
+}
+
+/* Number of hash buckets in a directory. */
+#define NUM_BUCKETS(dir) ((dir)->inode.size / XGOSFS_FS_BLOCK_SIZE)
+
+/*
+ * Hash function for filenames (FNV-1a).
+ */
+static ulong_t Hash_Name(const char *name, size_t len)
+{
+    ulong_t hash = 2166136261UL;
+
+    while (len-- > 0) {
+	hash ^= (uchar_t) *name++;
+	hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/*
+ * Get the buffer of given bucket of a directory, checking that
+ * its records fill exactly the space it says is used.
+ */
+static int Get_Bucket(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir, ulong_t bucket,
+    struct FS_Buffer **pBuf)
+{
+    struct XGOSFS_Dir_Bucket *hdr;
+    ulong_t block, run;
+    uint_t offset;
+    int rc;
+
+    KASSERT(bucket < NUM_BUCKETS(dir));
+
+    if ((rc = Map_Block(instance, &dir->inode.u.map, bucket, &block, &run)) != 0)
+	return rc;
+    if ((rc = Get_FS_Buffer(instance->cache, block, pBuf)) != 0)
+	return rc;
+
+    hdr = (struct XGOSFS_Dir_Bucket*) (*pBuf)->data;
+    if (hdr->used < sizeof(*hdr) || hdr->used > XGOSFS_FS_BLOCK_SIZE)
+	goto corrupt;
+    for (offset = sizeof(*hdr); offset < hdr->used; ) {
+	struct XGOSFS_Dir_Record *rec = (struct XGOSFS_Dir_Record*) ((char*) hdr + offset);
+
+	if (hdr->used - offset < sizeof(*rec) || rec->inode == 0 ||
+	    rec->nameLen == 0 || rec->nameLen > XGOSFS_FILENAME_MAX)
+	    goto corrupt;
+	offset += XGOSFS_RECORD_SIZE(rec->nameLen);
+    }
+    if (offset != hdr->used)
+	goto corrupt;
+
+    return 0;
+
+corrupt:
+    Release_FS_Buffer(instance->cache, *pBuf);
+    Log(LOG_WARN, "XGOSFS: bad bucket %lu in directory inode %lu\n", bucket, dir->inodeNum);
+    return EIO;
+}
+
+/*
+ * Find the record with given name (of length len) in a bucket.
+ * Returns its offset, or 0 if there is none.
+ */
+static uint_t Find_In_Bucket(struct FS_Buffer *buf, const char *name, size_t len)
+{
+    struct XGOSFS_Dir_Bucket *hdr = (struct XGOSFS_Dir_Bucket*) buf->data;
+    uint_t offset;
+
+    for (offset = sizeof(*hdr); offset < hdr->used; ) {
+	struct XGOSFS_Dir_Record *rec = (struct XGOSFS_Dir_Record*) ((char*) hdr + offset);
+
+	if (rec->nameLen == len && memcmp(rec + 1, name, len) == 0)
+	    return offset;
+	offset += XGOSFS_RECORD_SIZE(rec->nameLen);
+    }
+    return 0;
+}
+
+/*
+ * Look up the inode of the file with given name (of length len)
+ * in a directory.  Only the bucket it hashes to is read.
+ * Returns 0 if found, ENOTFOUND if not, or an error code.
+ */
+static int Find_Record(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir,
+    const char *name, size_t len, ulong_t *pInodeNum)
+{
+    struct FS_Buffer *buf;
+    uint_t offset;
+    int rc;
+
+    KASSERT(len <= XGOSFS_FILENAME_MAX);
+
+    if (NUM_BUCKETS(dir) == 0)
+	return ENOTFOUND;
+    rc = Get_Bucket(instance, dir, Hash_Name(name, len) & (NUM_BUCKETS(dir) - 1), &buf);
+    if (rc != 0)
+	return rc;
+
+    if ((offset = Find_In_Bucket(buf, name, len)) != 0) {
+	*pInodeNum = ((struct XGOSFS_Dir_Record*) ((char*) buf->data + offset))->inode;
+	rc = 0;
+    } else
+	rc = ENOTFOUND;
+    Release_FS_Buffer(instance->cache, buf);
+
+    return rc;
+}
+
+/*
+ * Check whether a record in given bucket of a directory is
+ * stale: left behind when the bucket was split.
+ */
+static __inline__ bool Is_Stale(struct XGOSFS_Node *dir, ulong_t bucket, struct XGOSFS_Dir_Record *rec)
+{
+    return (Hash_Name((char*) (rec + 1), rec->nameLen) & (NUM_BUCKETS(dir) - 1)) != bucket;
+}
+
+/*
+ * Double the number of buckets in a directory: the records in
+ * bucket i whose hash has the next bit set belong in bucket i+n
+ * from now on, and are copied there.  The old buckets are left
+ * as they are, the stale records in them ignored until the
+ * bucket fills up, so the split writes only new blocks, which
+ * nothing refers to until the directory's inode is written.
+ */
+static int Split_Directory(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir)
+{
+    ulong_t n = NUM_BUCKETS(dir), i;
+    ulong_t block, run;
+    bool isNew;
+    int rc;
+
+    Debug("Splitting directory inode %lu into %lu buckets\n", dir->inodeNum, n * 2);
+
+    /* Add all of the new buckets first, so a failure leaves it as it was */
+    if ((rc = Get_Data_Block(instance, dir, n * 2 - 1, &block, &isNew)) != 0)
+	return rc;
+
+    for (i = 0; i < n; ++i) {
+	struct FS_Buffer *oldBuf, *newBuf;
+	struct XGOSFS_Dir_Bucket *oldHdr, *newHdr;
+	uint_t offset;
+
+	if ((rc = Get_Bucket(instance, dir, i, &oldBuf)) != 0)
+	    return rc;
+	if ((rc = Map_Block(instance, &dir->inode.u.map, n + i, &block, &run)) != 0 ||
+	    (rc = Get_New_FS_Buffer(instance->cache, block, &newBuf)) != 0) {
+	    Release_FS_Buffer(instance->cache, oldBuf);
+	    return rc;
+	}
+	oldHdr = (struct XGOSFS_Dir_Bucket*) oldBuf->data;
+	newHdr = (struct XGOSFS_Dir_Bucket*) newBuf->data;
+	newHdr->used = sizeof(*newHdr);
+
+	for (offset = sizeof(*oldHdr); offset < oldHdr->used; ) {
+	    struct XGOSFS_Dir_Record *rec = (struct XGOSFS_Dir_Record*) ((char*) oldHdr + offset);
+	    uint_t size = XGOSFS_RECORD_SIZE(rec->nameLen);
+
+	    if ((Hash_Name((char*) (rec + 1), rec->nameLen) & (n * 2 - 1)) == n + i) {
+		memcpy((char*) newHdr + newHdr->used, rec, size);
+		newHdr->used += size;
+	    }
+	    offset += size;
+	}
+
+	Release_FS_Buffer(instance->cache, oldBuf);
+	Modify_FS_Buffer(instance->cache, newBuf);
+	Release_FS_Buffer(instance->cache, newBuf);
+    }
+
+    dir->inode.size = n * 2 * XGOSFS_FS_BLOCK_SIZE;
+    return Write_Node(instance, dir);
+}
+
+/*
+ * Remove the stale records from a bucket of a directory.
+ * Returns true if there were any.
+ */
+static bool Purge_Bucket(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir, ulong_t bucket,
+    struct FS_Buffer *buf)
+{
+    struct XGOSFS_Dir_Bucket *hdr = (struct XGOSFS_Dir_Bucket*) buf->data;
+    uint_t offset, keep;
+
+    for (offset = keep = sizeof(*hdr); offset < hdr->used; ) {
+	struct XGOSFS_Dir_Record *rec = (struct XGOSFS_Dir_Record*) ((char*) hdr + offset);
+	uint_t size = XGOSFS_RECORD_SIZE(rec->nameLen);
+
+	if (!Is_Stale(dir, bucket, rec)) {
+	    if (keep != offset)
+		memmove((char*) hdr + keep, rec, size);
+	    keep += size;
+	}
+	offset += size;
+    }
+    if (keep == hdr->used)
+	return false;
+
+    hdr->used = keep;
+    Modify_Metadata(instance, buf);
+    return true;
+}
+
+/*
+ * Add a record for given inode, with given name (of length len),
+ * to a directory, which must not already have one by that name.
+ * A directory's first bucket is made when it gets its first record.
+ */
+static int Add_Record(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir,
+    const char *name, size_t len, ulong_t inodeNum)
+{
+    ulong_t hash = Hash_Name(name, len);
+    uint_t size = XGOSFS_RECORD_SIZE(len);
+    struct FS_Buffer *buf;
+    struct XGOSFS_Dir_Bucket *hdr;
+    struct XGOSFS_Dir_Record *rec;
+    int rc;
+
+    if (NUM_BUCKETS(dir) == 0) {
+	ulong_t block;
+	bool isNew;
+
+	if ((rc = Get_Data_Block(instance, dir, 0, &block, &isNew)) != 0)
+	    return rc;
+	if ((rc = Get_New_FS_Buffer(instance->cache, block, &buf)) != 0)
+	    return rc;
+	((struct XGOSFS_Dir_Bucket*) buf->data)->used = sizeof(struct XGOSFS_Dir_Bucket);
+	Modify_FS_Buffer(instance->cache, buf);
+	Release_FS_Buffer(instance->cache, buf);
+
+	dir->inode.size = XGOSFS_FS_BLOCK_SIZE;
+	if ((rc = Write_Node(instance, dir)) != 0)
+	    return rc;
+    }
+
+    for (;;) {
+	ulong_t bucket = hash & (NUM_BUCKETS(dir) - 1);
+
+	Begin_Step(instance);
+	if ((rc = Get_Bucket(instance, dir, bucket, &buf)) != 0)
+	    return rc;
+	hdr = (struct XGOSFS_Dir_Bucket*) buf->data;
+	if (XGOSFS_FS_BLOCK_SIZE - hdr->used >= size ||
+	    (Purge_Bucket(instance, dir, bucket, buf) && XGOSFS_FS_BLOCK_SIZE - hdr->used >= size))
+	    break;
+	Release_FS_Buffer(instance->cache, buf);
+
+	/* The bucket is full */
+	if (NUM_BUCKETS(dir) >= XGOSFS_MAX_DIR_BUCKETS)
+	    return ENOSPACE;
+	if ((rc = Split_Directory(instance, dir)) != 0)
+	    return rc;
+    }
+
+    rec = (struct XGOSFS_Dir_Record*) ((char*) hdr + hdr->used);
+    memset(rec, '\0', size);
+    rec->inode = inodeNum;
+    rec->nameLen = len;
+    memcpy(rec + 1, name, len);
+    hdr->used += size;
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Remove the record with given name (of length len) from a directory.
+ * Directories never shrink; their buckets are just left emptier.
+ */
+static int Remove_Record(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir,
+    const char *name, size_t len)
+{
+    struct FS_Buffer *buf;
+    struct XGOSFS_Dir_Bucket *hdr;
+    uint_t offset, size;
+    int rc;
+
+    if (NUM_BUCKETS(dir) == 0)
+	return ENOTFOUND;
+    Begin_Step(instance);
+    rc = Get_Bucket(instance, dir, Hash_Name(name, len) & (NUM_BUCKETS(dir) - 1), &buf);
+    if (rc != 0)
+	return rc;
+
+    if ((offset = Find_In_Bucket(buf, name, len)) == 0) {
+	Release_FS_Buffer(instance->cache, buf);
+	return ENOTFOUND;
+    }
+    hdr = (struct XGOSFS_Dir_Bucket*) buf->data;
+    size = XGOSFS_RECORD_SIZE(len);
+    memmove((char*) hdr + offset, (char*) hdr + offset + size, hdr->used - (offset + size));
+    hdr->used -= size;
+    Modify_Metadata(instance, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Find the first record at or after byte position *pPos of a
+ * directory, and copy its name (nul-terminated) into name and its
+ * inode number into *pInodeNum, if they are not null.  *pPos is
+ * set to the position after it.
+ * Returns 0 if one was found, VFS_NO_MORE_DIR_ENTRIES if not,
+ * or an error code.
+ */
+static int Next_Record(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir,
+    ulong_t *pPos, char *name, ulong_t *pInodeNum)
+{
+    ulong_t bucket = *pPos / XGOSFS_FS_BLOCK_SIZE;
+    uint_t offset = *pPos % XGOSFS_FS_BLOCK_SIZE;
+    int rc;
+
+    if (offset < sizeof(struct XGOSFS_Dir_Bucket))
+	offset = sizeof(struct XGOSFS_Dir_Bucket);
+
+    for (; bucket < NUM_BUCKETS(dir); ++bucket, offset = sizeof(struct XGOSFS_Dir_Bucket)) {
+	struct FS_Buffer *buf;
+	struct XGOSFS_Dir_Bucket *hdr;
+	struct XGOSFS_Dir_Record *rec;
+	uint_t cur;
+
+	if ((rc = Get_Bucket(instance, dir, bucket, &buf)) != 0)
+	    return rc;
+	hdr = (struct XGOSFS_Dir_Bucket*) buf->data;
+
+	/*
+	 * Records move when others are removed or the directory
+	 * is split, so the position may no longer be at one:
+	 * go on from the first record at or after it.
+	 */
+	for (cur = sizeof(*hdr); cur < offset && cur < hdr->used; )
+	    cur += XGOSFS_RECORD_SIZE(((struct XGOSFS_Dir_Record*) ((char*) hdr + cur))->nameLen);
+	offset = cur;
+
+	/* Skip records left behind by splits */
+	while (offset < hdr->used &&
+	       Is_Stale(dir, bucket, (struct XGOSFS_Dir_Record*) ((char*) hdr + offset)))
+	    offset += XGOSFS_RECORD_SIZE(((struct XGOSFS_Dir_Record*) ((char*) hdr + offset))->nameLen);
+	if (offset >= hdr->used) {
+	    Release_FS_Buffer(instance->cache, buf);
+	    continue;
+	}
+
+	rec = (struct XGOSFS_Dir_Record*) ((char*) hdr + offset);
+	if (name != 0) {
+	    memcpy(name, rec + 1, rec->nameLen);
+	    name[rec->nameLen] = '\0';
+	}
+	if (pInodeNum != 0)
+	    *pInodeNum = rec->inode;
+	*pPos = bucket * XGOSFS_FS_BLOCK_SIZE + offset + XGOSFS_RECORD_SIZE(rec->nameLen);
+	Release_FS_Buffer(instance->cache, buf);
+	return 0;
+    }
+
+    *pPos = NUM_BUCKETS(dir) * XGOSFS_FS_BLOCK_SIZE;
+    return VFS_NO_MORE_DIR_ENTRIES;
+}
+
+/*
+ * Create a file or directory (if flags has XGOSFS_INODE_ISDIRECTORY)
+ * with given name (of length len) in a directory.  A file's inode
+ * is placed in the directory's group, and a directory's in the
+ * group with the most room.
+ */
+static int Create_Entry(struct XGOSFS_Instance *instance, struct XGOSFS_Node *dir,
+    const char *name, size_t len, uint_t flags, ulong_t *pInodeNum)
+{
+    struct XGOSFS_Inode *inode;
+    ulong_t inodeNum, group = dir->inodeNum / instance->super.inodesPerGroup;
+    int rc;
+
+    if ((flags & XGOSFS_INODE_ISDIRECTORY) && (rc = Choose_Directory_Group(instance, &group)) != 0)
+	return rc;
+    if ((inode = (struct XGOSFS_Inode*) Malloc(sizeof(*inode))) == 0)
+	return ENOMEM;
+    if ((rc = Alloc_Inode(instance, group, &inodeNum)) != 0)
+	goto done;
+
+    /* Files start out with their data in the inode */
+    memset(inode, '\0', sizeof(*inode));
+    inode->flags = XGOSFS_INODE_USED | flags;
+    if (!(flags & XGOSFS_INODE_ISDIRECTORY))
+	inode->flags |= XGOSFS_INODE_INLINE;
+    if ((rc = Write_Inode(instance, inodeNum, inode)) != 0 ||
+	(rc = Add_Record(instance, dir, name, len, inodeNum)) != 0) {
+	Write_Inode(instance, inodeNum, 0);
+	Free_Inode(instance, inodeNum);
+	goto done;
+    }
+    *pInodeNum = inodeNum;
+
+done:
+    Free(inode);
+    return rc;
+}
+
+/*
+ * Walk given path from the root directory, and return the node of
+ * the file or directory it names.  If parent is true, stop at the
+ * last component instead, and return the node of the directory
+ * it should be in, and the last component and its length.
+ */
+static int Walk_Path(struct XGOSFS_Instance *instance, const char *path, bool parent,
+    struct XGOSFS_Node **pNode, const char **pName, size_t *pLen)
+{
+    struct XGOSFS_Node *node;
+    ulong_t inodeNum;
+    int rc;
+
+    if ((rc = Get_Node(instance, XGOSFS_ROOT_INODE, &node)) != 0)
+	return rc;
+
+    for (;;) {
+	const char *name;
+	size_t len;
+
+	while (*path == '/')
+	    ++path;
+	if (*path == '\0')
+	    break;
+
+	name = path;
+	while (*path != '\0' && *path != '/')
+	    ++path;
+	len = path - name;
+	if (len > XGOSFS_FILENAME_MAX) {
+	    rc = ENAMETOOLONG;
+	    goto fail;
+	}
+
+	if (parent) {
+	    const char *rest = path;
+	    while (*rest == '/')
+		++rest;
+	    if (*rest == '\0') {
+		*pName = name;
+		*pLen = len;
+		*pNode = node;
+		return 0;
+	    }
+	}
+
+	if (!IS_DIRECTORY(&node->inode)) {
+	    rc = ENOTDIR;
+	    goto fail;
+	}
+	if ((rc = Find_Record(instance, node, name, len, &inodeNum)) != 0)
+	    goto fail;
+	Put_Node(instance, node);
+	if ((rc = Get_Node(instance, inodeNum, &node)) != 0)
+	    return rc;
+    }
+
+    /* There was no last component: the path names the root */
+    if (parent) {
+	rc = EINVALID;
+	goto fail;
+    }
+
+    *pNode = node;
+    return 0;
+
+fail:
+    Put_Node(instance, node);
+    return rc;
+}
+
+/*
+ * Copy file metadata from inode into
+ * struct VFS_File_Stat object.
+ */
+static void Copy_Stat(struct VFS_File_Stat *stat, struct XGOSFS_Inode *inode)
+{
+    stat->size = inode->size;
+    stat->isDirectory = IS_DIRECTORY(inode);
+    stat->isSetuid = (inode->flags & XGOSFS_INODE_SETUID) != 0;
+    stat->isTerminal = 0;
+    memcpy(stat->acls, inode->acl, sizeof(stat->acls));
+}
+
+/* ----------------------------------------------------------------------
+ * Implementation of VFS operations
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Get metadata for given file or directory.
+ */
+static int XGOSFS_FStat(struct File *file, struct VFS_File_Stat *stat)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) file->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) file->fsData;
+
+    Mutex_Lock(&instance->lock);
+    Copy_Stat(stat, &node->inode);
+    Mutex_Unlock(&instance->lock);
+
+    return 0;
+}
+
+/*
+ * Read data from current position in file.
+ * Whole blocks are read straight into the caller's buffer,
+ * a contiguous run at a time.  Delayed blocks are copied
+ * from memory.
+ */
+static int XGOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) file->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) file->fsData;
+    ulong_t start = file->filePos, end, pos;
+    int rc = 0;
+
+    if ((file->mode & O_READ) == 0)
+	return EACCESS;
+    if (numBytes > INT_MAX)
+	return EINVALID;
+
+    Mutex_Lock(&instance->lock);
+
+    /* Read no further than the end of the file */
+    if (start >= node->inode.size) {
+	Mutex_Unlock(&instance->lock);
+	return 0;
+    }
+    end = numBytes < node->inode.size - start ? start + numBytes : node->inode.size;
+
+    pos = start;
+    if (IS_INLINE(&node->inode)) {
+	memcpy(buf, node->inode.u.data + start, end - start);
+	pos = end;
+    }
+
+    for (; pos < end; ) {
+	ulong_t offset = pos % XGOSFS_FS_BLOCK_SIZE;
+	ulong_t logical = pos / XGOSFS_FS_BLOCK_SIZE;
+	ulong_t block, run;
+	char *dest = (char*) buf + (pos - start);
+
+	if (logical >= node->inode.u.map.numBlocks) {
+	    ulong_t count = XGOSFS_FS_BLOCK_SIZE - offset;
+
+	    if (logical - node->inode.u.map.numBlocks >= node->numDelayed) {
+		rc = EIO;
+		break;
+	    }
+	    if (count > end - pos)
+		count = end - pos;
+	    memcpy(dest, (char*) node->delayed[logical - node->inode.u.map.numBlocks] + offset, count);
+	    pos += count;
+	    continue;
+	}
+
+	rc = Map_Block(instance, &node->inode.u.map, logical, &block, &run);
+	if (rc != 0)
+	    break;
+
+	if (offset == 0 && end - pos >= XGOSFS_FS_BLOCK_SIZE) {
+	    ulong_t count = (end - pos) / XGOSFS_FS_BLOCK_SIZE;
+
+	    if (count > run)
+		count = run;
+	    if (count > XGOSFS_MAX_READ_BLOCKS)
+		count = XGOSFS_MAX_READ_BLOCKS;
+	    Debug("Reading %lu blocks at %lu\n", count, block);
+	    if ((rc = Read_FS_Blocks(instance->cache, block, count, dest)) != 0)
+		break;
+	    pos += count * XGOSFS_FS_BLOCK_SIZE;
+	} else {
+	    struct FS_Buffer *fsBuf;
+	    ulong_t count = XGOSFS_FS_BLOCK_SIZE - offset;
+
+	    if (count > end - pos)
+		count = end - pos;
+	    if ((rc = Get_FS_Buffer(instance->cache, block, &fsBuf)) != 0)
+		break;
+	    memcpy(dest, (char*) fsBuf->data + offset, count);
+	    Release_FS_Buffer(instance->cache, fsBuf);
+	    pos += count;
+	}
+    }
+
+    Mutex_Unlock(&instance->lock);
+
+    if (pos == start)
+	return rc;
+    file->filePos = pos;
+    return pos - start;
+}
+
+/*
+ * Write data to current position in file.
+ * Data past the last block of the file goes into delayed
+ * blocks, which are allocated when they are written back.
+ */
+static int XGOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) file->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) file->fsData;
+    ulong_t start = file->filePos, end = start + numBytes, pos;
+    int rc = 0, rc2;
+
+    if ((file->mode & O_WRITE) == 0)
+	return EACCESS;
+    if (numBytes > INT_MAX || end < start)
+	return EINVALID;
+
+    Mutex_Lock(&instance->lock);
+
+    pos = start;
+    if (IS_INLINE(&node->inode)) {
+	if (end <= XGOSFS_MAX_INLINE_DATA) {
+	    memcpy(node->inode.u.data + start, buf, numBytes);
+	    pos = end;
+	    if (pos > node->inode.size)
+		node->inode.size = pos;
+	} else
+	    rc = Promote_Inline(instance, node);
+    }
+
+    for (; pos < end && rc == 0; ) {
+	ulong_t offset = pos % XGOSFS_FS_BLOCK_SIZE;
+	ulong_t count = XGOSFS_FS_BLOCK_SIZE - offset;
+	ulong_t logical = pos / XGOSFS_FS_BLOCK_SIZE;
+	struct FS_Buffer *fsBuf;
+	ulong_t block, run;
+	void *data;
+
+	if (count > end - pos)
+	    count = end - pos;
+
+	if (logical >= node->inode.u.map.numBlocks) {
+	    if ((rc = Get_Delayed_Block(instance, node, logical, &data)) != 0)
+		break;
+	    memcpy((char*) data + offset, (char*) buf + (pos - start), count);
+	} else {
+	    rc = Map_Block(instance, &node->inode.u.map, logical, &block, &run);
+	    if (rc != 0)
+		break;
+
+	    /* Don't read a block that is about to be overwritten */
+	    if (count == XGOSFS_FS_BLOCK_SIZE)
+		rc = Get_New_FS_Buffer(instance->cache, block, &fsBuf);
+	    else
+		rc = Get_FS_Buffer(instance->cache, block, &fsBuf);
+	    if (rc != 0)
+		break;
+	    memcpy((char*) fsBuf->data + offset, (char*) buf + (pos - start), count);
+	    Modify_FS_Buffer(instance->cache, fsBuf);
+	    Release_FS_Buffer(instance->cache, fsBuf);
+	}
+
+	pos += count;
+	if (pos > node->inode.size)
+	    node->inode.size = pos;
+    }
+
+    /* Blocks may have been added even if nothing was written */
+    rc2 = Write_Node(instance, node);
+    if (rc == 0)
+	rc = rc2;
+
+    End_Operation(instance);
+    Mutex_Unlock(&instance->lock);
+
+    if (pos == start)
+	return rc;
+    file->filePos = pos;
+    if (pos > file->endPos)
+	file->endPos = pos;
+    return pos - start;
+}
+
+/*
+ * Seek to a position in file.
+ * Seeking past the end of the file is allowed; a write there
+ * fills the gap with zeroes.
+ */
+static int XGOSFS_Seek(struct File *file, ulong_t pos)
+{
+    if (pos > INT_MAX)
+	return EINVALID;
+    file->filePos = pos;
+    return 0;
+}
+
+/*
+ * Close a file or directory.
+ */
+static int XGOSFS_Close(struct File *file)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) file->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) file->fsData;
+
+    Mutex_Lock(&instance->lock);
+    Put_Node(instance, node);
+    End_Operation(instance);
+    Mutex_Unlock(&instance->lock);
+
+    return 0;
+}
+
+/*
+ * Clone a file or directory.
+ * The clone will access the same underlying file as the
+ * original, but read/write/seek operations, etc. will be distinct.
+ * Returns 0 if successful, or an error code if unsuccessful.
+ */
+static int XGOSFS_Clone(struct File *file, struct File **pClone)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) file->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) file->fsData;
+    struct File *clone;
+
+    clone = Allocate_File(file->ops, file->filePos, file->endPos, node, file->mode, file->mountPoint);
+    if (clone == 0)
+	return ENOMEM;
+
+    /* The clone shares the node. */
+    Mutex_Lock(&instance->lock);
+    ++node->refCount;
+    Mutex_Unlock(&instance->lock);
+
+    *pClone = clone;
+    return 0;
+}
+
+static struct File_Ops s_xgosfsFileOps = {
+    &XGOSFS_FStat,
+    &XGOSFS_Read,
+    &XGOSFS_Write,
+    &XGOSFS_Seek,
+    &XGOSFS_Close,
+    0, /* Read_Entry */
+    &XGOSFS_Clone,
+};
+
+/*
+ * Seek to given entry of an open directory: the next Read_Entry()
+ * returns the entry after the first pos entries.  A directory's
+ * filePos is the byte position where the search for its next
+ * record starts.  Entries are returned in hash order.
+ */
+static int XGOSFS_Seek_Directory(struct File *dir, ulong_t pos)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) dir->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) dir->fsData;
+    ulong_t recPos = 0, i;
+    int rc = 0;
+
+    Mutex_Lock(&instance->lock);
+    for (i = 0; i < pos; ++i) {
+	if ((rc = Next_Record(instance, node, &recPos, 0, 0)) != 0)
+	    break;
+    }
+    Mutex_Unlock(&instance->lock);
+
+    if (rc < 0)
+	return rc;
+    dir->filePos = recPos;
+    return 0;
+}
+
+/*
+ * Read a directory entry from an open directory.
+ */
+static int XGOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) dir->mountPoint->fsData;
+    struct XGOSFS_Node *node = (struct XGOSFS_Node*) dir->fsData;
+    struct XGOSFS_Node *child;
+    struct XGOSFS_Inode inode;
+    ulong_t pos = dir->filePos, inodeNum;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+    rc = Next_Record(instance, node, &pos, entry->name, &inodeNum);
+    if (rc == 0) {
+	/* An open file's size on disk may not count its delayed blocks */
+	if ((child = Find_Node(instance, inodeNum)) != 0)
+	    memcpy(&inode, &child->inode, sizeof(inode));
+	else
+	    rc = Read_Inode(instance, inodeNum, &inode);
+    }
+    Mutex_Unlock(&instance->lock);
+
+    if (rc != 0)
+	return rc;
+
+    Copy_Stat(&entry->stats, &inode);
+    dir->filePos = pos;
+    return 0;
+}
+
+static struct File_Ops s_xgosfsDirOps = {
+    &XGOSFS_FStat,
+    0, /* Read */
+    0, /* Write */
+    &XGOSFS_Seek_Directory,
+    &XGOSFS_Close,
+    &XGOSFS_Read_Entry,
+    &XGOSFS_Clone,
+};
+
+/*
+ * Open a file named by given path.
+ */
+static int XGOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *dir, *node = 0;
+    struct File *file;
+    ulong_t inodeNum;
+    const char *name;
+    size_t len;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+
+    if ((rc = Walk_Path(instance, path, true, &dir, &name, &len)) != 0)
+	goto done;
+    if (!IS_DIRECTORY(&dir->inode))
+	rc = ENOTDIR;
+    else if ((rc = Find_Record(instance, dir, name, len, &inodeNum)) == 0) {
+	if ((mode & (O_CREATE|O_EXCL)) == (O_CREATE|O_EXCL))
+	    rc = EEXIST;
+    } else if (rc == ENOTFOUND && (mode & O_CREATE))
+	rc = Create_Entry(instance, dir, name, len, 0, &inodeNum);
+    if (rc == 0)
+	rc = Get_Node(instance, inodeNum, &node);
+    Put_Node(instance, dir);
+    if (rc != 0)
+	goto done;
+
+    /* Directories can't be opened as files. */
+    if (IS_DIRECTORY(&node->inode)) {
+	rc = EACCESS;
+	goto done;
+    }
+
+    file = Allocate_File(&s_xgosfsFileOps, 0, node->inode.size, node, 0, 0);
+    if (file == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
+    node = 0;
+    *pFile = file;
+
+done:
+    if (node != 0)
+	Put_Node(instance, node);
+    End_Operation(instance);
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Create a directory named by given path.
+ */
+static int XGOSFS_Create_Directory(struct Mount_Point *mountPoint, const char *path)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *dir;
+    ulong_t inodeNum;
+    const char *name;
+    size_t len;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+
+    if ((rc = Walk_Path(instance, path, true, &dir, &name, &len)) != 0)
+	goto done;
+    if (!IS_DIRECTORY(&dir->inode))
+	rc = ENOTDIR;
+    else if ((rc = Find_Record(instance, dir, name, len, &inodeNum)) == 0)
+	rc = EEXIST;
+    else if (rc == ENOTFOUND)
+	rc = Create_Entry(instance, dir, name, len, XGOSFS_INODE_ISDIRECTORY, &inodeNum);
+    Put_Node(instance, dir);
+
+done:
+    End_Operation(instance);
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Open a directory named by given path.
+ */
+static int XGOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path, struct File **pDir)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *node = 0;
+    struct File *dir;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+
+    if ((rc = Walk_Path(instance, path, false, &node, 0, 0)) != 0)
+	goto done;
+    if (!IS_DIRECTORY(&node->inode)) {
+	rc = ENOTDIR;
+	goto done;
+    }
+
+    dir = Allocate_File(&s_xgosfsDirOps, 0, node->inode.size, node, 0, 0);
+    if (dir == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
+    node = 0;
+    *pDir = dir;
+
+done:
+    if (node != 0)
+	Put_Node(instance, node);
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Delete a file, or an empty directory.  The blocks of a file
+ * that is open are freed when it is closed for the last time.
+ */
+static int XGOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *dir, *node = 0;
+    ulong_t inodeNum;
+    const char *name;
+    size_t len;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+
+    if ((rc = Walk_Path(instance, path, true, &dir, &name, &len)) != 0)
+	goto done;
+    if (!IS_DIRECTORY(&dir->inode))
+	rc = ENOTDIR;
+    else if ((rc = Find_Record(instance, dir, name, len, &inodeNum)) == 0)
+	rc = Get_Node(instance, inodeNum, &node);
+
+    if (rc == 0 && IS_DIRECTORY(&node->inode)) {
+	ulong_t pos = 0;
+
+	rc = Next_Record(instance, node, &pos, 0, 0);
+	if (rc == 0)
+	    rc = EACCESS;	/* Not empty */
+	else if (rc == VFS_NO_MORE_DIR_ENTRIES)
+	    rc = 0;
+    }
+
+    if (rc == 0 && (rc = Remove_Record(instance, dir, name, len)) == 0)
+	node->deleted = true;
+    if (node != 0)
+	Put_Node(instance, node);
+    Put_Node(instance, dir);
+
+done:
+    End_Operation(instance);
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Get metadata (size, permissions, etc.) of file named by given path.
+ */
+static int XGOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct VFS_File_Stat *stat)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *node;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+    if ((rc = Walk_Path(instance, path, false, &node, 0, 0)) == 0) {
+	Copy_Stat(stat, &node->inode);
+	Put_Node(instance, node);
+    }
+    Mutex_Unlock(&instance->lock);
+
+    return rc;
+}
+
+/*
+ * Synchronize the filesystem data with the disk
+ * (i.e., flush out all buffered filesystem data).
+ */
+static int XGOSFS_Sync(struct Mount_Point *mountPoint)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) mountPoint->fsData;
+    struct XGOSFS_Node *node;
+    int rc = 0, rc2;
+
+    Mutex_Lock(&instance->lock);
+
+    /* Delayed blocks get disk blocks first */
+    for (node = Get_Front_Of_XGOSFS_Node_List(&instance->nodeList);
+	 node != 0;
+	 node = Get_Next_In_XGOSFS_Node_List(node)) {
+	if (!node->deleted && (rc2 = Flush_Delayed(instance, node)) != 0 && rc == 0)
+	    rc = rc2;
+    }
+    /*
+     * Freeing the blocks a commit released starts a new transaction,
+     * which has to be committed too.
+     */
+    while (instance->txCount > 0 || instance->numPendingFrees > 0) {
+	if ((rc2 = Commit_Transaction(instance)) != 0) {
+	    if (rc == 0)
+		rc = rc2;
+	    break;
+	}
+    }
+
+    /* With everything in place, the log is no longer needed */
+    if ((rc2 = Sync_FS_Buffer_Cache(instance->cache)) == 0)
+	rc2 = Reset_Journal(instance);
+
+    Mutex_Unlock(&instance->lock);
+    return rc != 0 ? rc : rc2;
+}
+
+static struct Mount_Point_Ops s_xgosfsMountPointOps = {
+    &XGOSFS_Open,
+    &XGOSFS_Create_Directory,
+    &XGOSFS_Open_Directory,
+    &XGOSFS_Stat,
+    &XGOSFS_Sync,
+    &XGOSFS_Delete,
+};
+
+/*
+ * Mark bits [first, last) of the bitmap block bits as set.
+ */
+static void Set_Bits(uchar_t *bits, ulong_t first, ulong_t last)
+{
+    ulong_t i;
+
+    for (i = first; i < last; ++i)
+	bits[i / 8] |= 1 << (i % 8);
+}
+
+/*
+ * Write a bitmap of numBits bits starting at block bitmapStart,
+ * with the first numUsed bits set.  Bits past the end are set
+ * too, so they are never allocated.
+ */
+static int Format_Bitmap(struct FS_Buffer_Cache *cache, ulong_t bitmapStart,
+    ulong_t numBits, ulong_t numUsed)
+{
+    ulong_t numBlocks = (numBits + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    struct FS_Buffer *buf;
+    ulong_t i;
+    int rc;
+
+    for (i = 0; i < numBlocks; ++i) {
+	ulong_t first = i * XGOSFS_BITS_PER_BLOCK;
+
+	if ((rc = Get_New_FS_Buffer(cache, bitmapStart + i, &buf)) != 0)
+	    return rc;
+	if (first < numUsed)
+	    Set_Bits((uchar_t*) buf->data, 0,
+		numUsed - first < XGOSFS_BITS_PER_BLOCK ? numUsed - first : XGOSFS_BITS_PER_BLOCK);
+	if (first + XGOSFS_BITS_PER_BLOCK > numBits)
+	    Set_Bits((uchar_t*) buf->data, numBits - first, XGOSFS_BITS_PER_BLOCK);
+	Modify_FS_Buffer(cache, buf);
+	Release_FS_Buffer(cache, buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Format a device as an empty filesystem.
+ */
+static int XGOSFS_Format(struct Block_Device *blockDev)
+{
+    struct FS_Buffer_Cache *cache;
+    struct FS_Buffer *buf;
+    struct XGOSFS_Superblock *super;
+    struct XGOSFS_Inode *root;
+    ulong_t numBlocks = Get_Num_Blocks(blockDev) / XGOSFS_SECTORS_PER_FS_BLOCK;
+    ulong_t numGroups = (numBlocks + XGOSFS_BLOCKS_PER_GROUP - 1) / XGOSFS_BLOCKS_PER_GROUP;
+    ulong_t groupBlocks = (numGroups + XGOSFS_GROUPS_PER_BLOCK - 1) / XGOSFS_GROUPS_PER_BLOCK;
+    ulong_t bitmapBlocks = (numBlocks + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    ulong_t inodesPerGroup, numInodes, inodeBitmapBlocks, inodeTableStart, inodeTableBlocks;
+    ulong_t journalBlocks, firstData;
+    ulong_t i;
+    int rc = 0, rc2;
+
+    /*
+     * One inode for every few blocks of a group (or of the disk,
+     * if it is smaller), rounded down to a power of 2.
+     */
+    inodesPerGroup = XGOSFS_INODES_PER_BLOCK;
+    while (inodesPerGroup * 2 * XGOSFS_BLOCKS_PER_INODE <=
+	   (numBlocks < XGOSFS_BLOCKS_PER_GROUP ? numBlocks : XGOSFS_BLOCKS_PER_GROUP))
+	inodesPerGroup *= 2;
+    numInodes = numGroups * inodesPerGroup;
+    inodeBitmapBlocks = (numInodes + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    inodeTableStart = 1 + groupBlocks + bitmapBlocks + inodeBitmapBlocks;
+    inodeTableBlocks = numInodes / XGOSFS_INODES_PER_BLOCK;
+
+    /* A journal of 1/32 of the disk, within limits */
+    journalBlocks = numBlocks / 32;
+    if (journalBlocks < XGOSFS_JOURNAL_MIN_BLOCKS)
+	journalBlocks = XGOSFS_JOURNAL_MIN_BLOCKS;
+    if (journalBlocks > XGOSFS_JOURNAL_MAX_BLOCKS)
+	journalBlocks = XGOSFS_JOURNAL_MAX_BLOCKS;
+    firstData = inodeTableStart + inodeTableBlocks + journalBlocks;
+
+    /* Need at least the metadata and one free block */
+    if (numBlocks <= firstData)
+	return ENOSPACE;
+
+    if ((cache = Create_FS_Buffer_Cache(blockDev, XGOSFS_FS_BLOCK_SIZE)) == 0)
+	return ENOMEM;
+
+    /* Group descriptors, less the metadata, inode 0 and the root */
+    for (i = 0; i < groupBlocks && rc == 0; ++i) {
+	struct XGOSFS_Group *desc;
+	ulong_t group;
+
+	if ((rc = Get_New_FS_Buffer(cache, 1 + i, &buf)) != 0)
+	    break;
+	desc = (struct XGOSFS_Group*) buf->data;
+	for (group = i * XGOSFS_GROUPS_PER_BLOCK;
+	     group < numGroups && group < (i + 1) * XGOSFS_GROUPS_PER_BLOCK;
+	     ++group, ++desc) {
+	    ulong_t start = group * XGOSFS_BLOCKS_PER_GROUP;
+	    ulong_t end = start + XGOSFS_BLOCKS_PER_GROUP;
+
+	    if (end > numBlocks)
+		end = numBlocks;
+	    if (start < firstData)
+		start = firstData < end ? firstData : end;
+	    desc->freeBlocks = end - start;
+	    desc->freeInodes = inodesPerGroup - (group == 0 ? XGOSFS_ROOT_INODE + 1 : 0);
+	    desc->flags = lazyInitXGOSFS ? XGOSFS_GROUP_INODES_UNINIT : 0;
+	}
+	Modify_FS_Buffer(cache, buf);
+	Release_FS_Buffer(cache, buf);
+    }
+
+    if (rc == 0)
+	rc = Format_Bitmap(cache, 1 + groupBlocks, numBlocks, firstData);
+    if (rc == 0)
+	rc = Format_Bitmap(cache, 1 + groupBlocks + bitmapBlocks, numInodes, XGOSFS_ROOT_INODE + 1);
+
+    for (i = 0; i < inodeTableBlocks && rc == 0; ++i) {
+	if (lazyInitXGOSFS && i != XGOSFS_ROOT_INODE / XGOSFS_INODES_PER_BLOCK)
+	    continue;
+	if ((rc = Get_New_FS_Buffer(cache, inodeTableStart + i, &buf)) != 0)
+	    break;
+	if (i == XGOSFS_ROOT_INODE / XGOSFS_INODES_PER_BLOCK) {
+	    root = (struct XGOSFS_Inode*) ((char*) buf->data +
+		(XGOSFS_ROOT_INODE % XGOSFS_INODES_PER_BLOCK) * XGOSFS_INODE_SIZE);
+	    root->flags = XGOSFS_INODE_USED | XGOSFS_INODE_ISDIRECTORY;
+	}
+	Modify_FS_Buffer(cache, buf);
+	Release_FS_Buffer(cache, buf);
+    }
+
+    /*
+     * An empty journal.  The block after its superblock is cleared
+     * too, so nothing left there by an earlier filesystem is taken
+     * for the first transaction.
+     */
+    for (i = 0; i < 2 && rc == 0; ++i) {
+	if ((rc = Get_New_FS_Buffer(cache, firstData - journalBlocks + i, &buf)) != 0)
+	    break;
+	if (i == 0) {
+	    struct XGOSFS_Journal_Header *hdr = (struct XGOSFS_Journal_Header*) buf->data;
+
+	    hdr->magic = XGOSFS_JOURNAL_MAGIC;
+	    hdr->type = XGOSFS_JOURNAL_SUPER;
+	    hdr->sequence = 1;
+	}
+	Modify_FS_Buffer(cache, buf);
+	Release_FS_Buffer(cache, buf);
+    }
+
+    if (rc == 0 && (rc = Get_New_FS_Buffer(cache, 0, &buf)) == 0) {
+	super = (struct XGOSFS_Superblock*) buf->data;
+	super->magic = XGOSFS_MAGIC;
+	super->version = XGOSFS_VERSION;
+	super->numBlocks = numBlocks;
+	super->numGroups = numGroups;
+	super->blocksPerGroup = XGOSFS_BLOCKS_PER_GROUP;
+	super->inodesPerGroup = inodesPerGroup;
+	super->groupStart = 1;
+	super->groupBlocks = groupBlocks;
+	super->bitmapStart = 1 + groupBlocks;
+	super->bitmapBlocks = bitmapBlocks;
+	super->numInodes = numInodes;
+	super->inodeBitmapStart = 1 + groupBlocks + bitmapBlocks;
+	super->inodeBitmapBlocks = inodeBitmapBlocks;
+	super->inodeTableStart = inodeTableStart;
+	super->inodeTableBlocks = inodeTableBlocks;
+	super->journalStart = firstData - journalBlocks;
+	super->journalBlocks = journalBlocks;
+	Modify_FS_Buffer(cache, buf);
+	Release_FS_Buffer(cache, buf);
+    }
+
+    rc2 = Destroy_FS_Buffer_Cache(cache);
+    return rc != 0 ? rc : rc2;
+}
+
+/*
+ * Add up the free blocks and inodes in the group descriptors,
+ * and the groups whose inode tables haven't been zeroed yet.
+ */
+static int Count_Free(struct XGOSFS_Instance *instance, ulong_t *pUninit)
+{
+    ulong_t group;
+    int rc;
+
+    instance->freeBlocks = instance->freeInodes = *pUninit = 0;
+    for (group = 0; group < instance->super.numGroups; ++group) {
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+
+	if ((rc = Get_Group(instance, group, &buf, &desc)) != 0)
+	    return rc;
+	instance->freeBlocks += desc->freeBlocks;
+	instance->freeInodes += desc->freeInodes;
+	if (desc->flags & XGOSFS_GROUP_INODES_UNINIT)
+	    ++*pUninit;
+	Release_FS_Buffer(instance->cache, buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Zero the free inodes in block i of the inode table of a group.
+ * A block with no inodes in use isn't read first.
+ */
+static int Init_Inode_Block(struct XGOSFS_Instance *instance, ulong_t group, ulong_t i)
+{
+    struct XGOSFS_Superblock *super = &instance->super;
+    ulong_t first = group * super->inodesPerGroup + i * XGOSFS_INODES_PER_BLOCK;
+    ulong_t bit = first % XGOSFS_BITS_PER_BLOCK;
+    struct FS_Buffer *buf;
+    uchar_t *bits;
+    uint_t used = 0, j;
+    int rc;
+
+    rc = Get_FS_Buffer(instance->cache, super->inodeBitmapStart + first / XGOSFS_BITS_PER_BLOCK, &buf);
+    if (rc != 0)
+	return rc;
+    bits = (uchar_t*) buf->data;
+    for (j = 0; j < XGOSFS_INODES_PER_BLOCK; ++j, ++bit) {
+	if (bits[bit / 8] & (1 << (bit % 8)))
+	    used |= 1 << j;
+    }
+    Release_FS_Buffer(instance->cache, buf);
+
+    if (used == 0)
+	rc = Get_New_FS_Buffer(instance->cache, super->inodeTableStart + first / XGOSFS_INODES_PER_BLOCK, &buf);
+    else
+	rc = Get_FS_Buffer(instance->cache, super->inodeTableStart + first / XGOSFS_INODES_PER_BLOCK, &buf);
+    if (rc != 0)
+	return rc;
+    for (j = 0; j < XGOSFS_INODES_PER_BLOCK; ++j) {
+	if (!(used & (1 << j)))
+	    memset((char*) buf->data + j * XGOSFS_INODE_SIZE, '\0', XGOSFS_INODE_SIZE);
+    }
+    Modify_FS_Buffer(instance->cache, buf);
+    Release_FS_Buffer(instance->cache, buf);
+
+    return 0;
+}
+
+/*
+ * Kernel thread zeroing the inode tables of the groups of a
+ * filesystem formatted with lazyInitXGOSFS set.  It takes the
+ * lock for one block at a time, so operations on the filesystem
+ * go on meanwhile.  A group is marked done, in its descriptor,
+ * once all of its inode table has been zeroed.  A group that
+ * can't be zeroed is left for the next mount to try again.
+ */
+static void Lazy_Init_Thread(ulong_t arg)
+{
+    struct XGOSFS_Instance *instance = (struct XGOSFS_Instance*) arg;
+    ulong_t blocks = instance->super.inodesPerGroup / XGOSFS_INODES_PER_BLOCK;
+    ulong_t group, i;
+
+    for (group = 0; group < instance->super.numGroups; ++group) {
+	struct FS_Buffer *buf;
+	struct XGOSFS_Group *desc;
+	bool uninit = false;
+	int rc;
+
+	Mutex_Lock(&instance->lock);
+	if ((rc = Get_Group(instance, group, &buf, &desc)) == 0) {
+	    uninit = (desc->flags & XGOSFS_GROUP_INODES_UNINIT) != 0;
+	    Release_FS_Buffer(instance->cache, buf);
+	}
+	Mutex_Unlock(&instance->lock);
+
+	for (i = 0; i < blocks && uninit && rc == 0; ++i) {
+	    Mutex_Lock(&instance->lock);
+	    rc = Init_Inode_Block(instance, group, i);
+	    Mutex_Unlock(&instance->lock);
+	}
+
+	if (uninit && rc == 0) {
+	    Mutex_Lock(&instance->lock);
+	    Begin_Step(instance);
+	    if ((rc = Get_Group(instance, group, &buf, &desc)) == 0) {
+		desc->flags &= ~XGOSFS_GROUP_INODES_UNINIT;
+		Modify_Metadata(instance, buf);
+		Release_FS_Buffer(instance->cache, buf);
+		Debug("Zeroed inode table of group %lu\n", group);
+	    }
+	    End_Operation(instance);
+	    Mutex_Unlock(&instance->lock);
+	}
+
+	if (rc != 0)
+	    Log(LOG_WARN, "XGOSFS: could not zero inode table of group %lu: %d\n", group, rc);
+    }
+}
+
+/*
+ * Check that the layout described by a superblock is the one
+ * XGOSFS_Format() makes, and fits on a device of devBlocks blocks.
+ */
+static bool Check_Superblock(struct XGOSFS_Superblock *super, ulong_t devBlocks)
+{
+    return super->magic == XGOSFS_MAGIC && super->version == XGOSFS_VERSION &&
+	super->numBlocks <= devBlocks && super->blocksPerGroup == XGOSFS_BLOCKS_PER_GROUP &&
+	super->numGroups == (super->numBlocks + XGOSFS_BLOCKS_PER_GROUP - 1) / XGOSFS_BLOCKS_PER_GROUP &&
+	super->inodesPerGroup >= XGOSFS_INODES_PER_BLOCK && super->inodesPerGroup <= XGOSFS_BLOCKS_PER_GROUP &&
+	(super->inodesPerGroup & (super->inodesPerGroup - 1)) == 0 &&
+	super->groupStart == 1 &&
+	super->groupBlocks == (super->numGroups + XGOSFS_GROUPS_PER_BLOCK - 1) / XGOSFS_GROUPS_PER_BLOCK &&
+	super->bitmapStart == super->groupStart + super->groupBlocks &&
+	super->bitmapBlocks == (super->numBlocks + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK &&
+	super->numInodes == super->numGroups * super->inodesPerGroup &&
+	super->inodeBitmapStart == super->bitmapStart + super->bitmapBlocks &&
+	super->inodeBitmapBlocks == (super->numInodes + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK &&
+	super->inodeTableStart == super->inodeBitmapStart + super->inodeBitmapBlocks &&
+	super->inodeTableBlocks * XGOSFS_INODES_PER_BLOCK == super->numInodes &&
+	super->journalStart == super->inodeTableStart + super->inodeTableBlocks &&
+	super->journalBlocks >= XGOSFS_JOURNAL_MIN_BLOCKS && super->journalBlocks <= XGOSFS_JOURNAL_MAX_BLOCKS &&
+	super->journalStart + super->journalBlocks < super->numBlocks;
+}
+
+/*
+ * Check a journal block header.
+ */
+static bool Check_Journal_Header(struct XGOSFS_Journal_Header *hdr, uint_t type, ulong_t sequence)
+{
+    return hdr->magic == XGOSFS_JOURNAL_MAGIC && hdr->type == type && hdr->sequence == sequence;
+}
+
+/*
+ * Replay the journal: write the blocks of each transaction in the
+ * log in place, in order, up to the first one that is incomplete
+ * (its commit block was never written), then start the log over.
+ */
+static int Replay_Journal(struct XGOSFS_Instance *instance)
+{
+    struct XGOSFS_Superblock *super = &instance->super;
+    struct Block_Device *dev = instance->cache->dev;
+    char *block = instance->journalBuf;
+    struct XGOSFS_Journal_Header *hdr = (struct XGOSFS_Journal_Header*) block;
+    ulong_t pos = 1, replayed = 0;
+    int rc;
+
+    rc = Block_Read_Multiple(dev, super->journalStart * XGOSFS_SECTORS_PER_FS_BLOCK,
+	XGOSFS_SECTORS_PER_FS_BLOCK, block);
+    if (rc != 0)
+	return rc;
+    if (hdr->magic != XGOSFS_JOURNAL_MAGIC || hdr->type != XGOSFS_JOURNAL_SUPER)
+	return EINVALIDFS;
+    instance->journalSequence = hdr->sequence;
+
+    while (pos + 2 <= super->journalBlocks) {
+	struct XGOSFS_Journal_Header *commit;
+	uint_t *blockNums, count, i;
+
+	rc = Block_Read_Multiple(dev, (super->journalStart + pos) * XGOSFS_SECTORS_PER_FS_BLOCK,
+	    XGOSFS_SECTORS_PER_FS_BLOCK, block);
+	if (rc != 0)
+	    return rc;
+	count = hdr->count;
+	if (!Check_Journal_Header(hdr, XGOSFS_JOURNAL_DESCRIPTOR, instance->journalSequence) ||
+	    count == 0 || count > XGOSFS_MAX_TRANSACTION_BLOCKS || pos + count + 2 > super->journalBlocks)
+	    break;
+
+	/* The copies and the commit block */
+	rc = Block_Read_Multiple(dev, (super->journalStart + pos + 1) * XGOSFS_SECTORS_PER_FS_BLOCK,
+	    (count + 1) * XGOSFS_SECTORS_PER_FS_BLOCK, block + XGOSFS_FS_BLOCK_SIZE);
+	if (rc != 0)
+	    return rc;
+	commit = (struct XGOSFS_Journal_Header*) (block + (count + 1) * XGOSFS_FS_BLOCK_SIZE);
+	if (!Check_Journal_Header(commit, XGOSFS_JOURNAL_COMMIT, instance->journalSequence) ||
+	    commit->count != count || commit->checksum != Journal_Checksum(block, count + 1))
+	    break;
+
+	blockNums = (uint_t*) (hdr + 1);
+	for (i = 0; i < count; ++i) {
+	    struct FS_Buffer *buf;
+
+	    if (blockNums[i] >= super->journalStart && blockNums[i] < First_Data_Block(instance))
+		return EINVALIDFS;
+	    if (blockNums[i] >= super->numBlocks)
+		return EINVALIDFS;
+	    if ((rc = Get_New_FS_Buffer(instance->cache, blockNums[i], &buf)) != 0)
+		return rc;
+	    memcpy(buf->data, block + (i + 1) * XGOSFS_FS_BLOCK_SIZE, XGOSFS_FS_BLOCK_SIZE);
+	    Modify_FS_Buffer(instance->cache, buf);
+	    Release_FS_Buffer(instance->cache, buf);
+	}
+
+	Debug("Replayed transaction %lu: %u blocks at %lu\n", instance->journalSequence, count, pos);
+	pos += count + 2;
+	++instance->journalSequence;
+	++replayed;
+    }
+
+    if (replayed > 0) {
+	Print("XGOSFS: replayed %lu transactions on %s\n", replayed, dev->name);
+	if ((rc = Sync_FS_Buffer_Cache(instance->cache)) != 0)
+	    return rc;
+    }
+    return Reset_Journal(instance);
+}
+
+static int XGOSFS_Mount(struct Mount_Point *mountPoint)
+{
+    struct XGOSFS_Instance *instance;
+    struct XGOSFS_Superblock *super;
+    struct XGOSFS_Node *root;
+    struct FS_Buffer *buf;
+    ulong_t devBlocks = Get_Num_Blocks(mountPoint->dev) / XGOSFS_SECTORS_PER_FS_BLOCK;
+    ulong_t uninit;
+    int rc;
+
+    instance = (struct XGOSFS_Instance*) Malloc(sizeof(*instance));
+    if (instance == 0)
+	return ENOMEM;
+    memset(instance, '\0', sizeof(*instance));
+    Mutex_Init(&instance->lock);
+    Clear_XGOSFS_Node_List(&instance->nodeList);
+
+    instance->cache = Create_FS_Buffer_Cache(mountPoint->dev, XGOSFS_FS_BLOCK_SIZE);
+    if (instance->cache == 0) {
+	rc = ENOMEM;
+	goto fail;
+    }
+
+    /* Read and check the superblock */
+    if ((rc = Get_FS_Buffer(instance->cache, 0, &buf)) != 0)
+	goto fail;
+    memcpy(&instance->super, buf->data, sizeof(instance->super));
+    Release_FS_Buffer(instance->cache, buf);
+
+    super = &instance->super;
+    if (!Check_Superblock(super, devBlocks))
+	goto invalid;
+
+    /* Bring the metadata up to date before looking at any of it */
+    instance->journalBuf = Malloc((XGOSFS_MAX_TRANSACTION_BLOCKS + 2) * XGOSFS_FS_BLOCK_SIZE);
+    if (instance->journalBuf == 0) {
+	rc = ENOMEM;
+	goto fail;
+    }
+    if ((rc = Replay_Journal(instance)) == EINVALIDFS)
+	goto invalid;
+    else if (rc != 0)
+	goto fail;
+
+    /* The root must be a directory */
+    if ((rc = Get_Node(instance, XGOSFS_ROOT_INODE, &root)) != 0)
+	goto invalid;
+    rc = IS_DIRECTORY(&root->inode) ? 0 : EINVALIDFS;
+    Put_Node(instance, root);
+    if (rc != 0)
+	goto invalid;
+
+    if ((rc = Count_Free(instance, &uninit)) != 0)
+	goto fail;
+    Debug("%lu of %u blocks and %lu of %u inodes free\n",
+	instance->freeBlocks, super->numBlocks, instance->freeInodes, super->numInodes);
+
+    /* Finish what a lazy format left undone */
+    if (uninit > 0) {
+	Debug("Zeroing inode tables of %lu groups\n", uninit);
+	if (Start_Kernel_Thread(Lazy_Init_Thread, (ulong_t) instance, PRIORITY_LOW, true) == 0)
+	    Log(LOG_WARN, "XGOSFS: could not start thread to zero inode table\n");
+    }
+
+    mountPoint->ops = &s_xgosfsMountPointOps;
+    mountPoint->fsData = instance;
+    return 0;
+
+invalid:
+    Print("XGOSFS: bad superblock on %s\n", mountPoint->dev->name);
+    rc = EINVALIDFS;
+fail:
+    if (instance->cache != 0)
+	Destroy_FS_Buffer_Cache(instance->cache);
+    if (instance->journalBuf != 0)
+	Free(instance->journalBuf);
+    Free(instance);
+    return rc;
+}
+
+static struct Filesystem_Ops s_xgosfsFilesystemOps = {
+    &XGOSFS_Format,
+    &XGOSFS_Mount,
+};
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+void Init_XGOSFS(void)
+{
+    Register_Filesystem("xgosfs", &s_xgosfsFilesystemOps);
+}
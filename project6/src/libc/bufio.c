@@ -0,0 +1,195 @@
+/*
+ * Buffered output
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <fmtout.h>
+#include <string.h>
+#include <fileio.h>
+#include <bufio.h>
+
+struct Output_Buffer g_stdOutput = { 1, BUFIO_AUTO, 0, 0 };
+
+/* All buffers, so they can be flushed at exit */
+static struct Output_Buffer *s_bufferList = &g_stdOutput;
+
+/*
+ * Output sink for formatting into a buffer.
+ */
+struct Buffer_Sink {
+    struct Output_Sink sink;
+    struct Output_Buffer *out;
+};
+
+/*
+ * Pick the buffering mode for a buffer left to BUFIO_AUTO:
+ * line buffering if it writes to the console, so output
+ * appears a line at a time, otherwise full buffering.
+ */
+static void Choose_Mode(struct Output_Buffer *out)
+{
+    struct VFS_File_Stat stat;
+
+    if (FStat(out->fd, &stat) == 0 && stat.isTerminal)
+	out->mode = BUFIO_LINE;
+    else
+	out->mode = BUFIO_FULL;
+}
+
+static void Buffer_Emit(struct Output_Sink *o, int ch)
+{
+    Buffer_Put_Char(((struct Buffer_Sink*) o)->out, ch);
+}
+
+static void Buffer_Finish(struct Output_Sink *o) { }
+
+/*
+ * Set up a buffer for given file descriptor.
+ * It is flushed at exit, unless closed first.
+ */
+void Init_Output_Buffer(struct Output_Buffer *out, int fd, int mode)
+{
+    out->fd = fd;
+    out->mode = mode;
+    out->count = 0;
+    out->next = s_bufferList;
+    s_bufferList = out;
+}
+
+/*
+ * Flush a buffer and forget about it.
+ * The file descriptor is left open.
+ */
+int Close_Output_Buffer(struct Output_Buffer *out)
+{
+    struct Output_Buffer **p;
+
+    for (p = &s_bufferList; *p != 0; p = &(*p)->next) {
+	if (*p == out) {
+	    *p = out->next;
+	    break;
+	}
+    }
+    return Flush_Output(out);
+}
+
+/*
+ * Write out any buffered data.
+ * Returns 0 if successful, or an error code; the buffered
+ * data is discarded either way.
+ */
+int Flush_Output(struct Output_Buffer *out)
+{
+    int done = 0, rc = 0;
+
+    while (done < out->count) {
+	rc = Write(out->fd, out->data + done, out->count - done);
+	if (rc <= 0)
+	    break;
+	done += rc;
+    }
+    out->count = 0;
+
+    return rc < 0 ? rc : 0;
+}
+
+/*
+ * Flush every buffer.  Called at exit, and before anything
+ * (such as forking) that would otherwise reorder or duplicate output.
+ */
+void Flush_All_Output(void)
+{
+    struct Output_Buffer *out;
+
+    for (out = s_bufferList; out != 0; out = out->next)
+	Flush_Output(out);
+}
+
+/*
+ * Append bytes to a buffer, writing it out as the buffering
+ * mode calls for.  Writes too large for the buffer go straight
+ * to the file.
+ * Returns the number of bytes accepted, or an error code.
+ */
+int Buffer_Write(struct Output_Buffer *out, const void *buf, unsigned long len)
+{
+    const char *src = (const char*) buf;
+    unsigned long i;
+    int rc;
+
+    if (out->mode == BUFIO_AUTO)
+	Choose_Mode(out);
+
+    if (out->mode == BUFIO_NONE || len >= BUFIO_SIZE) {
+	if ((rc = Flush_Output(out)) < 0)
+	    return rc;
+	return Write(out->fd, buf, len);
+    }
+
+    if (out->count + len > BUFIO_SIZE && (rc = Flush_Output(out)) < 0)
+	return rc;
+
+    memcpy(out->data + out->count, src, len);
+    out->count += len;
+
+    if (out->mode == BUFIO_LINE) {
+	for (i = 0; i < len; ++i) {
+	    if (src[i] == '\n')
+		return (rc = Flush_Output(out)) < 0 ? rc : (int) len;
+	}
+    }
+
+    return (int) len;
+}
+
+/*
+ * Append a single character to a buffer.
+ * Returns 1 if successful, or an error code.
+ */
+int Buffer_Put_Char(struct Output_Buffer *out, int ch)
+{
+    int rc;
+
+    if (out->mode == BUFIO_AUTO)
+	Choose_Mode(out);
+
+    if (out->mode == BUFIO_NONE || out->count == BUFIO_SIZE) {
+	char buf = (char) ch;
+	return Buffer_Write(out, &buf, 1);
+    }
+
+    out->data[out->count++] = (char) ch;
+    if (out->mode == BUFIO_LINE && ch == '\n' && (rc = Flush_Output(out)) < 0)
+	return rc;
+
+    return 1;
+}
+
+/*
+ * Formatted output to a buffer.
+ * Returns the number of characters formatted.
+ */
+int Buffer_VPrint(struct Output_Buffer *out, const char *fmt, va_list args)
+{
+    struct Buffer_Sink sink;
+
+    sink.sink.Emit = &Buffer_Emit;
+    sink.sink.Finish = &Buffer_Finish;
+    sink.out = out;
+
+    return Format_Output(&sink.sink, fmt, args);
+}
+
+int Buffer_Print(struct Output_Buffer *out, const char *fmt, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start(args, fmt);
+    rc = Buffer_VPrint(out, fmt, args);
+    va_end(args);
+
+    return rc;
+}
@@ -11,24 +11,46 @@
 #include <fmtout.h>
 #include <string.h>
 #include <fileio.h>
+#include <bufio.h>
 #include <conio.h>
 
 static bool s_echo = true;
 
 /* System call wrappers. */
-DEF_SYSCALL(Set_Attr,SYS_SETATTR,int,(int attr),int arg0 = attr;,SYSCALL_REGS_1)
-DEF_SYSCALL(Get_Cursor,SYS_GETCURSOR,int,(int *row, int *col),
+static DEF_SYSCALL(Set_Screen_Attr,SYS_SETATTR,int,(int attr),int arg0 = attr;,SYSCALL_REGS_1)
+static DEF_SYSCALL(Get_Screen_Cursor,SYS_GETCURSOR,int,(int *row, int *col),
     int *arg0 = row; int *arg1 = col;,SYSCALL_REGS_2)
 
+/*
+ * Console output goes through the standard output buffer.
+ * It is flushed before anything that acts on the screen directly,
+ * or waits for input, so the screen is up to date.
+ */
+
+int Set_Attr(int attr)
+{
+    Flush_Output(&g_stdOutput);
+    return Set_Screen_Attr(attr);
+}
+
+int Get_Cursor(int *row, int *col)
+{
+    Flush_Output(&g_stdOutput);
+    return Get_Screen_Cursor(row, col);
+}
+
 int Print_String(const char *s)
 {
-    return Write(1, s, strlen(s));
+    return Buffer_Write(&g_stdOutput, s, strlen(s));
 }
 
 Keycode Get_Key(void)
 {
     char buf[1];
-    int rc = Read(0, buf, 1);
+    int rc;
+
+    Flush_Output(&g_stdOutput);
+    rc = Read(0, buf, 1);
     return rc == 1 ? ((Keycode) buf[0]) : 0;
 }
 
@@ -46,10 +68,7 @@ int Put_Cursor(int row, int col)
 
 int Put_Char(int ch)
 {
-    char buf[2];
-    buf[0] = (char) ch;
-    buf[1] = '\0';
-    return Print_String(buf);
+    return Buffer_Put_Char(&g_stdOutput, ch);
 }
 
 void Echo(bool enable)
@@ -148,17 +167,12 @@ const char *Get_Error_String(int errno)
 	return __strerrTable[errno];
 }
 
-/* Support for Print(). */
-static void Print_Emit(struct Output_Sink *o, int ch) { Put_Char(ch); }
-static void Print_Finish(struct Output_Sink *o) { }
-static struct Output_Sink s_outputSink = { &Print_Emit, &Print_Finish };
-
 void Print(const char *fmt, ...)
 {
     va_list args;
 
     va_start(args, fmt);
-    Format_Output(&s_outputSink, fmt, args);
+    Buffer_VPrint(&g_stdOutput, fmt, args);
     va_end(args);
 }
 
@@ -12,6 +12,12 @@
 
 int main(int argc, char **argv);
 void Exit(int exitCode);
+int Have_Sysenter(void);
+
+/*
+ * Nonzero if system calls should use sysenter rather than int $0x90.
+ */
+int g_useSysenter;
 
 /*
  * Entry point.  Calls user program's main() routine, then exits.
@@ -23,6 +29,9 @@ void _Entry(void)
     /* The argument block pointer is in the ESI register. */
     __asm__ __volatile__ ("movl %%esi, %0" : "=r" (argBlock));
 
+    /* Use the fast system call path if the kernel supports it. */
+    g_useSysenter = Have_Sysenter();
+
     /* Call main(), and then exit with whatever value it returns. */
     Exit(main(argBlock->argc, argBlock->argv));
 }
@@ -55,6 +55,102 @@ DEF_SYSCALL(Create_Pipe,SYS_CREATEPIPE,int,
     int *arg0 = readfd; int *arg1 = writefd;,
     SYSCALL_REGS_2)
 
+static DEF_SYSCALL(Submit_Batch_Ring,SYS_SUBMITBATCH,int,(struct Batch_Ring *ring),
+    struct Batch_Ring *arg0 = ring;,
+    SYSCALL_REGS_1)
+
+/*
+ * The process's batch ring.  Operations are queued with the
+ * Batch_xxx() functions, carried out by Submit_Batch(), and
+ * their results collected with Get_Completion().
+ * There is no locking: only one thread of a process may use
+ * the ring.
+ */
+static struct Batch_Ring s_batchRing;
+
+/*
+ * Queue an operation.
+ * Returns 0 if successful, or EBUSY if the submission queue
+ * is full or too many completions are waiting to be collected.
+ */
+static int Queue_Batch_Op(int opcode, int fd, const void *buf, ulong_t len,
+    struct VFS_File_Stat *stat, ulong_t userData)
+{
+    struct Batch_Op *op;
+
+    if (s_batchRing.sqTail - s_batchRing.cqHead >= BATCH_RING_SIZE)
+	return EBUSY;
+
+    op = &s_batchRing.sq[s_batchRing.sqTail % BATCH_RING_SIZE];
+    op->opcode = opcode;
+    op->fd = fd;
+    op->buf = (ulong_t) buf;
+    op->len = len;
+    op->stat = stat;
+    op->userData = userData;
+    ++s_batchRing.sqTail;
+
+    return 0;
+}
+
+int Batch_Read(int fd, void *buf, ulong_t len, ulong_t userData)
+{
+    return Queue_Batch_Op(BATCH_READ, fd, buf, len, 0, userData);
+}
+
+int Batch_Write(int fd, const void *buf, ulong_t len, ulong_t userData)
+{
+    return Queue_Batch_Op(BATCH_WRITE, fd, buf, len, 0, userData);
+}
+
+int Batch_Seek(int fd, int pos, ulong_t userData)
+{
+    return Queue_Batch_Op(BATCH_SEEK, fd, 0, (ulong_t) pos, 0, userData);
+}
+
+/*
+ * The path must stay valid until the batch is submitted.
+ */
+int Batch_Stat(const char *path, struct VFS_File_Stat *stat, ulong_t userData)
+{
+    return Queue_Batch_Op(BATCH_STAT, 0, path, strlen(path), stat, userData);
+}
+
+int Batch_FStat(int fd, struct VFS_File_Stat *stat, ulong_t userData)
+{
+    return Queue_Batch_Op(BATCH_FSTAT, fd, 0, 0, stat, userData);
+}
+
+/*
+ * Carry out all queued operations with a single system call.
+ * Returns the number of operations completed, or an error code.
+ */
+int Submit_Batch(void)
+{
+    int rc;
+
+    /* The kernel reads and updates the ring behind the compiler's back */
+    __asm__ __volatile__ ("" : : : "memory");
+    rc = Submit_Batch_Ring(&s_batchRing);
+    __asm__ __volatile__ ("" : : : "memory");
+
+    return rc;
+}
+
+/*
+ * Collect the oldest completion, if there is one.
+ * Returns true if a completion was stored, false if none are waiting.
+ */
+bool Get_Completion(struct Batch_Completion *completion)
+{
+    if (s_batchRing.cqHead == s_batchRing.cqTail)
+	return false;
+
+    *completion = s_batchRing.cq[s_batchRing.cqHead % BATCH_RING_SIZE];
+    ++s_batchRing.cqHead;
+    return true;
+}
+
 static bool Copy_String(char *dst, const char *src, size_t len)
 {
     if (strnlen(src, len) == len)
@@ -13,18 +13,73 @@
 #include <geekos/syscall.h>
 #include <geekos/errno.h>
 #include <string.h>
+#include <bufio.h>
 #include <process.h>
 
 /* System call wrappers */
 DEF_SYSCALL(Null,SYS_NULL,int,(void),,SYSCALL_REGS_0)
-DEF_SYSCALL(Exit,SYS_EXIT,int,(int exitCode), int arg0 = exitCode;, SYSCALL_REGS_1)
-DEF_SYSCALL(Spawn_Program,SYS_SPAWN,int,
+static DEF_SYSCALL(Exit_Thread,SYS_EXIT,int,(int exitCode), int arg0 = exitCode;, SYSCALL_REGS_1)
+static DEF_SYSCALL(Spawn_Process,SYS_SPAWN,int,
     (const char *program, const char *command, int stdinFd, int stdoutFd),
     const char *arg0 = program; size_t arg1 = strlen(program); const char *arg2 = command; size_t arg3 = strlen(command);
     int arg4 = ((stdinFd & 0xffff) | (stdoutFd << 16));,
     SYSCALL_REGS_5)
 DEF_SYSCALL(Wait,SYS_WAIT,int,(int pid),int arg0 = pid;,SYSCALL_REGS_1)
 DEF_SYSCALL(Get_PID,SYS_GETPID,int,(void),,SYSCALL_REGS_0)
+static DEF_SYSCALL(Fork_Process,SYS_FORK,int,(void),,SYSCALL_REGS_0)
+static DEF_SYSCALL(Start_Thread,SYS_CREATETHREAD,int,
+    (void (*entry)(int (*)(void *), void *), int (*startFunc)(void *), void *arg),
+    void *arg0 = entry; void *arg1 = startFunc; void *arg2 = arg;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Join_Thread,SYS_JOINTHREAD,int,(int tid),int arg0 = tid;,SYSCALL_REGS_1)
+DEF_SYSCALL(Have_Sysenter,SYS_HAVESYSENTER,int,(void),,SYSCALL_REGS_0)
+
+/*
+ * Buffered output is flushed before exiting, and before starting
+ * a process that shares our output, or a copy of ours that
+ * would otherwise write our pending output a second time.
+ */
+
+int Exit(int exitCode)
+{
+    Flush_All_Output();
+    return Exit_Thread(exitCode);
+}
+
+int Spawn_Program(const char *program, const char *command, int stdinFd, int stdoutFd)
+{
+    Flush_All_Output();
+    return Spawn_Process(program, command, stdinFd, stdoutFd);
+}
+
+int Fork(void)
+{
+    Flush_All_Output();
+    return Fork_Process();
+}
+
+/*
+ * Every new thread starts here, with a stack that looks
+ * as if it had been called normally.  Output buffers are not
+ * safe for use by several threads at once, so only the main
+ * thread flushes them, when it exits; exiting another thread
+ * leaves them alone.
+ */
+static void Thread_Entry(int (*startFunc)(void *), void *arg)
+{
+    Exit_Thread(startFunc(arg));
+}
+
+/*
+ * Start a new thread in this process, running startFunc(arg).
+ * The thread exits with startFunc's return value.  It should
+ * leave buffered output (Print() and friends) to the main thread.
+ * Returns the thread's id, or an error code.
+ */
+int Create_Thread(int (*startFunc)(void *), void *arg)
+{
+    return Start_Thread(Thread_Entry, startFunc, arg);
+}
 
 #define CMDLEN 79
 
@@ -9,10 +9,23 @@
  */
 
 #include <geekos/syscall.h>
+#include <geekos/stats.h>
+#include <geekos/profile.h>
 #include <string.h>
 
 DEF_SYSCALL(Set_Scheduling_Policy,SYS_SETSCHEDULINGPOLICY,int, (int policy, int quantum),
     int arg0 = policy; int arg1 = quantum;,
     SYSCALL_REGS_2)
 DEF_SYSCALL(Get_Time_Of_Day,SYS_GETTIMEOFDAY,int,(void),,SYSCALL_REGS_0)
-
+DEF_SYSCALL(Get_Stats,SYS_GETSTATS,int,(struct Kernel_Stats *stats),
+    struct Kernel_Stats *arg0 = stats; ulong_t arg1 = sizeof(*stats);,
+    SYSCALL_REGS_2)
+DEF_SYSCALL(Start_Profile,SYS_PROFILESTART,int,(int interval),
+    int arg0 = interval;,
+    SYSCALL_REGS_1)
+DEF_SYSCALL(Stop_Profile,SYS_PROFILESTOP,int,(struct Profile_Header *header),
+    struct Profile_Header *arg0 = header;,
+    SYSCALL_REGS_1)
+DEF_SYSCALL(Dump_Profile,SYS_PROFILEDUMP,int,(struct Profile_Sample *buf, int first, int max),
+    struct Profile_Sample *arg0 = buf; int arg1 = first; int arg2 = max;,
+    SYSCALL_REGS_3)
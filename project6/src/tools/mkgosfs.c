@@ -0,0 +1,409 @@
+/*
+ * Build an XGOSFS filesystem image on the host
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * The image is laid out exactly as XGOSFS_Format() would lay it out,
+ * and the given files are copied into its root directory, each as a
+ * single extent (or in its inode, if it is small enough).  Only
+ * blocks with something in them are written: the image is truncated
+ * first, so the rest of it, the inode table included, is left as a
+ * hole that reads as zeroes.
+ */
+
+#include <geekos/xgosfs.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTOR_SIZE 512
+
+/* Bytes copied into the image with each write. */
+#define COPY_SIZE (256 * 1024)
+
+struct importFile {
+    const char *path;
+    const char *name;
+    ulong_t size;
+    ulong_t inode;
+    ulong_t start;		/* First block, if not inline */
+};
+
+static int imageFd;
+static const char *imageFile;
+
+static void writeBlocks(ulong_t block, const void *buf, ulong_t len)
+{
+    if (pwrite(imageFd, buf, len, (off_t) block * XGOSFS_FS_BLOCK_SIZE) != (ssize_t) len) {
+	perror(imageFile);
+	exit(-1);
+    }
+}
+
+/*
+ * Write a block, unless it is all zeroes.
+ */
+static void writeBlock(ulong_t block, const void *buf)
+{
+    const uchar_t *p = buf;
+    int i;
+
+    for (i = 0; i < XGOSFS_FS_BLOCK_SIZE; ++i) {
+	if (p[i] != 0) {
+	    writeBlocks(block, buf, XGOSFS_FS_BLOCK_SIZE);
+	    return;
+	}
+    }
+}
+
+/*
+ * Write a bitmap of numBits bits, of which the first numUsed are set;
+ * the bits past the end of it are set too, as XGOSFS_Format() does.
+ */
+static void writeBitmap(ulong_t bitmapStart, ulong_t numBits, ulong_t numUsed)
+{
+    ulong_t numBlocks = (numBits + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    uchar_t bits[XGOSFS_FS_BLOCK_SIZE];
+    ulong_t i, j;
+
+    for (i = 0; i < numBlocks; ++i) {
+	memset(bits, 0, sizeof(bits));
+	for (j = 0; j < XGOSFS_BITS_PER_BLOCK; ++j) {
+	    ulong_t bit = i * XGOSFS_BITS_PER_BLOCK + j;
+
+	    if (bit < numUsed || bit >= numBits)
+		bits[j / 8] |= 1 << (j % 8);
+	}
+	writeBlock(bitmapStart + i, bits);
+    }
+}
+
+/*
+ * Hash function for filenames: must be the one in xgosfs.c.
+ */
+static ulong_t hashName(const char *name, size_t len)
+{
+    uint_t hash = 2166136261U;
+
+    while (len-- > 0) {
+	hash ^= (uchar_t) *name++;
+	hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Find how many buckets the root directory needs for its records
+ * not to overflow any of them.  Returns 0 if there are no files,
+ * or if they don't fit at all.
+ */
+static ulong_t countBuckets(struct importFile *files, int fileCount)
+{
+    static uint_t used[XGOSFS_MAX_DIR_BUCKETS];
+    ulong_t n;
+    int i;
+
+    for (n = 1; fileCount > 0 && n <= XGOSFS_MAX_DIR_BUCKETS; n *= 2) {
+	for (i = 0; i < (int) n; ++i)
+	    used[i] = sizeof(struct XGOSFS_Dir_Bucket);
+	for (i = 0; i < fileCount; ++i) {
+	    uint_t *u = &used[hashName(files[i].name, strlen(files[i].name)) & (n - 1)];
+
+	    *u += XGOSFS_RECORD_SIZE(strlen(files[i].name));
+	    if (*u > XGOSFS_FS_BLOCK_SIZE)
+		break;
+	}
+	if (i == fileCount)
+	    return n;
+    }
+    return 0;
+}
+
+/*
+ * Copy a file into the image, starting at given block.
+ */
+static void copyFile(struct importFile *file, ulong_t block)
+{
+    static char buf[COPY_SIZE];
+    ulong_t done = 0;
+    int fd;
+
+    fd = open(file->path, O_RDONLY, 0);
+    if (fd < 0) {
+	perror(file->path);
+	exit(-1);
+    }
+    while (done < file->size) {
+	ssize_t ret = read(fd, buf, sizeof(buf));
+
+	if (ret <= 0) {
+	    printf("error reading %s\n", file->path);
+	    exit(-1);
+	}
+	/* Whole blocks, the last one zero filled */
+	memset(buf + ret, 0, (XGOSFS_FS_BLOCK_SIZE - ret % XGOSFS_FS_BLOCK_SIZE) % XGOSFS_FS_BLOCK_SIZE);
+	writeBlocks(block + done / XGOSFS_FS_BLOCK_SIZE, buf,
+	    (ret + XGOSFS_FS_BLOCK_SIZE - 1) / XGOSFS_FS_BLOCK_SIZE * XGOSFS_FS_BLOCK_SIZE);
+	done += ret;
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    static uchar_t block[XGOSFS_FS_BLOCK_SIZE];
+    struct XGOSFS_Superblock *super = (struct XGOSFS_Superblock*) block;
+    struct XGOSFS_Journal_Header *hdr = (struct XGOSFS_Journal_Header*) block;
+    struct importFile *files;
+    struct stat sbuf;
+    off_t diskSize = 0;
+    ulong_t numBlocks, numGroups, groupBlocks, bitmapBlocks;
+    ulong_t inodesPerGroup, numInodes, inodeBitmapBlocks, inodeTableStart, inodeTableBlocks;
+    ulong_t journalBlocks, firstData, numBuckets, dirStart, nextBlock, nextInode;
+    int fileCount, curr = 1, i, j;
+
+    if (argc > 2 && !strcmp(argv[1], "-s")) {
+	diskSize = (off_t) atol(argv[2]) * SECTOR_SIZE;
+	curr += 2;
+    }
+    if (curr >= argc) {
+	printf("usage: mkgosfs [-s <sectors>] <diskImage> <files>\n");
+	exit(-1);
+    }
+    imageFile = argv[curr++];
+
+    if (diskSize == 0) {
+	if (stat(imageFile, &sbuf) != 0) {
+	    perror(imageFile);
+	    exit(-1);
+	}
+	diskSize = sbuf.st_size;
+    }
+
+    /* The same layout as XGOSFS_Format() */
+    numBlocks = diskSize / XGOSFS_FS_BLOCK_SIZE;
+    numGroups = (numBlocks + XGOSFS_BLOCKS_PER_GROUP - 1) / XGOSFS_BLOCKS_PER_GROUP;
+    groupBlocks = (numGroups + XGOSFS_GROUPS_PER_BLOCK - 1) / XGOSFS_GROUPS_PER_BLOCK;
+    bitmapBlocks = (numBlocks + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    inodesPerGroup = XGOSFS_INODES_PER_BLOCK;
+    while (inodesPerGroup * 2 * XGOSFS_BLOCKS_PER_INODE <=
+	   (numBlocks < XGOSFS_BLOCKS_PER_GROUP ? numBlocks : XGOSFS_BLOCKS_PER_GROUP))
+	inodesPerGroup *= 2;
+    numInodes = numGroups * inodesPerGroup;
+    inodeBitmapBlocks = (numInodes + XGOSFS_BITS_PER_BLOCK - 1) / XGOSFS_BITS_PER_BLOCK;
+    inodeTableStart = 1 + groupBlocks + bitmapBlocks + inodeBitmapBlocks;
+    inodeTableBlocks = numInodes / XGOSFS_INODES_PER_BLOCK;
+    journalBlocks = numBlocks / 32;
+    if (journalBlocks < XGOSFS_JOURNAL_MIN_BLOCKS)
+	journalBlocks = XGOSFS_JOURNAL_MIN_BLOCKS;
+    if (journalBlocks > XGOSFS_JOURNAL_MAX_BLOCKS)
+	journalBlocks = XGOSFS_JOURNAL_MAX_BLOCKS;
+    firstData = inodeTableStart + inodeTableBlocks + journalBlocks;
+    if (numBlocks <= firstData) {
+	printf("%s is too small\n", imageFile);
+	exit(-1);
+    }
+
+    /* Where everything goes: the root directory, then the files */
+    fileCount = argc - curr;
+    files = (struct importFile*) calloc(fileCount + 1, sizeof(*files));
+    for (i = 0; i < fileCount; ++i) {
+	const char *name = argv[curr + i];
+
+	if (stat(name, &sbuf) != 0 || !S_ISREG(sbuf.st_mode)) {
+	    printf("%s is not a file\n", name);
+	    exit(-1);
+	}
+	files[i].path = name;
+	files[i].size = sbuf.st_size;
+	if (strrchr(name, '/') != 0)
+	    name = strrchr(name, '/') + 1;
+	files[i].name = name;
+	if (strlen(name) == 0 || strlen(name) > XGOSFS_FILENAME_MAX) {
+	    printf("bad name for %s\n", files[i].path);
+	    exit(-1);
+	}
+	for (j = 0; j < i; ++j) {
+	    if (!strcmp(files[j].name, name)) {
+		printf("%s: more than one file named %s\n", imageFile, name);
+		exit(-1);
+	    }
+	}
+    }
+    numBuckets = countBuckets(files, fileCount);
+    if (fileCount > 0 && numBuckets == 0) {
+	printf("%s: too many files for one directory\n", imageFile);
+	exit(-1);
+    }
+    if ((ulong_t) fileCount > numInodes - (XGOSFS_ROOT_INODE + 1)) {
+	printf("%s: too many files\n", imageFile);
+	exit(-1);
+    }
+
+    dirStart = firstData;
+    nextBlock = dirStart + numBuckets;
+    nextInode = XGOSFS_ROOT_INODE + 1;
+    for (i = 0; i < fileCount; ++i) {
+	files[i].inode = nextInode++;
+	if (files[i].size > XGOSFS_MAX_INLINE_DATA) {
+	    files[i].start = nextBlock;
+	    nextBlock += (files[i].size + XGOSFS_FS_BLOCK_SIZE - 1) / XGOSFS_FS_BLOCK_SIZE;
+	}
+    }
+    if (nextBlock > numBlocks) {
+	printf("Error: %s is full\n", imageFile);
+	exit(-1);
+    }
+    printf("%lu blocks, %lu inodes, %lu blocks free\n", numBlocks, numInodes, numBlocks - nextBlock);
+
+    /* Start from an image that is all hole */
+    imageFd = open(imageFile, O_WRONLY | O_CREAT, 0644);
+    if (imageFd < 0 || ftruncate(imageFd, 0) != 0 || ftruncate(imageFd, diskSize) != 0) {
+	perror(imageFile);
+	exit(-1);
+    }
+
+    /* Group descriptors */
+    for (i = 0; i < (int) groupBlocks; ++i) {
+	struct XGOSFS_Group *desc = (struct XGOSFS_Group*) block;
+	ulong_t group;
+
+	memset(block, 0, sizeof(block));
+	for (group = i * XGOSFS_GROUPS_PER_BLOCK;
+	     group < numGroups && group < (i + 1) * XGOSFS_GROUPS_PER_BLOCK;
+	     ++group, ++desc) {
+	    ulong_t start = group * XGOSFS_BLOCKS_PER_GROUP;
+	    ulong_t end = start + XGOSFS_BLOCKS_PER_GROUP;
+	    ulong_t firstInode = group * inodesPerGroup;
+
+	    if (end > numBlocks)
+		end = numBlocks;
+	    if (start < nextBlock)
+		start = nextBlock < end ? nextBlock : end;
+	    desc->freeBlocks = end - start;
+	    if (nextInode <= firstInode)
+		desc->freeInodes = inodesPerGroup;
+	    else if (nextInode < firstInode + inodesPerGroup)
+		desc->freeInodes = firstInode + inodesPerGroup - nextInode;
+	}
+	writeBlock(1 + i, block);
+    }
+
+    writeBitmap(1 + groupBlocks, numBlocks, nextBlock);
+    writeBitmap(1 + groupBlocks + bitmapBlocks, numInodes, nextInode);
+
+    /* Inodes: the root directory's, then the files' */
+    for (i = -1; i < fileCount; ) {
+	ulong_t tableBlock = (i < 0 ? XGOSFS_ROOT_INODE : files[i].inode) / XGOSFS_INODES_PER_BLOCK;
+
+	memset(block, 0, sizeof(block));
+	for (; i < fileCount; ++i) {
+	    ulong_t inodeNum = i < 0 ? XGOSFS_ROOT_INODE : files[i].inode;
+	    struct XGOSFS_Inode *inode = (struct XGOSFS_Inode*)
+		(block + (inodeNum % XGOSFS_INODES_PER_BLOCK) * XGOSFS_INODE_SIZE);
+	    struct XGOSFS_Extent_Map *map = &inode->u.map;
+
+	    if (inodeNum / XGOSFS_INODES_PER_BLOCK != tableBlock)
+		break;
+	    if (i < 0) {
+		inode->flags = XGOSFS_INODE_USED | XGOSFS_INODE_ISDIRECTORY;
+		inode->size = numBuckets * XGOSFS_FS_BLOCK_SIZE;
+		if (numBuckets == 0)
+		    continue;
+		map->numBlocks = numBuckets;
+		map->extent[0].start = dirStart;
+	    } else if (files[i].size <= XGOSFS_MAX_INLINE_DATA) {
+		FILE *fp = fopen(files[i].path, "rb");
+
+		inode->flags = XGOSFS_INODE_USED | XGOSFS_INODE_INLINE;
+		inode->size = files[i].size;
+		if (fp == 0 || fread(inode->u.data, 1, files[i].size, fp) != files[i].size) {
+		    printf("error reading %s\n", files[i].path);
+		    exit(-1);
+		}
+		fclose(fp);
+		continue;
+	    } else {
+		inode->flags = XGOSFS_INODE_USED;
+		inode->size = files[i].size;
+		map->numBlocks = (files[i].size + XGOSFS_FS_BLOCK_SIZE - 1) / XGOSFS_FS_BLOCK_SIZE;
+		map->extent[0].start = files[i].start;
+	    }
+	    map->numExtents = 1;
+	    map->extent[0].logical = 0;
+	    map->extent[0].length = map->numBlocks;
+	}
+	writeBlock(inodeTableStart + tableBlock, block);
+    }
+
+    /* An empty journal; the block after its superblock is a hole */
+    memset(block, 0, sizeof(block));
+    hdr->magic = XGOSFS_JOURNAL_MAGIC;
+    hdr->type = XGOSFS_JOURNAL_SUPER;
+    hdr->sequence = 1;
+    writeBlock(inodeTableStart + inodeTableBlocks, block);
+
+    /* The root directory's buckets */
+    for (j = 0; j < (int) numBuckets; ++j) {
+	struct XGOSFS_Dir_Bucket *bucket = (struct XGOSFS_Dir_Bucket*) block;
+
+	memset(block, 0, sizeof(block));
+	bucket->used = sizeof(*bucket);
+	for (i = 0; i < fileCount; ++i) {
+	    size_t len = strlen(files[i].name);
+	    struct XGOSFS_Dir_Record *rec;
+
+	    if ((hashName(files[i].name, len) & (numBuckets - 1)) != (ulong_t) j)
+		continue;
+	    rec = (struct XGOSFS_Dir_Record*) (block + bucket->used);
+	    rec->inode = files[i].inode;
+	    rec->nameLen = len;
+	    memcpy(rec + 1, files[i].name, len);
+	    bucket->used += XGOSFS_RECORD_SIZE(len);
+	}
+	writeBlocks(dirStart + j, block, XGOSFS_FS_BLOCK_SIZE);
+    }
+
+    /* The files themselves */
+    for (i = 0; i < fileCount; ++i) {
+	if (files[i].size > XGOSFS_MAX_INLINE_DATA) {
+	    printf("file %s starts at block %lu\n", files[i].name, files[i].start);
+	    copyFile(&files[i], files[i].start);
+	} else
+	    printf("file %s is in inode %lu\n", files[i].name, files[i].inode);
+    }
+
+    /* The superblock goes last, so a failure leaves no filesystem */
+    memset(block, 0, sizeof(block));
+    super->magic = XGOSFS_MAGIC;
+    super->version = XGOSFS_VERSION;
+    super->numBlocks = numBlocks;
+    super->numGroups = numGroups;
+    super->blocksPerGroup = XGOSFS_BLOCKS_PER_GROUP;
+    super->inodesPerGroup = inodesPerGroup;
+    super->groupStart = 1;
+    super->groupBlocks = groupBlocks;
+    super->bitmapStart = 1 + groupBlocks;
+    super->bitmapBlocks = bitmapBlocks;
+    super->numInodes = numInodes;
+    super->inodeBitmapStart = 1 + groupBlocks + bitmapBlocks;
+    super->inodeBitmapBlocks = inodeBitmapBlocks;
+    super->inodeTableStart = inodeTableStart;
+    super->inodeTableBlocks = inodeTableBlocks;
+    super->journalStart = inodeTableStart + inodeTableBlocks;
+    super->journalBlocks = journalBlocks;
+    writeBlocks(0, block, XGOSFS_FS_BLOCK_SIZE);
+
+    if (close(imageFd) != 0) {
+	perror(imageFile);
+	exit(-1);
+    }
+    exit(0);
+}
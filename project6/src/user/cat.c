@@ -12,6 +12,7 @@
 #include <conio.h>
 #include <process.h>
 #include <fileio.h>
+#include <bufio.h>
 
 int main(int argc, char *argv[])
 {
@@ -32,7 +33,7 @@ int main(int argc, char *argv[])
 	    }
 
 	    if (ret > 0) {
-		Write(1, buffer, ret);
+		Buffer_Write(&g_stdOutput, buffer, ret);
 	    }
 	} while (ret != 0);
 
@@ -68,7 +69,7 @@ int main(int argc, char *argv[])
 	    }
 
 	    buffer[ret] = '\0';
-	    rc = Write(1, buffer, ret);
+	    rc = Buffer_Write(&g_stdOutput, buffer, ret);
 	    if (rc < 0) {
 		Print("Could not write to stdout: %s\n", Get_Error_String(rc));
 		Exit(1);
@@ -13,14 +13,52 @@
 #include <process.h>
 #include <fileio.h>
 
+/* Tags identifying batched operations */
+#define COPY_READ  0
+#define COPY_WRITE 1
+
+static char buffer[2][4096];
+
+/*
+ * Submit the queued operations and check their completions.
+ * A write must have written all of the writeLen bytes queued.
+ * Returns the number of bytes read, if a read was queued.
+ */
+static int Run_Batch(int writeLen)
+{
+    struct Batch_Completion done;
+    int ret, nread = 0;
+
+    ret = Submit_Batch();
+    if (ret < 0) {
+	Print("Error submitting batch for copy: %s\n", Get_Error_String(ret));
+	Exit(1);
+    }
+    while (Get_Completion(&done)) {
+	if (done.result < 0) {
+	    Print("Error %s file for copy: %s\n", done.userData == COPY_READ ? "reading" : "writing",
+		Get_Error_String(done.result));
+	    Exit(1);
+	}
+	if (done.userData == COPY_WRITE && done.result != writeLen) {
+	    Print("Error writing file for copy: wrote %d of %d bytes\n", done.result, writeLen);
+	    Exit(1);
+	}
+	if (done.userData == COPY_READ)
+	    nread = done.result;
+    }
+    return nread;
+}
+
 int main(int argc, char *argv[])
 {
     int ret;
-    int read;
+    int copied;
+    int cur;
+    int nwritten;
     int inFd;
     int outFd;
     struct VFS_File_Stat stat;
-    char buffer[1024];
 
     if (argc != 3) {
         Print("usage: cp <file1> <file2>\n");
@@ -50,18 +88,24 @@ int main(int argc, char *argv[])
 	Exit(1);
     }
 
-    for (read =0; read < stat.size; read += ret) {
-        ret = Read(inFd, buffer, sizeof(buffer));
-	if (ret < 0) {
-	    Print("Error reading file for copy: %s\n", Get_Error_String(ret));
-	    Exit(1);
-	}
+    /*
+     * Double buffered: each batch writes out one buffer and
+     * reads the next piece of the file into the other.
+     */
+    Batch_Read(inFd, buffer[0], sizeof(buffer[0]), COPY_READ);
+    for (copied = 0, cur = 0, nwritten = 0; copied < stat.size; cur = !cur) {
+	int nread = Run_Batch(nwritten);
 
-	ret = Write(outFd, buffer, ret);
-	if (ret < 0) {
-	    Print("Error writing file for copy: %s\n", Get_Error_String(ret));
-	    Exit(1);
-	}
+	if (nread == 0)
+	    break;
+	copied += nread;
+
+	Batch_Write(outFd, buffer[cur], nread, COPY_WRITE);
+	nwritten = nread;
+	if (copied < stat.size)
+	    Batch_Read(inFd, buffer[!cur], sizeof(buffer[!cur]), COPY_READ);
+	else
+	    Run_Batch(nwritten);
     }
 
     Close(inFd);
@@ -0,0 +1,134 @@
+/*
+ * File descriptor table benchmark: fills the table up to its
+ * limit, checks that the lowest free descriptor is always reused,
+ * and times a long run of open/close pairs.
+ *
+ * usage: fdbench [file] [iterations]
+ */
+
+#include <conio.h>
+#include <fileio.h>
+#include <sched.h>
+#include <string.h>
+#include <geekos/errno.h>
+
+/* Descriptors per process; see FILE_TABLE_MAX_SIZE in <geekos/fdtable.h> */
+#define MAX_OPEN 1024
+
+/* Descriptors opened here, in the order they were opened */
+static int s_fds[MAX_OPEN];
+
+/*
+ * Holes punched in the table, in no particular order: both ends,
+ * and either side of some of the 32-descriptor bitmap words.
+ */
+static const int s_holes[] = { 1023, 512, 31, 64, 995, 32, 511, 63, 500, 33 };
+#define NUM_HOLES (sizeof(s_holes) / sizeof(s_holes[0]))
+
+/*
+ * Open descriptors until the table is full.
+ * Returns the number opened, or -1 if Open failed for any other
+ * reason than a full table.
+ */
+static int Fill_Table(const char *path, int numOpen)
+{
+    int fd;
+
+    while ((fd = Open(path, O_READ)) >= 0) {
+	if (numOpen == MAX_OPEN) {
+	    Print("descriptor %d opened past the limit\n", fd);
+	    return -1;
+	}
+	s_fds[numOpen++] = fd;
+    }
+    if (fd != EMFILE) {
+	Print("Could not open %s: %s\n", path, Get_Error_String(fd));
+	return -1;
+    }
+    return numOpen;
+}
+
+/*
+ * Reopen closed descriptors, checking that they come back
+ * lowest first.  expected is sorted.  Returns 0 if successful.
+ */
+static int Check_Reuse(const char *path, const int *expected, int count)
+{
+    int i;
+
+    for (i = 0; i < count; ++i) {
+	int fd = Open(path, O_READ);
+	if (fd != expected[i]) {
+	    Print("expected fd %d, got %d\n", expected[i], fd);
+	    return -1;
+	}
+    }
+    if (Open(path, O_READ) != EMFILE) {
+	Print("table not full after refilling it\n");
+	return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/c/shell.exe";
+    int iterations = 5000;
+    int expected[32];
+    int i, j, numOpen, start, elapsed;
+
+    if (argc > 1)
+	path = argv[1];
+    if (argc > 2)
+	iterations = atoi(argv[2]);
+
+    /* Fill the table to its limit */
+    start = Get_Time_Of_Day();
+    numOpen = Fill_Table(path, 0);
+    elapsed = Get_Time_Of_Day() - start;
+    if (numOpen <= 0)
+	return 1;
+    Print("opened %d files at once in %d ticks (highest fd %d)\n",
+	numOpen, elapsed, s_fds[numOpen - 1]);
+    if (s_fds[numOpen - 1] != MAX_OPEN - 1) {
+	Print("table full at fd %d, expected %d\n", s_fds[numOpen - 1], MAX_OPEN - 1);
+	return 1;
+    }
+
+    /* Punch scattered holes, then check they are refilled lowest first */
+    for (i = 0; i < NUM_HOLES; ++i) {
+	Close(s_holes[i]);
+	for (j = i; j > 0 && expected[j - 1] > s_holes[i]; --j)
+	    expected[j] = expected[j - 1];
+	expected[j] = s_holes[i];
+    }
+    if (Check_Reuse(path, expected, NUM_HOLES) != 0)
+	return 1;
+
+    /* Free a whole bitmap word, then check it is refilled in order */
+    for (i = 0; i < 32; ++i) {
+	expected[i] = 64 + i;
+	Close(expected[i]);
+    }
+    if (Check_Reuse(path, expected, 32) != 0)
+	return 1;
+
+    for (i = 0; i < numOpen; ++i)
+	Close(s_fds[i]);
+    Print("lowest free descriptor reused correctly\n");
+
+    /* Open/close churn */
+    start = Get_Time_Of_Day();
+    for (i = 0; i < iterations; ++i) {
+	int fd = Open(path, O_READ);
+	if (fd < 0) {
+	    Print("Open failed after %d iterations: %d\n", i, fd);
+	    return 1;
+	}
+	Close(fd);
+    }
+    elapsed = Get_Time_Of_Day() - start;
+    Print("%d open/close pairs in %d ticks\n", iterations, elapsed);
+
+    return 0;
+}
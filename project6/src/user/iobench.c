@@ -0,0 +1,141 @@
+/*
+ * File I/O throughput benchmark: writes a file and reads it back
+ * with a range of buffer sizes, and reports the rate for each.
+ * Large buffers are where transferring straight from user pages,
+ * instead of through a kernel copy, pays off.  Each file is then
+ * read back once more and checked, and the kernel's counters show
+ * how many pages went to the filesystem per request.
+ *
+ * usage: iobench [file] [kbytes per run]
+ */
+
+#include <conio.h>
+#include <fileio.h>
+#include <sched.h>
+#include <string.h>
+#include <geekos/stats.h>
+
+#define MAX_BUFFER (256 * 1024)
+
+/*
+ * Reads are checked into a buffer that starts part way into a page,
+ * so every transfer also has partial pages at both ends.
+ */
+#define CHECK_OFFSET 100
+
+static char s_buffer[MAX_BUFFER];
+static char s_checkBuffer[MAX_BUFFER + CHECK_OFFSET];
+static struct Kernel_Stats s_before, s_after;
+
+static const int s_bufferSizes[] = { 1024, 4096, 16384, 65536, MAX_BUFFER };
+
+/*
+ * Transfer total bytes through the file in bufSize pieces,
+ * printing the rate.  Returns 0 if successful, -1 if not.
+ */
+static int Time_Transfer(const char *path, int total, int bufSize, bool write)
+{
+    int fd, done, rc, start, elapsed;
+
+    fd = Open(path, write ? O_WRITE|O_CREATE : O_READ);
+    if (fd < 0) {
+	Print("Could not open %s: %s\n", path, Get_Error_String(fd));
+	return -1;
+    }
+
+    start = Get_Time_Of_Day();
+    for (done = 0; done < total; done += rc) {
+	int count = total - done < bufSize ? total - done : bufSize;
+	rc = write ? Write(fd, s_buffer, count) : Read(fd, s_buffer, count);
+	if (rc <= 0) {
+	    Print("%s failed after %d bytes: %s\n", write ? "Write" : "Read", done,
+		rc < 0 ? Get_Error_String(rc) : "end of file");
+	    Close(fd);
+	    return -1;
+	}
+    }
+    elapsed = Get_Time_Of_Day() - start;
+    Close(fd);
+
+    Print("%6s %7d byte buffers: %d KB in %d ticks", write ? "write" : "read", bufSize, total / 1024, elapsed);
+    if (elapsed > 0)
+	Print(", %d KB/tick", (total / 1024) / elapsed);
+    Print("\n");
+    return 0;
+}
+
+/*
+ * Read the file written with bufSize pieces back, and check that
+ * each byte is the one written.  Prints the number of filesystem
+ * requests the reads took and the user pages they covered; a
+ * request covers several pages when the buffer's pages are
+ * physically contiguous.  Returns 0 if successful, -1 if not.
+ */
+static int Check_File(const char *path, int total, int bufSize)
+{
+    char *buf = s_checkBuffer + CHECK_OFFSET;
+    int fd, done, rc, i;
+    ulong_t requests, pages;
+
+    fd = Open(path, O_READ);
+    if (fd < 0) {
+	Print("Could not open %s: %s\n", path, Get_Error_String(fd));
+	return -1;
+    }
+
+    Get_Stats(&s_before);
+    for (done = 0; done < total; done += rc) {
+	int count = total - done < bufSize ? total - done : bufSize;
+
+	memset(buf, '\0', count);
+	rc = Read(fd, buf, count);
+	if (rc <= 0) {
+	    Print("Read failed after %d bytes: %s\n", done,
+		rc < 0 ? Get_Error_String(rc) : "end of file");
+	    Close(fd);
+	    return -1;
+	}
+	for (i = 0; i < rc; ++i) {
+	    if (buf[i] != (char) (((done + i) % bufSize) % 251)) {
+		Print("byte %d of %s is wrong\n", done + i, path);
+		Close(fd);
+		return -1;
+	    }
+	}
+    }
+    Get_Stats(&s_after);
+    Close(fd);
+
+    requests = s_after.counter[STAT_USER_IO_REQUESTS] - s_before.counter[STAT_USER_IO_REQUESTS];
+    pages = s_after.counter[STAT_USER_IO_PAGES] - s_before.counter[STAT_USER_IO_PAGES];
+    Print("%6s %7d byte buffers: %lu requests for %lu pages\n", "check", bufSize, requests, pages);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/d/iobench.dat";
+    int total = 1024 * 1024;
+    int i;
+
+    if (argc > 1)
+	path = argv[1];
+    if (argc > 2)
+	total = atoi(argv[2]) * 1024;
+    if (total < 1) {
+	Print("usage: %s [file] [kbytes per run]\n", argv[0]);
+	return 1;
+    }
+
+    for (i = 0; i < MAX_BUFFER; ++i)
+	s_buffer[i] = i % 251;
+
+    for (i = 0; i < sizeof(s_bufferSizes) / sizeof(s_bufferSizes[0]); ++i) {
+	if (Time_Transfer(path, total, s_bufferSizes[i], true) != 0 ||
+	    Time_Transfer(path, total, s_bufferSizes[i], false) != 0 ||
+	    Check_File(path, total, s_bufferSizes[i]) != 0)
+	    return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * prof - control the kernel's sampling profiler
+ *
+ * usage: prof start [interval]
+ *        prof stop [file]
+ *
+ * "start" takes a sample every interval timer ticks (default 1).
+ * "stop" writes the samples to file (default /d/prof.out), which
+ * scripts/profile turns into a flat profile on the host.
+ */
+
+#include <conio.h>
+#include <fileio.h>
+#include <sched.h>
+#include <string.h>
+#include <geekos/errno.h>
+#include <geekos/profile.h>
+
+/* Samples copied out per Dump_Profile() call */
+#define CHUNK 512
+
+static struct Profile_Sample s_samples[CHUNK];
+
+static int Usage(const char *prog)
+{
+    Print("usage: %s start [interval]\n", prog);
+    Print("       %s stop [file]\n", prog);
+    return 1;
+}
+
+static int Write_Fully(int fd, const void *buf, int len)
+{
+    int rc = Write(fd, buf, len);
+    return rc < 0 ? rc : (rc == len ? 0 : EIO);
+}
+
+/*
+ * Stop the profiler and write the header and samples to given file.
+ */
+static int Save_Profile(const char *path)
+{
+    struct Profile_Header header;
+    ulong_t numUser = 0;
+    int fd, count, i, first = 0, rc;
+
+    if ((rc = Stop_Profile(&header)) != 0) {
+	Print("Could not stop profiler: %s\n", Get_Error_String(rc));
+	return 1;
+    }
+
+    /* Open() doesn't truncate, so remove any longer dump first */
+    if ((rc = Delete(path)) != 0 && rc != ENOTFOUND) {
+	Print("Could not remove old %s: %s\n", path, Get_Error_String(rc));
+	return 1;
+    }
+    if ((fd = Open(path, O_CREATE|O_WRITE)) < 0) {
+	Print("Could not open %s: %s\n", path, Get_Error_String(fd));
+	return 1;
+    }
+
+    rc = Write_Fully(fd, &header, sizeof(header));
+    while (rc == 0 && (count = Dump_Profile(s_samples, first, CHUNK)) != 0) {
+	if (count < 0) {
+	    rc = count;
+	    break;
+	}
+	for (i = 0; i < count; ++i)
+	    numUser += s_samples[i].user;
+	rc = Write_Fully(fd, s_samples, count * sizeof(struct Profile_Sample));
+	first += count;
+    }
+    Close(fd);
+
+    if (rc != 0) {
+	Print("Could not write %s: %s\n", path, Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("%lu samples (%lu user, %lu kernel) every %lu ticks written to %s\n",
+	header.numSamples, numUser, header.numSamples - numUser, header.interval, path);
+    if (header.numDropped > 0)
+	Print("%lu samples dropped: buffer full\n", header.numDropped);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    if (argc < 2)
+	return Usage(argv[0]);
+
+    if (strcmp(argv[1], "start") == 0) {
+	int interval = argc > 2 ? atoi(argv[2]) : 1;
+	if ((rc = Start_Profile(interval)) != 0) {
+	    Print("Could not start profiler: %s\n", Get_Error_String(rc));
+	    return 1;
+	}
+	return 0;
+    } else if (strcmp(argv[1], "stop") == 0)
+	return Save_Profile(argc > 2 ? argv[2] : "/d/prof.out");
+    else
+	return Usage(argv[0]);
+}
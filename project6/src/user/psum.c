@@ -0,0 +1,90 @@
+/*
+ * Parallel sum: adds up an array using several threads
+ * sharing one address space, and checks each thread's result
+ * against a sequential sum.  Only the main thread prints,
+ * since output buffers are not safe for several threads.
+ *
+ * usage: psum [threads] [count]
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <string.h>
+
+#define MAX_THREADS 7
+#define MAX_COUNT   65536
+
+static int s_data[MAX_COUNT];
+
+struct Slice {
+    int start, end;
+    int sum;			/* Computed by the thread */
+    int expected;		/* Computed sequentially */
+};
+
+static struct Slice s_slices[MAX_THREADS];
+
+static int Sum_Slice(void *arg)
+{
+    struct Slice *slice = (struct Slice *) arg;
+    int i, sum = 0;
+
+    for (i = slice->start; i < slice->end; ++i)
+	sum += s_data[i];
+    slice->sum = sum;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int numThreads = 4, count = MAX_COUNT;
+    int tids[MAX_THREADS];
+    int i, total = 0, expected = 0;
+
+    if (argc > 1)
+	numThreads = atoi(argv[1]);
+    if (argc > 2)
+	count = atoi(argv[2]);
+    if (numThreads < 1 || numThreads > MAX_THREADS || count < 1 || count > MAX_COUNT) {
+	Print("usage: %s [threads (1..%d)] [count (1..%d)]\n", argv[0], MAX_THREADS, MAX_COUNT);
+	return 1;
+    }
+
+    for (i = 0; i < count; ++i)
+	s_data[i] = i % 1000;
+
+    for (i = 0; i < numThreads; ++i) {
+	int j;
+
+	s_slices[i].start = (count / numThreads) * i;
+	s_slices[i].end = (i == numThreads - 1) ? count : (count / numThreads) * (i + 1);
+	for (j = s_slices[i].start; j < s_slices[i].end; ++j)
+	    s_slices[i].expected += s_data[j];
+	expected += s_slices[i].expected;
+    }
+
+    for (i = 0; i < numThreads; ++i) {
+	tids[i] = Create_Thread(Sum_Slice, &s_slices[i]);
+	if (tids[i] < 0) {
+	    Print("Could not create thread %d: %d\n", i, tids[i]);
+	    return 1;
+	}
+    }
+
+    for (i = 0; i < numThreads; ++i) {
+	int rc = Join_Thread(tids[i]);
+	if (rc != 0) {
+	    Print("Thread %d failed: %d\n", tids[i], rc);
+	    return 1;
+	}
+	Print("thread %d: [%d, %d) sum %d%s\n", tids[i], s_slices[i].start, s_slices[i].end,
+	    s_slices[i].sum, s_slices[i].sum == s_slices[i].expected ? "" : " MISMATCH");
+	if (s_slices[i].sum != s_slices[i].expected)
+	    return 1;
+	total += s_slices[i].sum;
+    }
+
+    Print("total %d, expected %d: %s\n", total, expected, total == expected ? "ok" : "MISMATCH");
+    return total == expected ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+/*
+ * stat - print kernel event counters
+ *
+ * usage: stat [-s]
+ *   -s  also print the count of each system call
+ */
+
+#include <conio.h>
+#include <sched.h>
+#include <string.h>
+#include <geekos/stats.h>
+
+static const char *s_counterNames[NUM_STAT_COUNTERS] = {
+    "context switches",
+    "threads created",
+    "system calls",
+    "page faults",
+    "copy-on-write faults",
+    "pages in",
+    "pages out",
+    "block requests",
+    "buffer cache hits",
+    "buffer cache misses",
+    "buffer cache evictions",
+    "pfat reads",
+    "pfat bytes read",
+    "user i/o requests",
+    "user i/o pages",
+};
+
+static struct Kernel_Stats s_stats;
+
+int main(int argc, char **argv)
+{
+    bool showSyscalls = (argc > 1 && strcmp(argv[1], "-s") == 0);
+    int i, rc;
+
+    rc = Get_Stats(&s_stats);
+    if (rc != 0) {
+	Print("Could not get statistics: %s\n", Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("uptime: %lu ticks\n", s_stats.ticks);
+    for (i = 0; i < NUM_STAT_COUNTERS; ++i)
+	Print("%24s: %lu\n", s_counterNames[i], s_stats.counter[i]);
+
+    if (s_stats.counter[STAT_BUFCACHE_HITS] + s_stats.counter[STAT_BUFCACHE_MISSES] > 0)
+	Print("%24s: %lu%%\n", "buffer cache hit rate",
+	    s_stats.counter[STAT_BUFCACHE_HITS] * 100 /
+	    (s_stats.counter[STAT_BUFCACHE_HITS] + s_stats.counter[STAT_BUFCACHE_MISSES]));
+
+    Print("\ndevice      reads   blocks   writes   blocks\n");
+    for (i = 0; i < s_stats.numDevices; ++i) {
+	struct Device_Stats *dev = &s_stats.device[i];
+	Print("%-8s %8lu %8lu %8lu %8lu\n", dev->name,
+	    dev->numReads, dev->blocksRead, dev->numWrites, dev->blocksWritten);
+    }
+
+    Print("\n  pid  prio     ticks\n");
+    for (i = 0; i < s_stats.numThreads; ++i) {
+	struct Thread_Stats *thread = &s_stats.thread[i];
+	Print("%5d %5d %9lu%s\n", thread->pid, thread->priority, thread->ticks,
+	    thread->user ? "" : "  (kernel)");
+    }
+
+    if (showSyscalls) {
+	Print("\nsyscall    count\n");
+	for (i = 0; i < STATS_MAX_SYSCALLS; ++i) {
+	    if (s_stats.syscallCount[i] != 0)
+		Print("%7d %8lu\n", i, s_stats.syscallCount[i]);
+	}
+    }
+
+    return 0;
+}
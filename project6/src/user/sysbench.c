@@ -0,0 +1,66 @@
+/*
+ * System call round-trip benchmark: times the Null system call
+ * made through int 0x90 and through sysenter.
+ *
+ * usage: sysbench [calls]
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <string.h>
+#include <geekos/syscall.h>
+
+/*
+ * Low 32 bits of the time stamp counter; enough for timing
+ * runs of a few seconds without 64-bit division.
+ */
+static __inline__ unsigned long Read_TSC(void)
+{
+    unsigned long low;
+    __asm__ __volatile__ ("rdtsc" : "=a" (low) : : "edx");
+    return low;
+}
+
+/*
+ * Report average cycles per Null() call with the current
+ * system call path.
+ */
+static void Time_Null(const char *label, int calls)
+{
+    unsigned long start, cycles;
+    int i;
+
+    Null();  /* warm up */
+
+    start = Read_TSC();
+    for (i = 0; i < calls; ++i)
+	Null();
+    cycles = Read_TSC() - start;
+
+    Print("%s: %d calls, %lu cycles/call\n", label, calls, cycles / calls);
+}
+
+int main(int argc, char **argv)
+{
+    int calls = 100000;
+    int haveSysenter = g_useSysenter;
+
+    if (argc > 1)
+	calls = atoi(argv[1]);
+    if (calls < 1) {
+	Print("usage: %s [calls]\n", argv[0]);
+	return 1;
+    }
+
+    g_useSysenter = 0;
+    Time_Null("int 0x90", calls);
+
+    if (haveSysenter) {
+	g_useSysenter = 1;
+	Time_Null("sysenter", calls);
+    } else
+	Print("sysenter not supported by this kernel or processor\n");
+
+    g_useSysenter = haveSysenter;
+    return 0;
+}